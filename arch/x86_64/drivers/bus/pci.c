@@ -31,6 +31,11 @@
 #include <sea/mm/kmalloc.h>
 #include <sea/cpu/cpu-io.h>
 #include <sea/vsprintf.h>
+#include <sea/cpu/interrupt.h>
+#include <sea/mm/vmm.h>
+#include <sea/errno.h>
+#include <sea/kernel.h>
+#include <stdatomic.h>
 #define PCI_LOGLEVEL 2
 
 struct pci_device *pci_list=0;
@@ -274,6 +279,83 @@ unsigned pci_get_base_address(struct pci_device *device)
 	return tmp & 0xFFFFFFFC;
 }
 
+/* returns the config space offset of the capability, or 0 */
+uint8_t pci_find_capability(struct pci_device *dev, uint8_t id)
+{
+	if(!(dev->pcs->status & PCI_STATUS_CAPLIST))
+		return 0;
+	uint8_t cap = pci_read_dword(dev->bus, dev->dev, dev->func, PCI_CAP_POINTER) & 0xFC;
+	/* the list can't be longer than config space, so bound it in case it loops */
+	for(int i=0;cap && i<48;i++) {
+		uint32_t header = pci_read_dword(dev->bus, dev->dev, dev->func, cap);
+		if((header & 0xFF) == id)
+			return cap;
+		cap = (header >> 8) & 0xFC;
+	}
+	return 0;
+}
+
+static addr_t __bar_address(struct pci_device *dev, int bar)
+{
+	uint32_t low = pci_read_dword(dev->bus, dev->dev, dev->func, 0x10 + bar * 4);
+	addr_t address = low & 0xFFFFFFF0;
+	/* 64-bit memory BAR */
+	if(((low >> 1) & 3) == 2 && bar < 5)
+		address |= (addr_t)pci_read_dword(dev->bus, dev->dev, dev->func, 0x14 + bar * 4) << 32;
+	return address;
+}
+
+/* find and map the device's MSI-X table. The table starts out masked. */
+int pci_msix_init(struct pci_device *dev, struct pci_msix *msix)
+{
+	uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+	if(!cap)
+		return -ENOTSUP;
+	uint32_t control = pci_read_dword(dev->bus, dev->dev, dev->func, cap) >> 16;
+	uint32_t table = pci_read_dword(dev->bus, dev->dev, dev->func, cap + 4);
+	msix->dev = dev;
+	msix->cap = cap;
+	msix->table_size = (control & 0x7FF) + 1;
+	msix->table = (void *)(__bar_address(dev, table & 7) + (table & ~7) + PHYS_PAGE_MAP);
+	for(int i=0;i<msix->table_size;i++)
+		msix->table[i * 4 + 3] |= PCI_MSIX_MASKED;
+	return 0;
+}
+
+/* vectors are never given back; there are few MSI-X devices, and they
+ * don't come and go. */
+int pci_msix_allocate_vector(void)
+{
+	static _Atomic int next = 0;
+	int v = atomic_fetch_add(&next, 1);
+	if(v >= IRQ_MSI_COUNT)
+		return -ENOSPC;
+	return IRQ_MSI_BASE + v;
+}
+
+/* point an entry at a vector on a CPU (given by its local APIC ID), and unmask it */
+void pci_msix_set_entry(struct pci_msix *msix, int entry, int vector, unsigned apic_id)
+{
+	assert(entry < msix->table_size);
+	volatile uint32_t *e = &msix->table[entry * 4];
+	e[3] |= PCI_MSIX_MASKED;
+	e[0] = 0xFEE00000 | (apic_id << 12);
+	e[1] = 0;
+	e[2] = vector;
+	e[3] &= ~PCI_MSIX_MASKED;
+}
+
+void pci_msix_enable(struct pci_msix *msix, bool enable)
+{
+	struct pci_device *dev = msix->dev;
+	uint32_t header = pci_read_dword(dev->bus, dev->dev, dev->func, msix->cap);
+	if(enable)
+		header = (header | (PCI_MSIX_ENABLE << 16)) & ~(PCI_MSIX_MASKALL << 16);
+	else
+		header &= ~(PCI_MSIX_ENABLE << 16);
+	pci_write_dword(dev->bus, dev->dev, dev->func, msix->cap, header);
+}
+
 int module_install(void)
 {
 	pci_list=0;
@@ -287,6 +369,11 @@ int module_install(void)
 	loader_add_kernel_symbol(pci_get_base_address);
 	loader_add_kernel_symbol(pci_read_dword);
 	loader_add_kernel_symbol(pci_write_dword);
+	loader_add_kernel_symbol(pci_find_capability);
+	loader_add_kernel_symbol(pci_msix_init);
+	loader_add_kernel_symbol(pci_msix_allocate_vector);
+	loader_add_kernel_symbol(pci_msix_set_entry);
+	loader_add_kernel_symbol(pci_msix_enable);
 	return 0;
 }
 
@@ -299,6 +386,11 @@ int module_exit(void)
 	loader_remove_kernel_symbol("pci_get_base_address");
 	loader_remove_kernel_symbol("pci_read_dword");
 	loader_remove_kernel_symbol("pci_write_dword");
+	loader_remove_kernel_symbol("pci_find_capability");
+	loader_remove_kernel_symbol("pci_msix_init");
+	loader_remove_kernel_symbol("pci_msix_allocate_vector");
+	loader_remove_kernel_symbol("pci_msix_set_entry");
+	loader_remove_kernel_symbol("pci_msix_enable");
 	mutex_destroy(pci_mutex);
 	return 0;
 }
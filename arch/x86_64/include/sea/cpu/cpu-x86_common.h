@@ -21,7 +21,20 @@ struct cpuid {
 	char cpu_brand[49];
 };
 
+/* pending TLB invalidations posted by other CPUs. Merged into a
+ * single range (or a full flush) until the target handles its IPI.
+ * Each post bumps posted; once the target has invalidated everything up
+ * to a post, done catches up to it. */
+struct x86_tlb_mailbox {
+	struct spinlock lock;
+	bool pending, full;
+	addr_t start, end;
+	unsigned long posted;
+	_Atomic unsigned long done;
+};
+
 struct arch_cpu {
+	struct x86_tlb_mailbox tlb;
 	struct cpuid cpuid;
 	gdt_entry_t gdt[NUM_GDT_ENTRIES];
 	gdt_ptr_t gdt_ptr;
@@ -111,7 +124,6 @@ uint32_t lapic_read(int reg);
 
 extern addr_t lapic_addr;
 extern unsigned lapic_timer_start;
-extern struct spinlock ipi_lock;
 
 struct cpu;
 
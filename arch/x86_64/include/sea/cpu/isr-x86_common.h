@@ -18,6 +18,10 @@
 #define IRQ14 46
 #define IRQ15 47
 
+/* vectors for message signalled interrupts, handed out by the PCI code */
+#define IRQ_MSI_BASE  48
+#define IRQ_MSI_COUNT 16
+
 #define IOINT_PIC  1
 #define IOINT_APIC 2
 
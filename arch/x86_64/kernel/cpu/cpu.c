@@ -24,7 +24,6 @@ void arch_cpu_processor_init_1(void)
 #if CONFIG_SMP
 	primary_cpu = &cpu_array[0];
 	primary_cpu->knum = 0;
-	spinlock_create(&ipi_lock);
 	memset(cpu_array, 0, sizeof(struct cpu) * CONFIG_MAX_CPUS);
 	cpu_array_num = 1;
 	load_tables_ap(primary_cpu);
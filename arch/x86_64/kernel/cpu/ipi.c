@@ -26,8 +26,6 @@
 
 #include <sea/spinlock.h>
 
-struct spinlock ipi_lock;
-
 int x86_cpu_send_ipi(unsigned char dest_shorthand, unsigned int dst, unsigned int v)
 {
 	assert((v & LAPIC_ICR_DM_INIT) || (v & LAPIC_ICR_LEVELASSERT));
@@ -35,8 +33,10 @@ int x86_cpu_send_ipi(unsigned char dest_shorthand, unsigned int dst, unsigned in
 	if(!(kernel_state_flags & KSF_SMP_ENABLE))
 		return 1;
 	int to, send_status;
+	/* the ICR belongs to this CPU's local APIC, so there's no need to
+	 * serialize against other CPUs; we just need to not be interrupted
+	 * (and possibly send another IPI) between the two writes. */
 	int old = cpu_interrupt_set(0);
-	spinlock_acquire(&ipi_lock);
 	/* Writing to the lower ICR register causes the interrupt
 	 * to get sent off (Intel 3A 10.6.1), so do the higher reg first */
 	LAPIC_WRITE(LAPIC_ICR+0x10, (dst << 24));
@@ -49,7 +49,6 @@ int x86_cpu_send_ipi(unsigned char dest_shorthand, unsigned int dst, unsigned in
 		asm("pause");
 		send_status = LAPIC_READ(LAPIC_ICR) & LAPIC_ICR_STATUS_PEND;
 	} while (send_status && (to++ < 1000));
-	spinlock_release(&ipi_lock);
 	cpu_interrupt_set(old);
 	return (to < 1000);
 }
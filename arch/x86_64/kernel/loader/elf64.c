@@ -94,11 +94,15 @@ int arch_loader_parse_elf_executable(void *mem, struct file *file, addr_t *start
 				flags |= MAP_PRIVATE;
 			else
 				flags |= MAP_SHARED;
+			/* text is going to be touched right away; load it now instead
+			 * of taking a fault for every page */
+			if(prot & PROT_EXEC)
+				flags |= MAP_POPULATE;
 			mm_mmap(ph->p_addr & PAGE_MASK, ph->p_filesz + inpage_offset, 
 					prot, flags, file, ph->p_offset & PAGE_MASK, 0);
 			if(additional > page_free) {
 				mm_mmap((newend & PAGE_MASK) + PAGE_SIZE, additional - page_free,
-						prot, flags | MAP_ANONYMOUS, 0, 0, 0);
+						prot, (flags & ~MAP_POPULATE) | MAP_ANONYMOUS, 0, 0, 0);
 			}
 		}
 	}
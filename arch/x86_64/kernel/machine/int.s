@@ -175,6 +175,25 @@ IRQ  13,    45
 IRQ  14,    46
 IRQ  15,    47
 
+; message signalled interrupts. These don't come through the IO-APIC, and
+; are handed out to devices by the PCI code (see IRQ_MSI_BASE).
+IRQ  16,    48
+IRQ  17,    49
+IRQ  18,    50
+IRQ  19,    51
+IRQ  20,    52
+IRQ  21,    53
+IRQ  22,    54
+IRQ  23,    55
+IRQ  24,    56
+IRQ  25,    57
+IRQ  26,    58
+IRQ  27,    59
+IRQ  28,    60
+IRQ  29,    61
+IRQ  30,    62
+IRQ  31,    63
+
 ; interprocessor interrupts (only matter in SMP)
 IPI  panic    , IPI_PANIC
 IPI  shutdown , IPI_SHUTDOWN
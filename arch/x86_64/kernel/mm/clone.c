@@ -24,6 +24,10 @@ void arch_mm_context_clone(struct vmm_context *oldcontext, struct vmm_context *n
 	newcontext->root_virtual = (addr_t)pml4;
 	newcontext->root_physical = pml4_phys;
 	spinlock_create(&newcontext->lock);
+#if CONFIG_SMP
+	for(int i=0;i<VMM_CPUMASK_WORDS;i++)
+		newcontext->cpumask[i] = 0;
+#endif
 	mm_context_virtual_map(newcontext, MEMMAP_SYSGATE_ADDRESS, sysgate_page, PAGE_PRESENT | PAGE_USER, PAGE_SIZE);
 }
 
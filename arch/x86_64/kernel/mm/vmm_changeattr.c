@@ -42,8 +42,9 @@ bool arch_mm_context_virtual_changeattr(struct vmm_context *ctx, addr_t virtual,
 		if(!atomic_compare_exchange_strong(&pdv[pdidx], &old, new))
 			return false;
 	}
+	asm volatile("invlpg (%0)" :: "r"(virtual));
 #if CONFIG_SMP
-	x86_maybe_tlb_shootdown(virtual);
+	x86_maybe_tlb_shootdown(ctx, virtual & ~(length - 1), length);
 #endif
 	return true;
 }
@@ -7,16 +7,158 @@
 #include <sea/asm/system.h>
 #include <sea/string.h>
 
+void arch_mm_flush_page_tables(void);
+
+/* ranges longer than this many pages are invalidated by reloading cr3 */
+#define TLB_FLUSH_THRESHOLD 32
+/* how long to wait for another CPU to acknowledge a shootdown before
+ * deciding it's wedged with interrupts off. This is many seconds' worth. */
+#define TLB_SHOOTDOWN_SPINS 100000000ul
+
 #if CONFIG_SMP
-void x86_maybe_tlb_shootdown(addr_t virtual)
+/* merge a range into a CPU's mailbox. Returns true if the CPU needs an
+ * IPI (it didn't already have one pending), and sets *ticket to the value
+ * its done counter will reach once the range is invalidated. */
+static bool x86_tlb_post(struct cpu *cpu, addr_t start, addr_t end, unsigned long *ticket)
+{
+	struct x86_tlb_mailbox *mb = &cpu->arch_cpu_data.tlb;
+	int old = cpu_interrupt_set(0);
+	spinlock_acquire(&mb->lock);
+	*ticket = ++mb->posted;
+	bool send = !mb->pending;
+	if(send) {
+		mb->pending = true;
+		mb->start = start;
+		mb->end = end;
+	} else {
+		if(start < mb->start)
+			mb->start = start;
+		if(end > mb->end)
+			mb->end = end;
+	}
+	if((mb->end - mb->start) / 0x1000 > TLB_FLUSH_THRESHOLD)
+		mb->full = true;
+	spinlock_release(&mb->lock);
+	cpu_interrupt_set(old);
+	return send;
+}
+
+/* do whatever invalidations have been posted to this CPU */
+static void x86_tlb_process(struct cpu *cpu)
+{
+	struct x86_tlb_mailbox *mb = &cpu->arch_cpu_data.tlb;
+	int old = cpu_interrupt_set(0);
+	spinlock_acquire(&mb->lock);
+	bool pending = mb->pending, full = mb->full;
+	addr_t start = mb->start, end = mb->end;
+	unsigned long ticket = mb->posted;
+	mb->pending = mb->full = false;
+	spinlock_release(&mb->lock);
+
+	if(pending) {
+		if(full) {
+			arch_mm_flush_page_tables();
+		} else {
+			for(addr_t addr = start & ~0xFFFull;addr < end;addr += 0x1000)
+				asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+		}
+	}
+	atomic_store(&mb->done, ticket);
+	cpu_interrupt_set(old);
+}
+
+/* kernel addresses are shared by every context, so every other CPU has to
+ * invalidate them. User addresses only need to be invalidated on CPUs that
+ * have the context loaded. Doesn't return until every CPU that was asked
+ * has done it, so the caller may free what used to be mapped. */
+static void x86_tlb_shootdown(struct vmm_context *ctx, addr_t start, addr_t end)
+{
+	if(!(kernel_state_flags & KSF_SMP_ENABLE) || !current_thread)
+		return;
+	/* make sure our page table writes are visible before we look at
+	 * which CPUs have this context loaded */
+	atomic_thread_fence(memory_order_seq_cst);
+	bool kernel = IS_KERN_MEM(start);
+	unsigned long tickets[CONFIG_MAX_CPUS];
+	struct cpu *me = cpu_get_current();
+	for(unsigned i=0;i<cpu_array_num;i++) {
+		struct cpu *cpu = cpu_get(i);
+		tickets[i] = 0;
+		if(cpu == me || !(cpu->flags & CPU_UP))
+			continue;
+		if(!kernel && !mm_context_test_cpu(ctx, i))
+			continue;
+		if(x86_tlb_post(cpu, start, end, &tickets[i]))
+			x86_cpu_send_ipi(LAPIC_ICR_SHORT_DEST, cpu->snum,
+					LAPIC_ICR_LEVELASSERT | LAPIC_ICR_TM_LEVEL | IPI_TLB);
+	}
+	for(unsigned i=0;i<cpu_array_num;i++) {
+		if(!tickets[i])
+			continue;
+		struct cpu *cpu = cpu_get(i);
+		struct x86_tlb_mailbox *mb = &cpu->arch_cpu_data.tlb;
+		unsigned long spins = 0;
+		while(atomic_load(&mb->done) < tickets[i]) {
+			/* another CPU may be waiting on us in the same way. If our
+			 * interrupts are off, its IPI can't get in, so do its
+			 * work here. */
+			x86_tlb_process(me);
+			cpu_pause();
+			if(++spins == TLB_SHOOTDOWN_SPINS)
+				panic(PANIC_NOSYNC, "tlb shootdown: cpu %d (apic %d) never acknowledged ticket %d (done %d)",
+						i, cpu->snum, tickets[i], atomic_load(&mb->done));
+		}
+	}
+	cpu_put_current(me);
+}
+
+void x86_maybe_tlb_shootdown(struct vmm_context *ctx, addr_t virtual, size_t length)
+{
+	struct tlb_gather *gather = current_thread ? &current_thread->tlb_gather : NULL;
+	if(!gather || !gather->depth) {
+		x86_tlb_shootdown(ctx, virtual, virtual + length);
+		return;
+	}
+	if(gather->end > gather->start && (gather->ctx != ctx
+				|| IS_KERN_MEM(gather->start) != IS_KERN_MEM(virtual))) {
+		x86_tlb_shootdown(gather->ctx, gather->start, gather->end);
+		gather->start = gather->end = 0;
+	}
+	if(gather->end <= gather->start) {
+		gather->ctx = ctx;
+		gather->start = virtual;
+		gather->end = virtual + length;
+	} else {
+		if(virtual < gather->start)
+			gather->start = virtual;
+		if(virtual + length > gather->end)
+			gather->end = virtual + length;
+	}
+}
+
+void arch_mm_tlb_gather_flush(struct tlb_gather *gather)
+{
+	if(gather->end > gather->start)
+		x86_tlb_shootdown(gather->ctx, gather->start, gather->end);
+	gather->start = gather->end = 0;
+}
+
+void arch_mm_handle_tlb_ipi(void)
+{
+	/* a CPU that's still coming up has no thread yet, but can already
+	 * be sent shootdowns */
+	struct cpu *cpu = current_thread ? current_thread->cpu
+		: cpu_get_snum(LAPIC_READ(LAPIC_ID) >> 24);
+	x86_tlb_process(cpu);
+}
+#else
+void arch_mm_tlb_gather_flush(struct tlb_gather *gather)
+{
+	gather->start = gather->end = 0;
+}
+
+void arch_mm_handle_tlb_ipi(void)
 {
-	/* TODO: when do actually send? */
-	if(IS_KERN_MEM(virtual))
-		x86_cpu_send_ipi(LAPIC_ICR_SHORT_OTHERS,
-				0, LAPIC_ICR_LEVELASSERT | LAPIC_ICR_TM_LEVEL | IPI_TLB);
-	//else if((IS_THREAD_SHARED_MEM(virtual)))
-	//	x86_cpu_send_ipi(LAPIC_ICR_SHORT_OTHERS,
-	//			0, LAPIC_ICR_LEVELASSERT | LAPIC_ICR_TM_LEVEL | IPI_TLB);
 }
 #endif
 
@@ -73,13 +215,10 @@ bool arch_mm_context_virtual_map(struct vmm_context *ctx, addr_t virtual,
 			result = false;
 		}
 	}
+	/* no shootdown is needed here: we only ever fill in entries that were
+	 * empty, and non-present entries are never cached in the TLB. */
 	if(clear)
 		memset((void *)(physical + PHYS_PAGE_MAP), 0, length);
-#if CONFIG_SMP
-	if(result) {
-		x86_maybe_tlb_shootdown(virtual);
-	}
-#endif
 
 	return result;
 }
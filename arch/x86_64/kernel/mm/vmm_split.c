@@ -0,0 +1,86 @@
+/* Functions for breaking up large pages */
+#include <sea/mm/vmm.h>
+#include <sea/tm/process.h>
+#include <sea/cpu/processor.h>
+#include <sea/cpu/cpu-x86_64.h>
+
+/* replace a 2MB mapping with a page table that maps the same physical
+ * memory with the same attributes as 512 small pages. Returns false if
+ * the address isn't mapped by a large page. */
+bool arch_mm_context_virtual_split(struct vmm_context *ctx, addr_t virtual)
+{
+	int pml4idx = PML4_INDEX(virtual);
+	int pdptidx = PDPT_INDEX(virtual);
+	int pdidx = PD_INDEX(virtual);
+
+	addr_t *pml4v = (addr_t *)ctx->root_virtual;
+	if(!pml4v[pml4idx]) {
+		return false;
+	}
+	addr_t *pdptv = (addr_t *)((pml4v[pml4idx] & PAGE_MASK_PHYSICAL) + PHYS_PAGE_MAP);
+	if(!pdptv[pdptidx]) {
+		return false;
+	}
+	addr_t *pdv = (addr_t *)((pdptv[pdptidx] & PAGE_MASK_PHYSICAL) + PHYS_PAGE_MAP);
+	addr_t old = atomic_load(&pdv[pdidx]);
+	if(!(old & PAGE_LARGE))
+		return false;
+
+	addr_t table = mm_physical_allocate(0x1000, false);
+	addr_t *ptv = (addr_t *)(table + PHYS_PAGE_MAP);
+	addr_t base = old & PAGE_MASK_PHYSICAL;
+	addr_t attr = old & ATTRIB_MASK & ~(addr_t)PAGE_LARGE;
+	for(int i=0;i<512;i++)
+		ptv[i] = (base + i * 0x1000) | attr;
+	if(!atomic_compare_exchange_strong(&pdv[pdidx], &old,
+				table | PAGE_PRESENT | PAGE_WRITE | PAGE_USER)) {
+		mm_physical_deallocate(table);
+		return false;
+	}
+	virtual &= ~(addr_t)(0x200000 - 1);
+	asm volatile("invlpg (%0)" :: "r"(virtual));
+#if CONFIG_SMP
+	x86_maybe_tlb_shootdown(ctx, virtual, 0x200000);
+#endif
+	return true;
+}
+
+bool arch_mm_virtual_split(addr_t virtual)
+{
+	struct vmm_context *ctx;
+	if(current_process) {
+		ctx = &current_process->vmm_context;
+	} else {
+		ctx = &kernel_context;
+	}
+
+	return arch_mm_context_virtual_split(ctx, virtual);
+}
+
+/* returns true if nothing (not even an empty page table) occupies the
+ * page directory entry for this address, so that a large page could be
+ * mapped there. */
+bool arch_mm_virtual_large_slot_free(addr_t virtual)
+{
+	struct vmm_context *ctx;
+	if(current_process) {
+		ctx = &current_process->vmm_context;
+	} else {
+		ctx = &kernel_context;
+	}
+	int pml4idx = PML4_INDEX(virtual);
+	int pdptidx = PDPT_INDEX(virtual);
+	int pdidx = PD_INDEX(virtual);
+
+	addr_t *pml4v = (addr_t *)ctx->root_virtual;
+	if(!pml4v[pml4idx]) {
+		return true;
+	}
+	addr_t *pdptv = (addr_t *)((pml4v[pml4idx] & PAGE_MASK_PHYSICAL) + PHYS_PAGE_MAP);
+	if(!pdptv[pdptidx]) {
+		return true;
+	}
+	addr_t *pdv = (addr_t *)((pdptv[pdptidx] & PAGE_MASK_PHYSICAL) + PHYS_PAGE_MAP);
+	return pdv[pdidx] == 0;
+}
+
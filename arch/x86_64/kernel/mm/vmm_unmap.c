@@ -13,6 +13,7 @@ addr_t arch_mm_context_virtual_unmap(struct vmm_context *ctx, addr_t address)
 	int pdidx = PD_INDEX(address);
 
 	addr_t destp, offset;
+	size_t length = 0x1000;
 	addr_t *pml4v = (addr_t *)ctx->root_virtual;
 	if(!pml4v[pml4idx]) {
 		return 0;
@@ -40,10 +41,11 @@ addr_t arch_mm_context_virtual_unmap(struct vmm_context *ctx, addr_t address)
 		}
 		destp = pdv[pdidx] & PAGE_MASK_PHYSICAL;
 		pdv[pdidx] = 0;
+		length = 0x200000;
 	}
 	asm volatile("invlpg (%0)" :: "r"(address));
 #if CONFIG_SMP
-	x86_maybe_tlb_shootdown(address);
+	x86_maybe_tlb_shootdown(ctx, address & ~(length - 1), length);
 #endif
 	return destp;
 }
@@ -44,6 +44,14 @@ __attribute__((noinline)) void arch_tm_thread_switch(struct thread *old, struct
 				"fxrstor (%0)" :: "r" (ALIGN(new->arch_thread.fpu_save_data, 16)) : "memory");
 	}
 	addr_t cr3 = (old->process != new->process) ? new->process->vmm_context.root_physical : 0;
+#if CONFIG_SMP
+	/* keep track of which CPUs have which contexts loaded, so that TLB
+	 * shootdowns for user addresses only go where they're needed */
+	unsigned knum = old->cpu->knum;
+	if(cr3)
+		mm_context_clear_cpu(&old->process->vmm_context, knum);
+	mm_context_set_cpu(&new->process->vmm_context, knum);
+#endif
 	if(jump)
 		cpu_enable_preemption();
 	arch_tm_do_switch(&old->stack_pointer, &new->stack_pointer, jump, cr3);
@@ -7,6 +7,7 @@
 #include <sea/vsprintf.h>
 #include <sea/mm/kmalloc.h>
 #include <sea/string.h>
+#include <sea/dm/block.h>
 
 uint32_t ahci_flush_commands(struct hba_port *port)
 {
@@ -48,16 +49,27 @@ void ahci_reset_device(struct hba_memory *abar, struct hba_port *port, struct ah
 	tm_thread_delay_sleep(ONE_MILLISECOND);
 	/* initialize state */
 	port->interrupt_status = ~0; /* clear pending interrupts */
-	port->interrupt_enable = AHCI_DEFAULT_INT; /* we want some interrupts */
+	port->interrupt_enable = ahci_port_interrupts(abar, dev->idx); /* we want some interrupts */
 	port->command &= ~((1 << 27) | (1 << 26)); /* clear some bits */
 	port->sata_control |= 1;
 	tm_thread_delay_sleep(10 * ONE_MILLISECOND);
 	port->sata_control |= (~1);
 	tm_thread_delay_sleep(10 * ONE_MILLISECOND);
 	port->interrupt_status = ~0; /* clear pending interrupts */
-	port->interrupt_enable = AHCI_DEFAULT_INT; /* we want some interrupts */
+	port->interrupt_enable = ahci_port_interrupts(abar, dev->idx); /* we want some interrupts */
 	ahci_start_port_command_engine(port);
 	dev->slots=0;
+	/* anything that was queued is gone now. Wake up whoever was waiting
+	 * for it, and they'll see that there was a reset. */
+	dev->resets++;
+	atomic_store(&dev->int_status, 0);
+	uint32_t lost = atomic_exchange(&dev->issued, 0);
+	for(int i=0;i<HBA_COMMAND_HEADER_NUM;i++) {
+		if(lost & (1 << i))
+			tm_blocklist_wakeall(&dev->slot_wait[i]);
+	}
+	if(lost & dev->ncq_active)
+		block_io_notify(&dev->bctl);
 	port->sata_error = ~0;
 }
 
@@ -80,7 +92,7 @@ int ahci_initialize_device(struct hba_memory *abar, struct ahci_device *dev)
 	tm_thread_delay_sleep(1 * ONE_MILLISECOND);
 	/* initialize state */
 	port->interrupt_status = ~0; /* clear pending interrupts */
-	port->interrupt_enable = AHCI_DEFAULT_INT; /* we want some interrupts */
+	port->interrupt_enable = ahci_port_interrupts(abar, dev->idx); /* we want some interrupts */
 	
 	port->command &= ~1;
 	while(port->command & (1 << 15)) cpu_pause();
@@ -95,7 +107,7 @@ int ahci_initialize_device(struct hba_memory *abar, struct ahci_device *dev)
 	port->command |= (1 << 28); /* set interface to active */
 	while((port->sata_status >> 8) != 1) cpu_pause();
 	port->interrupt_status = ~0; /* clear pending interrupts */
-	port->interrupt_enable = AHCI_DEFAULT_INT; /* we want some interrupts */
+	port->interrupt_enable = ahci_port_interrupts(abar, dev->idx); /* we want some interrupts */
 	/* map memory */
 	addr_t clb_phys, fis_phys;
 	
@@ -115,7 +127,7 @@ int ahci_initialize_device(struct hba_memory *abar, struct ahci_device *dev)
 	struct hba_command_header *h = (struct hba_command_header *)dev->clb_virt;
 	int i;
 	for(i=0;i<HBA_COMMAND_HEADER_NUM;i++) {
-		dev->ch_dmas[i].p.size = 0x1000;
+		dev->ch_dmas[i].p.size = AHCI_COMMAND_TABLE_SIZE;
 		dev->ch_dmas[i].p.alignment = 0x1000;
 		mm_allocate_dma_buffer(&dev->ch_dmas[i]);
 		dev->ch[i] = (void *)dev->ch_dmas[i].v;
@@ -132,7 +144,19 @@ int ahci_initialize_device(struct hba_memory *abar, struct ahci_device *dev)
 	port->fis_base_h = UPPER32(fis_phys);
  	ahci_start_port_command_engine(port);
 	port->sata_error = ~0;
-	return ahci_device_identify_ahci(abar, port, dev);
+	dev->nslots = HBA_CAP_NCS(abar->capability);
+	if(!ahci_device_identify_ahci(abar, port, dev))
+		return 0;
+	if((abar->capability & HBA_CAP_SNCQ)
+			&& (ata_identify_word(&dev->identify, ATA_IDENTIFY_SATA_CAP) & ATA_SATA_CAP_NCQ)) {
+		dev->ncq_depth = (ata_identify_word(&dev->identify, ATA_IDENTIFY_QUEUE_DEPTH) & 0x1F) + 1;
+		if(dev->ncq_depth > dev->nslots)
+			dev->ncq_depth = dev->nslots;
+		/* tags have to be less than the device's queue depth */
+		dev->nslots = dev->ncq_depth;
+		printk(2, "[ahci]: device %d: NCQ, queue depth %d\n", dev->idx, dev->ncq_depth);
+	}
+	return 1;
 }
 
 uint32_t ahci_check_type(volatile struct hba_port *port)
@@ -174,6 +198,10 @@ void ahci_probe_ports(struct hba_memory *abar)
 				ports[i]->type = type;
 				ports[i]->idx = i;
 				mutex_create(&(ports[i]->lock), 0);
+				for(int j=0;j<HBA_COMMAND_HEADER_NUM;j++)
+					blocklist_create(&ports[i]->slot_wait[j], 0, "ahci-slot");
+				async_call_create(&ports[i]->wake_call, 0, ahci_port_wakeup,
+						(unsigned long)ports[i], ASYNC_CALL_PRIORITY_HIGH);
 				if(ahci_initialize_device(abar, ports[i]))
 					ahci_create_device(ports[i]);
 				else
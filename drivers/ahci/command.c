@@ -6,6 +6,9 @@
 #include <sea/vsprintf.h>
 #include <sea/mm/kmalloc.h>
 #include <sea/string.h>
+#include <sea/tm/blocking.h>
+#include <sea/tm/thread.h>
+#include <sea/mm/vmm.h>
 
 struct hba_command_header *ahci_initialize_command_header(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int write, int atapi, int prd_entries, int fis_len)
 {
@@ -37,56 +40,118 @@ struct fis_reg_host_to_device *ahci_initialize_fis_host_to_device(struct hba_mem
 
 void ahci_send_command(struct hba_port *port, int slot)
 {
-	port->interrupt_status = ~0;
 	port->command_issue = (1 << slot);
 	ahci_flush_commands(port);
 }
 
+/* find the physical address of a byte in a buffer. Fails if the page isn't
+ * mapped, or if the device will be writing to it and it isn't writable. */
+static bool __buffer_phys(addr_t virt, addr_t *phys, bool device_writes)
+{
+	if(virt >= PHYS_PAGE_MAP) {
+		*phys = virt - PHYS_PAGE_MAP;
+		return true;
+	}
+	int flags;
+	if(!mm_virtual_getmap(virt, phys, &flags))
+		return false;
+	if(device_writes && !(flags & PAGE_WRITE))
+		return false;
+	size_t size = mm_page_size((flags & PAGE_LARGE) ? 1 : 0);
+	*phys = (*phys & ~(size - 1)) + (virt & (size - 1));
+	return true;
+}
+
+/* can the HBA do DMA straight to or from this buffer? Every page has to
+ * be there already, and PRDT entries have to be word aligned. */
+bool ahci_buffer_dma_capable(addr_t virt_buffer, size_t length, bool device_writes)
+{
+	if((virt_buffer | length) & 1)
+		return false;
+	addr_t end = virt_buffer + length;
+	for(addr_t virt = virt_buffer;virt < end;virt = (virt & ~(PAGE_SIZE - 1)) + PAGE_SIZE) {
+		addr_t phys;
+		if(!__buffer_phys(virt, &phys, device_writes))
+			return false;
+	}
+	return true;
+}
+
+/* build a PRDT that points straight at the buffer's pages. Pages that happen
+ * to be physically contiguous share an entry. The caller makes sure the buffer
+ * passes ahci_buffer_dma_capable (and stays mapped), and isn't longer than
+ * AHCI_MAX_SECTORS. */
 int ahci_write_prdt(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int offset, int length, addr_t virt_buffer)
 {
-	int num_entries = ((length-1) / PRDT_MAX_COUNT) + 1;
 	struct hba_command_table *tbl = (struct hba_command_table *)(dev->ch[slot]);
-	int i;
-	struct hba_prdt_entry *prd;
-	for(i=0;i<num_entries-1;i++)
+	struct hba_prdt_entry *prd = NULL;
+	int i = offset;
+	addr_t next = 0;
+	while(length > 0)
 	{
-		/* TODO: do we need to do this? */
+		int this = PAGE_SIZE - (virt_buffer % PAGE_SIZE);
+		if(this > length)
+			this = length;
 		addr_t phys_buffer;
-		mm_virtual_getmap(virt_buffer, &phys_buffer, 0);
-		prd = &tbl->prdt_entries[i+offset];
-		prd->byte_count = PRDT_MAX_COUNT-1;
-		prd->data_base_l = LOWER32(phys_buffer);
-		prd->data_base_h = UPPER32(phys_buffer);
-		prd->interrupt_on_complete=0;
-		
-		length -= PRDT_MAX_COUNT;
-		virt_buffer += PRDT_MAX_COUNT;
+		if(!__buffer_phys(virt_buffer, &phys_buffer, false))
+			panic(0, "[ahci]: DMA to unmapped buffer %x", virt_buffer);
+		if(prd && phys_buffer == next && prd->byte_count + 1 + this <= PRDT_MAX_COUNT) {
+			prd->byte_count += this;
+		} else {
+			assert((size_t)i < AHCI_PRDT_ENTRIES);
+			prd = &tbl->prdt_entries[i++];
+			prd->byte_count = this - 1;
+			prd->data_base_l = LOWER32(phys_buffer);
+			prd->data_base_h = UPPER32(phys_buffer);
+			prd->interrupt_on_complete=0;
+		}
+		next = phys_buffer + this;
+		length -= this;
+		virt_buffer += this;
 	}
-	addr_t phys_buffer;
-	mm_virtual_getmap(virt_buffer, &phys_buffer, 0);
-	prd = &tbl->prdt_entries[i+offset];
-	prd->byte_count = length-1;
-	prd->data_base_l = LOWER32(phys_buffer);
-	prd->data_base_h = UPPER32(phys_buffer);
-	prd->interrupt_on_complete=0;
-	
-	return num_entries;
+	return i - offset;
 }
 
-int ahci_port_dma_data_transfer(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int write, addr_t virt_buffer, int sectors, uint64_t lba)
+/* point the slot at a buffer for a transfer of length bytes. Buffers are
+ * always kernel memory by now: O_DIRECT user pages are mapped into the kernel
+ * before they get here. Returns false if the buffer can't be used directly,
+ * and has to be bounced. */
+bool ahci_prdt_setup(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int write, addr_t virt_buffer, size_t length)
 {
-	int timeout;
+	assert(IS_KERN_MEM(virt_buffer));
+	if(!ahci_buffer_dma_capable(virt_buffer, length, !write))
+		return false;
 	int fis_len = sizeof(struct fis_reg_host_to_device) / 4;
-	int ne = ahci_write_prdt(abar, port, dev,
-			slot, 0, ATA_SECTOR_SIZE * sectors, virt_buffer);
-	struct hba_command_header *h = ahci_initialize_command_header(abar,
-			port, dev, slot, write, 0, ne, fis_len);
-	struct fis_reg_host_to_device *fis = ahci_initialize_fis_host_to_device(abar,
-			port, dev, slot, 1, write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX);
+	int ne = ahci_write_prdt(abar, port, dev, slot, 0, length, virt_buffer);
+	ahci_initialize_command_header(abar, port, dev, slot, write, 0, ne, fis_len);
+	return true;
+}
+
+/* issue a DMA transfer in slot, without waiting for it to finish. The slot
+ * has already been pointed at the buffer with ahci_prdt_setup.
+ * Devices that do native command queuing get the FPDMA QUEUED commands, with
+ * the slot as the tag, so that several can be outstanding at once. Returns 0
+ * if the port is hung. */
+int ahci_port_dma_data_start(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int write, addr_t virt_buffer, int sectors, uint64_t lba)
+{
+	int timeout;
+	struct fis_reg_host_to_device *fis;
+	if(dev->ncq_depth) {
+		fis = ahci_initialize_fis_host_to_device(abar, port, dev, slot, 1,
+				write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED);
+		/* queued commands take the count in the feature register, and
+		 * the tag in the count register */
+		fis->feature_l = sectors & 0xFF;
+		fis->feature_h = (sectors >> 8) & 0xFF;
+		fis->count_l = slot << 3;
+	} else {
+		fis = ahci_initialize_fis_host_to_device(abar, port, dev, slot, 1,
+				write ? ATA_CMD_WRITE_DMA_EX : ATA_CMD_READ_DMA_EX);
+		/* WARNING: assumes little-endian */
+		fis->count_l = sectors & 0xFF;
+		fis->count_h = (sectors >> 8) & 0xFF;
+	}
 	fis->device = 1<<6;
-	/* WARNING: assumes little-endian */
-	fis->count_l = sectors & 0xFF;
-	fis->count_h = (sectors >> 8) & 0xFF;
 	
 	fis->lba0 = (unsigned char)( lba        & 0xFF);
 	fis->lba1 = (unsigned char)((lba >> 8)  & 0xFF);
@@ -100,25 +165,56 @@ int ahci_port_dma_data_transfer(struct hba_memory *abar, struct hba_port *port,
 	{
 		tm_schedule();
 	}
-	if(!timeout) goto port_hung;
+	if(!timeout)
+		return 0;
 	
 	port->sata_error = ~0;
+	atomic_fetch_or(&dev->issued, 1 << slot);
+	if(dev->ncq_depth)
+		port->sata_active = (1 << slot);
 	ahci_send_command(port, slot);
-	timeout = ATA_TFD_TIMEOUT;
-	while ((port->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && --timeout)
-	{
-		tm_schedule();
+	return 1;
+}
+
+struct slot_wait {
+	struct ahci_device *dev;
+	int slot;
+};
+
+static bool __slot_issued(void *data)
+{
+	struct slot_wait *w = data;
+	return atomic_load(&w->dev->issued) & (1 << w->slot);
+}
+
+int ahci_port_dma_data_transfer(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int write, addr_t virt_buffer, int sectors, uint64_t lba)
+{
+	unsigned int resets = dev->resets;
+	if(!ahci_port_dma_data_start(abar, port, dev, slot, write, virt_buffer, sectors, lba))
+		goto port_hung;
+	/* sleep until the interrupt handler sees the command finish */
+	struct slot_wait w = { .dev = dev, .slot = slot };
+	time_t start = tm_timing_get_microseconds();
+	while(__slot_issued(&w)) {
+		time_t waited = tm_timing_get_microseconds() - start;
+		if(waited >= AHCI_IO_TIMEOUT)
+			break;
+		tm_thread_block_confirm_timeout(&dev->slot_wait[slot], THREADSTATE_UNINTERRUPTIBLE,
+				AHCI_IO_TIMEOUT - waited, __slot_issued, &w);
 	}
-	if(!timeout) goto port_hung;
-	
-	timeout = AHCI_CMD_TIMEOUT;
-	while(--timeout)
+	if(dev->resets != resets) {
+		printk(KERN_DEBUG, "[ahci]: device %d: command lost to a reset\n", dev->idx);
+		return 0;
+	}
+	/* the interrupt may have gone missing, so trust the port over the timeout */
+	if((port->sata_active | port->command_issue) & (1 << slot))
+		goto port_hung;
+	atomic_fetch_and(&dev->issued, ~(1 << slot));
+	if(atomic_load(&dev->int_status) & HBA_PxIS_ERROR)
 	{
-		if(!((port->sata_active | port->command_issue) & (1 << slot)))
-			break;
-		tm_schedule();
+		printk(KERN_DEBUG, "[ahci]: device %d: error interrupt: %x\n", dev->idx, dev->int_status);
+		goto error;
 	}
-	if(!timeout) goto port_hung;
 	if(port->sata_error)
 	{
 		printk(KERN_DEBUG, "[ahci]: device %d: ahci error\n", dev->idx);
@@ -16,6 +16,8 @@
 #include <sea/errno.h>
 #include <sea/dm/blockdev.h>
 #include <sea/mm/kmalloc.h>
+#include <sea/fs/kerfs.h>
+#include <sea/string.h>
 
 struct pci_device *ahci_pci;
 int ahci_int = 0;
@@ -46,16 +48,119 @@ struct pci_device *get_ahci_pci (void)
 	return ahci;
 }
 
+/* stage2 for a port's interrupts: wake up whoever is waiting on the commands
+ * that have finished since it last ran */
+void ahci_port_wakeup(unsigned long data)
+{
+	struct ahci_device *dev = (struct ahci_device *)data;
+	atomic_store(&dev->wake_pending, false);
+	uint32_t done = atomic_exchange(&dev->int_done, 0);
+	for(int i=0;i<HBA_COMMAND_HEADER_NUM;i++) {
+		if(done & (1 << i))
+			tm_blocklist_wakeall(&dev->slot_wait[i]);
+	}
+	if(done & dev->ncq_active)
+		block_io_notify(&dev->bctl);
+}
+
+/* note the commands that this port has finished, and get them woken up. An
+ * error stops the port, so on an error everyone is woken to find out. This
+ * runs in interrupt context, where the blocklists' spinlocks can't be taken
+ * (the interrupted thread may hold one), so the wakeups happen at stage2. */
+static void __port_interrupt(struct ahci_device *dev)
+{
+	struct hba_port *port = (struct hba_port *)&hba_mem->ports[dev->idx];
+	uint32_t is = port->interrupt_status;
+	port->interrupt_status = is;
+	atomic_fetch_or(&dev->int_status, is);
+	uint32_t busy = port->sata_active | port->command_issue;
+	uint32_t done;
+	if(is & HBA_PxIS_ERROR)
+		done = atomic_exchange(&dev->issued, 0);
+	else
+		done = atomic_fetch_and(&dev->issued, busy) & ~busy;
+	if(!done)
+		return;
+	atomic_fetch_or(&dev->int_done, done);
+	if(!atomic_exchange(&dev->wake_pending, true))
+		cpu_interrupt_schedule_stage2(&dev->wake_call);
+}
+
 void ahci_interrupt_handler(struct registers *regs, int int_no, int flags)
 {
-	int i;
-	for(i=0;i<32;i++) {
-		if(hba_mem->interrupt_status & (1 << i)) {
+	uint32_t is = hba_mem->interrupt_status;
+	uint32_t service = is;
+	uint32_t ccc = hba_mem->ccc_control;
+	/* a coalesced interrupt covers every port in ccc_ports */
+	if((ccc & HBA_CCC_ENABLE) && (is & (1 << HBA_CCC_INT(ccc))))
+		service |= hba_mem->ccc_ports;
+	for(int i=0;i<32;i++) {
+		if(!(service & (1 << i)))
+			continue;
+		if(ports[i])
+			__port_interrupt(ports[i]);
+		else if(hba_mem->port_implemented & (1 << i))
 			hba_mem->ports[i].interrupt_status = ~0;
-			hba_mem->interrupt_status = (1 << i);
-			ahci_flush_commands((struct hba_port *)&hba_mem->ports[i]);
-		}
 	}
+	hba_mem->interrupt_status = is;
+}
+
+/* command completion coalescing: the HBA holds off interrupting until
+ * ccc_completions commands have finished, or ccc_timeout milliseconds
+ * have passed since the first one did. 0 completions turns it off. */
+static int ccc_completions = 0, ccc_timeout = 1;
+
+static void __ccc_apply(void)
+{
+	uint32_t devices = 0;
+	hba_mem->ccc_control &= ~HBA_CCC_ENABLE;
+	for(int i=0;i<32;i++) {
+		if(ports[i])
+			devices |= (1 << i);
+	}
+	if(ccc_completions) {
+		hba_mem->ccc_ports = devices;
+		hba_mem->ccc_control = (ccc_timeout << 16) | (ccc_completions << 8);
+		hba_mem->ccc_control |= HBA_CCC_ENABLE;
+	}
+	for(int i=0;i<32;i++) {
+		if(ports[i])
+			hba_mem->ports[i].interrupt_enable = ahci_port_interrupts(hba_mem, i);
+	}
+}
+
+/* /dev/ahci-ccc: reads and writes "<completions> <timeout ms>" */
+int kerfs_ahci_ccc(int direction, void *param, size_t size, size_t offset, size_t length, unsigned char *buf)
+{
+	size_t current = 0;
+	if(direction == READ) {
+		KERFS_PRINTF(offset, length, buf, current, "%d %d\n", ccc_completions, ccc_timeout);
+		return current;
+	}
+	if(offset > 0)
+		return 0;
+	if(length > 32)
+		length = 32;
+	char tmp[length + 1];
+	memset(tmp, 0, length + 1);
+	strncpy(tmp, (char *)buf, length);
+	char *n;
+	if((n = strrchr(tmp, '\n')))
+		*n = 0;
+	if(!(n = strchr(tmp, ' ')))
+		return -EINVAL;
+	*n++ = 0;
+	int completions = strtoint(tmp);
+	int timeout = strtoint(n);
+	if(completions < 0 || completions > HBA_CCC_MAX_COMPLETIONS
+			|| timeout < 1 || timeout > HBA_CCC_MAX_TIMEOUT)
+		return -EINVAL;
+	if(!(hba_mem->capability & HBA_CAP_CCCS))
+		return -ENOTSUP;
+	ccc_completions = completions;
+	ccc_timeout = timeout;
+	__ccc_apply();
+	return length;
 }
 
 int ahci_port_acquire_slot(struct ahci_device *dev)
@@ -63,7 +168,7 @@ int ahci_port_acquire_slot(struct ahci_device *dev)
 	while(1) {
 		int i;
 		mutex_acquire(&dev->lock);
-		for(i=0;i<32;i++)
+		for(i=0;i<dev->nslots;i++)
 		{
 			if(!(dev->slots & (1 << i))) {
 				dev->slots |= (1 << i);
@@ -83,16 +188,14 @@ void ahci_port_release_slot(struct ahci_device *dev, int slot)
 	mutex_release(&dev->lock);
 }
 
-/* since a DMA transfer must write to contiguous physical RAM, we need to allocate
- * buffers that allow us to create PRDT entries that do not cross a page boundary.
- * That means that each PRDT entry can transfer a maximum of PAGE_SIZE bytes (for
- * 0x1000 page size, that's 8 sectors). Thus, we allocate a buffer that is page aligned, 
- * in a multiple of PAGE_SIZE, so that the PRDT will write to contiguous physical ram
- * (the key here is that the buffer need not be contiguous across multiple PRDT entries).
+/* the PRDT points straight at the caller's pages (block cache pages, kernel
+ * buffers, or the kernel's mapping of the user's pages for O_DIRECT), so
+ * there's nothing to copy.
+ * Only a buffer that the HBA can't use directly (one that is misaligned, or
+ * has pages that aren't mapped in yet) goes through a bounce buffer.
  */
 int ahci_rw_multiple_do(int rw, int min, uint64_t blk, unsigned char *out_buffer, int count)
 {
-	uint32_t length = count * ATA_SECTOR_SIZE;
 	int d = min;
 	struct ahci_device *dev = ports[d];
 	uint64_t end_blk = dev->identify.lba48_addressable_sectors;
@@ -102,41 +205,48 @@ int ahci_rw_multiple_do(int rw, int min, uint64_t blk, unsigned char *out_buffer
 		count = end_blk - blk;
 	if(!count)
 		return 0;
-	int num_pages = ((ATA_SECTOR_SIZE * (count-1)) / PAGE_SIZE) + 1;
-	assert(length <= (unsigned)num_pages * 0x1000);
-	struct dma_region dma;
-	dma.p.size = 0x1000 * num_pages;
-	dma.p.alignment = 0x1000;
-	mm_allocate_dma_buffer(&dma);
+	uint32_t length = count * ATA_SECTOR_SIZE;
 	int num_read_blocks = count;
 	struct hba_port *port = (struct hba_port *)&hba_mem->ports[dev->idx];
-	if(rw == WRITE)
-		memcpy((void *)dma.v, out_buffer, length);
-	
+	addr_t buffer = (addr_t)out_buffer;
+	struct dma_region dma;
 	int slot=ahci_port_acquire_slot(dev);
-	if(!ahci_port_dma_data_transfer(hba_mem, port, dev, slot, rw == WRITE ? 1 : 0, (addr_t)dma.v, count, blk))
+	bool bounce = !ahci_prdt_setup(hba_mem, port, dev, slot, rw == WRITE, buffer, length);
+	if(bounce) {
+		dma.p.size = ((length - 1) / PAGE_SIZE + 1) * PAGE_SIZE;
+		dma.p.alignment = 0x1000;
+		mm_allocate_dma_buffer(&dma);
+		buffer = dma.v;
+		if(rw == WRITE)
+			memcpy((void *)dma.v, out_buffer, length);
+		if(!ahci_prdt_setup(hba_mem, port, dev, slot, rw == WRITE, buffer, length))
+			panic(0, "[ahci]: can't DMA to bounce buffer %x", buffer);
+	}
+	
+	if(!ahci_port_dma_data_transfer(hba_mem, port, dev, slot, rw == WRITE ? 1 : 0, buffer, count, blk))
 		num_read_blocks = 0;
 	
 	ahci_port_release_slot(dev, slot);
 	
-	if(rw == READ && num_read_blocks)
-		memcpy(out_buffer, (void *)dma.v, length);
-	
-	mm_free_dma_buffer(&dma);
+	if(bounce) {
+		if(rw == READ && num_read_blocks)
+			memcpy(out_buffer, (void *)dma.v, length);
+		mm_free_dma_buffer(&dma);
+	}
 	return num_read_blocks * ATA_SECTOR_SIZE;
 }
 
-/* and then since there is a maximum transfer amount because of the page size
- * limit, wrap the transfer function to allow for bigger transfers than that even.
+/* and then since a command table can only hold so many PRDT entries, wrap
+ * the transfer function to allow for bigger transfers than that even.
  */
 int ahci_rw_multiple(int rw, int min, uint64_t blk, unsigned char *out_buffer, int count)
 {
 	int i=0;
 	int ret=0;
 	int c = count;
-	for(i=0;i<count;i+=(PRDT_MAX_ENTRIES * PRDT_MAX_COUNT) / ATA_SECTOR_SIZE)
+	for(i=0;i<count;i+=AHCI_MAX_SECTORS)
 	{
-		int n = (PRDT_MAX_ENTRIES * PRDT_MAX_COUNT) / ATA_SECTOR_SIZE;
+		int n = AHCI_MAX_SECTORS;
 		if(n > c)
 			n=c;
 		ret += ahci_rw_multiple_do(rw, min, blk+i, out_buffer + ret, n);
@@ -153,6 +263,91 @@ static ssize_t __rw(int rw, struct inode *node, uint64_t block, uint8_t *buffer,
 	return ahci_rw_multiple(rw, port, block, buffer, len);
 }
 
+static struct ahci_device *__node_device(struct inode *node)
+{
+	int min = MINOR(node->phys_dev);
+	return ports[(long)hash_lookup(&portmap, &min, sizeof(min))];
+}
+
+/* a queued command is done (or has failed, or been lost to a reset). Give
+ * back the slot, and tell the elevator. */
+static void __ncq_finish(struct ahci_device *dev, int slot, bool ok)
+{
+	struct blockio *io = dev->slot_io[slot];
+	dev->slot_io[slot] = NULL;
+	mutex_acquire(&dev->lock);
+	dev->ncq_active &= ~(1 << slot);
+	/* a reset already took the slot back */
+	if(dev->slot_reset[slot] == dev->resets)
+		dev->slots &= ~(1 << slot);
+	mutex_release(&dev->lock);
+	block_io_complete(io, ok);
+}
+
+/* start a queued command for the elevator, without waiting for it */
+static int __submit(struct inode *node, struct blockio *io)
+{
+	struct ahci_device *dev = __node_device(node);
+	struct hba_port *port = (struct hba_port *)&hba_mem->ports[dev->idx];
+	if(io->start + io->count > dev->identify.lba48_addressable_sectors
+			|| io->count > AHCI_MAX_SECTORS)
+		return -EINVAL;
+	int slot = ahci_port_acquire_slot(dev);
+	/* the elevator's buffers are always its own pages, so they can be used directly */
+	if(!ahci_prdt_setup(hba_mem, port, dev, slot, io->direction == WRITE,
+				(addr_t)io->buffer, io->count * ATA_SECTOR_SIZE))
+		panic(0, "[ahci]: can't DMA to elevator buffer %x", io->buffer);
+	dev->slot_io[slot] = io;
+	dev->slot_time[slot] = tm_timing_get_microseconds();
+	mutex_acquire(&dev->lock);
+	dev->slot_reset[slot] = dev->resets;
+	dev->ncq_active |= (1 << slot);
+	mutex_release(&dev->lock);
+	if(!ahci_port_dma_data_start(hba_mem, port, dev, slot, io->direction == WRITE,
+				(addr_t)io->buffer, io->count, io->start)) {
+		printk(KERN_DEBUG, "[ahci]: device %d: port hung\n", dev->idx);
+		ahci_reset_device(hba_mem, port, dev);
+		__ncq_finish(dev, slot, false);
+	}
+	return 0;
+}
+
+/* finish the queued commands that the device has completed. The device clears
+ * a command's bit in SActive when it's done with it. If the device reports an
+ * error, or a command takes too long, everything still outstanding has been
+ * lost, so it all fails and the port is reset. */
+static int __poll(struct inode *node)
+{
+	struct ahci_device *dev = __node_device(node);
+	struct hba_port *port = (struct hba_port *)&hba_mem->ports[dev->idx];
+	mutex_acquire(&dev->lock);
+	uint32_t active = dev->ncq_active;
+	mutex_release(&dev->lock);
+	uint32_t busy = port->sata_active | port->command_issue;
+	bool error = (atomic_load(&dev->int_status) & HBA_PxIS_ERROR) || (port->task_file_data & ATA_DEV_ERR);
+	time_t now = tm_timing_get_microseconds();
+	for(int slot=0;slot<HBA_COMMAND_HEADER_NUM;slot++) {
+		if((busy & active & (1 << slot)) && now - dev->slot_time[slot] > AHCI_IO_TIMEOUT)
+			error = true;
+	}
+	int count = 0;
+	for(int slot=0;slot<HBA_COMMAND_HEADER_NUM;slot++) {
+		if(!(active & (1 << slot)))
+			continue;
+		bool lost = dev->slot_reset[slot] != dev->resets;
+		if((busy & (1 << slot)) && !lost && !error)
+			continue;
+		__ncq_finish(dev, slot, !lost && !(busy & (1 << slot)));
+		count++;
+	}
+	if(error) {
+		printk(KERN_DEBUG, "[ahci]: device %d: queued command failed: tfd=%x, serr=%x\n",
+				dev->idx, port->task_file_data, port->sata_error);
+		ahci_reset_device(hba_mem, port, dev);
+	}
+	return count;
+}
+
 void ahci_create_device(struct ahci_device *dev)
 {
 	dev->created=1;
@@ -166,6 +361,11 @@ void ahci_create_device(struct ahci_device *dev)
 	dev->bctl.ioctl = NULL;
 	dev->bctl.select = NULL;
 	dev->bctl.blocksize = 512;
+	if(dev->ncq_depth) {
+		dev->bctl.submit = __submit;
+		dev->bctl.poll = __poll;
+		dev->bctl.queue_depth = dev->ncq_depth;
+	}
 	int min = blockdev_register(node, &dev->bctl);
 	vfs_icache_put(node);
 	dev->minor = min;
@@ -185,12 +385,15 @@ int module_install(void)
 	irq = cpu_interrupt_register_handler(ahci_int, ahci_interrupt_handler);
 	ahci_init_hba(hba_mem);
 	ahci_probe_ports(hba_mem);
+	kerfs_register_parameter("/dev/ahci-ccc", NULL, 0, KERFS_PARAM_WRITE, kerfs_ahci_ccc);
 	return 0;
 }
 
 int module_exit(void)
 {
 	int i;
+	kerfs_unregister_entry("/dev/ahci-ccc");
+	hba_mem->ccc_control &= ~HBA_CCC_ENABLE;
 	cpu_interrupt_unregister_handler(ahci_int, irq);
 	for(i=0;i<32;i++)
 	{
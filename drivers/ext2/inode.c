@@ -831,6 +831,47 @@ int ext2_inode_writedata(ext2_inode_t* inode, uint32_t start, size_t len,
 	return counter;
 }
 
+/* O_DIRECT: start and len must be whole blocks. Blocks that are contiguous on
+ * disk are transferred together, straight between buf and the device. Holes
+ * read as zeros, and get allocated on write. */
+int ext2_inode_directio(ext2_inode_t* inode, int write, uint32_t start, size_t len,
+	unsigned char* buf)
+{
+	struct ext2_info *fs = inode->fs;
+	size_t block_size = ext2_sb_blocksize(fs->sb);
+	uint32_t start_block = start / block_size;
+	size_t block_count = len / block_size;
+	unsigned int init_sect_count = inode->sector_count;
+	size_t i = 0;
+	int counter = 0;
+	while (i < block_count) {
+		uint32_t offset = get_block_offset(inode, start_block + i, write);
+		if (offset == 0) {
+			if (write)
+				break;
+			memset(buf + i * block_size, 0, block_size);
+			counter += block_size;
+			i++;
+			continue;
+		}
+		size_t run = 1;
+		while (i + run < block_count && get_block_offset(inode,
+					start_block + i + run, write) == offset + run * block_size)
+			run++;
+		int ret = ext2_direct_io(fs, write, offset, buf + i * block_size, run * block_size);
+		if (ret != (int)(run * block_size))
+			break;
+		counter += ret;
+		i += run;
+	}
+	if (write && (start + counter > inode->size || inode->sector_count != init_sect_count)) {
+		if (start + counter > inode->size)
+			inode->size = start + counter;
+		ext2_inode_update(inode);
+	}
+	return counter;
+}
+
 int ext2_inode_truncate(ext2_inode_t* inode, uint32_t size, int noupdate)
 {
 	size_t block_size = ext2_sb_blocksize(inode->fs->sb);
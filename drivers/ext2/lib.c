@@ -7,6 +7,7 @@ int ext2_read_block(struct ext2_info *fs, uint64_t block, unsigned char *buf)
 {
 	off_t off = block * ext2_sb_blocksize(fs->sb);// + fs->block*512;
 	struct file f;
+	f.flags = 0;
 	f.inode = fs->filesys->node;
 	int ret = fs_file_pread(&f, off, buf, ext2_sb_blocksize(fs->sb));
 	return ret;
@@ -16,14 +17,23 @@ int ext2_write_block(struct ext2_info *fs, uint64_t block, unsigned char *buf)
 {
 	off_t off = block * ext2_sb_blocksize(fs->sb);// + fs->block*512;
 	struct file f;
+	f.flags = 0;
 	f.inode = fs->filesys->node;
 	int ret = fs_file_pwrite(&f, off, buf, ext2_sb_blocksize(fs->sb));
 	return ret;
 }
 
+/* O_DIRECT transfer of len bytes at byte offset off of the device, going around
+ * the block cache */
+int ext2_direct_io(struct ext2_info *fs, int write, off_t off, unsigned char *buf, size_t len)
+{
+	return block_direct_io(write ? WRITE : READ, fs->filesys->node, off, buf, len);
+}
+
 int ext2_read_off(struct ext2_info *fs, off_t off, unsigned char *buf, size_t len)
 {
 	struct file f;
+	f.flags = 0;
 	f.inode = fs->filesys->node;
 	int ret = fs_file_pread(&f, off, buf, len);
 	return ret;
@@ -32,6 +42,7 @@ int ext2_read_off(struct ext2_info *fs, off_t off, unsigned char *buf, size_t le
 int ext2_write_off(struct ext2_info *fs, off_t off, unsigned char *buf, size_t len)
 {
 	struct file f;
+	f.flags = 0;
 	f.inode = fs->filesys->node;
 	int ret = fs_file_pwrite(&f, off, buf, len);
 	return ret;
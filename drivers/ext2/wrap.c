@@ -182,6 +182,45 @@ ssize_t ext2_wrap_inode_write(struct filesystem *fs, struct inode *node,
 	return ret;
 }
 
+ssize_t ext2_wrap_inode_direct_io(struct filesystem *fs, struct inode *node, int rw,
+		size_t offset, size_t length, unsigned char *buffer)
+{
+	struct ext2_info *info = fs->data;
+	size_t block_size = ext2_sb_blocksize(info->sb);
+	if(offset % block_size || length % block_size)
+		return -EINVAL;
+	ext2_inode_t inode;
+	if(rw == READ) {
+		if(!ext2_inode_read(info, node->id, &inode))
+			return -EIO;
+		if(offset >= (size_t)node->length)
+			return 0;
+		/* read the whole of the last block, but only report up to the end of the file */
+		size_t avail = node->length - offset;
+		if(length > avail)
+			length = ((avail - 1) / block_size + 1) * block_size;
+		size_t ret = ext2_inode_directio(&inode, 0, offset, length, buffer);
+		return ret > avail ? avail : ret;
+	}
+	if(info->flags & EXT2_FS_READONLY)
+		return -EROFS;
+	rwlock_acquire(&node->metalock, RWL_WRITER);
+	if(!ext2_inode_read(info, node->id, &inode)) {
+		rwlock_release(&node->metalock, RWL_WRITER);
+		return -EIO;
+	}
+	assert(inode.link_count);
+	unsigned sz = inode.size;
+	unsigned sc = inode.sector_count;
+	int ret = ext2_inode_directio(&inode, 1, offset, length, buffer);
+	if(sz != inode.size || sc != inode.sector_count) {
+		node->length = inode.size;
+		node->nblocks = inode.sector_count;
+	}
+	rwlock_release(&node->metalock, RWL_WRITER);
+	return ret;
+}
+
 int ext2_fs_stat(struct filesystem *fs, struct posix_statfs *stat)
 {
 	struct ext2_info *info = fs->data;
@@ -208,7 +247,8 @@ struct filesystem_inode_callbacks ext2_wrap_iops = {
 	.getdents = ext2_wrap_inode_getdents,
 	.link = ext2_wrap_inode_link,
 	.unlink = ext2_wrap_inode_unlink,
-	.select = 0
+	.select = 0,
+	.direct_io = ext2_wrap_inode_direct_io,
 };
 
 struct filesystem_callbacks ext2_wrap_fsops = {
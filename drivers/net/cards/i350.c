@@ -6,21 +6,21 @@
 #include <sea/kernel.h>
 #include <sea/loader/module.h>
 #include <sea/mm/kmalloc.h>
-#include <sea/mm/pmap.h>
+#include <sea/mm/pmm.h>
 #include <sea/mutex.h>
 #include <sea/net/interface.h>
 #include <sea/net/packet.h>
+#include <sea/tm/kthread.h>
 #include <sea/tm/process.h>
+#include <sea/tm/thread.h>
 #include <sea/tm/timing.h>
 #include <sea/vsprintf.h>
 #include <stdatomic.h>
-#include <sea/mm/kmalloc.h>
 int i350_int;
-struct pmap i350_pmap;
 struct i350_device *i350_dev;
-struct net_dev *i350_net_dev;
 
-int i350_receive_packet(struct net_dev *nd, struct net_packet *, int count);
+int i350_receive_packet(struct net_dev *nd, int queue, struct net_packet **, int budget);
+void i350_rx_interrupts(struct net_dev *nd, int queue, bool enable);
 int i350_transmit_packet(struct net_dev *nd, struct net_packet *packets, int count);
 
 int i350_get_mac(struct net_dev *nd, uint8_t mac[6])
@@ -38,7 +38,18 @@ struct net_dev_calls i350_net_callbacks = {
 	i350_receive_packet,
 	i350_transmit_packet,
 	i350_get_mac,
-	0,0
+	0,0,
+	i350_rx_interrupts,
+};
+
+/* the usual Toeplitz key, so that flows hash the same way they would on
+ * most other systems */
+static const uint8_t i350_rss_key[40] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
 };
 
 struct pci_device *get_i350_pci (void)
@@ -51,7 +62,7 @@ struct pci_device *get_i350_pci (void)
 	i350->flags |= PCI_DRIVEN;
 	printk(KERN_DEBUG, "[i350]: found i350 device, initializing...\n");
 	if(!(i350->pcs->command & 4))
-		printk(KERN_DEBUG, "[ahci]: setting PCI command to bus mastering mode\n");
+		printk(KERN_DEBUG, "[i350]: setting PCI command to bus mastering mode\n");
 	unsigned short cmd = i350->pcs->command | 4;
 	i350->pcs->command = cmd;
 	pci_write_dword(i350->bus, i350->dev, i350->func, 4, cmd);
@@ -61,15 +72,13 @@ struct pci_device *get_i350_pci (void)
 
 void i350_write32(struct i350_device *dev, uint32_t reg, uint32_t value)
 {
-	addr_t addr = pmap_get_mapping(&i350_pmap, dev->mem + reg);
-	volatile uint32_t *a = (uint32_t *)(addr);
+	volatile uint32_t *a = (uint32_t *)(dev->mem + reg);
 	*a = value;
 }
 
 uint32_t i350_read32(struct i350_device *dev, uint32_t reg)
 {
-	addr_t addr = pmap_get_mapping(&i350_pmap, dev->mem + reg);
-	volatile uint32_t *a = (uint32_t *)(addr);
+	volatile uint32_t *a = (uint32_t *)(dev->mem + reg);
 	return *a;
 }
 
@@ -84,220 +93,277 @@ void i350_reset(struct i350_device *dev)
 	tmp = i350_read32(dev, E1000_CTRL);
 	tmp |= E1000_CTRL_GIO_MASTER_DISABLE;
 	i350_write32(dev, E1000_CTRL, tmp);
-	
+
 	/* wait for master to disable */
 	while((i350_read32(dev, E1000_STATUS) & E1000_STATUS_GIO_MASTER_ENABLE))
 		cpu_pause();
-	
+
 	/* issue port reset */
 	tmp |= E1000_CTRL_RESET;
 	i350_write32(dev, E1000_CTRL, tmp);
-	
+
 	/* wait for reset */
 	while((i350_read32(dev, E1000_CTRL) & E1000_CTRL_RESET))
 		cpu_pause();
 	while(!(i350_read32(dev, E1000_STATUS) & E1000_STATUS_RESET_DONE))
 		cpu_pause();
-	
+
 	/* re-enable master */
 	tmp = i350_read32(dev, E1000_CTRL);
 	tmp &= ~E1000_CTRL_GIO_MASTER_DISABLE;
 	i350_write32(dev, E1000_CTRL, tmp);
 }
 
-void i350_allocate_receive_buffers(struct i350_device *dev)
+/* point an rx descriptor at a packet's buffer. The device writes the frame
+ * where the packet's data starts, leaving the headroom alone. */
+static void __rx_arm(struct i350_queue *q, uint32_t i, struct net_packet *packet)
 {
-	dev->rx_buffer_len = 0x1000;
-	
-	struct i350_receive_descriptor *r;
-	addr_t rxring;
-	r = kmalloc_ap(0x1000, &rxring);
-	dev->receive_list_physical = rxring;
-	dev->rx_list_count = (0x1000 / sizeof(struct i350_receive_descriptor));
-	dev->receive_ring = r;
-	kprintf("[i350]: allocated rx_list: %d descs\n", dev->rx_list_count);
-	
-	dev->rx_ring_virt_buffers = kmalloc(sizeof(addr_t) * dev->rx_list_count);
-	
-	for(unsigned int i=0;i<dev->rx_list_count;i++)
-	{
-		addr_t ba;
-		dev->rx_ring_virt_buffers[i] = (addr_t)kmalloc_ap(0x1000, &ba);
-		memset(r, 0, sizeof(*r));
-		r->buffer = ba;
-		r++;
-	}
-	
-	uint32_t tmp = i350_read32(dev, E1000_RXDCTL);
-	tmp &= ~(1 << 25);
-	i350_write32(dev, E1000_RXDCTL, tmp);
-	
-	tmp = dev->rx_list_count / 8;
-	i350_write32(dev, E1000_RDLEN0, tmp << 7);
-	
-	i350_write32(dev, E1000_SRRCTL0, 4);
-	
-	
-	i350_write32(dev, E1000_RDBAL0, rxring & 0xFFFFFFFF);
-	i350_write32(dev, E1000_RDBAH0, UPPER32(rxring));
-	
-	tmp |= (1<<25);
-	i350_write32(dev, E1000_RXDCTL, tmp);
-	
-	while(!(i350_read32(dev, E1000_RXDCTL) & (1<<25))) cpu_pause();
-	
-	tmp = i350_read32(dev, E1000_RCTL);
-	i350_write32(dev, E1000_RCTL, tmp | (1<<1) | (1<<3) | (1<<4) | (1<<15));
-	
+	struct i350_receive_descriptor *r = &q->rx_ring[i];
+	q->rx_packets[i] = packet;
+	memset(r, 0, sizeof(*r));
+	r->buffer = packet->page + NP_HEADROOM;
+}
+
+void i350_allocate_receive_buffers(struct i350_device *dev, struct i350_queue *q)
+{
+	q->rx_ring_physical = mm_physical_allocate(PAGE_SIZE, true);
+	q->rx_ring = (void *)(q->rx_ring_physical + PHYS_PAGE_MAP);
+	for(unsigned int i=0;i<I350_RING_SIZE;i++)
+		__rx_arm(q, i, net_packet_create(0, 0));
+	q->rx_next = 0;
+
+	uint32_t tmp = i350_read32(dev, E1000_RXDCTL(q->idx));
+	tmp &= ~E1000_QUEUE_ENABLE;
+	i350_write32(dev, E1000_RXDCTL(q->idx), tmp);
+
+	i350_write32(dev, E1000_RDLEN(q->idx), I350_RING_SIZE * sizeof(struct i350_receive_descriptor));
+	/* legacy descriptors. A full queue drops, rather than holding up the
+	 * other queues. */
+	i350_write32(dev, E1000_SRRCTL(q->idx), E1000_SRRCTL_DROP_EN
+			| ((MAX_PACKET_SIZE / 1024) << E1000_SRRCTL_BSIZEPKT_SHIFT));
+
+	i350_write32(dev, E1000_RDBAL(q->idx), q->rx_ring_physical & 0xFFFFFFFF);
+	i350_write32(dev, E1000_RDBAH(q->idx), UPPER32(q->rx_ring_physical));
+
+	tmp |= E1000_QUEUE_ENABLE;
+	i350_write32(dev, E1000_RXDCTL(q->idx), tmp);
+
+	while(!(i350_read32(dev, E1000_RXDCTL(q->idx)) & E1000_QUEUE_ENABLE)) cpu_pause();
+
+	/* one descriptor is always left empty, so a full ring isn't empty */
+	i350_write32(dev, E1000_RDH(q->idx), 0);
+	i350_write32(dev, E1000_RDT(q->idx), I350_RING_SIZE - 1);
+}
+
+void i350_allocate_transmit_buffers(struct i350_device *dev, struct i350_queue *q)
+{
+	q->tx_ring_physical = mm_physical_allocate(PAGE_SIZE, true);
+	q->tx_ring = (void *)(q->tx_ring_physical + PHYS_PAGE_MAP);
+	q->tx_tail = q->tx_clean = 0;
+	mutex_create(&q->tx_lock, 0);
+
+	uint32_t tmp = i350_read32(dev, E1000_TXDCTL(q->idx));
+	tmp &= ~E1000_QUEUE_ENABLE;
+	i350_write32(dev, E1000_TXDCTL(q->idx), tmp);
+
+	i350_write32(dev, E1000_TDLEN(q->idx), I350_RING_SIZE * sizeof(struct i350_transmit_descriptor));
+
+	i350_write32(dev, E1000_TDBAL(q->idx), q->tx_ring_physical & 0xFFFFFFFF);
+	i350_write32(dev, E1000_TDBAH(q->idx), UPPER32(q->tx_ring_physical));
+	i350_write32(dev, E1000_TDH(q->idx), 0);
+	i350_write32(dev, E1000_TDT(q->idx), 0);
+
+	tmp |= E1000_QUEUE_ENABLE;
+	i350_write32(dev, E1000_TXDCTL(q->idx), tmp);
+
+	while(!(i350_read32(dev, E1000_TXDCTL(q->idx)) & E1000_QUEUE_ENABLE)) cpu_pause();
 }
 
-void i350_allocate_transmit_buffers(struct i350_device *dev)
+/* spread flows over the receive queues by their Toeplitz hash. The
+ * redirection table has 128 byte entries, four to a register. */
+void i350_setup_rss(struct i350_device *dev)
 {
-	dev->tx_buffer_len = 0x1000;
-	
-	struct i350_transmit_descriptor *r;
-	addr_t txring;
-	r = kmalloc_ap(0x1000, &txring);
-	dev->transmit_list_physical = txring;
-	dev->tx_list_count = (0x1000 / sizeof(struct i350_transmit_descriptor));
-	dev->transmit_ring = r;
-	kprintf("[i350]: allocated tx_list: %d descs\n", dev->tx_list_count);
-	
-	dev->tx_ring_virt_buffers = kmalloc(sizeof(addr_t) * dev->rx_list_count);
-	
-	for(unsigned int i=0;i<dev->tx_list_count;i++)
-	{
-		addr_t ba;
-		dev->tx_ring_virt_buffers[i] = (addr_t)kmalloc_ap(0x1000, &ba);
-		memset(r, 0, sizeof(*r));
-		r->buffer = ba;
-		r++;
+	for(int i=0;i<10;i++) {
+		const uint8_t *k = &i350_rss_key[i * 4];
+		i350_write32(dev, E1000_RSSRK(i), k[0] | (k[1] << 8) | (k[2] << 16) | ((uint32_t)k[3] << 24));
 	}
-	
-	uint32_t tmp = i350_read32(dev, E1000_RXDCTL);
-	tmp &= ~(1 << 25);
-	i350_write32(dev, E1000_TXDCTL, tmp);
-	
-	tmp = dev->tx_list_count / 8;
-	i350_write32(dev, E1000_TDLEN0, tmp << 7);
-	
-	i350_write32(dev, E1000_TDBAL0, txring & 0xFFFFFFFF);
-	i350_write32(dev, E1000_TDBAH0, UPPER32(txring));
-	
-	tmp |= (1<<25);
-	i350_write32(dev, E1000_TXDCTL, tmp);
-	
-	while(!(i350_read32(dev, E1000_TXDCTL) & (1<<25))) cpu_pause();
-	
-	tmp = i350_read32(dev, E1000_TCTL);
-	i350_write32(dev, E1000_TCTL, tmp | (1<<1) | (1<<3));
-	
+	for(int i=0;i<32;i++) {
+		uint32_t reta = 0;
+		for(int j=0;j<4;j++)
+			reta |= ((i * 4 + j) % dev->queue_count) << (j * 8);
+		i350_write32(dev, E1000_RETA(i), reta);
+	}
+	i350_write32(dev, E1000_MRQC, E1000_MRQC_RSS | E1000_MRQC_IPV4 | E1000_MRQC_TCP_IPV4
+			| E1000_MRQC_IPV6 | E1000_MRQC_TCP_IPV6);
 }
 
 void i350_init(struct i350_device *dev)
 {
-	dev->mem = dev->pci->pcs->bar0;
-	kprintf("[i350]: using interrupt %d\n", i350_int);
-	
+	dev->mem = dev->pci->pcs->bar0 & ~0xF;
+	dev->mem += PHYS_PAGE_MAP;
+
 	/* disable interrupts */
 	i350_write32(dev, E1000_IMC, ~0);
-	
+	i350_write32(dev, E1000_EIMC, ~0);
+
 	printk(KERN_DEBUG, "[i350]: resetting device\n");
 	i350_reset(dev);
-	
+
 	/* disable interrupts again */
 	i350_write32(dev, E1000_IMC, ~0);
-	
+	i350_write32(dev, E1000_EIMC, ~0);
+
 	/* clear ILOS bit */
-	uint32_t tmp, tmp2, tmp3, tmp4;
+	uint32_t tmp;
 	tmp = i350_read32(dev, E1000_CTRL);
 	tmp &= ~E1000_CTRL_ILOS;
 	i350_write32(dev, E1000_CTRL, tmp);
-	
+
 	/* set Auto-Negotiation */
 	tmp = i350_read32(dev, E1000_PCS_LCTL);
 	tmp |= E1000_PCS_LCTL_AN_ENABLE;
 	i350_write32(dev, E1000_PCS_LCTL, tmp);
-	
+
 	tm_thread_delay_sleep(ONE_MILLISECOND * 10);
-	
-	i350_allocate_receive_buffers(dev);
-	i350_allocate_transmit_buffers(dev);
-	
+}
+
+void i350_start(struct i350_device *dev)
+{
+	for(int i=0;i<dev->queue_count;i++) {
+		i350_allocate_receive_buffers(dev, &dev->queues[i]);
+		i350_allocate_transmit_buffers(dev, &dev->queues[i]);
+	}
+	if(dev->queue_count > 1)
+		i350_setup_rss(dev);
+
+	uint32_t tmp = i350_read32(dev, E1000_RCTL);
+	i350_write32(dev, E1000_RCTL, tmp | E1000_RCTL_RXEN | E1000_RCTL_UPE | E1000_RCTL_MPE | E1000_RCTL_BAM);
+	tmp = i350_read32(dev, E1000_TCTL);
+	i350_write32(dev, E1000_TCTL, tmp | E1000_TCTL_EN | E1000_TCTL_PSP);
+
 	tmp = i350_read32(dev, E1000_CTRL);
 	tmp |= E1000_CTRL_SLU;
 	tmp &= ~(E1000_CTRL_RXFC);
 	i350_write32(dev, E1000_CTRL, tmp);
-	
-	i350_write32(dev, E1000_IMS, ~0);
-	i350_write32(dev, E1000_RDT0, dev->rx_list_count-1);
-	for(;;)
-	{
-		//tmp2 = i350_read32(dev, E1000_GPTC);
-		//kprintf("**%d**\n", tmp2);
-		tm_thread_delay_sleep(ONE_MILLISECOND * 2000);
+}
+
+/* this is called by a queue's [kpacket] thread, to read in packets. Full
+ * buffers are swapped for the empty packets in the array, so the frames
+ * are never copied. */
+int i350_receive_packet(struct net_dev *nd, int queue, struct net_packet **packets, int budget)
+{
+	int num=0;
+	bool refilled = false;
+	struct i350_device *dev = nd->data;
+	struct i350_queue *q = &dev->queues[queue];
+
+	while(num < budget) {
+		struct i350_receive_descriptor *r = &q->rx_ring[q->rx_next];
+		if(!(((volatile struct i350_receive_descriptor *)r)->status & E1000_RXD_STAT_DD))
+			break;
+		/* don't read the rest of the descriptor before the status */
+		atomic_thread_fence(memory_order_acquire);
+
+		struct net_packet *packet = q->rx_packets[q->rx_next];
+		if((r->status & E1000_RXD_STAT_EOP) && !r->error) {
+			packet->length = r->length;
+			packet->flags = NP_FLAG_ALLOC;
+			__rx_arm(q, q->rx_next, packets[num]);
+			packets[num++] = packet;
+		} else {
+			/* a frame that didn't fit in one buffer, or a bad one */
+			nd->rx_err_count++;
+			__rx_arm(q, q->rx_next, packet);
+		}
+		q->rx_next = (q->rx_next + 1) % I350_RING_SIZE;
+		refilled = true;
 	}
+	/* give the whole batch of descriptors back at once */
+	if(refilled)
+		i350_write32(dev, E1000_RDT(queue), (q->rx_next + I350_RING_SIZE - 1) % I350_RING_SIZE);
+	return num;
+}
 
+/* the queue's own interrupt if we have MSI-X, or receive descriptor written
+ * and receiver overrun if we don't */
+void i350_rx_interrupts(struct net_dev *nd, int queue, bool enable)
+{
+	struct i350_device *dev = nd->data;
+	if(dev->msix)
+		i350_write32(dev, enable ? E1000_EIMS : E1000_EIMC, 1 << queue);
+	else
+		i350_write32(dev, enable ? E1000_IMS : E1000_IMC, E1000_ICR_RXDW | E1000_ICR_RXMISS);
 }
 
-void i350_notify_packet_available(void)
+/* drop the packets that the device has finished sending. Called with the
+ * queue's tx lock held. */
+static void __tx_clean(struct i350_queue *q)
 {
-	/* tell networking subsystem that this device has a packet available
-	 * for reading. This doesn't do anything about the rx rings, that is
-	 * up to the networking system to call i350_receive_packet */
-	net_notify_packet_ready(i350_net_dev);
+	while(q->tx_clean != q->tx_tail) {
+		struct i350_transmit_descriptor *t = &q->tx_ring[q->tx_clean];
+		struct net_packet *packet = q->tx_packets[q->tx_clean];
+		/* only the last descriptor of a packet reports back */
+		if(packet) {
+			if(!(((volatile struct i350_transmit_descriptor *)t)->sta & E1000_TXD_STAT_DD))
+				break;
+			q->tx_packets[q->tx_clean] = 0;
+			net_packet_put(packet, 0);
+		}
+		q->tx_clean = (q->tx_clean + 1) % I350_RING_SIZE;
+	}
 }
 
-/* this is called by the networking subsystem, to read in packets */
-int i350_receive_packet(struct net_dev *nd, struct net_packet *packets, int count)
+static void __tx_desc(struct i350_queue *q, addr_t buffer, size_t length, int cmd)
 {
-	if(count > 1) panic(0, "count > 1: NI");
-	int num=1;
-	struct i350_device *dev = i350_dev;
-	mutex_acquire(dev->rx_queue_lock[0]);
-	uint32_t head = i350_read32(dev, E1000_RDH0);
-	uint32_t tail = i350_read32(dev, E1000_RDT0);
-	
-	uint32_t next = tail + 1;
-	if(next > (dev->rx_list_count-1))
-		next = 0;
-	
-	if(next == head) return 0;
-
-	struct i350_receive_descriptor *r = &dev->receive_ring[next];
-	
-	kprintf("PACKET (%d %d %d): %x, %d\n", head, tail, next, r->status, r->length);
-	atomic_fetch_sub(&nd->rx_pending, 1);
-	
-	memcpy(packets[0].data, (void *)(dev->rx_ring_virt_buffers[next]), r->length);
-	packets[0].length = r->length;
-	packets[0].flags = 0;
-	
-	i350_write32(dev, E1000_RDT0, next);
-	mutex_release(dev->rx_queue_lock[0]);
-	return num;
+	struct i350_transmit_descriptor *t = &q->tx_ring[q->tx_tail];
+	memset(t, 0, sizeof(*t));
+	t->buffer = buffer;
+	t->length = length;
+	t->cmd = cmd;
+	q->tx_tail = (q->tx_tail + 1) % I350_RING_SIZE;
 }
 
+/* each CPU sends on its own queue. The device reads the frame straight out
+ * of the packet's pages, one descriptor for the linear part and one for
+ * each fragment, and the packet is held until it's done. */
 int i350_transmit_packet(struct net_dev *nd, struct net_packet *packets, int count)
 {
-	if(count > 1) panic(0, "count > 1: NI");
-	struct i350_device *dev = i350_dev;
-	mutex_acquire(dev->tx_queue_lock[0]);
-	uint32_t head = i350_read32(dev, E1000_TDH0);
-	uint32_t tail = i350_read32(dev, E1000_TDT0);
-	
-	memcpy((void *)(dev->tx_ring_virt_buffers[tail]), packets[0].data, packets[0].length);
-	dev->transmit_ring[tail].length = packets[0].length;
-	dev->transmit_ring[tail].cmd = (1 | (1<<3) | (1<<1));
-	int old = tail;
-	kprintf("SEND: %d\n", tail);
-	tail++;
-	if(tail == dev->tx_list_count)
-		tail=0;
-	
-	i350_write32(dev, E1000_TDT0, tail);
-	mutex_release(dev->tx_queue_lock[0]);
-	return count;
+	struct i350_device *dev = nd->data;
+	struct cpu *cpu = cpu_get_current();
+	struct i350_queue *q = &dev->queues[cpu->knum % dev->queue_count];
+	cpu_put_current(cpu);
+
+	int sent;
+	mutex_acquire(&q->tx_lock);
+	__tx_clean(q);
+	for(sent=0;sent<count;sent++) {
+		struct net_packet *packet = &packets[sent];
+		uint32_t free = (q->tx_clean + I350_RING_SIZE - q->tx_tail - 1) % I350_RING_SIZE;
+		if(free < (uint32_t)packet->nr_frags + 1)
+			break;
+		if(packet->flags & NP_FLAG_ALLOC) {
+			net_packet_get(packet);
+		} else {
+			/* it's on the caller's stack, and will be gone before the
+			 * device gets to it */
+			struct net_packet *copy = net_packet_create(0, 0);
+			copy->length = net_packet_copy_out(packet, 0, copy->data, packet->length);
+			packet = copy;
+		}
+		size_t headlen = net_packet_headlen(packet);
+		int last = packet->nr_frags ? 0 : E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS;
+		__tx_desc(q, packet->page + net_packet_headroom(packet), headlen, E1000_TXD_CMD_IFCS | last);
+		for(int i=0;i<packet->nr_frags;i++) {
+			struct net_packet_frag *frag = &packet->frags[i];
+			last = i == packet->nr_frags - 1 ? E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS : 0;
+			__tx_desc(q, frag->page + frag->offset, frag->length, E1000_TXD_CMD_IFCS | last);
+		}
+		q->tx_packets[(q->tx_tail + I350_RING_SIZE - 1) % I350_RING_SIZE] = packet;
+	}
+	if(sent)
+		i350_write32(dev, E1000_TDT(q->idx), q->tx_tail);
+	mutex_release(&q->tx_lock);
+	return sent;
 }
 
 void i350_link_status_change(void)
@@ -305,11 +371,6 @@ void i350_link_status_change(void)
 	kprintf("[i350]: link status changed\n");
 }
 
-void i350_transmitted_packet(void)
-{
-	//kprintf("[i350]: transmit complete\n");
-}
-
 void i350_rx_miss(void)
 {
 	kprintf("[i350]: warning - missed packet\n");
@@ -320,39 +381,98 @@ void i350_error_interrupt(void)
 	kprintf("[i350]: error - fatal error interrupt received\n");
 }
 
-void i350_interrupt(struct registers *regs, int int_no, int flags)
+static void __other_causes(uint32_t t)
 {
-	uint32_t t = i350_read32(i350_dev, E1000_ICR);
-	if(!(t & (1 << 31)))
-		return;
-	
 	if((t & E1000_ICR_LSC))
 		i350_link_status_change();
-	if((t & E1000_ICR_RXDW))
-		i350_notify_packet_available();
-	if((t & E1000_ICR_TXDW))
-		i350_transmitted_packet();
 	if((t & E1000_ICR_RXMISS))
 		i350_rx_miss();
 	if((t & E1000_ICR_FER) || (t & E1000_ICR_PCIEX))
 		i350_error_interrupt();
-	
+}
+
+/* legacy interrupt, if MSI-X isn't available. There's only the one queue. */
+void i350_interrupt(struct registers *regs, int int_no, int flags)
+{
+	uint32_t t = i350_read32(i350_dev, E1000_ICR);
+	if(!(t & (1 << 31)))
+		return;
+
+	__other_causes(t);
+	if((t & E1000_ICR_RXDW))
+		net_notify_rx_queue(i350_dev->nd, 0);
+
 	/* clear interrupt cause */
 	i350_write32(i350_dev, E1000_ICR, t);
 }
-/*
-void i350_interrupt_lvl2(struct registers *regs, int int_no)
+
+/* an MSI-X vector for a receive queue. It arrives on the CPU that the
+ * queue's thread runs on, and the cause is cleared automatically. That
+ * means it usually interrupts the queue's own thread, so nothing on this
+ * path may take a lock the thread could hold; net_notify_rx_queue takes
+ * none. */
+void i350_queue_interrupt(struct registers *regs, int int_no, int flags)
 {
-	if(i350_net_dev->rx_pending)
-	{
-		struct net_packet packet[1];
-		i350_receive_packet(i350_net_dev, packet, 1);
-		net_receive_packet(i350_net_dev, packet, 1);
+	for(int i=0;i<i350_dev->queue_count;i++) {
+		if(i350_dev->queues[i].vector == int_no) {
+			net_notify_rx_queue(i350_dev->nd, i);
+			return;
+		}
 	}
 }
-*/
 
-int i350_irq1;
+void i350_other_interrupt(struct registers *regs, int int_no, int flags)
+{
+	__other_causes(i350_read32(i350_dev, E1000_ICR));
+}
+
+/* get a vector for each queue and one for everything else, and aim each
+ * queue's vector at the CPU its thread runs on. Returns false if we have to
+ * make do with the legacy interrupt. */
+static bool __setup_msix(struct i350_device *dev)
+{
+	if(pci_msix_init(dev->pci, &dev->msix_table) < 0)
+		return false;
+	if((dev->other_vector = pci_msix_allocate_vector()) < 0)
+		return false;
+	int count = dev->queue_count;
+	if(count > dev->msix_table.table_size - 1)
+		count = dev->msix_table.table_size - 1;
+	dev->queue_count = 0;
+	while(dev->queue_count < count) {
+		int vector = pci_msix_allocate_vector();
+		if(vector < 0)
+			break;
+		dev->queues[dev->queue_count++].vector = vector;
+	}
+	return dev->queue_count > 0;
+}
+
+static void __enable_msix(struct i350_device *dev)
+{
+	uint32_t queues = (1 << dev->queue_count) - 1;
+	i350_write32(dev, E1000_GPIE, E1000_GPIE_NSICR | E1000_GPIE_MSIX_MODE | E1000_GPIE_PBA);
+	for(int i=0;i<dev->queue_count;i++) {
+		struct i350_queue *q = &dev->queues[i];
+		cpu_interrupt_register_handler(q->vector, i350_queue_interrupt);
+		pci_msix_set_entry(&dev->msix_table, i, q->vector,
+				dev->nd->rx_queues[i].thread.thread->cpu->snum);
+		/* receive queue i causes MSI-X entry i */
+		uint32_t ivar = i350_read32(dev, E1000_IVAR(i / 2));
+		ivar &= ~(0xFF << ((i % 2) * 16));
+		ivar |= (i | E1000_IVAR_VALID) << ((i % 2) * 16);
+		i350_write32(dev, E1000_IVAR(i / 2), ivar);
+	}
+	cpu_interrupt_register_handler(dev->other_vector, i350_other_interrupt);
+	pci_msix_set_entry(&dev->msix_table, dev->queue_count, dev->other_vector,
+			current_thread->cpu->snum);
+	i350_write32(dev, E1000_IVAR_MISC, (dev->queue_count | E1000_IVAR_VALID) << 8);
+	pci_msix_enable(&dev->msix_table, true);
+
+	i350_write32(dev, E1000_EIAC, queues);
+	i350_write32(dev, E1000_IMS, E1000_ICR_LSC | E1000_ICR_RXMISS);
+	i350_write32(dev, E1000_EIMS, queues | (1 << dev->queue_count));
+}
 
 int module_install(void)
 {
@@ -362,16 +482,34 @@ int module_install(void)
 		printk(KERN_DEBUG, "[i350]: no such device found!\n");
 		return -ENOENT;
 	}
-	pmap_create(&i350_pmap, 0);
 	struct i350_device *dev = kmalloc(sizeof(struct i350_device));
 	dev->pci = i350;
-	i350_irq1=cpu_interrupt_register_handler(i350_int, i350_interrupt);
 	i350_dev = dev;
-	dev->tx_queue_lock[0] = mutex_create(0, 0);
-	dev->rx_queue_lock[0] = mutex_create(0, 0);
-	i350_net_dev = net_add_device(&i350_net_callbacks, 0);
 	i350_init(dev);
-	
+
+	dev->queue_count = num_cpus < I350_MAX_QUEUES ? num_cpus : I350_MAX_QUEUES;
+	if(dev->queue_count < 1)
+		dev->queue_count = 1;
+	dev->msix = __setup_msix(dev);
+	if(!dev->msix)
+		dev->queue_count = 1;
+	for(int i=0;i<dev->queue_count;i++) {
+		dev->queues[i].dev = dev;
+		dev->queues[i].idx = i;
+	}
+	printk(KERN_DEBUG, "[i350]: using %d queue%s, %s\n", dev->queue_count,
+			dev->queue_count == 1 ? "" : "s", dev->msix ? "MSI-X" : "legacy interrupt");
+
+	/* the rx threads have to exist before we know where to send interrupts */
+	dev->nd = net_add_device_mq(&i350_net_callbacks, dev, dev->queue_count);
+	i350_start(dev);
+	if(dev->msix) {
+		__enable_msix(dev);
+	} else {
+		cpu_interrupt_register_handler(i350_int, i350_interrupt);
+		i350_write32(dev, E1000_IMS, E1000_ICR_LSC | E1000_ICR_RXDW | E1000_ICR_RXMISS
+				| E1000_ICR_FER | E1000_ICR_PCIEX);
+	}
 	return 0;
 }
 
@@ -35,7 +35,8 @@ typedef struct rtl8139_dev_s
 rtl8139dev_t *devs[16];
 
 #define RX_BUF_SIZE (64 * 1024)
-int rtl8139_receive_packet(struct net_dev *nd, struct net_packet *, int count);
+int rtl8139_receive_packet(struct net_dev *nd, int queue, struct net_packet **, int budget);
+void rtl8139_rx_interrupts(struct net_dev *nd, int queue, bool enable);
 int rtl8139_transmit_packet(struct net_dev *nd, struct net_packet *packets, int count);
 int rtl8139_set_flags(struct net_dev *nd, int flags);
 int rtl8139_get_mac(struct net_dev *nd, uint8_t mac[6])
@@ -55,7 +56,8 @@ struct net_dev_calls rtl8139_net_callbacks = {
 	rtl8139_transmit_packet,
 	rtl8139_get_mac,
 	rtl8139_set_flags,
-	0
+	0,
+	rtl8139_rx_interrupts,
 };
 
 
@@ -257,7 +259,7 @@ int rtl8139_transmit_packet(struct net_dev *nd, struct net_packet *packets, int
 			break;
 		cpu_pause();
 	}
-	memcpy((void *)dev->tx_buffer[dev->tx_num].v, packets[0].data, packets[0].length);
+	net_packet_copy_out(&packets[0], 0, (void *)dev->tx_buffer[dev->tx_num].v, packets[0].length);
 	if(packets[0].length < 0x1000)
 		memset((void *)(dev->tx_buffer[dev->tx_num].v + packets[0].length), 0, 0x1000 - packets[0].length);
 
@@ -270,17 +272,17 @@ int rtl8139_transmit_packet(struct net_dev *nd, struct net_packet *packets, int
 	mutex_release(&dev->tx_lock);
 	return 1;
 }
-int rtl8139_receive_packet(struct net_dev *nd, struct net_packet *packets, int count)
+int rtl8139_receive_packet(struct net_dev *nd, int queue, struct net_packet **packets, int budget)
 {
 	rtl8139dev_t *dev = nd->data;
 	uint8_t *buffer;
 	uint16_t length, info;
 	int num=0;
-	while(1)
+	while(num < budget)
 	{
 		uint32_t cmd = inb(dev->addr + 0x37);
 		if(cmd & 1) {
-			return 0;
+			break;
 		}
 
 		buffer = (void *)(dev->rec_buf_virt + dev->rx_o);
@@ -293,8 +295,8 @@ int rtl8139_receive_packet(struct net_dev *nd, struct net_packet *packets, int c
 			dev->rx_o += 4;
 			if(length >= 14 && (info & 1)) /* larger than ethernet frame header */
 			{
-				uint8_t *data = packets[0].data;
-				packets[0].length = length - 4;
+				uint8_t *data = packets[num]->data;
+				packets[num]->length = length - 4;
 
 				if((dev->rx_o + length - 4) >= RX_BUF_SIZE) {
 					memcpy(data, buffer, RX_BUF_SIZE - dev->rx_o);
@@ -304,7 +306,7 @@ int rtl8139_receive_packet(struct net_dev *nd, struct net_packet *packets, int c
 					memcpy(data, buffer, length - 4);
 				}
 
-				num = 1;
+				num++;
 
 			}
 
@@ -313,15 +315,19 @@ int rtl8139_receive_packet(struct net_dev *nd, struct net_packet *packets, int c
 		dev->rx_o %= RX_BUF_SIZE;
 
 		outw(dev->addr + 0x38, dev->rx_o - 0x10);
-
-		/* TODO */
-		break;
 	}
 
 
 	return num;
 }
 
+/* IMR bits 0 and 1 are rx ok and rx error */
+void rtl8139_rx_interrupts(struct net_dev *nd, int queue, bool enable)
+{
+	rtl8139dev_t *dev = nd->data;
+	outw(dev->addr + 0x3C, enable ? 15 : (15 & ~3));
+}
+
 void do_recieve(rtl8139dev_t *dev, unsigned short data)
 {
 	net_notify_packet_ready(dev->net_dev);
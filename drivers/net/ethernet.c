@@ -21,8 +21,15 @@ void ethernet_construct_header(struct ethernet_header *head, uint8_t src_mac[6],
 
 void ethernet_send_packet(struct net_dev *nd, struct net_packet *netpacket)
 {
-	if(netpacket->length < 60)
+	if(netpacket->length < 60) {
+		/* the padding goes after the whole frame, so a short frame with
+		 * fragments is pulled into the linear part first. It's short, so
+		 * it fits. */
+		net_packet_linearize(netpacket);
+		/* pooled pages aren't cleared, so don't pad with stale data */
+		memset(netpacket->data + netpacket->length, 0, 60 - netpacket->length);
 		netpacket->length = 60;
+	}
 	TRACE(0, "[ethernet]: send packet size %d\n", netpacket->length);
 	net_transmit_packet(nd, netpacket, 1);
 }
@@ -30,8 +37,10 @@ void ethernet_send_packet(struct net_dev *nd, struct net_packet *netpacket)
 void ethernet_transmit_packet(struct net_dev *nd, struct net_packet *netpacket, sa_family_t sa, uint8_t dest[6], int len)
 {
 	int etype = ethernet_convert_sa_family(sa);
-	ethernet_construct_header(netpacket->data_header, nd->hw_address, dest, etype);
-	netpacket->length = len + sizeof(struct ethernet_header);
+	netpacket->length = len;
+	struct ethernet_header *head = net_packet_push(netpacket, sizeof(struct ethernet_header));
+	ethernet_construct_header(head, nd->hw_address, dest, etype);
+	netpacket->data_header = head;
 	ethernet_send_packet(nd, netpacket);
 }
 
@@ -57,21 +66,27 @@ int ethernet_convert_sa_family(sa_family_t sa)
 	return -1;
 }
 
-void ethernet_receive_packet(struct net_dev *nd, struct net_packet *packet)
+sa_family_t ethernet_decode_packet(struct net_dev *nd, struct net_packet *packet)
 {
 	struct ethernet_header *head = (struct ethernet_header *)packet->data;
-	unsigned char *payload = (unsigned char *)(head+1);
 	TRACE(0, "[ethernet]: receive packet size %d\n", packet->length);
-	sa_family_t af = ethernet_get_sa_family(BIG_TO_HOST16(head->type));
+	packet->network_header = head + 1;
+	return ethernet_get_sa_family(BIG_TO_HOST16(head->type));
+}
+
+void ethernet_receive_packet(struct net_dev *nd, struct net_packet *packet)
+{
+	sa_family_t af = ethernet_decode_packet(nd, packet);
 	if(af == (sa_family_t)-1)
 		return;
-	net_nlayer_receive_from_dlayer(nd, packet, af, payload);
+	net_nlayer_receive_from_dlayer(nd, packet, af, packet->network_header);
 }
 
 struct data_layer_protocol ether = {
 	.flags = 0,
 	.send = ethernet_transmit_packet,
 	.receive = ethernet_receive_packet,
+	.decode = ethernet_decode_packet,
 };
 
 int module_install(void)
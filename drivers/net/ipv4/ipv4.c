@@ -43,6 +43,7 @@ uint16_t ipv4_calc_checksum(void *__data, int length)
 struct nlayer_protocol ipv4 = {
 	.flags = 0,
 	.receive = ipv4_receive_packet,
+	.receive_batch = ipv4_receive_batch,
 	.send = ipv4_enqueue_sockaddr,
 };
 
@@ -262,6 +262,8 @@ void ipv4_forward_packet(struct net_dev *nd, struct net_packet *netpacket, struc
 		rh->ttl = 64;
 		rh->dest_ip = header->src_ip;
 		rh->id = 0;
+		rh->tos = 0;
+		rh->frag_offset = 0;
 		rh->length = HOST_TO_BIG16(header->header_len * 8 + 8 + sizeof(struct icmp_packet));
 		rh->ptype = 1;
 		memcpy(data + header->header_len * 4 + sizeof(struct icmp_packet), header, header->header_len * 4 + 8);
@@ -276,11 +278,11 @@ void ipv4_forward_packet(struct net_dev *nd, struct net_packet *netpacket, struc
 	ipv4_enqueue_packet(netpacket, header);
 }
 
-void ipv4_receive_packet(struct net_dev *nd, struct net_packet *netpacket, void *__packet)
+static void __ipv4_receive(struct net_dev *nd, struct net_packet *netpacket, struct ipv4_header *packet,
+		union ipv4_address ifaddr, uint32_t mask)
 {
 	/* check if we are to accept this packet */
 	TRACE_MSG("ipv4", "[ipv4]: receive_packet\n");
-	struct ipv4_header *packet = __packet;
 	netpacket->network_header = packet;
 	uint16_t checksum = packet->checksum;
 	packet->checksum = 0;
@@ -294,13 +296,6 @@ void ipv4_receive_packet(struct net_dev *nd, struct net_packet *netpacket, void
 	union ipv4_address dest = (union ipv4_address)(uint32_t)packet->dest_ip;
 	TRACE_MSG("ipv4", "[ipv4]: packet from %x (%d.%d.%d.%d)\n",
 			src.address, src.addr_bytes[0], src.addr_bytes[1], src.addr_bytes[2], src.addr_bytes[3]);
-	union ipv4_address ifaddr;
-	uint32_t mask;
-	struct sockaddr s;
-	net_iface_get_netaddr(nd, AF_INET, &s);
-	memcpy(&ifaddr.address, s.sa_data + 2, 4);
-	net_iface_get_netmask(nd, AF_INET, &s);
-	memcpy(&mask, s.sa_data + 2, 4);
 	if(ifaddr.address == dest.address
 			/* TODO: should we use this automatic broadcast address? */
 			|| (dest.address == BROADCAST_ADDRESS(ifaddr.address, mask)
@@ -316,3 +311,29 @@ void ipv4_receive_packet(struct net_dev *nd, struct net_packet *netpacket, void
 	}
 }
 
+static void __ipv4_get_iface(struct net_dev *nd, union ipv4_address *ifaddr, uint32_t *mask)
+{
+	struct sockaddr s;
+	net_iface_get_netaddr(nd, AF_INET, &s);
+	memcpy(&ifaddr->address, s.sa_data + 2, 4);
+	net_iface_get_netmask(nd, AF_INET, &s);
+	memcpy(mask, s.sa_data + 2, 4);
+}
+
+void ipv4_receive_packet(struct net_dev *nd, struct net_packet *netpacket, void *__packet)
+{
+	union ipv4_address ifaddr;
+	uint32_t mask;
+	__ipv4_get_iface(nd, &ifaddr, &mask);
+	__ipv4_receive(nd, netpacket, __packet, ifaddr, mask);
+}
+
+/* a batch all comes from one interface, so only look up its address once */
+void ipv4_receive_batch(struct net_dev *nd, struct net_packet **packets, int count)
+{
+	union ipv4_address ifaddr;
+	uint32_t mask;
+	__ipv4_get_iface(nd, &ifaddr, &mask);
+	for(int i=0;i<count;i++)
+		__ipv4_receive(nd, packets[i], packets[i]->network_header, ifaddr, mask);
+}
@@ -42,6 +42,27 @@ static int ipv4_do_enqueue_packet(struct ipv4_packet *packet)
 	return 0;
 }
 
+/* the packet keeps the reference to the route */
+static struct ipv4_packet *ipv4_packet_create(struct net_packet *netpacket, struct ipv4_header *header,
+		struct route *r, unsigned long gen)
+{
+	struct ipv4_packet *packet = kmalloc(sizeof(struct ipv4_packet));
+	packet->enqueue_time = tm_timing_get_microseconds();
+	packet->header = header;
+	packet->netpacket = netpacket;
+	packet->route = r;
+	packet->route_gen = gen;
+	return packet;
+}
+
+static void ipv4_packet_destroy(struct ipv4_packet *packet)
+{
+	net_packet_put(packet->netpacket, 0);
+	if(packet->route)
+		net_route_put(packet->route);
+	kfree(packet);
+}
+
 static void ipv4_finish_constructing_packet(struct net_dev *nd, struct route *r, struct ipv4_packet *packet)
 {
 	if(!(packet->netpacket->flags & NP_FLAG_FORW) && !(packet->netpacket->flags & NP_FLAG_NOFILLSRC)) {
@@ -52,7 +73,6 @@ static void ipv4_finish_constructing_packet(struct net_dev *nd, struct route *r,
 	}
 	packet->header->version = 4;
 	packet->header->header_len = 5;
-	packet->header->frag_offset = 0;
 	packet->header->checksum = 0;
 	packet->header->checksum = ipv4_calc_checksum(packet->header, packet->header->header_len * 4);
 }
@@ -85,7 +105,15 @@ static int ipv4_send_packet(struct ipv4_packet *packet)
 	packet->tries++;
 	packet->last_attempt_time = tm_timing_get_microseconds();
 
-	struct route *r = net_route_select_entry(dest.address);
+	/* only look the route up again if the table has changed since */
+	if(packet->route_gen != net_route_generation()) {
+		if(packet->route)
+			net_route_put(packet->route);
+		unsigned long gen;
+		packet->route = net_route_lookup(dest.address, &gen);
+		packet->route_gen = gen;
+	}
+	struct route *r = packet->route;
 	uint8_t hwaddr[6];
 	if(!r) {
 		return -1;
@@ -125,9 +153,12 @@ static int ipv4_send_packet(struct ipv4_packet *packet)
 	TRACE_MSG("ipv4", "[ipv4]: send_packet: sending\n");
 	ipv4_finish_constructing_packet(nd, r, packet);
 	
-	/* split the packet if we need to... */
+	/* split the packet if we need to. The fragments don't copy the payload,
+	 * they each get a copy of the header and point into the parent's page
+	 * for the data. The parent is then cut down to be the first fragment. */
+	int header_length = packet->header->header_len * 4;
 	int total_packet_length = r->interface->data_header_len + BIG_TO_HOST16(packet->header->length);
-	int data_length = BIG_TO_HOST16(packet->header->length) - packet->header->header_len * 4;
+	int data_length = BIG_TO_HOST16(packet->header->length) - header_length;
 	uint16_t parent_flags = (BIG_TO_HOST16(packet->header->frag_offset) & 0xF000) >> 12;
 	uint16_t parent_offset = (BIG_TO_HOST16(packet->header->frag_offset) & ~0xF000) * 8;
 	if(r->interface->mtu && r->interface->mtu < total_packet_length) {
@@ -137,24 +168,23 @@ static int ipv4_send_packet(struct ipv4_packet *packet)
 			return -1;
 		}
 		/* split! */
-		int multiples = (nd->mtu - packet->header->header_len * 4) / 8;
-		int num_frags = data_length / multiples + 1;
-		assert(num_frags >= 2);
-		for(int i = 1;i<num_frags;i++) {
-			struct net_packet *frag = net_packet_create(0, 0);
-			struct ipv4_header *fh = (void *)(frag->data + nd->data_header_len);
-			memcpy(fh, packet->header, sizeof(*fh));
-
-			/* copy the data... */
-			int offset = i * multiples;
-			int length = multiples;
+		int chunk = ((nd->mtu - nd->data_header_len - header_length) / 8) * 8;
+		addr_t page = packet->netpacket->page;
+		size_t page_offset = (addr_t)packet->header->data - (addr_t)packet->netpacket->head;
+		for(int offset = chunk;offset < data_length;offset += chunk) {
+			int length = chunk;
 			if(offset + length > data_length)
 				length = data_length - offset;
-			memcpy(fh->data, packet->header->data + offset, length);
-			/* fix up the new header */
+			struct net_packet *frag = net_packet_create(0, 0);
+			struct ipv4_header *fh = (void *)frag->data;
+			memcpy(fh, packet->header, header_length);
+			frag->length = header_length;
+			net_packet_add_frag(frag, page, page_offset + offset, length);
 
-			uint16_t flags = ((i + 1 == num_frags) && !(parent_flags & IP_FLAG_MF))
+			/* fix up the new header */
+			uint16_t flags = ((offset + length == data_length) && !(parent_flags & IP_FLAG_MF))
 				? 0 : IP_FLAG_MF;
+			fh->length = HOST_TO_BIG16(header_length + length);
 			fh->frag_offset = HOST_TO_BIG16(
 					((uint16_t)((offset + parent_offset) / 8) & ~0xF000) | (flags << 12)
 					);
@@ -164,9 +194,16 @@ static int ipv4_send_packet(struct ipv4_packet *packet)
 			net_packet_put(frag, 0);
 		}
 		/* parent packet header update */
-		packet->header->frag_offset = HOST_TO_BIG16(IP_FLAG_MF << 12);
+		packet->header->length = HOST_TO_BIG16(header_length + chunk);
+		packet->header->frag_offset = HOST_TO_BIG16(
+				((uint16_t)(parent_offset / 8) & ~0xF000) | (IP_FLAG_MF << 12)
+				);
+		packet->header->checksum = 0;
+		packet->header->checksum = ipv4_calc_checksum(packet->header, header_length);
 	}
 
+	/* the frame starts at the IP header; the data layer pushes its own */
+	packet->netpacket->data = (unsigned char *)packet->header;
 	net_data_send(nd, packet->netpacket, AF_INET, hwaddr, BIG_TO_HOST16(packet->header->length));
 	return 1;
 }
@@ -174,16 +211,14 @@ static int ipv4_send_packet(struct ipv4_packet *packet)
 int ipv4_enqueue_packet(struct net_packet *netpacket, struct ipv4_header *header)
 {
 	union ipv4_address dest = (union ipv4_address)header->dest_ip;
-	struct route *r = net_route_select_entry(dest.address);
+	unsigned long gen;
+	struct route *r = net_route_lookup(dest.address, &gen);
 	if(!r) {
 		TRACE_MSG("ipv4", "[ipv4]: destination unavailable\n");
 		return -ENETUNREACH;
 	}
-	struct ipv4_packet *packet = kmalloc(sizeof(struct ipv4_packet));
-	packet->enqueue_time = tm_timing_get_microseconds();
-	packet->header = header;
 	net_packet_get(netpacket);
-	packet->netpacket = netpacket;
+	struct ipv4_packet *packet = ipv4_packet_create(netpacket, header, r, gen);
 	TRACE_MSG("ipv4", "[ipv4]: enqueue packet to %x\n", header->dest_ip);
 	ipv4_do_enqueue_packet(packet);
 	return 0;
@@ -192,38 +227,44 @@ int ipv4_enqueue_packet(struct net_packet *netpacket, struct ipv4_header *header
 int ipv4_copy_enqueue_packet(struct net_packet *netpacket, struct ipv4_header *header)
 {
 	union ipv4_address dest = (union ipv4_address)header->dest_ip;
-	struct route *r = net_route_select_entry(dest.address);
+	unsigned long gen;
+	struct route *r = net_route_lookup(dest.address, &gen);
 	if(!r) {
 		TRACE_MSG("ipv4", "[ipv4]: destination unavailable\n");
 		return -ENETUNREACH;
 	}
-	memcpy(netpacket->data + r->interface->data_header_len, header, BIG_TO_HOST16(header->length));
-	struct ipv4_packet *packet = kmalloc(sizeof(struct ipv4_packet));
-	packet->enqueue_time = tm_timing_get_microseconds();
-	packet->header = (void *)(netpacket->data + r->interface->data_header_len);
+	memcpy(netpacket->data, header, BIG_TO_HOST16(header->length));
 	net_packet_get(netpacket);
-	packet->netpacket = netpacket;
+	struct ipv4_packet *packet = ipv4_packet_create(netpacket, (void *)netpacket->data, r, gen);
 	TRACE_MSG("ipv4", "[ipv4]: enqueue packet to %x\n", header->dest_ip);
 	ipv4_do_enqueue_packet(packet);
 	return BIG_TO_HOST32(header->length);
 }
 
-int ipv4_enqueue_sockaddr(void *payload, size_t len, struct sockaddr *addr, struct sockaddr *src, int prot)
+int ipv4_enqueue_sockaddr(void *payload, size_t len, struct sockaddr *addr, struct sockaddr *src, int prot,
+		struct route_cache *rc)
 {
 	union ipv4_address dest, src_ip;
+	/* the header and payload have to fit in a new packet's linear part */
+	if(len + 20 > MAX_PACKET_SIZE)
+		return -EMSGSIZE;
 	memcpy(&dest.address, addr->sa_data + 2, 4);
-	struct route *r = net_route_select_entry(dest.address);
+	unsigned long gen;
+	struct route *r = rc ? net_route_cache_lookup(rc, dest.address, &gen)
+		: net_route_lookup(dest.address, &gen);
 	if(!r)
 		return -ENETUNREACH;
 
 	struct net_packet *np = net_packet_create(0, 0);
-	struct ipv4_header *header = (void *)(np->data + r->interface->data_header_len);
+	struct ipv4_header *header = (void *)np->data;
 
 	header->dest_ip = addr->sa_data[2] | (addr->sa_data[3] << 8)
 		| (addr->sa_data[4] << 16) | (addr->sa_data[5] << 24);
 	header->ttl = 64;
 	header->length = HOST_TO_BIG16(len + 20);
 	header->id = 0;
+	header->tos = 0;
+	header->frag_offset = 0;
 	header->ptype = prot;
 	memcpy(&src_ip.address, src->sa_data + 2, 4);
 	if(src_ip.address) {
@@ -232,11 +273,9 @@ int ipv4_enqueue_sockaddr(void *payload, size_t len, struct sockaddr *addr, stru
 		np->flags |= NP_FLAG_NOFILLSRC;
 	}
 
+	assert(len + 20 <= net_packet_tailroom(np));
 	memcpy(header->data, payload, len);
-	struct ipv4_packet *packet = kmalloc(sizeof(struct ipv4_packet));
-	packet->enqueue_time = tm_timing_get_microseconds();
-	packet->header = header;
-	packet->netpacket = np;
+	struct ipv4_packet *packet = ipv4_packet_create(np, header, r, gen);
 	TRACE_MSG("ipv4", "[ipv4]: enqueue packet %x to %x\n", np, header->dest_ip);
 	ipv4_do_enqueue_packet(packet);
 	return 0;
@@ -253,16 +292,13 @@ int ipv4_sending_thread(struct kthread *kt, void *arg)
 				if(tm_timing_get_microseconds() > packet->enqueue_time + ONE_SECOND * (10)) {
 					/* timeout! */
 					TRACE_MSG("ipv4", "[kipv4-send]: packet timed out\n");
-					net_packet_put(packet->netpacket, 0);
-					kfree(packet);
+					ipv4_packet_destroy(packet);
 				} else { 
 					int r = ipv4_send_packet(packet);
 					if(!r)
 						tm_schedule();
-					if(r != 0) {
-						net_packet_put(packet->netpacket, 0);
-						kfree(packet);
-					}
+					if(r != 0)
+						ipv4_packet_destroy(packet);
 				}
 			}
 			ipv4_thread_lastwork = tm_timing_get_microseconds();
@@ -24,7 +24,10 @@ static int send(struct net_dev *nd, struct net_packet *packets, int count)
 	if(!(nd->flags & IFACE_FLAG_UP))
 		return 0;
 	/* immediately just receive the packets... */
-	net_receive_packet(nd, packets, count);
+	struct net_packet *batch[count];
+	for(int i=0;i<count;i++)
+		batch[i] = &packets[i];
+	net_receive_packet(nd, batch, count);
 	return count;
 }
 
@@ -42,7 +45,9 @@ int loop_convert_sa_family(sa_family_t sa)
 static void data_layer_send(struct net_dev *nd, struct net_packet *packet, sa_family_t sa, uint8_t dest[6], int len)
 {
 	int etype = loop_convert_sa_family(sa);
-	*(uint16_t *)(packet->data) = HOST_TO_BIG16(etype);
+	packet->length = len;
+	*(uint16_t *)net_packet_push(packet, 2) = HOST_TO_BIG16(etype);
+	packet->data_header = packet->data;
 	net_transmit_packet(nd, packet, 1);
 }
 
@@ -0,0 +1,273 @@
+/* buffer.c: the send and receive rings, the out-of-order queue, and the
+ * sender's record of what the peer has SACKed. Everything here is called
+ * with the tcb's lock held. */
+#include <modules/tcp.h>
+#include <sea/mm/kmalloc.h>
+#include <sea/string.h>
+#include <sea/kernel.h>
+
+void tcp_ring_create(struct tcp_ring *ring, size_t size)
+{
+	ring->data = kmalloc(size);
+	ring->size = size;
+	ring->start = ring->count = 0;
+}
+
+void tcp_ring_destroy(struct tcp_ring *ring)
+{
+	kfree(ring->data);
+	ring->data = NULL;
+}
+
+/* append as much of buf as fits. Returns the number of bytes written */
+size_t tcp_ring_write(struct tcp_ring *ring, const void *buf, size_t len)
+{
+	if(len > tcp_ring_space(ring))
+		len = tcp_ring_space(ring);
+	size_t end = (ring->start + ring->count) % ring->size;
+	size_t first = ring->size - end;
+	if(first > len)
+		first = len;
+	memcpy(ring->data + end, buf, first);
+	memcpy(ring->data, (const uint8_t *)buf + first, len - first);
+	ring->count += len;
+	return len;
+}
+
+/* copy len bytes starting offset bytes into the ring, without consuming them */
+void tcp_ring_peek(struct tcp_ring *ring, size_t offset, void *buf, size_t len)
+{
+	assert(offset + len <= ring->count);
+	size_t pos = (ring->start + offset) % ring->size;
+	size_t first = ring->size - pos;
+	if(first > len)
+		first = len;
+	memcpy(buf, ring->data + pos, first);
+	memcpy((uint8_t *)buf + first, ring->data, len - first);
+}
+
+void tcp_ring_consume(struct tcp_ring *ring, size_t len)
+{
+	assert(len <= ring->count);
+	ring->start = (ring->start + len) % ring->size;
+	ring->count -= len;
+}
+
+/* hold on to a segment that arrived past rcv_nxt. It keeps a reference to the
+ * packet rather than copying it. */
+void tcp_ooo_insert(struct tcb *tcb, struct net_packet *np, uint8_t *data,
+		uint32_t seq, size_t len, bool fin)
+{
+	if(tcb->ooo.count >= TCP_MAX_OOO)
+		return;
+	struct tcp_segment *seg = kmalloc(sizeof(struct tcp_segment));
+	net_packet_get(np);
+	seg->packet = np;
+	seg->data = data;
+	seg->seq = seq;
+	seg->length = len;
+	seg->fin = fin;
+	linkedlist_insert(&tcb->ooo, &seg->entry, seg);
+	tcb->ooo_last = seq;
+}
+
+static void __segment_free(struct tcb *tcb, struct tcp_segment *seg)
+{
+	linkedlist_do_remove(&tcb->ooo, &seg->entry);
+	net_packet_put(seg->packet, 0);
+	kfree(seg);
+}
+
+/* move the queued segments that rcv_nxt has reached into the receive ring.
+ * The queue isn't sorted, so keep scanning until nothing fits. Returns true
+ * if we reached a FIN. */
+bool tcp_ooo_drain(struct tcb *tcb)
+{
+	bool progress = true;
+	while(progress) {
+		progress = false;
+		struct linkedentry *ent, *next;
+		for(ent = linkedlist_iter_start(&tcb->ooo);ent != linkedlist_iter_end(&tcb->ooo);ent = next) {
+			next = linkedlist_iter_next(ent);
+			struct tcp_segment *seg = ent->obj;
+			uint32_t end = seg->seq + seg->length;
+			if(SEQ_GT(seg->seq, tcb->rcv_nxt))
+				continue;
+			bool fin = false;
+			if(SEQ_GT(end, tcb->rcv_nxt)) {
+				size_t skip = tcb->rcv_nxt - seg->seq;
+				size_t n = tcp_ring_write(&tcb->rcvbuf, seg->data + skip, seg->length - skip);
+				tcb->rcv_nxt += n;
+				progress = true;
+				fin = seg->fin && n == seg->length - skip;
+			} else {
+				fin = seg->fin && end == tcb->rcv_nxt;
+			}
+			__segment_free(tcb, seg);
+			if(fin)
+				return true;
+		}
+	}
+	return false;
+}
+
+void tcp_ooo_clear(struct tcb *tcb)
+{
+	struct linkedentry *ent, *next;
+	for(ent = linkedlist_iter_start(&tcb->ooo);ent != linkedlist_iter_end(&tcb->ooo);ent = next) {
+		next = linkedlist_iter_next(ent);
+		__segment_free(tcb, ent->obj);
+	}
+}
+
+/* the ranges we hold past rcv_nxt, for the SACK option. The block holding the
+ * most recent arrival goes first (RFC 2018), and the rest in order. */
+int tcp_ooo_sack_blocks(struct tcb *tcb, struct tcp_sack_block *blocks, int max)
+{
+	struct tcp_sack_block all[TCP_MAX_OOO];
+	int count = 0;
+	struct linkedentry *ent;
+	for(ent = linkedlist_iter_start(&tcb->ooo);ent != linkedlist_iter_end(&tcb->ooo);ent = linkedlist_iter_next(ent)) {
+		struct tcp_segment *seg = ent->obj;
+		if(!seg->length)
+			continue;
+		/* insertion sort; the list is short */
+		int i = count++;
+		while(i > 0 && SEQ_GT(all[i - 1].start, seg->seq)) {
+			all[i] = all[i - 1];
+			i--;
+		}
+		all[i].start = seg->seq;
+		all[i].end = seg->seq + seg->length;
+	}
+	int merged = 0;
+	for(int i=0;i<count;i++) {
+		if(merged && SEQ_LEQ(all[i].start, all[merged - 1].end)) {
+			if(SEQ_GT(all[i].end, all[merged - 1].end))
+				all[merged - 1].end = all[i].end;
+		} else {
+			all[merged++] = all[i];
+		}
+	}
+	int n = 0;
+	for(int i=0;i<merged && n < max;i++) {
+		if(SEQ_GEQ(tcb->ooo_last, all[i].start) && SEQ_LT(tcb->ooo_last, all[i].end)) {
+			blocks[n++] = all[i];
+			all[i].start = all[i].end;
+			break;
+		}
+	}
+	for(int i=0;i<merged && n < max;i++) {
+		if(all[i].start != all[i].end)
+			blocks[n++] = all[i];
+	}
+	return n;
+}
+
+static void __sack_add(struct tcb *tcb, uint32_t start, uint32_t end)
+{
+	/* swallow every block that this one overlaps or touches */
+	int i = 0;
+	while(i < tcb->nr_sacked) {
+		struct tcp_sack_block *s = &tcb->sacked[i];
+		if(SEQ_LT(s->end, start) || SEQ_GT(s->start, end)) {
+			i++;
+			continue;
+		}
+		if(SEQ_LT(s->start, start))
+			start = s->start;
+		if(SEQ_GT(s->end, end))
+			end = s->end;
+		tcb->nr_sacked--;
+		memmove(s, s + 1, (tcb->nr_sacked - i) * sizeof(*s));
+	}
+	/* if the scoreboard is full, forgetting a block is safe: we'll just
+	 * retransmit something the peer already has */
+	if(tcb->nr_sacked == TCP_SCOREBOARD_SIZE)
+		return;
+	for(i=0;i<tcb->nr_sacked && SEQ_LT(tcb->sacked[i].start, start);i++);
+	memmove(&tcb->sacked[i + 1], &tcb->sacked[i], (tcb->nr_sacked - i) * sizeof(tcb->sacked[0]));
+	tcb->sacked[i].start = start;
+	tcb->sacked[i].end = end;
+	tcb->nr_sacked++;
+}
+
+void tcp_sack_update(struct tcb *tcb, struct tcp_sack_block *blocks, int count)
+{
+	for(int i=0;i<count;i++) {
+		uint32_t start = blocks[i].start, end = blocks[i].end;
+		if(!SEQ_LT(start, end) || SEQ_LEQ(end, tcb->snd_una) || SEQ_GT(end, tcb->snd_max))
+			continue;
+		if(SEQ_LT(start, tcb->snd_una))
+			start = tcb->snd_una;
+		__sack_add(tcb, start, end);
+	}
+}
+
+/* snd_una moved; drop what it covers */
+void tcp_sack_advance(struct tcb *tcb)
+{
+	int i = 0;
+	while(i < tcb->nr_sacked && SEQ_LEQ(tcb->sacked[i].end, tcb->snd_una))
+		i++;
+	tcb->nr_sacked -= i;
+	memmove(tcb->sacked, tcb->sacked + i, tcb->nr_sacked * sizeof(tcb->sacked[0]));
+	if(tcb->nr_sacked && SEQ_LT(tcb->sacked[0].start, tcb->snd_una))
+		tcb->sacked[0].start = tcb->snd_una;
+}
+
+void tcp_sack_clear(struct tcb *tcb)
+{
+	tcb->nr_sacked = 0;
+}
+
+/* find the first hole at or after *seq that has SACKed data above it, which
+ * we take to be lost (a simplified RFC 6675). */
+bool tcp_sack_next_hole(struct tcb *tcb, uint32_t *seq, uint32_t *end)
+{
+	uint32_t s = *seq;
+	if(SEQ_LT(s, tcb->snd_una))
+		s = tcb->snd_una;
+	for(int i=0;i<tcb->nr_sacked;i++) {
+		struct tcp_sack_block *b = &tcb->sacked[i];
+		if(SEQ_LEQ(b->end, s))
+			continue;
+		if(SEQ_GEQ(s, b->start)) {
+			s = b->end;
+			continue;
+		}
+		*seq = s;
+		*end = b->start;
+		return true;
+	}
+	return false;
+}
+
+static uint32_t __holes(struct tcb *tcb, uint32_t from, uint32_t to)
+{
+	uint32_t bytes = 0, start = from, end;
+	while(SEQ_LT(start, to) && tcp_sack_next_hole(tcb, &start, &end)) {
+		if(SEQ_GT(end, to))
+			end = to;
+		if(SEQ_GT(end, start))
+			bytes += end - start;
+		start = end;
+	}
+	return bytes;
+}
+
+/* an estimate of the bytes in the network during SACK recovery. Holes below
+ * rexmit_nxt have been retransmitted, holes above it are presumed lost, and
+ * everything past the highest SACK is still out there. */
+uint32_t tcp_sack_pipe(struct tcb *tcb)
+{
+	if(!tcb->nr_sacked)
+		return tcb->snd_nxt - tcb->snd_una;
+	uint32_t highest = tcb->sacked[tcb->nr_sacked - 1].end;
+	uint32_t pipe = __holes(tcb, tcb->snd_una, tcb->rexmit_nxt);
+	uint32_t above = SEQ_GT(tcb->rexmit_nxt, highest) ? tcb->rexmit_nxt : highest;
+	if(SEQ_GT(tcb->snd_nxt, above))
+		pipe += tcb->snd_nxt - above;
+	return pipe;
+}
+
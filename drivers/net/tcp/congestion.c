@@ -0,0 +1,197 @@
+/* congestion.c: congestion control. Loss detection, fast retransmit and
+ * recovery are common (see input.c); the algorithms here only decide how
+ * cwnd grows and how far it is cut. New connections use tcp_default_cc,
+ * which /dev/tcp-congestion selects. */
+#include <modules/tcp.h>
+#include <sea/fs/kerfs.h>
+#include <sea/string.h>
+#include <sea/errno.h>
+
+/* cwnd grows by what was acked, but no more than two segments per ack (RFC 3465) */
+void tcp_slow_start(struct tcb *tcb, uint32_t acked)
+{
+	uint32_t limit = 2u * tcb->mss;
+	tcb->cwnd += acked < limit ? acked : limit;
+	if(tcb->cwnd > TCP_MAX_CWND)
+		tcb->cwnd = TCP_MAX_CWND;
+}
+
+static uint32_t __flight_half(struct tcb *tcb)
+{
+	uint32_t half = (tcb->snd_max - tcb->snd_una) / 2;
+	return half > 2u * tcb->mss ? half : 2u * tcb->mss;
+}
+
+static void newreno_init(struct tcb *tcb)
+{
+	tcb->ca_acc = 0;
+}
+
+static void newreno_ack(struct tcb *tcb, uint32_t acked)
+{
+	if(tcb->cwnd < tcb->ssthresh) {
+		tcp_slow_start(tcb, acked);
+		return;
+	}
+	/* one segment per cwnd's worth of acked data */
+	tcb->ca_acc += acked;
+	if(tcb->ca_acc >= tcb->cwnd) {
+		tcb->ca_acc -= tcb->cwnd;
+		if(tcb->cwnd < TCP_MAX_CWND)
+			tcb->cwnd += tcb->mss;
+	}
+}
+
+static uint32_t newreno_ssthresh(struct tcb *tcb)
+{
+	tcb->ca_acc = 0;
+	return __flight_half(tcb);
+}
+
+struct tcp_congestion_ops tcp_newreno = {
+	.name = "newreno",
+	.init = newreno_init,
+	.ack = newreno_ack,
+	.ssthresh = newreno_ssthresh,
+};
+
+/* CUBIC (RFC 8312). After a reduction, cwnd follows
+ * W(t) = C(t - K)^3 + W_max, which flattens out around the old maximum and
+ * then probes past it. C = 0.4, and beta = 0.7 (CUBIC_BETA / 1024). */
+#define CUBIC_BETA 717
+#define CUBIC_MAX_T 30000 /* ms; keeps the cube from overflowing */
+
+static uint64_t __cbrt(uint64_t x)
+{
+	uint64_t r = 0;
+	for(int s = 63;s >= 0;s -= 3) {
+		r <<= 1;
+		uint64_t b = 3 * r * (r + 1) + 1;
+		if((x >> s) >= b) {
+			x -= b << s;
+			r++;
+		}
+	}
+	return r;
+}
+
+static void cubic_init(struct tcb *tcb)
+{
+	memset(&tcb->ccdata.cubic, 0, sizeof(tcb->ccdata.cubic));
+}
+
+static void cubic_ack(struct tcb *tcb, uint32_t acked)
+{
+	struct tcp_cubic *cu = &tcb->ccdata.cubic;
+	if(tcb->cwnd < tcb->ssthresh) {
+		tcp_slow_start(tcb, acked);
+		return;
+	}
+	time_t now = tm_timing_get_microseconds();
+	if(!cu->epoch) {
+		cu->epoch = now;
+		cu->acc = 0;
+		cu->w_est = tcb->cwnd;
+		if(cu->w_max > tcb->cwnd) {
+			/* K = cbrt((W_max - cwnd) / C), in segments and seconds */
+			cu->k = __cbrt((uint64_t)(cu->w_max - tcb->cwnd) * 2500000000ull / tcb->mss);
+		} else {
+			cu->k = 0;
+			cu->w_max = tcb->cwnd;
+		}
+	}
+	/* aim for where the curve will be an rtt from now */
+	int64_t t = (now - cu->epoch + tcb->srtt) / ONE_MILLISECOND - cu->k;
+	if(t > CUBIC_MAX_T)
+		t = CUBIC_MAX_T;
+	if(t < -CUBIC_MAX_T)
+		t = -CUBIC_MAX_T;
+	int64_t target = (int64_t)cu->w_max + (4 * t * t * t * tcb->mss) / 10000000000ll;
+	/* in the TCP-friendly region, grow at least as fast as reno would:
+	 * 3(1 - beta)/(1 + beta) segments per rtt */
+	cu->w_est += (uint64_t)acked * tcb->mss * 53 / (100 * tcb->cwnd);
+	if(target < cu->w_est)
+		target = cu->w_est;
+	if(target > TCP_MAX_CWND)
+		target = TCP_MAX_CWND;
+	if(target <= tcb->cwnd)
+		return;
+	/* close the gap to the target over about an rtt */
+	cu->acc += (uint64_t)(target - tcb->cwnd) * acked;
+	tcb->cwnd += cu->acc / tcb->cwnd;
+	cu->acc %= tcb->cwnd;
+}
+
+static uint32_t cubic_ssthresh(struct tcb *tcb)
+{
+	struct tcp_cubic *cu = &tcb->ccdata.cubic;
+	cu->epoch = 0;
+	/* fast convergence: if we're below the last maximum, we're probably
+	 * competing with a new flow, so give up a little more */
+	if(tcb->cwnd < cu->w_max)
+		cu->w_max = (uint32_t)(((uint64_t)tcb->cwnd * (1024 + CUBIC_BETA)) / 2048);
+	else
+		cu->w_max = tcb->cwnd;
+	uint32_t ssthresh = (uint32_t)(((uint64_t)tcb->cwnd * CUBIC_BETA) / 1024);
+	return ssthresh > 2u * tcb->mss ? ssthresh : 2u * tcb->mss;
+}
+
+struct tcp_congestion_ops tcp_cubic = {
+	.name = "cubic",
+	.init = cubic_init,
+	.ack = cubic_ack,
+	.ssthresh = cubic_ssthresh,
+};
+
+static struct tcp_congestion_ops *algorithms[] = {
+	&tcp_cubic,
+	&tcp_newreno,
+};
+
+#define NUM_ALGORITHMS (sizeof(algorithms) / sizeof(algorithms[0]))
+
+struct tcp_congestion_ops *tcp_default_cc = &tcp_cubic;
+
+struct tcp_congestion_ops *tcp_congestion_find(const char *name)
+{
+	for(size_t i=0;i<NUM_ALGORITHMS;i++) {
+		if(!strcmp(name, algorithms[i]->name))
+			return algorithms[i];
+	}
+	return NULL;
+}
+
+/* /dev/tcp-congestion: reading lists the algorithms, with the default in
+ * brackets. Writing an algorithm's name makes it the default for new connections. */
+int kerfs_tcp_congestion(int direction, void *param, size_t size,
+		size_t offset, size_t length, unsigned char *buf)
+{
+	size_t current = 0;
+	if(direction == READ) {
+		for(size_t i=0;i<NUM_ALGORITHMS;i++) {
+			if(algorithms[i] == tcp_default_cc) {
+				KERFS_PRINTF(offset, length, buf, current, "[%s] ", algorithms[i]->name);
+			} else {
+				KERFS_PRINTF(offset, length, buf, current, "%s ", algorithms[i]->name);
+			}
+		}
+		KERFS_PRINTF(offset, length, buf, current, "\n");
+		return current;
+	}
+	if(offset > 0)
+		return 0;
+	if(length > 32)
+		length = 32;
+	char tmp[length + 1];
+	memset(tmp, 0, length + 1);
+	strncpy(tmp, (char *)buf, length);
+	char *n;
+	if((n = strrchr(tmp, '\n')))
+		*n = 0;
+	struct tcp_congestion_ops *cc = tcp_congestion_find(tmp);
+	if(!cc)
+		return -EINVAL;
+	tcp_default_cc = cc;
+	return length;
+}
+
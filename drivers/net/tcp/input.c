@@ -0,0 +1,543 @@
+/* input.c: incoming segments. The transport layer hands us every packet
+ * (TLPROT_FLAG_DEMUX), and we find the connection from both ends' addresses
+ * and ports, falling back to a listener on the local port. */
+#include <modules/tcp.h>
+#include <modules/ipv4/ipv4.h>
+#include <sea/net/tlayer.h>
+#include <sea/net/route.h>
+#include <sea/string.h>
+#include <sea/errno.h>
+
+int tcp_verify(struct net_packet *np, void *payload, size_t len)
+{
+	struct tcp_header *th = payload;
+	if(len < sizeof(struct tcp_header))
+		return -EINVAL;
+	if(th->offset * 4u < sizeof(struct tcp_header) || th->offset * 4u > len)
+		return -EINVAL;
+	struct ipv4_header *ip = np->network_header;
+	if(tcp_checksum(ip->src_ip, ip->dest_ip, payload, len) != 0)
+		return -EINVAL;
+	return 0;
+}
+
+void tcp_inject_port(struct net_packet *np, void *payload, size_t len,
+		struct sockaddr *src, struct sockaddr *dest)
+{
+	struct tcp_header *th = payload;
+	*(uint16_t *)(src->sa_data) = th->src_port;
+	*(uint16_t *)(dest->sa_data) = th->dest_port;
+}
+
+static void __parse_options(struct tcp_input *in, uint8_t *opt, size_t len)
+{
+	size_t i = 0;
+	while(i < len) {
+		uint8_t kind = opt[i];
+		if(kind == TCPOPT_EOL)
+			break;
+		if(kind == TCPOPT_NOP) {
+			i++;
+			continue;
+		}
+		if(i + 1 >= len || opt[i + 1] < 2 || i + opt[i + 1] > len)
+			break;
+		uint8_t olen = opt[i + 1];
+		switch(kind) {
+			case TCPOPT_MSS:
+				if(olen == 4 && (in->flags & TCP_SYN))
+					in->mss = BIG_TO_HOST16(*(uint16_t *)(opt + i + 2));
+				break;
+			case TCPOPT_SACK_PERMITTED:
+				if(olen == 2 && (in->flags & TCP_SYN))
+					in->sack_permitted = true;
+				break;
+			case TCPOPT_SACK:
+				for(int b = 0;b < (olen - 2) / 8 && in->nr_sacks < TCP_MAX_SACK_BLOCKS;b++) {
+					uint8_t *p = opt + i + 2 + b * 8;
+					in->sacks[in->nr_sacks].start = BIG_TO_HOST32(*(uint32_t *)p);
+					in->sacks[in->nr_sacks].end = BIG_TO_HOST32(*(uint32_t *)(p + 4));
+					in->nr_sacks++;
+				}
+				break;
+		}
+		i += olen;
+	}
+}
+
+/* take the options from the peer's SYN */
+static void __syn_options(struct tcb *tcb, struct tcp_input *in)
+{
+	uint16_t mss = in->mss ? in->mss : TCP_DEFAULT_MSS;
+	if(mss > tcb->our_mss)
+		mss = tcb->our_mss;
+	if(mss < 64)
+		mss = 64;
+	tcp_set_mss(tcb, mss);
+	if(in->sack_permitted)
+		tcb->flags |= TCB_SACK_OK;
+}
+
+/* a SYN for a listener. Make a child connection and answer it. */
+static void __listen_input(struct tcb *listener, struct tcp_endpoints *ends, struct tcp_input *in)
+{
+	if(in->flags & TCP_RST)
+		return;
+	if(in->flags & TCP_ACK) {
+		tcp_reset_reply(ends, in);
+		return;
+	}
+	if(!(in->flags & TCP_SYN))
+		return;
+	/* the peer will try again when we have room */
+	if(listener->nr_children >= listener->backlog)
+		return;
+	struct route *r = net_route_select_entry(ends->raddr);
+	if(!r)
+		return;
+
+	struct tcb *child = tcp_tcb_create();
+	child->ends = *ends;
+	tcp_tcb_setup(child, r->interface);
+	net_route_put(r);
+	__syn_options(child, in);
+	child->irs = in->seq;
+	child->rcv_nxt = child->rcv_adv = in->seq + 1;
+	child->iss = tcp_new_iss(ends);
+	child->snd_una = child->snd_nxt = child->snd_max = child->recover = child->iss;
+	child->snd_wnd = in->window;
+	child->snd_wl1 = in->seq;
+	child->state = TCP_SYN_RECEIVED;
+
+	mutex_acquire(&child->lock);
+	if(tcp_hash_insert(child) < 0) {
+		mutex_release(&child->lock);
+		tcp_tcb_put(child);
+		return;
+	}
+	/* the list keeps the reference we made it with */
+	mutex_acquire(&tcp_lock);
+	child->parent = listener;
+	linkedlist_insert(&listener->children, &child->child_entry, child);
+	listener->nr_children++;
+	mutex_release(&tcp_lock);
+	tcp_send_syn(child);
+	mutex_release(&child->lock);
+}
+
+static void __syn_sent_input(struct tcb *tcb, struct tcp_endpoints *ends, struct tcp_input *in)
+{
+	bool ack_ok = false;
+	if(in->flags & TCP_ACK) {
+		if(SEQ_LEQ(in->ack, tcb->iss) || SEQ_GT(in->ack, tcb->snd_max)) {
+			tcp_reset_reply(ends, in);
+			return;
+		}
+		ack_ok = true;
+	}
+	if(in->flags & TCP_RST) {
+		if(ack_ok) {
+			tcb->error = ECONNREFUSED;
+			tcp_close(tcb);
+		}
+		return;
+	}
+	if(!(in->flags & TCP_SYN))
+		return;
+	tcb->irs = in->seq;
+	tcb->rcv_nxt = tcb->rcv_adv = in->seq + 1;
+	__syn_options(tcb, in);
+	tcb->snd_wnd = in->window;
+	tcb->snd_wl1 = in->seq;
+	if(!ack_ok) {
+		/* simultaneous open */
+		tcb->state = TCP_SYN_RECEIVED;
+		tcp_send_syn(tcb);
+		return;
+	}
+	tcb->snd_una = in->ack;
+	tcb->snd_wl2 = in->ack;
+	if(tcb->flags & TCB_RTT_TIMING) {
+		tcp_rtt_sample(tcb, tm_timing_get_microseconds() - tcb->rtt_start);
+		tcb->flags &= ~TCB_RTT_TIMING;
+	}
+	tcb->rto_at = 0;
+	tcp_established(tcb);
+	tcb->flags |= TCB_ACK_NOW;
+	tcp_output(tcb);
+}
+
+static void __enter_recovery(struct tcb *tcb)
+{
+	tcb->ssthresh = tcb->cc->ssthresh(tcb);
+	tcb->recover = tcb->snd_max;
+	tcb->flags |= TCB_RECOVERY;
+	if(tcb->flags & TCB_SACK_OK) {
+		/* RFC 6675: from here on, the pipe estimate decides what to send */
+		tcb->cwnd = tcb->ssthresh;
+		tcb->rexmit_nxt = tcb->snd_una + tcb->mss;
+	} else {
+		/* RFC 6582 */
+		tcb->cwnd = tcb->ssthresh + TCP_DUPACK_THRESHOLD * tcb->mss;
+	}
+	tcp_retransmit(tcb, tcb->snd_una);
+	tcb->rto_at = tm_timing_get_microseconds() + tcb->rto;
+}
+
+static void __dupack(struct tcb *tcb)
+{
+	if(tcb->flags & TCB_RECOVERY) {
+		/* each dupack means a segment left the network */
+		if(!(tcb->flags & TCB_SACK_OK) && tcb->cwnd < TCP_MAX_CWND)
+			tcb->cwnd += tcb->mss;
+		return;
+	}
+	/* don't go back into recovery for losses from before the last one */
+	if(++tcb->dupacks == TCP_DUPACK_THRESHOLD && SEQ_GT(tcb->snd_una, tcb->recover))
+		__enter_recovery(tcb);
+}
+
+/* process the ack field. Returns false if the segment should be dropped. */
+static bool __ack(struct tcb *tcb, struct tcp_input *in)
+{
+	if(SEQ_GT(in->ack, tcb->snd_max)) {
+		tcb->flags |= TCB_ACK_NOW;
+		tcp_output(tcb);
+		return false;
+	}
+	if(SEQ_LT(in->ack, tcb->snd_una))
+		return true;
+	uint32_t old_wnd = tcb->snd_wnd;
+	if(SEQ_LT(tcb->snd_wl1, in->seq) || (tcb->snd_wl1 == in->seq && SEQ_LEQ(tcb->snd_wl2, in->ack))) {
+		tcb->snd_wnd = in->window;
+		tcb->snd_wl1 = in->seq;
+		tcb->snd_wl2 = in->ack;
+	}
+	if((tcb->flags & TCB_SACK_OK) && in->nr_sacks)
+		tcp_sack_update(tcb, in->sacks, in->nr_sacks);
+
+	if(in->ack == tcb->snd_una) {
+		/* RFC 5681's definition of a duplicate ack */
+		if(!in->length && !(in->flags & (TCP_SYN | TCP_FIN)) && tcb->snd_wnd == old_wnd
+				&& tcb->snd_una != tcb->snd_max)
+			__dupack(tcb);
+		return true;
+	}
+
+	uint32_t acked = in->ack - tcb->snd_una;
+	uint32_t bytes = acked;
+	if((tcb->flags & TCB_FIN_SENT) && SEQ_GT(in->ack, tcb->fin_seq))
+		bytes--;
+	if(bytes > tcb->sndbuf.count)
+		bytes = tcb->sndbuf.count;
+	tcp_ring_consume(&tcb->sndbuf, bytes);
+	/* Karn: retransmission clears the timing flag */
+	if((tcb->flags & TCB_RTT_TIMING) && SEQ_GT(in->ack, tcb->rtt_seq)) {
+		tcp_rtt_sample(tcb, tm_timing_get_microseconds() - tcb->rtt_start);
+		tcb->flags &= ~TCB_RTT_TIMING;
+	}
+	tcb->retries = 0;
+	tcb->snd_una = in->ack;
+	if(SEQ_LT(tcb->snd_nxt, tcb->snd_una))
+		tcb->snd_nxt = tcb->snd_una;
+	tcp_sack_advance(tcb);
+
+	if(tcb->flags & TCB_RECOVERY) {
+		if(SEQ_GEQ(in->ack, tcb->recover)) {
+			tcb->flags &= ~TCB_RECOVERY;
+			tcb->cwnd = tcb->ssthresh;
+			tcb->dupacks = 0;
+		} else if(!(tcb->flags & TCB_SACK_OK)) {
+			/* a partial ack: the next hole is lost too (RFC 6582). Deflate
+			 * by what was acked, and add back a segment. */
+			tcp_retransmit(tcb, tcb->snd_una);
+			tcb->cwnd = tcb->cwnd > acked ? tcb->cwnd - acked : 0;
+			if(acked >= tcb->mss)
+				tcb->cwnd += tcb->mss;
+			if(tcb->cwnd < tcb->mss)
+				tcb->cwnd = tcb->mss;
+		}
+	} else {
+		tcb->dupacks = 0;
+		tcb->cc->ack(tcb, acked);
+	}
+
+	if(tcb->snd_una == tcb->snd_max)
+		tcb->rto_at = 0;
+	else
+		tcb->rto_at = tm_timing_get_microseconds() + tcb->rto;
+	tm_blocklist_wakeall(&tcb->wait);
+	return true;
+}
+
+/* the peer acked our FIN */
+static bool __fin_acked(struct tcb *tcb)
+{
+	time_t now = tm_timing_get_microseconds();
+	switch(tcb->state) {
+		case TCP_FIN_WAIT_1:
+			tcb->state = TCP_FIN_WAIT_2;
+			/* if the socket is gone, don't wait forever for the peer */
+			if(!tcb->sock && !tcb->parent)
+				tcb->timewait_at = now + TCP_FIN_WAIT_2_TIME;
+			break;
+		case TCP_CLOSING:
+			tcb->state = TCP_TIME_WAIT;
+			tcb->timewait_at = now + 2 * TCP_MSL;
+			tcb->rto_at = 0;
+			break;
+		case TCP_LAST_ACK:
+			tcp_close(tcb);
+			return false;
+	}
+	return true;
+}
+
+static void __fin_received(struct tcb *tcb)
+{
+	time_t now = tm_timing_get_microseconds();
+	tcb->rcv_nxt++;
+	tcb->flags |= TCB_FIN_RECEIVED | TCB_ACK_NOW;
+	switch(tcb->state) {
+		case TCP_SYN_RECEIVED: case TCP_ESTABLISHED:
+			tcb->state = TCP_CLOSE_WAIT;
+			break;
+		case TCP_FIN_WAIT_1:
+			tcb->state = TCP_CLOSING;
+			break;
+		case TCP_FIN_WAIT_2:
+			tcb->state = TCP_TIME_WAIT;
+			tcb->timewait_at = now + 2 * TCP_MSL;
+			tcb->rto_at = 0;
+			break;
+	}
+	tm_blocklist_wakeall(&tcb->wait);
+}
+
+static bool __acceptable(struct tcb *tcb, struct tcp_input *in, uint32_t wnd)
+{
+	uint32_t len = in->length + !!(in->flags & TCP_SYN) + !!(in->flags & TCP_FIN);
+	if(in->seq == tcb->rcv_nxt)
+		return true;
+	if(!wnd)
+		return false;
+	uint32_t end = tcb->rcv_nxt + wnd;
+	if(SEQ_GEQ(in->seq, tcb->rcv_nxt) && SEQ_LT(in->seq, end))
+		return true;
+	return len && SEQ_GEQ(in->seq + len - 1, tcb->rcv_nxt) && SEQ_LT(in->seq + len - 1, end);
+}
+
+/* cut the segment down to what's inside the receive window */
+static void __trim(struct tcb *tcb, struct tcp_input *in, uint32_t wnd)
+{
+	if(SEQ_LT(in->seq, tcb->rcv_nxt)) {
+		if(in->flags & TCP_SYN) {
+			in->flags &= ~TCP_SYN;
+			in->seq++;
+		}
+		uint32_t skip = tcb->rcv_nxt - in->seq;
+		if(skip >= in->length) {
+			/* all old. If the FIN is old too, forget it. */
+			if(skip > in->length)
+				in->flags &= ~TCP_FIN;
+			skip = in->length;
+		}
+		in->data += skip;
+		in->length -= skip;
+		in->seq += skip;
+		tcb->flags |= TCB_ACK_NOW;
+	}
+	uint32_t end = tcb->rcv_nxt + wnd;
+	if(SEQ_GT(in->seq + in->length, end)) {
+		in->length = SEQ_GT(end, in->seq) ? end - in->seq : 0;
+		in->flags &= ~TCP_FIN;
+		tcb->flags |= TCB_ACK_NOW;
+	}
+}
+
+static void __data(struct tcb *tcb, struct net_packet *np, struct tcp_input *in)
+{
+	bool fin = in->flags & TCP_FIN;
+	if(in->seq != tcb->rcv_nxt) {
+		/* a hole in front of it. Hold on to it, and tell the peer where
+		 * we are right away, so it can fast retransmit. */
+		tcp_ooo_insert(tcb, np, in->data, in->seq, in->length, fin);
+		tcb->flags |= TCB_ACK_NOW;
+		return;
+	}
+	if(in->length) {
+		size_t n = tcp_ring_write(&tcb->rcvbuf, in->data, in->length);
+		tcb->rcv_nxt += n;
+		if(n < in->length)
+			fin = false;
+		if(tcb->ooo.count) {
+			if(tcp_ooo_drain(tcb))
+				fin = true;
+			tcb->flags |= TCB_ACK_NOW;
+		}
+		/* ack every other segment (RFC 1122 4.2.3.2) */
+		if(++tcb->delayed >= 2)
+			tcb->flags |= TCB_ACK_NOW;
+		tm_blocklist_wakeall(&tcb->wait);
+	}
+	if(fin)
+		__fin_received(tcb);
+}
+
+/* a segment for a synchronized connection (RFC 793 p69). Returns true if
+ * the connection was in TIME_WAIT and the segment is a new SYN that should
+ * go to the listener instead. */
+static bool __input(struct tcb *tcb, struct net_packet *np, struct tcp_endpoints *ends, struct tcp_input *in)
+{
+	if(tcb->state == TCP_SYN_RECEIVED && (in->flags & TCP_SYN) && !(in->flags & TCP_ACK)
+			&& in->seq == tcb->irs) {
+		/* our SYN-ACK was lost */
+		tcp_send_syn(tcb);
+		return false;
+	}
+	if(tcb->state == TCP_TIME_WAIT && (in->flags & TCP_SYN) && !(in->flags & (TCP_ACK | TCP_RST))
+			&& SEQ_GT(in->seq, tcb->rcv_nxt)) {
+		tcp_close(tcb);
+		return true;
+	}
+	uint32_t wnd = SEQ_GT(tcb->rcv_adv, tcb->rcv_nxt) ? tcb->rcv_adv - tcb->rcv_nxt : 0;
+	if(!__acceptable(tcb, in, wnd)) {
+		if(!(in->flags & TCP_RST)) {
+			tcb->flags |= TCB_ACK_NOW;
+			tcp_output(tcb);
+		}
+		return false;
+	}
+	if(in->flags & TCP_RST) {
+		/* RFC 5961: only an exact match resets. Anything else in the
+		 * window might be a guess, so challenge it. */
+		if(in->seq != tcb->rcv_nxt) {
+			tcp_send_ack(tcb);
+			return false;
+		}
+		switch(tcb->state) {
+			case TCP_SYN_RECEIVED:
+				if(!tcb->parent)
+					tcb->error = ECONNREFUSED;
+				break;
+			case TCP_ESTABLISHED: case TCP_FIN_WAIT_1: case TCP_FIN_WAIT_2: case TCP_CLOSE_WAIT:
+				tcb->error = ECONNRESET;
+				break;
+		}
+		tcp_close(tcb);
+		return false;
+	}
+	__trim(tcb, in, wnd);
+	if(in->flags & TCP_SYN) {
+		tcp_send_ack(tcb);
+		return false;
+	}
+	if(!(in->flags & TCP_ACK))
+		return false;
+	if(tcb->state == TCP_SYN_RECEIVED) {
+		if(SEQ_LEQ(in->ack, tcb->iss) || SEQ_GT(in->ack, tcb->snd_max)) {
+			tcp_reset_reply(ends, in);
+			return false;
+		}
+		/* this acks our SYN */
+		tcb->snd_una = tcb->iss + 1;
+		if(tcb->flags & TCB_RTT_TIMING) {
+			tcp_rtt_sample(tcb, tm_timing_get_microseconds() - tcb->rtt_start);
+			tcb->flags &= ~TCB_RTT_TIMING;
+		}
+		tcb->snd_wnd = in->window;
+		tcb->snd_wl1 = in->seq;
+		tcb->snd_wl2 = in->ack;
+		tcb->rto_at = 0;
+		tcp_established(tcb);
+	}
+	if(!__ack(tcb, in))
+		return false;
+	if((tcb->flags & TCB_FIN_SENT) && SEQ_GT(tcb->snd_una, tcb->fin_seq)) {
+		if(!__fin_acked(tcb))
+			return false;
+	}
+
+	switch(tcb->state) {
+		case TCP_FIN_WAIT_1: case TCP_FIN_WAIT_2:
+			/* nobody will read it (RFC 2525 2.16) */
+			if(in->length && !tcb->sock && !tcb->parent) {
+				tcp_send_reset(tcb);
+				tcp_close(tcb);
+				return false;
+			}
+			/* fall through */
+		case TCP_ESTABLISHED:
+			if(in->length || (in->flags & TCP_FIN))
+				__data(tcb, np, in);
+			break;
+		case TCP_TIME_WAIT:
+			/* the peer didn't hear our ack of its FIN */
+			if(in->flags & TCP_FIN) {
+				tcb->flags |= TCB_ACK_NOW;
+				tcb->timewait_at = tm_timing_get_microseconds() + 2 * TCP_MSL;
+			}
+			break;
+	}
+	tcp_output(tcb);
+	return false;
+}
+
+int tcp_recv_packet(struct socket *sock, struct sockaddr *src, struct net_packet *np,
+		void *payload, size_t len)
+{
+	struct tcp_header *th = payload;
+	struct ipv4_header *ip = np->network_header;
+	size_t hlen = th->offset * 4;
+
+	struct tcp_input in;
+	memset(&in, 0, sizeof(in));
+	in.seq = BIG_TO_HOST32(th->seq);
+	in.ack = BIG_TO_HOST32(th->ack);
+	in.window = BIG_TO_HOST16(th->window);
+	in.flags = th->flags;
+	in.data = (uint8_t *)payload + hlen;
+	in.length = len - hlen;
+	__parse_options(&in, th->options, hlen - sizeof(*th));
+
+	struct tcp_endpoints ends = {
+		.laddr = ip->dest_ip,
+		.raddr = ip->src_ip,
+		.lport = th->dest_port,
+		.rport = th->src_port,
+	};
+
+	struct tcb *tcb = tcp_lookup(&ends);
+	if(tcb) {
+		mutex_acquire(&tcb->lock);
+		bool again = false;
+		switch(tcb->state) {
+			case TCP_CLOSED:
+				again = true;
+				break;
+			case TCP_SYN_SENT:
+				__syn_sent_input(tcb, &ends, &in);
+				break;
+			default:
+				again = __input(tcb, np, &ends, &in);
+		}
+		mutex_release(&tcb->lock);
+		tcp_tcb_put(tcb);
+		if(!again)
+			return 0;
+	}
+
+	if((tcb = tcp_lookup_listener(ends.laddr, ends.lport))) {
+		mutex_acquire(&tcb->lock);
+		if(tcb->state == TCP_LISTEN)
+			__listen_input(tcb, &ends, &in);
+		else
+			tcp_reset_reply(&ends, &in);
+		mutex_release(&tcb->lock);
+		tcp_tcb_put(tcb);
+		return 0;
+	}
+	tcp_reset_reply(&ends, &in);
+	return 0;
+}
+
@@ -0,0 +1,321 @@
+/* output.c: building and sending segments. Everything that takes a tcb is
+ * called with its lock held. */
+#include <modules/tcp.h>
+#include <sea/net/nlayer.h>
+#include <sea/string.h>
+#include <sea/kernel.h>
+
+uint16_t tcp_checksum(uint32_t src, uint32_t dest, void *segment, size_t len)
+{
+	/* the pseudo-header: addresses, protocol and length */
+	uint32_t sum = (src >> 16) + (src & 0xFFFF) + (dest >> 16) + (dest & 0xFFFF);
+	sum += HOST_TO_BIG16(PROTOCOL_TCP) + HOST_TO_BIG16((uint16_t)len);
+	uint16_t *w = segment;
+	while(len > 1) {
+		sum += *w++;
+		len -= 2;
+	}
+	if(len) {
+		uint16_t last = 0;
+		memcpy(&last, w, 1);
+		sum += last;
+	}
+	while(sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return ~sum;
+}
+
+static int __transmit(struct tcp_endpoints *ends, void *segment, size_t len, struct route_cache *rc)
+{
+	struct tcp_header *th = segment;
+	th->checksum = 0;
+	th->checksum = tcp_checksum(ends->laddr, ends->raddr, segment, len);
+	struct sockaddr src, dest;
+	memset(&src, 0, sizeof(src));
+	memset(&dest, 0, sizeof(dest));
+	src.sa_family = dest.sa_family = AF_INET;
+	memcpy(src.sa_data, &ends->lport, 2);
+	memcpy(src.sa_data + 2, &ends->laddr, 4);
+	memcpy(dest.sa_data, &ends->rport, 2);
+	memcpy(dest.sa_data + 2, &ends->raddr, 4);
+	return net_nlayer_send_packet(segment, len, &dest, &src, AF_INET, PROTOCOL_TCP, rc);
+}
+
+uint32_t tcp_receive_window(struct tcb *tcb)
+{
+	size_t space = tcp_ring_space(&tcb->rcvbuf);
+	if(space > TCP_MAX_WINDOW)
+		space = TCP_MAX_WINDOW;
+	/* receiver side silly window avoidance (RFC 1122 4.2.3.3) */
+	if(space < tcb->rcvbuf.size / 2 && space < tcb->our_mss)
+		space = 0;
+	/* but never take back what we've already offered */
+	if(SEQ_GT(tcb->rcv_adv, tcb->rcv_nxt) && space < tcb->rcv_adv - tcb->rcv_nxt)
+		space = tcb->rcv_adv - tcb->rcv_nxt;
+	return space;
+}
+
+static size_t __write_options(struct tcb *tcb, uint8_t *opt, uint8_t flags)
+{
+	size_t len = 0;
+	if(flags & TCP_SYN) {
+		opt[len++] = TCPOPT_MSS;
+		opt[len++] = 4;
+		*(uint16_t *)(opt + len) = HOST_TO_BIG16(tcb->our_mss);
+		len += 2;
+		/* offer SACK on a SYN, and agree to it on a SYN-ACK if it was offered */
+		if(!(flags & TCP_ACK) || (tcb->flags & TCB_SACK_OK)) {
+			opt[len++] = TCPOPT_NOP;
+			opt[len++] = TCPOPT_NOP;
+			opt[len++] = TCPOPT_SACK_PERMITTED;
+			opt[len++] = 2;
+		}
+		return len;
+	}
+	if((tcb->flags & TCB_SACK_OK) && tcb->ooo.count && (flags & TCP_ACK)) {
+		struct tcp_sack_block blocks[TCP_MAX_SACK_BLOCKS];
+		int count = tcp_ooo_sack_blocks(tcb, blocks, TCP_MAX_SACK_BLOCKS);
+		if(count) {
+			opt[len++] = TCPOPT_NOP;
+			opt[len++] = TCPOPT_NOP;
+			opt[len++] = TCPOPT_SACK;
+			opt[len++] = 2 + count * 8;
+			for(int i=0;i<count;i++) {
+				*(uint32_t *)(opt + len) = HOST_TO_BIG32(blocks[i].start);
+				*(uint32_t *)(opt + len + 4) = HOST_TO_BIG32(blocks[i].end);
+				len += 8;
+			}
+		}
+	}
+	return len;
+}
+
+/* send len bytes of the send buffer starting at seq, with the given flags */
+static void __send_segment(struct tcb *tcb, uint32_t seq, size_t len, uint8_t flags)
+{
+	struct tcp_header *th = (void *)tcb->segbuf;
+	memset(th, 0, sizeof(*th));
+	size_t hlen = sizeof(*th) + __write_options(tcb, th->options, flags);
+	if(len)
+		tcp_ring_peek(&tcb->sndbuf, seq - tcb->snd_una, tcb->segbuf + hlen, len);
+	th->src_port = tcb->ends.lport;
+	th->dest_port = tcb->ends.rport;
+	th->seq = HOST_TO_BIG32(seq);
+	th->offset = hlen / 4;
+	th->flags = flags;
+	if(flags & TCP_ACK) {
+		uint32_t wnd = tcp_receive_window(tcb);
+		th->ack = HOST_TO_BIG32(tcb->rcv_nxt);
+		th->window = HOST_TO_BIG16((uint16_t)wnd);
+		tcb->rcv_adv = tcb->rcv_nxt + wnd;
+		/* this acks everything, so nothing is pending any more */
+		tcb->flags &= ~TCB_ACK_NOW;
+		tcb->delayed = 0;
+		tcb->delack_at = 0;
+	}
+	__transmit(&tcb->ends, th, hlen + len, &tcb->route_cache);
+}
+
+void tcp_send_syn(struct tcb *tcb)
+{
+	uint8_t flags = TCP_SYN;
+	if(tcb->state == TCP_SYN_RECEIVED)
+		flags |= TCP_ACK;
+	if(!tcb->retries) {
+		tcb->flags |= TCB_RTT_TIMING;
+		tcb->rtt_seq = tcb->iss;
+		tcb->rtt_start = tm_timing_get_microseconds();
+	}
+	__send_segment(tcb, tcb->iss, 0, flags);
+	tcb->snd_nxt = tcb->snd_max = tcb->iss + 1;
+	tcb->rto_at = tm_timing_get_microseconds() + tcb->rto;
+	tcp_timer_update(tcb);
+}
+
+void tcp_send_ack(struct tcb *tcb)
+{
+	__send_segment(tcb, tcb->snd_nxt, 0, TCP_ACK);
+}
+
+void tcp_send_reset(struct tcb *tcb)
+{
+	__send_segment(tcb, tcb->snd_nxt, 0, TCP_RST | TCP_ACK);
+}
+
+/* poke a zero window with a byte past it. The peer will drop it, but its ack
+ * tells us when the window opens. */
+void tcp_send_probe(struct tcb *tcb)
+{
+	__send_segment(tcb, tcb->snd_nxt, 1, TCP_ACK);
+}
+
+/* resend a segment's worth from seq, without touching snd_nxt */
+void tcp_retransmit(struct tcb *tcb, uint32_t seq)
+{
+	uint32_t off = seq - tcb->snd_una;
+	size_t len = tcb->sndbuf.count > off ? tcb->sndbuf.count - off : 0;
+	if(len > tcb->mss)
+		len = tcb->mss;
+	uint8_t flags = TCP_ACK;
+	if((tcb->flags & TCB_FIN_SENT) && seq + len == tcb->fin_seq)
+		flags |= TCP_FIN;
+	if(!len && !(flags & TCP_FIN))
+		return;
+	/* Karn: don't time anything that's been sent twice */
+	if((tcb->flags & TCB_RTT_TIMING) && SEQ_GEQ(tcb->rtt_seq, seq))
+		tcb->flags &= ~TCB_RTT_TIMING;
+	__send_segment(tcb, seq, len, flags);
+}
+
+/* answer a segment that doesn't belong to any connection (RFC 793 p36) */
+void tcp_reset_reply(struct tcp_endpoints *ends, struct tcp_input *in)
+{
+	if(in->flags & TCP_RST)
+		return;
+	struct tcp_header th;
+	memset(&th, 0, sizeof(th));
+	th.src_port = ends->lport;
+	th.dest_port = ends->rport;
+	th.offset = sizeof(th) / 4;
+	if(in->flags & TCP_ACK) {
+		th.seq = HOST_TO_BIG32(in->ack);
+		th.flags = TCP_RST;
+	} else {
+		uint32_t len = in->length + !!(in->flags & TCP_SYN) + !!(in->flags & TCP_FIN);
+		th.ack = HOST_TO_BIG32(in->seq + len);
+		th.flags = TCP_RST | TCP_ACK;
+	}
+	__transmit(ends, &th, sizeof(th), NULL);
+}
+
+/* bytes we think are still in the network */
+static uint32_t __pipe(struct tcb *tcb)
+{
+	if((tcb->flags & TCB_RECOVERY) && (tcb->flags & TCB_SACK_OK))
+		return tcp_sack_pipe(tcb);
+	return tcb->snd_nxt - tcb->snd_una;
+}
+
+/* during SACK recovery, fill the holes before sending anything new */
+static bool __send_holes(struct tcb *tcb)
+{
+	bool sent = false;
+	uint32_t seq = tcb->rexmit_nxt, end;
+	while(__pipe(tcb) < tcb->cwnd && tcp_sack_next_hole(tcb, &seq, &end)) {
+		uint32_t len = end - seq;
+		if(len > tcb->mss)
+			len = tcb->mss;
+		tcp_retransmit(tcb, seq);
+		seq += len;
+		tcb->rexmit_nxt = seq;
+		sent = true;
+	}
+	return sent;
+}
+
+static bool __send_data(struct tcb *tcb)
+{
+	bool sent = false;
+	bool nodelay = tcb->sock && tcb->sock->sopt_levels[PROTOCOL_TCP][TCP_NODELAY];
+	for(;;) {
+		uint32_t off = tcb->snd_nxt - tcb->snd_una;
+		size_t avail = tcb->sndbuf.count > off ? tcb->sndbuf.count - off : 0;
+		/* after a timeout snd_nxt is pulled back behind a FIN that was
+		 * already sent, and the FIN goes out again at the same seq */
+		bool fin = (tcb->flags & TCB_FIN_QUEUED)
+			&& (!(tcb->flags & TCB_FIN_SENT) || SEQ_LEQ(tcb->snd_nxt, tcb->fin_seq));
+		if(!avail && !fin)
+			break;
+		uint32_t pipe = __pipe(tcb);
+		uint32_t right = tcb->snd_una + tcb->snd_wnd;
+		uint32_t rwnd = SEQ_GT(right, tcb->snd_nxt) ? right - tcb->snd_nxt : 0;
+		uint32_t cwnd = tcb->cwnd > pipe ? tcb->cwnd - pipe : 0;
+		size_t len = avail;
+		if(len > tcb->mss)
+			len = tcb->mss;
+		if(len > rwnd)
+			len = rwnd;
+		if(len > cwnd)
+			len = cwnd;
+		if(avail && !len) {
+			/* if the peer's window is shut, the retransmit timer probes it */
+			if(!tcb->snd_wnd && tcb->snd_una == tcb->snd_nxt && !tcb->rto_at)
+				tcb->rto_at = tm_timing_get_microseconds() + tcb->rto;
+			break;
+		}
+		/* don't send a sliver of a segment just because the window is
+		 * nearly full, and (Nagle) don't send a small segment while there
+		 * is unacknowledged data, unless we're told not to */
+		if(len < tcb->mss && pipe) {
+			if(len < avail)
+				break;
+			if(!nodelay && !fin)
+				break;
+		}
+		bool with_fin = fin && len == avail;
+		uint8_t flags = TCP_ACK;
+		if(len && len == avail)
+			flags |= TCP_PSH;
+		if(with_fin)
+			flags |= TCP_FIN;
+		if(!(tcb->flags & TCB_RTT_TIMING) && SEQ_GEQ(tcb->snd_nxt, tcb->snd_max) && len) {
+			tcb->flags |= TCB_RTT_TIMING;
+			tcb->rtt_seq = tcb->snd_nxt;
+			tcb->rtt_start = tm_timing_get_microseconds();
+		}
+		__send_segment(tcb, tcb->snd_nxt, len, flags);
+		tcb->snd_nxt += len;
+		if(with_fin) {
+			tcb->fin_seq = tcb->snd_nxt++;
+			tcb->flags |= TCB_FIN_SENT;
+		}
+		if(SEQ_GT(tcb->snd_nxt, tcb->snd_max))
+			tcb->snd_max = tcb->snd_nxt;
+		if(!tcb->rto_at)
+			tcb->rto_at = tm_timing_get_microseconds() + tcb->rto;
+		sent = true;
+		if(with_fin)
+			break;
+	}
+	return sent;
+}
+
+/* send whatever the windows allow, and any ack that's due */
+void tcp_output(struct tcb *tcb)
+{
+	switch(tcb->state) {
+		case TCP_ESTABLISHED: case TCP_CLOSE_WAIT: case TCP_FIN_WAIT_1:
+		case TCP_CLOSING: case TCP_LAST_ACK:
+			if((tcb->flags & TCB_RECOVERY) && (tcb->flags & TCB_SACK_OK))
+				__send_holes(tcb);
+			__send_data(tcb);
+			break;
+		case TCP_FIN_WAIT_2: case TCP_TIME_WAIT:
+			break;
+		default:
+			return;
+	}
+	if(tcb->flags & TCB_ACK_NOW)
+		tcp_send_ack(tcb);
+	else if(tcb->delayed && !tcb->delack_at)
+		tcb->delack_at = tm_timing_get_microseconds() + TCP_DELACK_TIME;
+	tcp_timer_update(tcb);
+}
+
+/* the reader made room in the receive buffer. Tell the peer, if the window
+ * has opened enough to matter (RFC 1122 4.2.3.3). */
+void tcp_window_update(struct tcb *tcb)
+{
+	if(tcb->state != TCP_ESTABLISHED && tcb->state != TCP_FIN_WAIT_1 && tcb->state != TCP_FIN_WAIT_2)
+		return;
+	uint32_t offered = tcb->rcv_adv - tcb->rcv_nxt;
+	uint32_t wnd = tcp_receive_window(tcb);
+	uint32_t step = 2u * tcb->our_mss;
+	if(step > tcb->rcvbuf.size / 2)
+		step = tcb->rcvbuf.size / 2;
+	if(wnd > offered && wnd - offered >= step) {
+		tcb->flags |= TCB_ACK_NOW;
+		tcp_output(tcb);
+	}
+}
+
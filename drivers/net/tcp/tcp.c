@@ -1,6 +1,742 @@
-int module_install()
+/* tcp.c: connection tables, tcb lifetime, and the socket calls.
+ *
+ * Each tcb has a lock, which is held while anything looks at or changes its
+ * state. tcp_lock protects the connection tables, and the listeners' lists of
+ * children. Locks are taken in the order listener, child, tcp_lock.
+ *
+ * A tcb is referenced by its socket, by the connection table, by its parent's
+ * list of children, and by its timer while the timer is armed. */
+#include <modules/tcp.h>
+#include <sea/net/tlayer.h>
+#include <sea/net/route.h>
+#include <sea/fs/kerfs.h>
+#include <sea/mm/kmalloc.h>
+#include <sea/tm/thread.h>
+#include <sea/cpu/time.h>
+#include <sea/string.h>
+#include <sea/errno.h>
+
+struct mutex tcp_lock;
+/* keyed by tcb->ends. Listeners have no remote address or port, and may
+ * have no local address. */
+static struct hash established, listening;
+static uint32_t iss_secret;
+
+static int tcp_init(struct socket *);
+static int tcp_connect(struct socket *, const struct sockaddr *addr, socklen_t len);
+static int tcp_accept(struct socket *, struct sockaddr *restrict addr, socklen_t *restrict len, int *err);
+static int tcp_listen(struct socket *, int backlog);
+static int tcp_bind(struct socket *, const struct sockaddr *addr, socklen_t len);
+static int tcp_shutdown(struct socket *, int how);
+static int tcp_recvfrom(struct socket *, void *buffer, size_t length,
+		int flags, struct sockaddr *addr, socklen_t *addr_len);
+static int tcp_sendto(struct socket *, const void *buffer, size_t length,
+		int flags, struct sockaddr *addr, socklen_t addr_len);
+static int tcp_destroy(struct socket *);
+static int tcp_select(struct socket *, int);
+
+struct tlayer_prot_interface tcp_tpi = {
+	.max_port = 65535,
+	.min_port = 0,
+	.start_ephemeral = 49152,
+	.end_ephemeral = 65535,
+	.flags = TLPROT_FLAG_DEMUX,
+	.verify = tcp_verify,
+	.inject_port = tcp_inject_port,
+	.recv_packet = tcp_recv_packet,
+};
+
+struct socket_calls socket_calls_tcp = {
+	.init = tcp_init,
+	.accept = tcp_accept,
+	.listen = tcp_listen,
+	.connect = tcp_connect,
+	.bind = tcp_bind,
+	.shutdown = tcp_shutdown,
+	.destroy = tcp_destroy,
+	.recvfrom = tcp_recvfrom,
+	.sendto = tcp_sendto,
+	.select = tcp_select
+};
+
+struct tcb *tcp_tcb_create(void)
+{
+	struct tcb *tcb = kmalloc(sizeof(struct tcb));
+	mutex_create(&tcb->lock, 0);
+	blocklist_create(&tcb->wait, 0, "tcp");
+	net_route_cache_create(&tcb->route_cache);
+	linkedlist_create(&tcb->children, LINKEDLIST_LOCKLESS);
+	linkedlist_create(&tcb->ooo, LINKEDLIST_LOCKLESS);
+	tcb->refs = 1;
+	tcb->state = TCP_CLOSED;
+	tcb->rto = TCP_RTO_INITIAL;
+	tcb->cc = tcp_default_cc;
+	tcp_timer_init(tcb);
+	return tcb;
+}
+
+void tcp_tcb_put(struct tcb *tcb)
+{
+	if(atomic_fetch_sub(&tcb->refs, 1) != 1)
+		return;
+	assert(!tcb->table && !atomic_load(&tcb->timer_ticker));
+	tcp_ooo_clear(tcb);
+	if(tcb->sndbuf.data)
+		tcp_ring_destroy(&tcb->sndbuf);
+	if(tcb->rcvbuf.data)
+		tcp_ring_destroy(&tcb->rcvbuf);
+	if(tcb->segbuf)
+		kfree(tcb->segbuf);
+	linkedlist_destroy(&tcb->children);
+	linkedlist_destroy(&tcb->ooo);
+	blocklist_destroy(&tcb->wait);
+	net_route_cache_destroy(&tcb->route_cache);
+	mutex_destroy(&tcb->lock);
+	kfree(tcb);
+}
+
+/* the segment size changed (before any data was sent), so the initial
+ * window does too (RFC 6928) */
+void tcp_set_mss(struct tcb *tcb, uint16_t mss)
+{
+	tcb->mss = mss;
+	uint32_t iw = 14600 > 2u * mss ? 14600 : 2u * mss;
+	tcb->cwnd = iw < 10u * mss ? iw : 10u * mss;
+}
+
+/* get a tcb ready to carry data over the given interface */
+void tcp_tcb_setup(struct tcb *tcb, struct net_dev *nd)
+{
+	if(!tcb->sndbuf.data)
+		tcp_ring_create(&tcb->sndbuf, TCP_BUFFER_SIZE);
+	if(!tcb->rcvbuf.data)
+		tcp_ring_create(&tcb->rcvbuf, TCP_BUFFER_SIZE);
+	if(!tcb->segbuf)
+		tcb->segbuf = kmalloc(TCP_SEGMENT_SIZE);
+	uint32_t mss;
+	if(nd->mtu)
+		mss = nd->mtu - 40;
+	else
+		mss = nd->hw_type == NET_HWTYPE_LOOP ? TCP_MAX_MSS : TCP_ETHERNET_MSS;
+	if(mss > TCP_MAX_MSS)
+		mss = TCP_MAX_MSS;
+	if(mss < TCP_DEFAULT_MSS)
+		mss = TCP_DEFAULT_MSS;
+	tcb->our_mss = mss;
+	tcp_set_mss(tcb, mss);
+	tcb->ssthresh = ~0u;
+	tcb->rto = TCP_RTO_INITIAL;
+	tcb->cc->init(tcb);
+}
+
+/* RFC 6528: a clock, plus a hash of the connection and a secret, so that
+ * sequence numbers can't be guessed from another connection's */
+uint32_t tcp_new_iss(struct tcp_endpoints *ends)
+{
+	uint32_t h = iss_secret;
+	uint8_t *key = (uint8_t *)ends;
+	for(size_t i=0;i<sizeof(*ends);i++) {
+		h += key[i];
+		h += h << 10;
+		h ^= h >> 6;
+	}
+	h += h << 3;
+	h ^= h >> 11;
+	h += h << 15;
+	return h + (uint32_t)(tm_timing_get_microseconds() / 4);
+}
+
+/* returns the tcb with a reference, or NULL */
+struct tcb *tcp_lookup(struct tcp_endpoints *ends)
+{
+	mutex_acquire(&tcp_lock);
+	struct tcb *tcb = hash_lookup(&established, ends, sizeof(*ends));
+	if(tcb)
+		tcp_tcb_get(tcb);
+	mutex_release(&tcp_lock);
+	return tcb;
+}
+
+struct tcb *tcp_lookup_listener(uint32_t addr, uint16_t port)
+{
+	struct tcp_endpoints key = { .laddr = addr, .lport = port };
+	mutex_acquire(&tcp_lock);
+	struct tcb *tcb = hash_lookup(&listening, &key, sizeof(key));
+	if(!tcb) {
+		key.laddr = 0;
+		tcb = hash_lookup(&listening, &key, sizeof(key));
+	}
+	if(tcb)
+		tcp_tcb_get(tcb);
+	mutex_release(&tcp_lock);
+	return tcb;
+}
+
+/* put the tcb in the table for its state. Returns -EEXIST if something
+ * already has its endpoints. */
+int tcp_hash_insert(struct tcb *tcb)
+{
+	struct hash *table = tcb->state == TCP_LISTEN ? &listening : &established;
+	mutex_acquire(&tcp_lock);
+	int ret = hash_insert(table, &tcb->ends, sizeof(tcb->ends), &tcb->hash_elem, tcb);
+	if(!ret) {
+		tcb->table = table;
+		tcp_tcb_get(tcb);
+	}
+	mutex_release(&tcp_lock);
+	return ret;
+}
+
+/* take a child off its listener's list. Called with tcp_lock held. Returns
+ * with the list's reference, which the caller must put. */
+static void __detach_child(struct tcb *child)
+{
+	struct tcb *parent = child->parent;
+	linkedlist_do_remove(&parent->children, &child->child_entry);
+	parent->nr_children--;
+	if(child->flags & TCB_ACCEPTABLE)
+		atomic_fetch_sub(&parent->accept_ready, 1);
+	child->flags &= ~TCB_ACCEPTABLE;
+	child->parent = NULL;
+}
+
+/* reset and close connections that were never accepted */
+static void __close_children(struct tcb *listener)
+{
+	for(;;) {
+		mutex_acquire(&tcp_lock);
+		struct linkedentry *ent = linkedlist_iter_start(&listener->children);
+		if(ent == linkedlist_iter_end(&listener->children)) {
+			mutex_release(&tcp_lock);
+			return;
+		}
+		struct tcb *child = ent->obj;
+		__detach_child(child);
+		mutex_release(&tcp_lock);
+
+		mutex_acquire(&child->lock);
+		if(child->state != TCP_CLOSED) {
+			tcp_send_reset(child);
+			tcp_close(child);
+		}
+		mutex_release(&child->lock);
+		tcp_tcb_put(child);
+	}
+}
+
+/* the connection is over. Called with the tcb's lock held, and the caller
+ * must hold a reference, since this drops the table's. */
+void tcp_close(struct tcb *tcb)
+{
+	int old = tcb->state;
+	tcb->state = TCP_CLOSED;
+	tcb->rto_at = tcb->delack_at = tcb->timewait_at = 0;
+	tcp_timer_cancel(tcb);
+	tcp_ooo_clear(tcb);
+	if(old == TCP_LISTEN)
+		__close_children(tcb);
+	bool put = false;
+	mutex_acquire(&tcp_lock);
+	if(tcb->table) {
+		hash_delete(tcb->table, &tcb->ends, sizeof(tcb->ends));
+		tcb->table = NULL;
+		put = true;
+	}
+	struct tcb *parent = tcb->parent;
+	if(parent)
+		__detach_child(tcb);
+	mutex_release(&tcp_lock);
+	if(put)
+		tcp_tcb_put(tcb);
+	if(parent)
+		tcp_tcb_put(tcb);
+	tm_blocklist_wakeall(&tcb->wait);
+}
+
+/* the handshake finished. Called with the tcb's lock held. */
+void tcp_established(struct tcb *tcb)
+{
+	tcb->state = TCP_ESTABLISHED;
+	tcb->retries = 0;
+	if(tcb->parent) {
+		mutex_acquire(&tcp_lock);
+		struct tcb *parent = tcb->parent;
+		if(parent) {
+			tcb->flags |= TCB_ACCEPTABLE;
+			atomic_fetch_add(&parent->accept_ready, 1);
+			tm_blocklist_wakeall(&parent->wait);
+		}
+		mutex_release(&tcp_lock);
+	}
+	tm_blocklist_wakeall(&tcb->wait);
+}
+
+static int __bind(struct socket *sock, struct tcb *tcb, struct sockaddr *addr)
+{
+	if(tcb->flags & TCB_PORT_BOUND)
+		return -EINVAL;
+	int ret = net_tlayer_bind_socket(sock, addr);
+	if(ret < 0)
+		return ret;
+	tcb->flags |= TCB_PORT_BOUND;
+	memcpy(&tcb->ends.lport, addr->sa_data, 2);
+	memcpy(&tcb->ends.laddr, addr->sa_data + 2, 4);
+	return 0;
+}
+
+/* grab an ephemeral port on any address */
+static int __autobind(struct socket *sock, struct tcb *tcb)
+{
+	struct sockaddr any;
+	memset(&any, 0, sizeof(any));
+	any.sa_family = AF_INET;
+	int ret = __bind(sock, tcb, &any);
+	if(ret < 0)
+		return ret;
+	socket_bind(sock, &any, sizeof(any));
+	return 0;
+}
+
+static void __endpoint_address(struct sockaddr *addr, uint32_t ip, uint16_t port)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sa_family = AF_INET;
+	memcpy(addr->sa_data, &port, 2);
+	memcpy(addr->sa_data + 2, &ip, 4);
+}
+
+static int tcp_init(struct socket *sock)
+{
+	struct tcb *tcb = tcp_tcb_create();
+	tcb->sock = sock;
+	sock->protdata = tcb;
+	return 0;
+}
+
+static int tcp_bind(struct socket *sock, const struct sockaddr *addr, socklen_t len)
+{
+	struct tcb *tcb = sock->protdata;
+	if(len < sizeof(struct sockaddr))
+		return -EINVAL;
+	if(addr->sa_family != AF_INET)
+		return -EAFNOSUPPORT;
+	struct sockaddr tmp;
+	memcpy(&tmp, addr, sizeof(tmp));
+	mutex_acquire(&tcb->lock);
+	int ret = tcb->state == TCP_CLOSED ? __bind(sock, tcb, &tmp) : -EINVAL;
+	mutex_release(&tcb->lock);
+	return ret;
+}
+
+static int tcp_listen(struct socket *sock, int backlog)
+{
+	struct tcb *tcb = sock->protdata;
+	if(backlog > SOMAXCONN)
+		backlog = SOMAXCONN;
+	if(backlog < 1)
+		backlog = 1;
+	int ret = 0;
+	mutex_acquire(&tcb->lock);
+	if(tcb->state == TCP_LISTEN) {
+		tcb->backlog = backlog;
+		goto out;
+	}
+	if(tcb->state != TCP_CLOSED || tcb->rcvbuf.data) {
+		ret = -EINVAL;
+		goto out;
+	}
+	if(!(tcb->flags & TCB_PORT_BOUND) && (ret = __autobind(sock, tcb)) < 0)
+		goto out;
+	tcb->backlog = backlog;
+	tcb->state = TCP_LISTEN;
+	if(tcp_hash_insert(tcb) < 0) {
+		tcb->state = TCP_CLOSED;
+		ret = -EADDRINUSE;
+		goto out;
+	}
+	/* the socket layer only accepts on connected sockets */
+	sock->flags |= SOCK_FLAG_CONNECTED;
+out:
+	mutex_release(&tcb->lock);
+	return ret;
+}
+
+static bool __accept_should_sleep(void *data)
+{
+	struct tcb *tcb = data;
+	return !atomic_load(&tcb->accept_ready) && tcb->state == TCP_LISTEN;
+}
+
+/* the oldest child that has finished its handshake, taken off the list, or NULL */
+static struct tcb *__accept_child(struct tcb *listener)
+{
+	struct tcb *child = NULL;
+	mutex_acquire(&tcp_lock);
+	struct linkedentry *ent;
+	for(ent = listener->children.sentry.prev;ent != &listener->children.sentry;ent = ent->prev) {
+		struct tcb *c = ent->obj;
+		if(c->flags & TCB_ACCEPTABLE) {
+			__detach_child(c);
+			child = c;
+			break;
+		}
+	}
+	mutex_release(&tcp_lock);
+	return child;
+}
+
+static int tcp_accept(struct socket *sock, struct sockaddr *restrict addr, socklen_t *restrict len, int *err)
+{
+	struct tcb *tcb = sock->protdata;
+	struct tcb *child;
+	for(;;) {
+		if(tcb->state != TCP_LISTEN)
+			return -EINVAL;
+		if((child = __accept_child(tcb)))
+			break;
+		int ret = tm_thread_block_confirm(&tcb->wait, THREADSTATE_INTERRUPTIBLE,
+				__accept_should_sleep, tcb);
+		if(ret < 0)
+			return ret;
+	}
+
+	/* the child's list reference now belongs to its socket */
+	int fd;
+	struct socket *ns = socket_create(err, &fd);
+	if(*err < 0) {
+		mutex_acquire(&child->lock);
+		if(child->state != TCP_CLOSED) {
+			tcp_send_reset(child);
+			tcp_close(child);
+		}
+		mutex_release(&child->lock);
+		tcp_tcb_put(child);
+		return *err;
+	}
+	ns->domain = sock->domain;
+	ns->type = sock->type;
+	ns->prot = sock->prot;
+	ns->calls = sock->calls;
+	ns->flags = SOCK_FLAG_ALLOWSEND | SOCK_FLAG_ALLOWRECV | SOCK_FLAG_CONNECTED;
+	ns->sopt_levels[PROTOCOL_TCP][TCP_NODELAY] = sock->sopt_levels[PROTOCOL_TCP][TCP_NODELAY];
+	ns->sopt_levels_sizes[PROTOCOL_TCP][TCP_NODELAY] = sock->sopt_levels_sizes[PROTOCOL_TCP][TCP_NODELAY];
+
+	mutex_acquire(&child->lock);
+	ns->protdata = child;
+	child->sock = ns;
+	struct sockaddr local, peer;
+	__endpoint_address(&local, child->ends.laddr, child->ends.lport);
+	__endpoint_address(&peer, child->ends.raddr, child->ends.rport);
+	/* it might have been woken for data before it had a socket */
+	if(child->rcvbuf.count)
+		tm_blocklist_wakeall(&child->wait);
+	mutex_release(&child->lock);
+
+	socket_bind(ns, &local, sizeof(local));
+	memcpy(&ns->peer, &peer, sizeof(peer));
+	ns->peer_len = sizeof(peer);
+	if(addr && len) {
+		socklen_t n = *len < sizeof(peer) ? *len : sizeof(peer);
+		memcpy(addr, &peer, n);
+		*len = sizeof(peer);
+	}
+	*err = 0;
+	return fd;
+}
+
+static bool __connect_should_sleep(void *data)
+{
+	struct tcb *tcb = data;
+	return tcb->state == TCP_SYN_SENT || tcb->state == TCP_SYN_RECEIVED;
+}
+
+static int tcp_connect(struct socket *sock, const struct sockaddr *addr, socklen_t len)
+{
+	struct tcb *tcb = sock->protdata;
+	if(len < sizeof(struct sockaddr))
+		return -EINVAL;
+	if(addr->sa_family != AF_INET)
+		return -EAFNOSUPPORT;
+	uint32_t raddr;
+	uint16_t rport;
+	memcpy(&rport, addr->sa_data, 2);
+	memcpy(&raddr, addr->sa_data + 2, 4);
+	if(!rport || !raddr)
+		return -EINVAL;
+	struct route *r = net_route_select_entry(raddr);
+	if(!r)
+		return -ENETUNREACH;
+
+	int ret = 0;
+	mutex_acquire(&tcb->lock);
+	/* a tcb carries one connection */
+	if(tcb->state != TCP_CLOSED || tcb->rcvbuf.data) {
+		ret = -EISCONN;
+		goto out;
+	}
+	if(!(tcb->flags & TCB_PORT_BOUND) && (ret = __autobind(sock, tcb)) < 0)
+		goto out;
+	if(!tcb->ends.laddr) {
+		struct sockaddr s;
+		net_iface_get_netaddr(r->interface, AF_INET, &s);
+		memcpy(&tcb->ends.laddr, s.sa_data + 2, 4);
+	}
+	tcb->ends.raddr = raddr;
+	tcb->ends.rport = rport;
+	tcp_tcb_setup(tcb, r->interface);
+	tcb->state = TCP_SYN_SENT;
+	for(int tries = 0;(ret = tcp_hash_insert(tcb)) == -EEXIST && !tries;tries++) {
+		/* an old connection between the same endpoints may be waiting out
+		 * TIME_WAIT without a socket. We're allowed to end that early. */
+		struct tcb *old = tcp_lookup(&tcb->ends);
+		if(!old)
+			continue;
+		mutex_acquire(&old->lock);
+		if(old->state == TCP_TIME_WAIT)
+			tcp_close(old);
+		mutex_release(&old->lock);
+		tcp_tcb_put(old);
+	}
+	if(ret < 0) {
+		tcb->state = TCP_CLOSED;
+		ret = -EADDRINUSE;
+		goto out;
+	}
+	tcb->iss = tcp_new_iss(&tcb->ends);
+	tcb->snd_una = tcb->snd_nxt = tcb->snd_max = tcb->recover = tcb->iss;
+	tcp_send_syn(tcb);
+
+	while(__connect_should_sleep(tcb)) {
+		mutex_release(&tcb->lock);
+		ret = tm_thread_block_confirm(&tcb->wait, THREADSTATE_INTERRUPTIBLE,
+				__connect_should_sleep, tcb);
+		mutex_acquire(&tcb->lock);
+		/* the handshake carries on without us */
+		if(ret < 0)
+			goto out;
+	}
+	if(tcb->state == TCP_CLOSED)
+		ret = tcb->error ? -tcb->error : -ECONNREFUSED;
+out:
+	mutex_release(&tcb->lock);
+	net_route_put(r);
+	return ret;
+}
+
+static bool __can_send(struct tcb *tcb)
+{
+	return (tcb->state == TCP_ESTABLISHED || tcb->state == TCP_CLOSE_WAIT)
+		&& !(tcb->flags & TCB_FIN_QUEUED);
+}
+
+static bool __send_should_sleep(void *data)
+{
+	struct tcb *tcb = data;
+	return __can_send(tcb) && !tcb->error && !tcp_ring_space(&tcb->sndbuf);
+}
+
+static int tcp_sendto(struct socket *sock, const void *buffer, size_t length,
+		int flags, struct sockaddr *addr, socklen_t addr_len)
+{
+	struct tcb *tcb = sock->protdata;
+	size_t sent = 0;
+	int ret = 0;
+	mutex_acquire(&tcb->lock);
+	while(sent < length) {
+		if(tcb->error) {
+			ret = -tcb->error;
+			break;
+		}
+		if(!__can_send(tcb)) {
+			ret = tcb->rcvbuf.data ? -EPIPE : -ENOTCONN;
+			break;
+		}
+		size_t n = tcp_ring_write(&tcb->sndbuf, (const uint8_t *)buffer + sent, length - sent);
+		sent += n;
+		if(n)
+			tcp_output(tcb);
+		if(sent == length)
+			break;
+		if(flags & MSG_DONTWAIT) {
+			ret = -EAGAIN;
+			break;
+		}
+		mutex_release(&tcb->lock);
+		ret = tm_thread_block_confirm(&tcb->wait, THREADSTATE_INTERRUPTIBLE,
+				__send_should_sleep, tcb);
+		mutex_acquire(&tcb->lock);
+		if(ret < 0)
+			break;
+	}
+	mutex_release(&tcb->lock);
+	return sent ? (int)sent : ret;
+}
+
+static bool __recv_should_sleep(void *data)
 {
+	struct tcb *tcb = data;
+	return !tcb->rcvbuf.count && !(tcb->flags & TCB_FIN_RECEIVED) && !tcb->error
+		&& tcb->state != TCP_CLOSED;
+}
 
+static int tcp_recvfrom(struct socket *sock, void *buffer, size_t length,
+		int flags, struct sockaddr *addr, socklen_t *addr_len)
+{
+	struct tcb *tcb = sock->protdata;
+	int ret;
+	mutex_acquire(&tcb->lock);
+	for(;;) {
+		if(tcb->rcvbuf.count) {
+			size_t n = length < tcb->rcvbuf.count ? length : tcb->rcvbuf.count;
+			tcp_ring_peek(&tcb->rcvbuf, 0, buffer, n);
+			if(!(flags & MSG_PEEK)) {
+				tcp_ring_consume(&tcb->rcvbuf, n);
+				tcp_window_update(tcb);
+			}
+			ret = n;
+			break;
+		}
+		if(tcb->flags & TCB_FIN_RECEIVED) {
+			ret = 0;
+			break;
+		}
+		if(tcb->error) {
+			ret = -tcb->error;
+			break;
+		}
+		if(tcb->state == TCP_CLOSED || tcb->state == TCP_LISTEN) {
+			ret = tcb->rcvbuf.data && tcb->state == TCP_CLOSED ? 0 : -ENOTCONN;
+			break;
+		}
+		if(flags & MSG_DONTWAIT) {
+			ret = -EAGAIN;
+			break;
+		}
+		mutex_release(&tcb->lock);
+		ret = tm_thread_block_confirm(&tcb->wait, THREADSTATE_INTERRUPTIBLE,
+				__recv_should_sleep, tcb);
+		mutex_acquire(&tcb->lock);
+		if(ret < 0)
+			break;
+	}
+	if(ret >= 0 && addr)
+		__endpoint_address(addr, tcb->ends.raddr, tcb->ends.rport);
+	if(ret >= 0 && addr_len)
+		*addr_len = sizeof(struct sockaddr);
+	mutex_release(&tcb->lock);
+	return ret;
+}
+
+/* stop sending. Called with the tcb's lock held. */
+static void __shutdown_write(struct tcb *tcb)
+{
+	switch(tcb->state) {
+		case TCP_ESTABLISHED:
+			tcb->state = TCP_FIN_WAIT_1;
+			break;
+		case TCP_CLOSE_WAIT:
+			tcb->state = TCP_LAST_ACK;
+			break;
+		case TCP_SYN_RECEIVED:
+			tcp_send_reset(tcb);
+			tcp_close(tcb);
+			return;
+		case TCP_SYN_SENT: case TCP_LISTEN:
+			tcp_close(tcb);
+			return;
+		default:
+			return;
+	}
+	tcb->flags |= TCB_FIN_QUEUED;
+	tcp_output(tcb);
+	tm_blocklist_wakeall(&tcb->wait);
+}
+
+static int tcp_shutdown(struct socket *sock, int how)
+{
+	struct tcb *tcb = sock->protdata;
+	if(how == SHUT_RD)
+		return 0;
+	mutex_acquire(&tcb->lock);
+	__shutdown_write(tcb);
+	mutex_release(&tcb->lock);
+	return 0;
+}
+
+static int tcp_destroy(struct socket *sock)
+{
+	struct tcb *tcb = sock->protdata;
+	if(!tcb)
+		return 0;
+	mutex_acquire(&tcb->lock);
+	if(tcb->flags & TCB_PORT_BOUND) {
+		net_tlayer_unbind_socket(sock, &sock->bindaddr);
+		tcb->flags &= ~TCB_PORT_BOUND;
+	}
+	tcb->sock = NULL;
+	sock->protdata = NULL;
+	if(tcb->rcvbuf.count && tcb->state != TCP_CLOSED && tcb->state != TCP_LISTEN) {
+		/* data was thrown away; tell the peer (RFC 2525 2.17) */
+		tcp_send_reset(tcb);
+		tcp_close(tcb);
+	} else {
+		__shutdown_write(tcb);
+	}
+	/* nobody is left to close the connection if the peer never does */
+	if(tcb->state == TCP_FIN_WAIT_2 && !tcb->timewait_at) {
+		tcb->timewait_at = tm_timing_get_microseconds() + TCP_FIN_WAIT_2_TIME;
+		tcp_timer_update(tcb);
+	}
+	mutex_release(&tcb->lock);
+	tcp_tcb_put(tcb);
+	return 0;
+}
+
+static int tcp_select(struct socket *sock, int rw)
+{
+	struct tcb *tcb = sock->protdata;
+	if(tcb->error || tcb->state == TCP_CLOSED)
+		return 1;
+	if(rw == READ) {
+		if(tcb->state == TCP_LISTEN)
+			return atomic_load(&tcb->accept_ready) > 0;
+		return tcb->rcvbuf.count || (tcb->flags & TCB_FIN_RECEIVED);
+	}
+	if(rw == WRITE)
+		return __can_send(tcb) && tcp_ring_space(&tcb->sndbuf);
+	return 0;
+}
+
+int module_install(void)
+{
+	mutex_create(&tcp_lock, 0);
+	hash_create(&established, HASH_LOCKLESS, 1024);
+	hash_create(&listening, HASH_LOCKLESS, 64);
+	iss_secret = (uint32_t)(time_get_epoch() ^ tm_timing_get_microseconds());
+	int ret = tcp_timers_init();
+	if(ret < 0) {
+		hash_destroy(&established);
+		hash_destroy(&listening);
+		mutex_destroy(&tcp_lock);
+		return ret;
+	}
+	net_tlayer_register_protocol(PROTOCOL_TCP, &tcp_tpi);
+	socket_set_calls(PROTOCOL_TCP, &socket_calls_tcp);
+	kerfs_register_parameter("/dev/tcp-congestion", NULL, 0, KERFS_PARAM_WRITE, kerfs_tcp_congestion);
+	return 0;
+}
+
+int module_exit(void)
+{
+	if(hash_count(&established) || hash_count(&listening))
+		return -EBUSY;
+	kerfs_unregister_entry("/dev/tcp-congestion");
+	socket_set_calls(PROTOCOL_TCP, 0);
+	net_tlayer_deregister_protocol(PROTOCOL_TCP);
+	tcp_timers_exit();
+	hash_destroy(&established);
+	hash_destroy(&listening);
+	mutex_destroy(&tcp_lock);
 	return 0;
 }
 
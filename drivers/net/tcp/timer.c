@@ -0,0 +1,197 @@
+/* timer.c: retransmission, delayed ack and TIME_WAIT timers. Each tcb has a
+ * single async call on the per-CPU ticker, armed for its earliest deadline.
+ * Ticker callbacks run with interrupts off and can't take the tcb's lock, so
+ * the callback just hands the tcb to the [ktcp] thread, which does the work. */
+#include <modules/tcp.h>
+#include <sea/cpu/processor.h>
+#include <sea/tm/kthread.h>
+#include <sea/tm/thread.h>
+#include <sea/lib/mpscq.h>
+#include <sea/errno.h>
+
+#define TCP_TIMER_QUEUE 1024
+
+static struct mpscq timer_queue;
+static struct blocklist timer_wait;
+static struct kthread worker;
+
+/* RFC 6298 */
+void tcp_rtt_sample(struct tcb *tcb, time_t rtt)
+{
+	if(rtt <= 0)
+		rtt = 1;
+	if(!tcb->srtt) {
+		tcb->srtt = rtt;
+		tcb->rttvar = rtt / 2;
+	} else {
+		time_t delta = rtt > tcb->srtt ? rtt - tcb->srtt : tcb->srtt - rtt;
+		tcb->rttvar = (3 * tcb->rttvar + delta) / 4;
+		tcb->srtt = (7 * tcb->srtt + rtt) / 8;
+	}
+	tcb->rto = tcb->srtt + 4 * tcb->rttvar;
+	if(tcb->rto < TCP_RTO_MIN)
+		tcb->rto = TCP_RTO_MIN;
+	if(tcb->rto > TCP_RTO_MAX)
+		tcb->rto = TCP_RTO_MAX;
+}
+
+static void __timer_expired(unsigned long data)
+{
+	struct tcb *tcb = (struct tcb *)data;
+	atomic_store(&tcb->timer_ticker, NULL);
+	/* the reference that the timer held goes to the worker */
+	if(!mpscq_enqueue(&timer_queue, tcb)) {
+		/* the worker is swamped. Try again in a bit. */
+		struct ticker *ticker = &__current_cpu->ticker;
+		atomic_store(&tcb->timer_ticker, ticker);
+		ticker_insert(ticker, ONE_MILLISECOND, &tcb->timer);
+		return;
+	}
+	tm_blocklist_wakeall(&timer_wait);
+}
+
+void tcp_timer_init(struct tcb *tcb)
+{
+	async_call_create(&tcb->timer, 0, __timer_expired, (unsigned long)tcb,
+			ASYNC_CALL_PRIORITY_MEDIUM);
+}
+
+void tcp_timer_cancel(struct tcb *tcb)
+{
+	struct ticker *ticker = atomic_exchange(&tcb->timer_ticker, NULL);
+	/* if it already fired, the worker drops the timer's reference */
+	if(ticker && ticker_delete(ticker, &tcb->timer) != -ENOENT)
+		tcp_tcb_put(tcb);
+}
+
+/* make sure the timer will go off by the earliest deadline. If it's set to go
+ * off sooner than that, leave it; the worker will just set it again. */
+void tcp_timer_update(struct tcb *tcb)
+{
+	time_t at = 0;
+	time_t deadlines[3] = { tcb->rto_at, tcb->delack_at, tcb->timewait_at };
+	for(int i=0;i<3;i++) {
+		if(deadlines[i] && (!at || deadlines[i] < at))
+			at = deadlines[i];
+	}
+	if(!at)
+		return;
+	if(atomic_load(&tcb->timer_ticker) && tcb->timer_at <= at)
+		return;
+	tcp_timer_cancel(tcb);
+	time_t now = tm_timing_get_microseconds();
+	tcp_tcb_get(tcb);
+	tcb->timer_at = at;
+	struct cpu *cpu = cpu_get_current();
+	struct ticker *ticker = &cpu->ticker;
+	atomic_store(&tcb->timer_ticker, ticker);
+	ticker_insert(ticker, at > now ? at - now : 1, &tcb->timer);
+	cpu_put_current(cpu);
+}
+
+static void __rto_expired(struct tcb *tcb)
+{
+	tcb->rto_at = 0;
+	int limit = (tcb->state == TCP_SYN_SENT || tcb->state == TCP_SYN_RECEIVED)
+		? TCP_SYN_RETRIES : TCP_RETRIES;
+	if(++tcb->retries > limit) {
+		tcb->error = ETIMEDOUT;
+		if(tcb->state != TCP_SYN_SENT)
+			tcp_send_reset(tcb);
+		tcp_close(tcb);
+		return;
+	}
+	tcb->rto *= 2;
+	if(tcb->rto > TCP_RTO_MAX)
+		tcb->rto = TCP_RTO_MAX;
+	tcb->flags &= ~TCB_RTT_TIMING;
+	switch(tcb->state) {
+		case TCP_SYN_SENT: case TCP_SYN_RECEIVED:
+			tcp_send_syn(tcb);
+			return;
+		case TCP_TIME_WAIT: case TCP_CLOSED: case TCP_LISTEN:
+			return;
+	}
+	uint32_t off = tcb->snd_nxt - tcb->snd_una;
+	if(!tcb->snd_wnd && tcb->snd_una == tcb->snd_max && off < tcb->sndbuf.count) {
+		/* the peer's window is closed; probe it */
+		tcp_send_probe(tcb);
+		tcb->rto_at = tm_timing_get_microseconds() + tcb->rto;
+		return;
+	}
+	if(tcb->snd_una == tcb->snd_max)
+		return;
+	/* everything outstanding is presumed lost (RFC 5681 3.1). Only cut
+	 * ssthresh once, however many times the same data times out. */
+	if(tcb->retries == 1)
+		tcb->ssthresh = tcb->cc->ssthresh(tcb);
+	tcb->cwnd = tcb->mss;
+	tcb->flags &= ~TCB_RECOVERY;
+	tcb->dupacks = 0;
+	tcb->recover = tcb->snd_max;
+	/* the peer is allowed to drop data it SACKed (RFC 2018) */
+	tcp_sack_clear(tcb);
+	/* TCB_FIN_SENT and fin_seq stay, so that an ack of the FIN that
+	 * arrives before it's resent is still recognised */
+	tcb->snd_nxt = tcb->snd_una;
+	tcp_output(tcb);
+}
+
+/* called by the worker with the tcb's lock held */
+static void __timer_run(struct tcb *tcb)
+{
+	time_t now = tm_timing_get_microseconds();
+	if(tcb->state == TCP_CLOSED)
+		return;
+	if(tcb->timewait_at && now >= tcb->timewait_at) {
+		tcp_close(tcb);
+		return;
+	}
+	if(tcb->delack_at && now >= tcb->delack_at) {
+		tcb->delack_at = 0;
+		tcb->flags |= TCB_ACK_NOW;
+		tcp_output(tcb);
+	}
+	if(tcb->rto_at && now >= tcb->rto_at)
+		__rto_expired(tcb);
+	if(tcb->state != TCP_CLOSED)
+		tcp_timer_update(tcb);
+}
+
+static bool __worker_should_sleep(void *data)
+{
+	struct kthread *kt = data;
+	return !mpscq_count(&timer_queue) && !kthread_is_joining(kt);
+}
+
+static int __tcp_worker(struct kthread *kt, void *arg)
+{
+	while(!kthread_is_joining(kt)) {
+		struct tcb *tcb;
+		while((tcb = mpscq_dequeue(&timer_queue))) {
+			mutex_acquire(&tcb->lock);
+			__timer_run(tcb);
+			mutex_release(&tcb->lock);
+			tcp_tcb_put(tcb);
+		}
+		tm_thread_block_confirm(&timer_wait, THREADSTATE_UNINTERRUPTIBLE,
+				__worker_should_sleep, kt);
+	}
+	return 0;
+}
+
+int tcp_timers_init(void)
+{
+	mpscq_create(&timer_queue, TCP_TIMER_QUEUE);
+	blocklist_create(&timer_wait, 0, "ktcp");
+	if(!kthread_create(&worker, "[ktcp]", 0, __tcp_worker, NULL))
+		return -ENOMEM;
+	return 0;
+}
+
+void tcp_timers_exit(void)
+{
+	kthread_join(&worker, 0);
+	mpscq_destroy(&timer_queue);
+}
+
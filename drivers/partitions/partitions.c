@@ -20,6 +20,7 @@ int enumerate_partitions(int num, struct inode *node, struct partition *part)
 {
 	unsigned char buf[512];
 	struct file f;
+	f.flags = 0;
 	f.inode = node;
 	int r = fs_file_pread(&f, 0, buf, 512);
 	struct partition ptable[4];
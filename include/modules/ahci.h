@@ -6,6 +6,7 @@
 #include <sea/fs/inode.h>
 #include <sea/mm/dma.h>
 #include <sea/dm/blockdev.h>
+#include <sea/tm/timing.h>
 typedef enum
 {
 	FIS_TYPE_REG_H2D	= 0x27,	// Register FIS - host to device
@@ -324,6 +325,28 @@ struct ahci_device {
 	struct dma_region ch_dmas[HBA_COMMAND_HEADER_NUM];
 	struct ata_identify identify;
 	uint32_t slots;
+	int nslots;
+	/* native command queuing. ncq_depth is 0 if the device or the HBA can't
+	 * do it. Queued commands started by the elevator are tracked per slot
+	 * (the slot is also the NCQ tag) until ahci_poll finishes them. */
+	int ncq_depth;
+	uint32_t ncq_active;
+	struct blockio *slot_io[HBA_COMMAND_HEADER_NUM];
+	time_t slot_time[HBA_COMMAND_HEADER_NUM];
+	unsigned int slot_reset[HBA_COMMAND_HEADER_NUM];
+	unsigned int resets;
+	/* slots with a command issued that the interrupt handler hasn't seen
+	 * finish yet. Threads waiting for a command sleep on slot_wait, and
+	 * int_status collects PxIS as the interrupt handler clears it. The
+	 * handler can't take the blocklists' locks, so it collects finished
+	 * slots in int_done and leaves the wakeups to wake_call, which runs
+	 * at stage2. */
+	_Atomic uint32_t issued;
+	_Atomic uint32_t int_status;
+	_Atomic uint32_t int_done;
+	_Atomic bool wake_pending;
+	struct async_call wake_call;
+	struct blocklist slot_wait[HBA_COMMAND_HEADER_NUM];
 	int created;
 	struct inode *node;
 	struct hashelem mapelem;
@@ -339,6 +362,26 @@ struct ahci_device {
 #define HBA_GHC_INTERRUPT_ENABLE (1 << 1)
 #define HBA_GHC_RESET (1 << 0)
 
+#define HBA_CAP_SNCQ (1 << 30)
+#define HBA_CAP_CCCS (1 << 7)
+#define HBA_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1)
+
+#define HBA_CCC_ENABLE (1 << 0)
+#define HBA_CCC_INT(ctl) (((ctl) >> 3) & 0x1F)
+#define HBA_CCC_MAX_COMPLETIONS 255
+#define HBA_CCC_MAX_TIMEOUT 0xFFFF
+
+#define HBA_PxIS_DHRS (1 << 0)
+#define HBA_PxIS_PSS  (1 << 1)
+#define HBA_PxIS_DSS  (1 << 2)
+#define HBA_PxIS_SDBS (1 << 3)
+#define HBA_PxIS_IFS  (1 << 27)
+#define HBA_PxIS_HBDS (1 << 28)
+#define HBA_PxIS_HBFS (1 << 29)
+#define HBA_PxIS_TFES (1 << 30)
+#define HBA_PxIS_COMPLETION (HBA_PxIS_DHRS | HBA_PxIS_PSS | HBA_PxIS_DSS | HBA_PxIS_SDBS)
+#define HBA_PxIS_ERROR (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+
 #define ATA_CMD_IDENTIFY 0xEC
 
 #define ATA_DEV_BUSY 0x80
@@ -347,22 +390,51 @@ struct ahci_device {
 
 #define ATA_CMD_READ_DMA_EX 0x25
 #define ATA_CMD_WRITE_DMA_EX 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
 
-#define PRDT_MAX_COUNT 0x1000
+/* IDENTIFY words for NCQ: the queue depth (minus one) is in the low 5 bits
+ * of word 75, and word 76 says whether the device supports it at all */
+#define ATA_IDENTIFY_QUEUE_DEPTH 75
+#define ATA_IDENTIFY_SATA_CAP    76
+#define ATA_SATA_CAP_NCQ (1 << 8)
+#define ata_identify_word(id, w) (((uint16_t *)(id))[w])
+
+/* the most one PRDT entry can transfer */
+#define PRDT_MAX_COUNT 0x400000
 
 #define PRDT_MAX_ENTRIES 65535
 
+/* each slot's command table is one preallocated page, which limits how
+ * many PRDT entries it can hold. A buffer that isn't physically contiguous
+ * needs an entry per page it touches, so limit commands to what fits even
+ * then. */
+#define AHCI_COMMAND_TABLE_SIZE 0x1000
+#define AHCI_PRDT_ENTRIES ((AHCI_COMMAND_TABLE_SIZE - sizeof(struct hba_command_table)) \
+		/ sizeof(struct hba_prdt_entry) + 1)
+#define AHCI_MAX_SECTORS (((AHCI_PRDT_ENTRIES - 1) * PAGE_SIZE) / ATA_SECTOR_SIZE)
+
 #define ATA_TFD_TIMEOUT  1000000
 #define AHCI_CMD_TIMEOUT 1000000
+/* how long a DMA command may be outstanding before the port is considered hung */
+#define AHCI_IO_TIMEOUT (5 * ONE_SECOND)
 
 #define ATA_SECTOR_SIZE 512
 
-#define AHCI_DEFAULT_INT 0
+#define AHCI_DEFAULT_INT (HBA_PxIS_COMPLETION | HBA_PxIS_ERROR)
+/* ports that are coalescing completions only interrupt on their own for errors */
+#define ahci_port_interrupts(abar, i) \
+	((((abar)->ccc_control & HBA_CCC_ENABLE) && ((abar)->ccc_ports & (1 << (i)))) \
+	 ? HBA_PxIS_ERROR : AHCI_DEFAULT_INT)
 
 struct hba_command_header *ahci_initialize_command_header(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int write, int atapi, int prd_entries, int fis_len);
 struct fis_reg_host_to_device *ahci_initialize_fis_host_to_device(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int cmdctl, int ata_command);
 void ahci_send_command(struct hba_port *port, int slot);
 int ahci_write_prdt(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int offset, int length, addr_t virt_buffer);
+bool ahci_buffer_dma_capable(addr_t virt_buffer, size_t length, bool device_writes);
+void ahci_port_wakeup(unsigned long data);
+bool ahci_prdt_setup(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int write, addr_t virt_buffer, size_t length);
+int ahci_port_dma_data_start(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int write, addr_t virt_buffer, int sectors, uint64_t lba);
 int ahci_port_dma_data_transfer(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev, int slot, int write, addr_t virt_buffer, int sectors, uint64_t lba);
 int ahci_device_identify_ahci(struct hba_memory *abar, struct hba_port *port, struct ahci_device *dev);
 
@@ -377,6 +449,8 @@ void ahci_probe_ports(struct hba_memory *abar);
 void ahci_init_hba(struct hba_memory *abar);
 
 void ahci_create_device(struct ahci_device *dev);
+int ahci_port_acquire_slot(struct ahci_device *dev);
+void ahci_port_release_slot(struct ahci_device *dev, int slot);
 
 extern int ahci_int;
 extern struct hba_memory *hba_mem;
@@ -12,6 +12,7 @@ struct ethernet_header {
 };
 
 void ethernet_receive_packet(struct net_dev *nd, struct net_packet *packet);
+sa_family_t ethernet_decode_packet(struct net_dev *nd, struct net_packet *packet);
 void ethernet_construct_header(struct ethernet_header *head, uint8_t src_mac[6], uint8_t dest_mac[6], uint16_t ethertype);
 int ethernet_convert_sa_family(sa_family_t sa);
 void ethernet_send_packet(struct net_dev *nd, struct net_packet *);
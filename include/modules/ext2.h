@@ -105,6 +105,7 @@ typedef struct ext2_blockgroup {
 
 int ext2_write_block(struct ext2_info *fs, uint64_t block, unsigned char *buf);
 int ext2_read_block(struct ext2_info *fs, uint64_t block, unsigned char *buf);
+int ext2_direct_io(struct ext2_info *fs, int write, off_t off, unsigned char *buf, size_t len);
 
 int ext2_inode_readblk(ext2_inode_t* inode, uint32_t block, void* buf, size_t count);
 
@@ -113,6 +114,8 @@ int ext2_inode_readdata(
 	ext2_inode_t* inode, uint32_t start, size_t len, unsigned char* buf);
 int ext2_inode_writedata(
 	ext2_inode_t* inode, uint32_t start, size_t len, const unsigned char* buf);
+int ext2_inode_directio(
+	ext2_inode_t* inode, int write, uint32_t start, size_t len, unsigned char* buf);
 int ext2_inode_truncate(ext2_inode_t* inode, uint32_t size, int);
 int ext2_bg_read(struct ext2_info* fs, int group_nr, ext2_blockgroup_t* bg);
 int ext2_bg_update(struct ext2_info* fs, int group_nr, ext2_blockgroup_t* bg);
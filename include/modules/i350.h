@@ -3,6 +3,10 @@
 #include <sea/types.h>
 #include <modules/pci.h>
 #include <sea/mutex.h>
+#include <sea/mm/vmm.h>
+#include <stdbool.h>
+
+struct net_packet;
 
 struct i350_receive_descriptor {
 	uint64_t buffer;
@@ -24,67 +28,89 @@ struct i350_transmit_descriptor {
 	uint64_t vlan:16;
 };
 
+/* one queue pair per CPU, up to the number the device has. Each receive
+ * queue belongs to its [kpacket] thread, and its interrupt goes to that
+ * thread's CPU, so the rx side needs no locking. A CPU sends on its own
+ * transmit queue, and the lock is only there for when a thread gets
+ * preempted mid-send by another on the same CPU. */
+#define I350_MAX_QUEUES 8
+#define I350_RING_SIZE  (PAGE_SIZE / 16)
+
+struct i350_device;
+
+struct i350_queue {
+	struct i350_device *dev;
+	int idx;
+	int vector;
+
+	struct i350_receive_descriptor *rx_ring;
+	addr_t rx_ring_physical;
+	/* the packet each rx descriptor's buffer belongs to */
+	struct net_packet *rx_packets[I350_RING_SIZE];
+	uint32_t rx_next;
+
+	struct i350_transmit_descriptor *tx_ring;
+	addr_t tx_ring_physical;
+	/* sent packets are held until the device is done reading them */
+	struct net_packet *tx_packets[I350_RING_SIZE];
+	uint32_t tx_tail, tx_clean;
+	struct mutex tx_lock;
+};
+
 struct i350_device {
 	struct pci_device *pci;
-	addr_t mem, pcsmem;
-	
-	addr_t receive_list_physical;
-	addr_t transmit_list_physical;
-	struct i350_receive_descriptor *receive_ring;
-	addr_t *rx_ring_virt_buffers;
-	struct i350_transmit_descriptor *transmit_ring;
-	addr_t *tx_ring_virt_buffers;
-	uint32_t rx_list_count;
-	uint32_t rx_buffer_len;
-	uint32_t tx_list_count;
-	uint32_t tx_buffer_len;
-	
-	struct mutex *tx_queue_lock[1];
-	struct mutex *rx_queue_lock[1];
-	
-};
+	addr_t mem;
+	struct net_dev *nd;
 
+	bool msix;
+	struct pci_msix msix_table;
+	int other_vector;
 
+	int queue_count;
+	struct i350_queue queues[I350_MAX_QUEUES];
+};
 
 #define E1000_CTRL     0x00000
 #define E1000_STATUS   0x00008
 #define E1000_CTRL_EXT 0x00018
 #define E1000_RCTL     0x00100  /* RX Control - RW */
-#define E1000_RDTR1    0x02820  /* RX Delay Timer (1) - RW */
-#define E1000_RDBAL1   0x02900  /* RX Descriptor Base Address Low (1) - RW */
-#define E1000_RDBAH1   0x02904  /* RX Descriptor Base Address High (1) - RW */
-#define E1000_RDLEN1   0x02908  /* RX Descriptor Length (1) - RW */
-#define E1000_RDH1     0x02910  /* RX Descriptor Head (1) - RW */
-#define E1000_RDT1     0x02918  /* RX Descriptor Tail (1) - RW */
 #define E1000_IMS      0x000D0  /* Interrupt Mask Set - RW */
 #define E1000_IMC      0x000D8  /* Interrupt Mask Clear - WO */
 #define E1000_ICR      0x01500
 
-#define E1000_RDBAL    0x02800  /* RX Descriptor Base Address Low - RW */
-#define E1000_RDBAH    0x02804  /* RX Descriptor Base Address High - RW */
-#define E1000_RDLEN    0x02808  /* RX Descriptor Length - RW */
-#define E1000_RDH      0x02810  /* RX Descriptor Head - RW */
-#define E1000_RDT      0x02818  /* RX Descriptor Tail - RW */
-#define E1000_RDTR     0x02820  /* RX Delay Timer - RW */
-#define E1000_RDBAL0   E1000_RDBAL /* RX Desc Base Address Low (0) - RW */
-#define E1000_RDBAH0   E1000_RDBAH /* RX Desc Base Address High (0) - RW */
-#define E1000_RDLEN0   E1000_RDLEN /* RX Desc Length (0) - RW */
-#define E1000_RDH0     E1000_RDH   /* RX Desc Head (0) - RW */
-#define E1000_RDT0     E1000_RDT   /* RX Desc Tail (0) - RW */
-#define E1000_RDTR0    E1000_RDTR  /* RX Delay Timer (0) - RW */
-#define E1000_RXDCTL   0x02828  /* RX Descriptor Control queue 0 - RW */
-#define E1000_SRRCTL0  0x0C00C
-
-
-#define E1000_TCTL     0x0400
-#define E1000_TDBAL0   0xE000
-#define E1000_TDBAH0   0xE004
-#define E1000_TDLEN0   0xE008
-#define E1000_TDH0     0xE010
-#define E1000_TDT0     0xE018
-#define E1000_TXDCTL   0xE028
-
-
+/* per-queue registers */
+#define E1000_RDBAL(n)  (0x0C000 + 0x40 * (n))
+#define E1000_RDBAH(n)  (0x0C004 + 0x40 * (n))
+#define E1000_RDLEN(n)  (0x0C008 + 0x40 * (n))
+#define E1000_SRRCTL(n) (0x0C00C + 0x40 * (n))
+#define E1000_RDH(n)    (0x0C010 + 0x40 * (n))
+#define E1000_RDT(n)    (0x0C018 + 0x40 * (n))
+#define E1000_RXDCTL(n) (0x0C028 + 0x40 * (n))
+#define E1000_TDBAL(n)  (0x0E000 + 0x40 * (n))
+#define E1000_TDBAH(n)  (0x0E004 + 0x40 * (n))
+#define E1000_TDLEN(n)  (0x0E008 + 0x40 * (n))
+#define E1000_TDH(n)    (0x0E010 + 0x40 * (n))
+#define E1000_TDT(n)    (0x0E018 + 0x40 * (n))
+#define E1000_TXDCTL(n) (0x0E028 + 0x40 * (n))
+
+#define E1000_TCTL     0x00400
+
+/* extended interrupts, for MSI-X */
+#define E1000_GPIE     0x01514
+#define E1000_EIMS     0x01524
+#define E1000_EIMC     0x01528
+#define E1000_EIAC     0x0152C
+#define E1000_EIAM     0x01530
+#define E1000_EICR     0x01580
+#define E1000_EITR(n)  (0x01680 + 4 * (n))
+#define E1000_IVAR(n)  (0x01700 + 4 * (n))
+#define E1000_IVAR_MISC 0x01740
+
+/* receive side scaling */
+#define E1000_RXCSUM   0x05000
+#define E1000_MRQC     0x05818
+#define E1000_RETA(n)  (0x05C00 + 4 * (n))
+#define E1000_RSSRK(n) (0x05C80 + 4 * (n))
 
 #define E1000_GPRC     0x04074
 #define E1000_GPTC     0x04080
@@ -116,4 +142,37 @@ struct i350_device {
 #define E1000_ICR_FER     (1 << 22)
 #define E1000_ICR_PCIEX   (1 << 24)
 
+#define E1000_RCTL_RXEN   (1 << 1)
+#define E1000_RCTL_UPE    (1 << 3)
+#define E1000_RCTL_MPE    (1 << 4)
+#define E1000_RCTL_BAM    (1 << 15)
+
+#define E1000_TCTL_EN     (1 << 1)
+#define E1000_TCTL_PSP    (1 << 3)
+
+#define E1000_QUEUE_ENABLE (1 << 25) /* in RXDCTL and TXDCTL */
+
+#define E1000_SRRCTL_BSIZEPKT_SHIFT 0 /* in kilobytes */
+#define E1000_SRRCTL_DROP_EN (1 << 31)
+
+#define E1000_RXD_STAT_DD  (1 << 0)
+#define E1000_RXD_STAT_EOP (1 << 1)
+
+#define E1000_TXD_CMD_EOP  (1 << 0)
+#define E1000_TXD_CMD_IFCS (1 << 1)
+#define E1000_TXD_CMD_RS   (1 << 3)
+#define E1000_TXD_STAT_DD  (1 << 0)
+
+#define E1000_GPIE_NSICR   (1 << 0)
+#define E1000_GPIE_MSIX_MODE (1 << 4)
+#define E1000_GPIE_PBA     (1 << 31)
+
+#define E1000_IVAR_VALID   0x80
+
+#define E1000_MRQC_RSS     2
+#define E1000_MRQC_TCP_IPV4 (1 << 16)
+#define E1000_MRQC_IPV4    (1 << 17)
+#define E1000_MRQC_IPV6    (1 << 20)
+#define E1000_MRQC_TCP_IPV6 (1 << 21)
+
 #endif
@@ -33,6 +33,10 @@ struct ipv4_packet {
 	int tries;
 	struct net_packet *netpacket;
 	struct ipv4_header *header;
+	/* the route the packet was enqueued with, good while the table is
+	 * still at route_gen */
+	struct route *route;
+	unsigned long route_gen;
 } __attribute__ ((packed));
 
 union ipv4_address {
@@ -54,9 +58,10 @@ struct ipv4_fragment {
 };
 
 void ipv4_receive_packet(struct net_dev *nd, struct net_packet *, void *);
+void ipv4_receive_batch(struct net_dev *nd, struct net_packet **, int);
 int ipv4_enqueue_packet(struct net_packet *netpacket, struct ipv4_header *header);
 int ipv4_copy_enqueue_packet(struct net_packet *netpacket, struct ipv4_header *header);
-int ipv4_enqueue_sockaddr(void *payload, size_t len, struct sockaddr *addr, struct sockaddr *src, int prot);
+int ipv4_enqueue_sockaddr(void *payload, size_t len, struct sockaddr *addr, struct sockaddr *src, int prot, struct route_cache *rc);
 int ipv4_sending_thread(struct kthread *kt, void *arg);
 int __ipv4_cleanup_fragments(int do_remove);
 uint16_t ipv4_calc_checksum(void *__data, int length);
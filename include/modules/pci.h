@@ -3,6 +3,7 @@
 #include <sea/config.h>
 #ifdef CONFIG_MODULE_PCI
 #include <sea/types.h>
+#include <stdbool.h>
 
 struct pci_config_space
 {
@@ -74,5 +75,27 @@ void pci_write_dword(const uint16_t bus, const uint16_t dev,
 uint32_t pci_read_dword(const uint16_t bus, const uint16_t dev, 
 	const uint16_t func, const uint32_t reg);
 struct pci_device *pci_locate_class(unsigned short class, unsigned short _subclass);
+
+#define PCI_STATUS_CAPLIST 0x10
+#define PCI_CAP_POINTER    0x34
+#define PCI_CAP_ID_MSIX    0x11
+
+#define PCI_MSIX_ENABLE    (1 << 15)
+#define PCI_MSIX_MASKALL   (1 << 14)
+#define PCI_MSIX_MASKED    1
+
+/* an MSI-X table, mapped in. Each entry sends an interrupt vector to a CPU. */
+struct pci_msix {
+	struct pci_device *dev;
+	uint8_t cap;
+	int table_size;
+	volatile uint32_t *table;
+};
+
+uint8_t pci_find_capability(struct pci_device *dev, uint8_t id);
+int pci_msix_init(struct pci_device *dev, struct pci_msix *msix);
+int pci_msix_allocate_vector(void);
+void pci_msix_set_entry(struct pci_msix *msix, int entry, int vector, unsigned apic_id);
+void pci_msix_enable(struct pci_msix *msix, bool enable);
 #endif
 #endif
@@ -0,0 +1,297 @@
+#ifndef __SEA_NET_TCP_H
+#define __SEA_NET_TCP_H
+
+#include <sea/types.h>
+#include <sea/mutex.h>
+#include <sea/lib/hash.h>
+#include <sea/lib/linkedlist.h>
+#include <sea/tm/blocking.h>
+#include <sea/tm/ticker.h>
+#include <sea/tm/timing.h>
+#include <sea/net/packet.h>
+#include <sea/net/interface.h>
+#include <sea/fs/socket.h>
+#include <sea/asm/system.h>
+#include <stdatomic.h>
+
+struct tcp_header {
+	uint16_t src_port;
+	uint16_t dest_port;
+	uint32_t seq;
+	uint32_t ack;
+#ifdef LITTLE_ENDIAN
+	uint8_t reserved : 4;
+	uint8_t offset : 4;
+#else
+	uint8_t offset : 4;
+	uint8_t reserved : 4;
+#endif
+	uint8_t flags;
+	uint16_t window;
+	uint16_t checksum;
+	uint16_t urgent;
+	uint8_t options[];
+} __attribute__ ((packed));
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_URG 0x20
+
+#define TCPOPT_EOL            0
+#define TCPOPT_NOP            1
+#define TCPOPT_MSS            2
+#define TCPOPT_SACK_PERMITTED 4
+#define TCPOPT_SACK           5
+
+/* socket options, at level PROTOCOL_TCP */
+#define TCP_NODELAY 1
+
+enum {
+	TCP_CLOSED,
+	TCP_LISTEN,
+	TCP_SYN_SENT,
+	TCP_SYN_RECEIVED,
+	TCP_ESTABLISHED,
+	TCP_FIN_WAIT_1,
+	TCP_FIN_WAIT_2,
+	TCP_CLOSE_WAIT,
+	TCP_CLOSING,
+	TCP_LAST_ACK,
+	TCP_TIME_WAIT,
+};
+
+/* comparisons in sequence space, which wraps */
+#define SEQ_LT(a,b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a,b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a,b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a,b) ((int32_t)((a) - (b)) >= 0)
+
+#define TCP_DEFAULT_MSS  536  /* if the peer doesn't say (RFC 1122) */
+#define TCP_ETHERNET_MSS 1460
+/* leave room for the link, ip and tcp headers, and options */
+#define TCP_MAX_MSS      (MAX_PACKET_SIZE - 128)
+#define TCP_SEGMENT_SIZE (TCP_MAX_MSS + 60)
+
+#define TCP_BUFFER_SIZE  0x10000
+#define TCP_MAX_WINDOW   0xFFFF /* no window scaling */
+#define TCP_MAX_CWND     (TCP_MAX_WINDOW * 4)
+#define TCP_MAX_OOO      64     /* out-of-order segments held per connection */
+#define TCP_MAX_SACK_BLOCKS 4   /* per segment, both ways */
+#define TCP_SCOREBOARD_SIZE 16
+
+#define TCP_RTO_INITIAL  ONE_SECOND
+#define TCP_RTO_MIN      (200 * ONE_MILLISECOND)
+#define TCP_RTO_MAX      (60 * ONE_SECOND)
+#define TCP_DELACK_TIME  (40 * ONE_MILLISECOND)
+#define TCP_MSL          (30 * ONE_SECOND)
+#define TCP_FIN_WAIT_2_TIME (60 * ONE_SECOND) /* for connections whose socket is gone */
+#define TCP_SYN_RETRIES  6
+#define TCP_RETRIES      15
+#define TCP_DUPACK_THRESHOLD 3
+
+#define TCB_SACK_OK      0x1   /* both sides agreed to SACK */
+#define TCB_FIN_QUEUED   0x2   /* send a FIN after the send buffer drains */
+#define TCB_FIN_SENT     0x4   /* snd_nxt is past our FIN */
+#define TCB_FIN_RECEIVED 0x8
+#define TCB_RECOVERY     0x10  /* in fast recovery */
+#define TCB_ACK_NOW      0x20
+#define TCB_RTT_TIMING   0x40
+#define TCB_PORT_BOUND   0x80  /* the socket holds a port in the transport layer */
+#define TCB_ACCEPTABLE   0x100 /* established, and waiting for accept */
+
+struct tcp_ring {
+	uint8_t *data;
+	size_t size, start, count;
+};
+
+struct tcp_sack_block {
+	uint32_t start, end;
+};
+
+/* a segment that arrived past rcv_nxt, waiting for the hole in front of it */
+struct tcp_segment {
+	uint32_t seq;
+	size_t length;
+	bool fin;
+	struct net_packet *packet;
+	uint8_t *data;
+	struct linkedentry entry;
+};
+
+/* what we pulled out of an incoming segment, in host byte order */
+struct tcp_input {
+	uint32_t seq, ack;
+	uint16_t window;
+	uint8_t flags;
+	uint8_t *data;
+	size_t length;
+	uint16_t mss; /* 0 if there was no MSS option */
+	bool sack_permitted;
+	int nr_sacks;
+	struct tcp_sack_block sacks[TCP_MAX_SACK_BLOCKS];
+};
+
+/* addresses and ports are in network byte order. This is the key for the
+ * connection tables, so it must not have padding. */
+struct tcp_endpoints {
+	uint32_t laddr, raddr;
+	uint16_t lport, rport;
+} __attribute__ ((packed));
+
+struct tcb;
+
+struct tcp_congestion_ops {
+	const char *name;
+	void (*init)(struct tcb *);
+	/* new data was acked outside of recovery */
+	void (*ack)(struct tcb *, uint32_t acked);
+	/* a loss was detected; return the new ssthresh */
+	uint32_t (*ssthresh)(struct tcb *);
+};
+
+struct tcp_cubic {
+	uint32_t w_max;  /* cwnd before the last reduction */
+	uint32_t w_est;  /* what reno would have by now */
+	uint64_t acc;
+	time_t epoch;    /* start of this growth period, 0 if not started */
+	time_t k;        /* time from the epoch to reach w_max, in ms */
+};
+
+struct tcb {
+	struct mutex lock;
+	_Atomic int refs;
+	int state;
+	int flags;
+	int error;
+	struct tcp_endpoints ends;
+	struct hash *table;
+	struct hashelem hash_elem;
+	struct socket *sock;
+	/* readers, writers, connect and accept all wait here */
+	struct blocklist wait;
+	/* where our segments go */
+	struct route_cache route_cache;
+
+	/* listening. The children list, parent and accept_ready are protected by tcp_lock */
+	struct tcb *parent;
+	struct linkedentry child_entry;
+	struct linkedlist children;
+	_Atomic int accept_ready;
+	int backlog, nr_children;
+
+	/* sending */
+	uint32_t iss, snd_una, snd_nxt, snd_max, snd_wnd, snd_wl1, snd_wl2, fin_seq;
+	uint16_t mss, our_mss;
+	struct tcp_ring sndbuf;
+	uint8_t *segbuf;
+
+	/* receiving */
+	uint32_t irs, rcv_nxt, rcv_adv;
+	struct tcp_ring rcvbuf;
+	struct linkedlist ooo;
+	uint32_t ooo_last; /* the most recent out-of-order segment, to SACK first */
+	int delayed;       /* segments not yet acked */
+
+	/* congestion control */
+	struct tcp_congestion_ops *cc;
+	uint32_t cwnd, ssthresh, recover, rexmit_nxt, ca_acc;
+	int dupacks;
+	struct tcp_sack_block sacked[TCP_SCOREBOARD_SIZE];
+	int nr_sacked;
+	union {
+		struct tcp_cubic cubic;
+	} ccdata;
+
+	/* round trip estimation (RFC 6298) */
+	time_t srtt, rttvar, rto, rtt_start;
+	uint32_t rtt_seq;
+	int retries;
+
+	/* deadlines, in microseconds since boot. 0 when not set. */
+	time_t rto_at, delack_at, timewait_at;
+	struct async_call timer;
+	struct ticker * _Atomic timer_ticker;
+	time_t timer_at;
+};
+
+static inline void tcp_tcb_get(struct tcb *tcb)
+{
+	atomic_fetch_add(&tcb->refs, 1);
+}
+
+static inline size_t tcp_ring_space(struct tcp_ring *ring)
+{
+	return ring->size - ring->count;
+}
+
+extern struct mutex tcp_lock;
+extern struct tcp_congestion_ops *tcp_default_cc;
+extern struct tcp_congestion_ops tcp_newreno, tcp_cubic;
+
+/* tcp.c */
+struct tcb *tcp_tcb_create(void);
+void tcp_tcb_put(struct tcb *tcb);
+void tcp_tcb_setup(struct tcb *tcb, struct net_dev *nd);
+void tcp_set_mss(struct tcb *tcb, uint16_t mss);
+struct tcb *tcp_lookup(struct tcp_endpoints *ends);
+struct tcb *tcp_lookup_listener(uint32_t addr, uint16_t port);
+int tcp_hash_insert(struct tcb *tcb);
+void tcp_close(struct tcb *tcb);
+void tcp_established(struct tcb *tcb);
+uint32_t tcp_new_iss(struct tcp_endpoints *ends);
+
+/* input.c */
+int tcp_verify(struct net_packet *np, void *payload, size_t len);
+void tcp_inject_port(struct net_packet *np, void *payload, size_t len,
+		struct sockaddr *src, struct sockaddr *dest);
+int tcp_recv_packet(struct socket *sock, struct sockaddr *src, struct net_packet *np,
+		void *payload, size_t len);
+
+/* output.c */
+uint16_t tcp_checksum(uint32_t src, uint32_t dest, void *segment, size_t len);
+uint32_t tcp_receive_window(struct tcb *tcb);
+void tcp_output(struct tcb *tcb);
+void tcp_send_syn(struct tcb *tcb);
+void tcp_send_ack(struct tcb *tcb);
+void tcp_send_reset(struct tcb *tcb);
+void tcp_send_probe(struct tcb *tcb);
+void tcp_retransmit(struct tcb *tcb, uint32_t seq);
+void tcp_reset_reply(struct tcp_endpoints *ends, struct tcp_input *in);
+void tcp_window_update(struct tcb *tcb);
+
+/* timer.c */
+void tcp_rtt_sample(struct tcb *tcb, time_t rtt);
+void tcp_timer_init(struct tcb *tcb);
+void tcp_timer_update(struct tcb *tcb);
+void tcp_timer_cancel(struct tcb *tcb);
+int tcp_timers_init(void);
+void tcp_timers_exit(void);
+
+/* congestion.c */
+void tcp_slow_start(struct tcb *tcb, uint32_t acked);
+struct tcp_congestion_ops *tcp_congestion_find(const char *name);
+int kerfs_tcp_congestion(int direction, void *param, size_t size,
+		size_t offset, size_t length, unsigned char *buf);
+
+/* buffer.c */
+void tcp_ring_create(struct tcp_ring *ring, size_t size);
+void tcp_ring_destroy(struct tcp_ring *ring);
+size_t tcp_ring_write(struct tcp_ring *ring, const void *buf, size_t len);
+void tcp_ring_peek(struct tcp_ring *ring, size_t offset, void *buf, size_t len);
+void tcp_ring_consume(struct tcp_ring *ring, size_t len);
+void tcp_ooo_insert(struct tcb *tcb, struct net_packet *np, uint8_t *data,
+		uint32_t seq, size_t len, bool fin);
+bool tcp_ooo_drain(struct tcb *tcb);
+void tcp_ooo_clear(struct tcb *tcb);
+int tcp_ooo_sack_blocks(struct tcb *tcb, struct tcp_sack_block *blocks, int max);
+void tcp_sack_update(struct tcb *tcb, struct tcp_sack_block *blocks, int count);
+void tcp_sack_advance(struct tcb *tcb);
+void tcp_sack_clear(struct tcb *tcb);
+bool tcp_sack_next_hole(struct tcb *tcb, uint32_t *seq, uint32_t *end);
+uint32_t tcp_sack_pipe(struct tcb *tcb);
+
+#endif
+
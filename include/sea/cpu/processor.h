@@ -34,6 +34,7 @@ struct cpu {
 	struct ticker ticker;
 	_Atomic int preempt_disable;
 	struct arch_cpu arch_cpu_data;
+	struct pmm_cpu_cache pmm_cache;
 };
 
 void cpu_smp_task_idle(struct cpu *me);
@@ -21,21 +21,79 @@ struct ioreq {
 	int flags;
 	struct blockdev *bd;
 	struct blocklist blocklist;
+	/* for direct I/O, the memory to transfer to or from, in place of the
+	 * block cache. Reachable from any thread, and never merged. */
+	uint8_t *buffer;
+
+	/* elevator state. Queued requests for adjacent blocks get merged into
+	 * groups, and the first request of a group describes the whole group
+	 * (start is a device block, with the partition offset applied). */
+	uint64_t start;
+	size_t length;
+	time_t deadline;
+	struct ioreq *merged;
+	struct linkedentry sort_entry, fifo_entry;
+	/* chunks of the group still being transferred, on devices that queue */
+	size_t outstanding;
 };
 
 #define IOREQ_COMPLETE 1
 #define IOREQ_FAILED   2
 
+/* an I/O scheduler. The elevator thread is the only one that calls these, so
+ * schedulers don't need to do any locking. add may merge the request into one
+ * that's already queued (see elevator_try_merge), and dispatch removes and
+ * returns the next group to issue, or NULL if there's nothing queued. */
+struct elevator_ops {
+	const char *name;
+	void *(*init)(void);
+	void (*destroy)(void *data);
+	void (*add)(void *data, struct ioreq *req);
+	struct ioreq *(*dispatch)(void *data);
+};
+
+/* a transfer on a device that can have several in flight at once (see
+ * blockctl.submit). The elevator fills in everything up to buffer, and the
+ * driver calls block_io_complete once the transfer is done. */
+struct blockio {
+	int direction;
+	uint64_t start; /* device block */
+	size_t count;
+	uint8_t *buffer;
+	_Atomic bool complete;
+	bool failed;
+
+	/* elevator state */
+	struct blockdev *bd;
+	struct ioreq *group;
+	uint64_t block;
+	addr_t pages; /* 0 for direct I/O */
+	struct linkedentry entry;
+};
+
+void block_io_complete(struct blockio *io, bool ok);
+
+/* merged groups never grow past this many blocks */
+#define ELEVATOR_MAX_BLOCKS 64
+
+extern struct elevator_ops elevator_noop, elevator_deadline;
+bool elevator_try_merge(struct ioreq *group, struct ioreq *req);
+
 struct buffer {
 	struct blockdev *bd;
 	int refs;
 	int flags;
 	uint64_t __block, trueblock;
+	time_t dirty_time;
+	/* the data lives in a physical page, which is shared with other buffers
+	 * when blocks are smaller than a page. Each buffer holds a reference to
+	 * its page, and data points at its part of it through the physical map. */
+	addr_t page;
+	unsigned char *data;
 	struct linkedentry lnode;
 	struct linkedentry dlistnode;
-	struct queue_item qi;
+	struct linkedentry clock_entry;
 	struct hashelem hash_elem;
-	char data[];
 };
 
 #define buffer_block(b) (b->__block + b->bd->partbegin)
@@ -44,23 +102,36 @@ struct buffer {
 #define BUFFER_DLIST 2
 #define BUFFER_WRITEPENDING 4
 #define BUFFER_LOCKED       8
+#define BUFFER_REFERENCED   16
 
 void block_cache_init(void);
 void block_buffer_init(void);
 int buffer_sync_all_dirty(void);
+struct blockctl;
+void block_cache_register(struct blockctl *ctl);
+void block_io_notify(struct blockctl *ctl);
+size_t dm_block_cache_reclaim(size_t nr);
+size_t dm_block_cache_reclaim_device(struct blockctl *ctl, size_t nr);
+void block_writeback_init(struct blockctl *ctl);
+void block_writeback_throttle(struct blockctl *ctl);
+void block_writeback_range(struct blockctl *ctl, uint64_t start, size_t count);
 int block_elevator_main(struct kthread *kt, void *arg);
 bool block_elevator_add_request(void *req);
 
 struct buffer *dm_block_cache_get(struct blockdev *bd, uint64_t block);
 int dm_block_cache_insert(struct blockdev *bd, uint64_t block, struct buffer *, int flags);
+void dm_block_cache_invalidate(struct blockdev *bd, uint64_t block, size_t count);
+ssize_t block_direct_io(int rw, struct inode *node, off_t pos, uint8_t *buf, size_t count);
 
 int block_cache_request(struct ioreq *req, off_t initial_offset, size_t total_bytecount, unsigned char *buffer);
 
 struct buffer *buffer_create(struct blockdev *bd, uint64_t block, int flags, unsigned char *data);
+struct buffer *buffer_create_page(struct blockdev *bd, uint64_t block, int flags, addr_t page, size_t offset);
+addr_t buffer_allocate_pages(size_t *length);
+void buffer_release_pages(addr_t pages, size_t length);
 void buffer_put(struct buffer *buf);
 void buffer_inc_refcount(struct buffer *buf);
 struct buffer *block_cache_get_first_buffer(struct ioreq *req);
-int block_cache_get_bufferlist(struct linkedlist *blist, struct ioreq *req);
 struct ioreq *ioreq_create(struct blockdev *bd, int, uint64_t start, size_t count);
 void ioreq_put(struct ioreq *req);
 #endif
@@ -6,6 +6,24 @@
 #include <sea/mutex.h>
 #include <sea/lib/hash.h>
 #include <sea/lib/mpscq.h>
+#include <sea/lib/linkedlist.h>
+#include <sea/tm/blocking.h>
+
+struct blockio;
+
+/* the buffer cache of each device is split into shards by block number.
+ * Each shard has its own lock, hash and CLOCK ring, so lookups of different
+ * blocks rarely contend, and reclaim only ever holds one shard at a time. */
+#define BCACHE_SHARDS 16
+#define BCACHE_SHARD_LENGTH 0x400
+#define BCACHE_RECLAIM_BATCH 32
+
+struct bcache_shard {
+	struct mutex lock;
+	struct hash cache;
+	struct linkedlist clock;
+	struct linkedentry *hand;
+};
 
 struct blockctl {
 	size_t blocksize;
@@ -13,9 +31,44 @@ struct blockctl {
 	int (*select)(struct inode *node, int rw);
 	int (*ioctl)(struct inode *node, int cmd, long arg);
 	struct kthread elevator;
-	struct mutex cachelock;
-	struct hash cache;
+	/* optional, for devices that can have several transfers in flight (like
+	 * NCQ disks). submit starts a transfer and returns without waiting, and
+	 * poll checks the device for transfers that have finished. At most
+	 * queue_depth are submitted at once. The driver calls block_io_notify
+	 * (from its interrupt handler, say) when it's worth polling again, and
+	 * the elevator sleeps on io_wait until then. */
+	int (*submit)(struct inode *node, struct blockio *io);
+	int (*poll)(struct inode *node);
+	int queue_depth;
+	struct linkedlist inflight;
+	struct blocklist io_wait;
+	_Atomic bool io_event;
+	struct bcache_shard shards[BCACHE_SHARDS];
+	_Atomic size_t cache_count;
+	_Atomic unsigned int reclaim_shard;
+	struct linkedentry cache_node;
 	struct mpscq queue;
+
+	/* I/O scheduling. sched_next is set to switch schedulers, and the
+	 * elevator thread picks it up. */
+	struct elevator_ops *sched, *sched_next;
+	void *sched_data;
+	_Atomic size_t el_queued, el_merged, el_dispatched;
+	_Atomic size_t direct_blocks;
+
+	/* writeback of dirty buffers */
+	struct kthread writeback;
+	struct mutex dirtylock, writeback_lock;
+	struct linkedlist dirty_list;
+	struct blocklist writeback_wait, throttle_wait;
+	_Atomic size_t dirty_count;
+	_Atomic size_t wb_requests, wb_blocks, wb_throttled;
+	struct linkedentry wb_node;
+
+	/* the page that new buffers are being packed into */
+	struct mutex carve_lock;
+	addr_t carve_page;
+	size_t carve_offset;
 };
 
 struct blockdev {
@@ -9,12 +9,20 @@
 #include <sea/tm/process.h>
 #include <sea/lib/hash.h>
 
+/* readahead state for an open file. All counts are in pages. */
+struct file_readahead {
+	size_t start, size;  /* the window most recently read ahead */
+	size_t async_start;  /* reading this page starts the next window */
+	off_t next;          /* where a sequential read would start */
+};
+
 struct file {
 	_Atomic int count;
 	int flags;
 	off_t pos;
 	struct inode * inode;
 	struct dirent *dirent;
+	struct file_readahead ra;
 };
 
 struct filedes {
@@ -41,6 +49,8 @@ ssize_t fs_file_read(struct file *file, uint8_t *buffer, size_t length);
 ssize_t fs_file_pwrite(struct file *file, off_t offset, uint8_t *buffer, size_t length);
 ssize_t fs_file_write(struct file *file, uint8_t *buffer, size_t length);
 struct file *fs_file_open(const char *name, int flags, mode_t mode, int *error);
+void fs_file_readahead(struct file *file, off_t offset, size_t length);
+void fs_file_readahead_cancel(struct file *file);
 
 int sys_write(int fp, off_t pos, unsigned char *buf, size_t count);
 int sys_sync();
@@ -33,6 +33,9 @@ struct filesystem_inode_callbacks {
 	ssize_t (*write)(struct filesystem *fs, struct inode *node,
 			size_t offset, size_t length, const unsigned char *buffer);
 	int (*select)(struct filesystem *, struct inode *, int rw);
+	/* O_DIRECT: move data straight between buffer and the disk */
+	ssize_t (*direct_io)(struct filesystem *fs, struct inode *node, int rw,
+			size_t offset, size_t length, unsigned char *buffer);
 };
 
 struct fsdriver;
@@ -71,6 +74,8 @@ void fs_unmount_all();
 
 ssize_t fs_callback_inode_read(struct inode *node, size_t off, size_t len, unsigned char *buf);
 ssize_t fs_callback_inode_write(struct inode *node, size_t off, size_t len, const unsigned char *buf);
+ssize_t fs_callback_inode_direct_io(struct inode *node, int rw, size_t off, size_t len, unsigned char *buf);
+bool fs_callback_inode_has_direct_io(struct inode *node);
 int fs_callback_inode_pull(struct inode *node);
 int fs_callback_inode_push(struct inode *node);
 int fs_callback_inode_link(struct inode *node, struct inode *target, const char *name, size_t namelen);
@@ -9,6 +9,7 @@
 #include <sea/fs/stat.h>
 #include <sea/lib/hash.h>
 #include <sea/lib/queue.h>
+#include <sea/lib/radix.h>
 #include <sea/fs/fs.h>
 #include <stdbool.h>
 #define MAY_EXEC      0100
@@ -78,8 +79,10 @@ struct inode {
 	uint32_t key[2];
 	struct hashelem hash_elem;
 
-	/* mmap stuff */
-	struct hash physicals;
+	/* page cache and mmap stuff */
+	struct radix_tree physicals;
+	struct linkedentry pcache_item;
+	_Atomic int pcache_reclaiming;
 	struct mutex mappings_lock;
 	size_t mapped_pages_count, mapped_entries_count;
 };
@@ -133,17 +136,28 @@ void fs_inode_init_kdev(struct inode *node);
 
 ssize_t fs_inode_write(struct inode *node, size_t off, size_t count, const unsigned char *buf);
 ssize_t fs_inode_read(struct inode *node, size_t off, size_t count, unsigned char *buf);
+ssize_t fs_inode_direct_io(int rw, struct inode *node, size_t off, size_t count, unsigned char *buf);
 
 #define FS_INODE_POPULATE 1
 addr_t fs_inode_map_shared_physical_page(struct inode *node, addr_t virt, 
 		size_t offset, int flags, int attrib);
 addr_t fs_inode_map_private_physical_page(struct inode *node, addr_t virt,
 		size_t offset, int attrib, size_t);
+size_t fs_inode_map_resident_pages(struct inode *node, addr_t virt,
+		size_t offset, size_t npages, int attrib);
 void fs_inode_map_region(struct inode *node, size_t offset, size_t length);
 void fs_inode_sync_physical_page(struct inode *node, addr_t virt, size_t offset, size_t);
 void fs_inode_unmap_region(struct inode *node, addr_t virt, size_t offset, size_t length);
 void fs_inode_destroy_physicals(struct inode *node);
 void fs_inode_sync_region(struct inode *node, addr_t virt, size_t offset, size_t length);
-void fs_inode_pcache_invalidate(struct inode *node, size_t offset, size_t length);
+void fs_inode_pcache_init(void);
+bool fs_inode_pcache_enabled(struct inode *node);
+size_t fs_inode_pcache_readahead(struct inode *node, size_t start, size_t npages, _Atomic bool *cancel);
+ssize_t fs_inode_pcache_read(struct inode *node, size_t off, size_t count, unsigned char *buf);
+ssize_t fs_inode_pcache_write(struct inode *node, size_t off, size_t count, const unsigned char *buf);
+void fs_inode_pcache_writeback(struct inode *node);
+void fs_inode_pcache_truncate(struct inode *node, size_t length);
+void fs_inode_pcache_invalidate(struct inode *node, size_t off, size_t count);
+void fs_inode_pcache_update(struct inode *node, size_t off, size_t count, const unsigned char *buf);
 
 #endif
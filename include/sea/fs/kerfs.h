@@ -18,6 +18,7 @@ int kerfs_int_report(int, void *, size_t, size_t, size_t, unsigned char *);
 int kerfs_kmalloc_report(int, void *, size_t, size_t, size_t, unsigned char *);
 int kerfs_pmm_report(int, void *, size_t, size_t, size_t, unsigned char *);
 int kerfs_icache_report(int, void *, size_t, size_t, size_t, unsigned char *);
+int kerfs_pcache_report(int, void *, size_t, size_t, size_t, unsigned char *);
 int kerfs_module_report(int, void *, size_t, size_t, size_t, unsigned char *);
 int kerfs_route_report(int, void *, size_t, size_t, size_t, unsigned char *);
 int kerfs_mount_report(int, void *, size_t, size_t, size_t, unsigned char *);
@@ -25,6 +26,12 @@ int kerfs_pfault_report(int direction, void *param, size_t size, size_t offset,
 int kerfs_syslog(int direction, void *param, size_t size, size_t offset, size_t length, unsigned char *buf);
 int kerfs_block_cache_report(int direction, void *param, size_t size,
 		size_t offset, size_t length, unsigned char *buf);
+int kerfs_elevator_param(int direction, void *param, size_t size,
+		size_t offset, size_t length, unsigned char *buf);
+int kerfs_valloc_report(int direction, void *param, size_t size, size_t offset, size_t length, unsigned char *buf);
+int kerfs_reclaim_report(int direction, void *param, size_t size, size_t offset, size_t length, unsigned char *buf);
+int kerfs_netdev_rx_report(int direction, void *param, size_t size,
+		size_t offset, size_t length, unsigned char *buf);
 int kerfs_frames_report(int direction, void *param, size_t size, size_t offset, size_t length, unsigned char *buf);
 
 int kerfs_rw_string(int direction, void *param, size_t sz,
@@ -6,6 +6,7 @@
 #include <sea/fs/file.h>
 #include <sea/lib/linkedlist.h>
 #include <sea/lib/queue.h>
+#include <sea/net/route.h>
 
 typedef unsigned short sa_family_t;
 typedef unsigned int socklen_t;
@@ -151,6 +152,8 @@ struct socket {
 	struct queue rec_data_queue;
 	struct sockaddr bindaddr;
 	struct hashelem hash_elem;
+	struct route_cache route_cache;
+	void *protdata;
 };
 
 struct socket_fromto_info {
@@ -181,5 +184,6 @@ int sys_recvfrom(int, struct socket_fromto_info *m);
 int sys_sendto(struct socket_fromto_info *m);
 int socket_select(struct file *file, int rw);
 void socket_bind(struct socket *sock, const struct sockaddr *address, socklen_t len);
+struct socket *socket_create(int *errcode, int *fd);
 #endif
 
@@ -0,0 +1,38 @@
+#ifndef __SEA_LIB_INTERVALTREE_H
+#define __SEA_LIB_INTERVALTREE_H
+
+#include <sea/types.h>
+#include <stdbool.h>
+
+/* an augmented red-black tree of half-open intervals [start, end), keyed by
+ * start. Each node also records the largest end in its subtree, so that
+ * finding an interval containing a point is O(log n) even if intervals
+ * overlap. The tree does no locking of its own. */
+struct interval_node {
+	struct interval_node *parent, *left, *right;
+	bool red;
+	addr_t start, end;
+	addr_t max_end;
+	void *obj;
+};
+
+struct interval_tree {
+	struct interval_node *root;
+	size_t count;
+};
+
+#define interval_node_obj(node) ((node) ? (node)->obj : NULL)
+
+void interval_tree_create(struct interval_tree *tree);
+void interval_tree_insert(struct interval_tree *tree, struct interval_node *node,
+		addr_t start, addr_t end, void *obj);
+void interval_tree_remove(struct interval_tree *tree, struct interval_node *node);
+struct interval_node *interval_tree_find(struct interval_tree *tree, addr_t point);
+struct interval_node *interval_tree_first_overlap(struct interval_tree *tree,
+		addr_t start, addr_t end);
+bool interval_tree_find_gap(struct interval_tree *tree, addr_t lo, addr_t hi,
+		size_t length, addr_t *result);
+struct interval_node *interval_tree_first(struct interval_tree *tree);
+struct interval_node *interval_tree_next(struct interval_node *node);
+
+#endif
@@ -26,7 +26,7 @@ void *queue_peek(struct queue *q);
 void queue_destroy(struct queue *q);
 struct queue_item *queue_dequeue_item(struct queue *q);
 
-#define queue_count(q) q->count
+#define queue_count(q) ((q)->count)
 
 #endif
 
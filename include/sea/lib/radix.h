@@ -0,0 +1,35 @@
+#ifndef __SEA_LIB_RADIX_H
+#define __SEA_LIB_RADIX_H
+
+#include <sea/types.h>
+
+/* a radix tree mapping unsigned long indexes to pointers. Each level
+ * resolves RADIX_TREE_SHIFT bits of the index, and the tree only grows
+ * as tall as the largest index stored in it needs, so dense small
+ * indexes (like page numbers in a file) stay shallow. The tree does no
+ * locking of its own. */
+#define RADIX_TREE_SHIFT 6
+#define RADIX_TREE_SLOTS (1 << RADIX_TREE_SHIFT)
+
+struct radix_node {
+	void *slots[RADIX_TREE_SLOTS];
+	unsigned int count;
+};
+
+struct radix_tree {
+	struct radix_node *root;
+	unsigned int height;
+	size_t count;
+};
+
+static inline size_t radix_tree_count(struct radix_tree *tree) { return tree->count; }
+
+void radix_tree_create(struct radix_tree *tree);
+void radix_tree_destroy(struct radix_tree *tree);
+int radix_tree_insert(struct radix_tree *tree, unsigned long index, void *item);
+void *radix_tree_lookup(struct radix_tree *tree, unsigned long index);
+void *radix_tree_delete(struct radix_tree *tree, unsigned long index);
+size_t radix_tree_gang_lookup(struct radix_tree *tree, unsigned long first,
+		void **results, size_t max);
+
+#endif
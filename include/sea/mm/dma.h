@@ -12,5 +12,17 @@ struct dma_region {
 int mm_allocate_dma_buffer(struct dma_region *);
 int mm_free_dma_buffer(struct dma_region *);
 
+/* a buffer in the current process's memory, pinned and mapped into kernel
+ * memory so that it can be reached from any thread */
+struct dma_user_region {
+	addr_t v; /* kernel address of the start of the buffer */
+	addr_t start;
+	size_t npages;
+	addr_t *pins; /* the frame each page holds a reference on */
+};
+
+int mm_map_user_buffer(struct dma_user_region *d, addr_t buffer, size_t length, bool write);
+void mm_unmap_user_buffer(struct dma_user_region *d);
+
 #endif
 
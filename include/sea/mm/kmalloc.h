@@ -6,6 +6,7 @@
 void slab_kfree(void *data);
 void *slab_kmalloc(size_t size);
 void slab_init(addr_t start, addr_t end);
+void slab_reclaim_init(void);
 
 #define kmalloc(a) slab_kmalloc(a)
 #define kfree(a) slab_kfree(a)
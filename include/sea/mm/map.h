@@ -3,7 +3,7 @@
 
 #include <sea/types.h>
 #include <sea/fs/inode.h>
-#include <sea/lib/linkedlist.h>
+#include <sea/lib/intervaltree.h>
 #include <sea/mm/valloc.h>
 
 struct memmap {
@@ -11,8 +11,12 @@ struct memmap {
 	size_t length, offset;
 	struct inode *node;
 	int flags, prot;
-	struct linkedentry entry;
-	struct valloc_region vr;
+	struct interval_node node_entry;
+};
+
+struct mm_fault_stats {
+	size_t thp_mapped, thp_fallback, thp_split;
+	size_t around_pages, populated_pages;
 };
 
 struct __mmap_args {
@@ -44,6 +48,7 @@ struct __mmap_args {
 #define MAP_EXECUTABLE  0x1000
 #define MAP_LOCKED      0x0080
 #define MAP_NORESERVE   0x0040
+#define MAP_POPULATE    0x8000
 /*
  *  * Failed flag from 'mmap'.
  *   */
@@ -68,6 +73,8 @@ int mm_mapping_munmap(addr_t start, size_t length);
 int mm_mapping_msync(addr_t start, size_t length, int flags);
 void mm_destroy_all_mappings(struct process *t);
 void mm_mappings_clone(struct process *child);
+void mm_mapping_get_fault_stats(struct mm_fault_stats *stats);
+void mm_mapping_populate(addr_t start, size_t length);
 
 int sys_msync(void *address, size_t length, int flags);
 int sys_munmap(void *addr, size_t length);
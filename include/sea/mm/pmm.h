@@ -2,6 +2,7 @@
 #define __SEA_MM_PMM_H
 #include <sea/mutex.h>
 #include <sea/types.h>
+#include <sea/lib/stack.h>
 #include <stdbool.h>
 
 struct mm_physical_region {
@@ -10,9 +11,30 @@ struct mm_physical_region {
 	addr_t alignment;
 };
 
+/* per-CPU caches of small buddy blocks (orders 0 through PMM_PCP_MAX_ORDER).
+ * Blocks sitting in these lists are still marked allocated in the buddy
+ * bitmaps; they are handed out and taken back without touching the global
+ * buddy lock, and are moved to and from the buddy freelists in batches. */
+#define PMM_PCP_MAX_ORDER 3
+#define PMM_PCP_BATCH_MAX 16
+
+struct pmm_pcp_list {
+	struct stack list;
+	size_t high, low, batch;
+};
+
+struct pmm_cpu_cache {
+	bool inited;
+	struct pmm_pcp_list lists[PMM_PCP_MAX_ORDER + 1];
+	size_t hits, misses, refills, drains;
+	unsigned long drain_gen;
+};
+
 void arch_mm_physical_memset(void *addr, int c, size_t length);
 addr_t mm_physical_allocate(size_t, bool);
+addr_t mm_physical_allocate_region(size_t length, bool clear, addr_t min, addr_t max);
 void mm_physical_deallocate(addr_t address);
+void mm_physical_split(addr_t address, size_t length);
 void mm_physical_memcpy(void *dest, void *src, size_t length, int);
 void mm_physical_increment_count(addr_t page);
 int mm_physical_decrement_count(addr_t page);
@@ -21,6 +43,9 @@ int mm_physical_get_usage(void);
 
 extern unsigned long pm_num_pages;
 
+/* upper bound for devices that can only address 32 bits */
+#define PMM_DMA32_LIMIT 0x100000000ull
+
 #define PHYS_MEMCPY_MODE_DEST 0
 #define PHYS_MEMCPY_MODE_SRC  1
 #define PHYS_MEMCPY_MODE_BOTH 2
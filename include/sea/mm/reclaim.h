@@ -3,16 +3,33 @@
 
 #include <sea/types.h>
 #include <sea/lib/linkedlist.h>
+#include <stdbool.h>
+
+/* a reclaimer (shrinker) is a cache that can give memory back under pressure.
+ * count returns how many objects could currently be freed, and scan tries to
+ * free up to nr of them, returning the number of bytes actually freed. seeks
+ * is the relative cost of recreating an object (2 is "normal"); caches that
+ * are expensive to refill are scanned less. */
 struct reclaimer {
-	size_t size;
-	size_t (*fn)(void);
+	const char *name;
+	size_t (*count)(void);
+	size_t (*scan)(size_t nr);
+	size_t object_size;
+	int seeks;
+	_Atomic size_t scanned, freed;
 	struct linkedentry node;
 };
 
+#define RECLAIM_DEFAULT_SEEKS 2
+/* each pass scans count >> priority objects from every reclaimer, starting
+ * at RECLAIM_PRIORITY_MAX and working toward 0 until enough is freed */
+#define RECLAIM_PRIORITY_MAX 12
+
 void mm_reclaim_init(void);
-void mm_reclaim_register(size_t (*fn)(void), size_t size);
+void mm_reclaim_register(struct reclaimer *rec);
 size_t mm_reclaim_size(size_t size);
 void mm_reclaim(void);
+bool mm_reclaim_under_pressure(void);
+void mm_pager_wakeup(void);
 
 #endif
-
@@ -16,13 +16,22 @@ struct valloc {
 	long npages; /* number of psize pages in this region */
 	addr_t start, end;
 	long nindex; /* number of index pages */
+	long nwords, nsum; /* number of bitmap words and summary words */
 	size_t psize; /* minimum allocation size, minimum PAGE_SIZE */
 	struct mutex lock;
 	int flags;
 	/*at*/ long last;
+	size_t searches, search_words;
 	uint32_t magic;
 };
 
+struct valloc_stats {
+	long free_pages;
+	long free_extents;
+	long largest_extent;
+	size_t searches, search_words;
+};
+
 #define VALLOC_ALLOC        1
 struct valloc *valloc_create(struct valloc *va, addr_t start, addr_t end, size_t page_size,
 		int flags);
@@ -33,6 +42,8 @@ struct valloc_region *valloc_allocate(struct valloc *va, struct valloc_region *r
 void valloc_reserve(struct valloc *va, struct valloc_region *reg);
 void valloc_deallocate(struct valloc *va, struct valloc_region *reg);
 int valloc_count_used(struct valloc *va);
+void valloc_get_stats(struct valloc *va, struct valloc_stats *st);
+void valloc_report_register(struct valloc *va, const char *name);
 struct valloc_region *valloc_split_region(struct valloc *va, struct valloc_region *reg,
 		struct valloc_region *nr, size_t np);
 #endif
@@ -7,13 +7,55 @@
 #include <stdbool.h>
 #include <sea/spinlock.h>
 
+#if CONFIG_SMP
+#define VMM_CPUMASK_WORDS ((CONFIG_MAX_CPUS + 63) / 64)
+#endif
+
 struct vmm_context {
 	addr_t root_physical;
 	addr_t root_virtual;
 	struct spinlock lock;
 	uint32_t magic;
+#if CONFIG_SMP
+	/* CPUs that currently have this context loaded, and so may
+	 * hold TLB entries for its user addresses */
+	_Atomic uint64_t cpumask[VMM_CPUMASK_WORDS];
+#endif
+};
+
+#if CONFIG_SMP
+static inline void mm_context_set_cpu(struct vmm_context *ctx, unsigned cpu)
+{
+	uint64_t bit = 1ull << (cpu % 64);
+	if(!(atomic_load(&ctx->cpumask[cpu / 64]) & bit))
+		atomic_fetch_or(&ctx->cpumask[cpu / 64], bit);
+}
+
+static inline void mm_context_clear_cpu(struct vmm_context *ctx, unsigned cpu)
+{
+	atomic_fetch_and(&ctx->cpumask[cpu / 64], ~(1ull << (cpu % 64)));
+}
+
+static inline bool mm_context_test_cpu(struct vmm_context *ctx, unsigned cpu)
+{
+	return atomic_load(&ctx->cpumask[cpu / 64]) & (1ull << (cpu % 64));
+}
+#endif
+
+/* TLB invalidations caused by unmapping (or changing attributes) between
+ * mm_tlb_gather_begin and mm_tlb_gather_end are collected into one range
+ * per thread, and other CPUs are only interrupted once, at the end. Pages
+ * that were unmapped should not be freed until after the gather ends. */
+struct tlb_gather {
+	int depth;
+	struct vmm_context *ctx;
+	addr_t start, end;
 };
 
+void mm_tlb_gather_begin(void);
+void mm_tlb_gather_end(void);
+void mm_handle_tlb_ipi(void);
+
 #define MAP_ZERO    0x100000
 #define __ALL_ATTRS MAP_ZERO
 _Static_assert((__ALL_ATTRS & ATTRIB_MASK) == 0,
@@ -45,6 +87,9 @@ bool mm_context_virtual_getmap(struct vmm_context *ctx, addr_t address, addr_t *
 bool mm_context_virtual_changeattr(struct vmm_context *ctx, addr_t virtual, int flags, size_t length);
 bool mm_virtual_changeattr(addr_t virtual, int flags, size_t length);
 addr_t mm_context_virtual_unmap(struct vmm_context *ctx, addr_t address);
+bool mm_virtual_split(addr_t virtual);
+bool mm_context_virtual_split(struct vmm_context *ctx, addr_t virtual);
+bool mm_virtual_large_slot_free(addr_t virtual);
 bool mm_context_virtual_trymap(struct vmm_context *ctx, addr_t virtual, int flags, size_t length);
 bool mm_virtual_trymap(addr_t virtual, int flags, size_t length);
 
@@ -9,10 +9,15 @@ struct data_layer_protocol {
 	int flags;
 	void (*receive)(struct net_dev *, struct net_packet *);
 	void (*send)(struct net_dev *, struct net_packet *, sa_family_t, uint8_t hwdest[6], int payload_len);
+	/* work out which network protocol a received packet is for, and point its
+	 * network_header at the payload. Returns -1 if it isn't for anything we know.
+	 * Protocols that provide this have their packets handed up in batches. */
+	sa_family_t (*decode)(struct net_dev *, struct net_packet *);
 };
 
 void net_data_send(struct net_dev *nd, struct net_packet *packet, sa_family_t, uint8_t dest[6], int payload_len);
 void net_data_receive(struct net_dev *nd, struct net_packet *packet);
+void net_data_receive_batch(struct net_dev *nd, struct net_packet **packets, int count);
 struct data_layer_protocol *net_data_get_protocol(int hwtype);
 void net_data_unregister_protocol(int hwtype);
 void net_data_register_protocol(int hwtype, struct data_layer_protocol *p);
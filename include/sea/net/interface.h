@@ -4,6 +4,7 @@
 #include <sea/types.h>
 #include <sea/lib/linkedlist.h>
 #include <sea/tm/kthread.h>
+#include <sea/tm/blocking.h>
 #include <sea/fs/inode.h>
 #include <sea/fs/socket.h>
 #include <sea/sys/ioctls.h>
@@ -56,15 +57,36 @@
 
 #define IFNAMSIZ 16
 
+/* the most packets the receive thread asks a driver for in one poll, and the
+ * number of buckets in the rx batch size histogram: one for empty polls, one
+ * for each power of two below the budget, and one for full polls. */
+#define NET_RX_BUDGET       32
+#define NET_RX_HIST_BUCKETS 7
+#define NET_MAX_RX_QUEUES   8
+
+struct net_dev;
+
+/* each receive queue of a device has its own thread, which polls it and
+ * hands its packets up the stack. */
+struct net_rx_queue {
+	struct net_dev *nd;
+	int idx;
+	int polling; /* the thread owns the queue, and its interrupts are off */
+	size_t pending;
+	size_t polls, batch_hist[NET_RX_HIST_BUCKETS];
+	struct kthread thread;
+};
+
 struct net_dev {
 	char name[IFNAMSIZ];
 	struct inode *devnode;
 	int num;
 	int flags;
 	uint32_t state;
-	size_t rx_count, tx_count, rx_err_count, tx_err_count, rx_pending, rx_bytes, tx_bytes, collisions, brate;
+	size_t rx_count, tx_count, rx_err_count, tx_err_count, rx_bytes, tx_bytes, collisions, brate;
 	int dropped;
-	time_t rx_thread_lastwork;
+	int rx_queue_count;
+	struct net_rx_queue rx_queues[NET_MAX_RX_QUEUES];
 	/* these fields are specified by the driver at time of net_dev creation */
 	struct net_dev_calls *callbacks;
 	void *data; /* driver specific data */
@@ -89,31 +111,39 @@ struct net_dev {
 	int mtu;
 
 	struct linkedentry node;
-	struct kthread rec_thread;
 };
 
 struct net_packet;
 
 struct net_dev_calls {
-	/* poll shall return received packets from the device in the array packets, up to
-	 * the number specified by max. This call does not block, and will return no packets
-	 * if none are available, and can return less than max packets if only some are
-	 * available. 
+	/* poll shall fill in received packets from the given receive queue of the device
+	 * into the packets in the array packets, up to the number specified by budget. This
+	 * call does not block, and will return no packets if none are available, and can
+	 * return less than budget packets if only some are available. Returning fewer than
+	 * budget tells the networking system that the queue has been drained. Instead of
+	 * copying into a packet, the driver may swap one of its own into the array, and
+	 * keep the one that was there.
 	 */
-	int (*poll)(struct net_dev *, struct net_packet *packets, int max);
+	int (*poll)(struct net_dev *, int queue, struct net_packet **packets, int budget);
 	int (*send)(struct net_dev *, struct net_packet *packets, int count);
 	int (*get_mac)(struct net_dev *, uint8_t mac[6]);
 	int (*set_flags)(struct net_dev *, int);
 	int (*change_link)(struct net_dev *, uint32_t);
+	/* mask or unmask a receive queue's interrupts. Called from interrupt
+	 * context, so it must not block. If a packet is waiting when they're
+	 * unmasked, the device must still raise an interrupt for it. */
+	void (*rx_interrupts)(struct net_dev *, int queue, bool enable);
 };
 
-int net_callback_poll(struct net_dev *, struct net_packet *, int);
+int net_callback_poll(struct net_dev *, int queue, struct net_packet **, int);
+void net_callback_rx_interrupts(struct net_dev *nd, int queue, bool enable);
 int net_callback_change_link(struct net_dev *, uint32_t);
 int net_callback_set_flags(struct net_dev *, int);
 int net_callback_send(struct net_dev *nd, struct net_packet *packets, int count);
 int net_callback_get_mac(struct net_dev *nd, uint8_t mac[6]);
 
 struct net_dev *net_add_device(struct net_dev_calls *fn, void *);
+struct net_dev *net_add_device_mq(struct net_dev_calls *fn, void *, int rx_queues);
 int net_transmit_packet(struct net_dev *nd, struct net_packet *packets, int count);
 
 int net_iface_set_flags(struct net_dev *nd, int flags);
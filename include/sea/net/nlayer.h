@@ -10,11 +10,15 @@
 struct nlayer_protocol {
 	int flags;
 	void (*receive)(struct net_dev *, struct net_packet *, void *payload);
-	int  (*send)(void *, size_t len, struct sockaddr *, struct sockaddr *, int);
+	/* optional; packets arrive with network_header pointing at the payload */
+	void (*receive_batch)(struct net_dev *, struct net_packet **, int count);
+	/* the route cache, if the sender has one, saves a route lookup */
+	int  (*send)(void *, size_t len, struct sockaddr *, struct sockaddr *, int, struct route_cache *);
 };
 
 void net_nlayer_receive_from_dlayer(struct net_dev *nd, struct net_packet *packet, sa_family_t sa_family, void *payload);
-int net_nlayer_send_packet(void *payload, size_t len, struct sockaddr *dest, struct sockaddr *src, sa_family_t sa_family, int prot);
+void net_nlayer_receive_batch(struct net_dev *nd, struct net_packet **packets, int count, sa_family_t sa_family);
+int net_nlayer_send_packet(void *payload, size_t len, struct sockaddr *dest, struct sockaddr *src, sa_family_t sa_family, int prot, struct route_cache *rc);
 void net_nlayer_register_protocol(sa_family_t p, struct nlayer_protocol *np);
 void net_nlayer_unregister_protocol(sa_family_t p);
 
@@ -3,18 +3,41 @@
 
 #include <sea/types.h>
 #include <sea/net/interface.h>
+#include <sea/mm/vmm.h>
+#include <sea/lib/stack.h>
+#include <sea/kernel.h>
 
-#define MAX_PACKET_SIZE 0x1000
+/* A packet's linear part lives in a physical page. data is the start of the
+ * frame, and NP_HEADROOM is left in front of it when the packet is made, so
+ * that each layer on the way down can push its header without moving what's
+ * already there. More payload can hang off the packet in page fragments;
+ * length counts those too. */
+#define NP_BUFFER_SIZE  PAGE_SIZE
+#define NP_HEADROOM     128
+#define MAX_PACKET_SIZE (NP_BUFFER_SIZE - NP_HEADROOM)
+#define NP_MAX_FRAGS    16
+
+struct net_packet_frag {
+	addr_t page;
+	size_t offset, length;
+};
 
 struct net_packet {
-	unsigned char data[MAX_PACKET_SIZE];
+	addr_t page;
+	unsigned char *head;
+	unsigned char *data;
 	size_t length;
 	int flags;
 
+	size_t frag_length;
+	int nr_frags;
+	struct net_packet_frag frags[NP_MAX_FRAGS];
+
 	void *data_header;
 	void *network_header;
 
 	volatile int count;
+	struct stack_elem pool_elem;
 };
 
 #define NP_FLAG_ALLOC 1
@@ -28,12 +51,50 @@ struct net_packet {
 						   * to ensure that a packet stored on the stack doesn't have a reference
 						   * that goes out of scope */
 
+/* bytes of the frame in the linear part */
+static inline size_t net_packet_headlen(struct net_packet *np)
+{
+	return np->length - np->frag_length;
+}
+
+static inline size_t net_packet_headroom(struct net_packet *np)
+{
+	return np->data - np->head;
+}
+
+static inline size_t net_packet_tailroom(struct net_packet *np)
+{
+	return NP_BUFFER_SIZE - net_packet_headroom(np) - net_packet_headlen(np);
+}
+
+/* add a header in front of the frame, and return where it goes */
+static inline void *net_packet_push(struct net_packet *np, size_t len)
+{
+	assert(len <= net_packet_headroom(np));
+	np->data -= len;
+	np->length += len;
+	return np->data;
+}
+
+/* strip a header off the front of the frame */
+static inline void *net_packet_pull(struct net_packet *np, size_t len)
+{
+	assert(len <= net_packet_headlen(np));
+	np->data += len;
+	np->length -= len;
+	return np->data;
+}
+
 void net_notify_packet_ready(struct net_dev *nd);
-void net_receive_packet(struct net_dev *nd, struct net_packet *packets, int count);
+void net_notify_rx_queue(struct net_dev *nd, int queue);
+void net_receive_packet(struct net_dev *nd, struct net_packet **packets, int count);
 
 struct net_packet *net_packet_create(struct net_packet *packet, int flags);
 void net_packet_destroy(struct net_packet *packet);
 void net_packet_get(struct net_packet *packet);
 void net_packet_put(struct net_packet *packet, int);
+int net_packet_add_frag(struct net_packet *packet, addr_t page, size_t offset, size_t length);
+int net_packet_linearize(struct net_packet *packet);
+size_t net_packet_copy_out(struct net_packet *packet, size_t offset, void *buf, size_t length);
 
 #endif
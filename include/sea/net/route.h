@@ -1,24 +1,47 @@
 #ifndef __SEA_NET_ROUTE_H
 #define __SEA_NET_ROUTE_H
 
-#include <sea/net/interface.h>
+#include <sea/types.h>
 #include <sea/lib/linkedlist.h>
+#include <sea/mutex.h>
+#include <stdbool.h>
 
 #define ROUTE_FLAG_HOST    1
 #define ROUTE_FLAG_DEFAULT 2
 #define ROUTE_FLAG_UP      4
 #define ROUTE_FLAG_GATEWAY 8
 
+struct net_dev;
+
+/* routes don't change once they're added. Lookups return a reference,
+ * which has to be given back with net_route_put. */
 struct route {
 	uint32_t gateway, destination;
 	uint32_t netmask;
 	int flags;
 	struct net_dev *interface;
+	_Atomic int refs;
 
 	struct linkedentry node;
 };
 
+/* the last route looked up through it, kept until the table changes */
+struct route_cache {
+	struct mutex lock;
+	struct route *route;
+	uint32_t addr;
+	unsigned long gen;
+};
+
 struct route *net_route_select_entry(uint32_t addr);
+struct route *net_route_lookup(uint32_t addr, unsigned long *gen);
+unsigned long net_route_generation(void);
+void net_route_get(struct route *r);
+void net_route_put(struct route *r);
+void net_route_cache_create(struct route_cache *rc);
+void net_route_cache_destroy(struct route_cache *rc);
+struct route *net_route_cache_lookup(struct route_cache *rc, uint32_t addr, unsigned long *gen);
+void net_route_init(void);
 void net_route_add_entry(struct route *r);
 void net_route_del_entry(struct route *r);
 int net_route_find_del_entry(uint32_t dest, struct net_dev *nd);
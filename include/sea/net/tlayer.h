@@ -6,6 +6,9 @@
 #include <sea/fs/socket.h>
 
 #define TLPROT_FLAG_CONNECTIONLESS 0x1
+/* the protocol finds the socket for a packet itself (there may be many sockets
+ * per port, or none). recv_packet is called for every packet with a NULL socket. */
+#define TLPROT_FLAG_DEMUX          0x2
 
 struct tlayer_prot_interface {
 	int min_port, max_port;
@@ -16,6 +16,7 @@
 #define	_FNONBLOCK	0x4000	/* non blocking I/O (POSIX style) */
 #define	_FNDELAY	_FNONBLOCK	/* non blocking I/O (4.2 style) */
 #define	_FNOCTTY	0x8000	/* don't assign a ctty on this open */
+#define	_FDIRECT	0x80000	/* transfer data without going through the caches */
 
 #define	O_ACCMODE	(O_RDONLY|O_WRONLY|O_RDWR)
 
@@ -36,6 +37,7 @@
 /*	O_NDELAY	_FNBIO 		set in include/fcntl.h */
 #define	O_NONBLOCK	_FNONBLOCK
 #define	O_NOCTTY	_FNOCTTY
+#define	O_DIRECT	_FDIRECT
 
 /*
  * Flags that work for fcntl(fd, F_SETFL, FXXXX)
@@ -21,6 +21,8 @@ int tm_thread_block_schedule_work(struct blocklist *blocklist,
 		int state, struct async_call *work);
 int tm_thread_block_confirm(struct blocklist *blocklist, int state,
 		bool (*cfn)(void *), void *data);
+int tm_thread_block_confirm_timeout(struct blocklist *blocklist, int state, time_t microseconds,
+		bool (*cfn)(void *), void *data);
 int tm_thread_block(struct blocklist *blocklist, int state);
 struct blocklist *blocklist_create(struct blocklist *list, int flags, const char *);
 void blocklist_destroy(struct blocklist *list);
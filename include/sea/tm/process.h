@@ -4,6 +4,7 @@
 #include <sea/types.h>
 #include <sea/mm/vmm.h>
 #include <sea/lib/linkedlist.h>
+#include <sea/lib/intervaltree.h>
 #include <sea/cpu/registers.h>
 #include <sea/tm/signal.h>
 #include <sea/sys/stat.h>
@@ -74,9 +75,9 @@ struct process {
 	struct mutex fdlock;
 	struct hash files;
 	unsigned char fdnum_bitmap[NUM_FD / 8];
-	struct linkedlist mappings;
+	struct interval_tree mappings;
+	unsigned long map_generation;
 	struct mutex map_lock;
-	struct valloc mmf_valloc;
 
 	/* time accounting */
 	time_t utime, stime, cutime, cstime;
@@ -16,6 +16,7 @@
 #include <sea/spinlock.h>
 #include <sea/lib/linkedlist.h>
 #include <sea/cpu/processor.h>
+#include <sea/mm/vmm.h>
 #define KERN_STACK_SIZE 0x20000
 #define THREAD_MAGIC 0xBABECAFE
 #define PRIO_PROCESS 1
@@ -69,6 +70,10 @@ struct thread {
 	int stack_num;
 	struct cpu *cpu;
 	int held_locks;
+	struct tlb_gather tlb_gather;
+	/* last mapping found by a page fault, see find_mapping */
+	struct memmap *map_cache;
+	unsigned long map_cache_generation;
 
 	sigset_t sig_mask;
 	unsigned signal, signals_pending;
@@ -32,6 +32,8 @@ void cpu_processor_init_2(void)
 	loader_add_kernel_symbol(cpu_interrupt_get_flag);
 	loader_add_kernel_symbol(cpu_disable_preemption);
 	loader_add_kernel_symbol(cpu_enable_preemption);
+	loader_add_kernel_symbol(cpu_get_current);
+	loader_add_kernel_symbol(cpu_put_current);
 #if CONFIG_SMP
 	loader_add_kernel_symbol(cpu_get);
 	loader_add_kernel_symbol((addr_t)&cpu_array_num);
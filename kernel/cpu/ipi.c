@@ -14,7 +14,7 @@ void cpu_send_ipi(int dest, unsigned signal, unsigned flags)
  * indeed disabled */
 void cpu_handle_ipi_tlb(struct registers *regs)
 {
-	mm_flush_page_tables();
+	mm_handle_tlb_ipi();
 }
 
 void cpu_handle_ipi_tlb_ack(struct registers *regs)
@@ -7,86 +7,315 @@
 #include <sea/tm/timing.h>
 #include <stdatomic.h>
 #include <sea/vsprintf.h>
-struct linkedlist dirty_list;
-struct mutex dlock;
-struct kthread syncer;
+#include <sea/mm/kmalloc.h>
+#include <sea/mm/pmm.h>
+#include <sea/mm/vmm.h>
+
+/* Each block device has a writeback thread that writes its dirty buffers. It
+ * wakes up every WRITEBACK_INTERVAL and writes buffers that have been dirty for
+ * longer than WRITEBACK_EXPIRE. If the device has more dirty data than the
+ * background ratio (a percentage of physical memory), it writes everything.
+ * Past the hard ratio, threads that dirty buffers wait for writeback to catch up.
+ * Buffers are written in block order, with adjacent blocks merged into one ioreq. */
+#define WRITEBACK_INTERVAL ONE_SECOND
+#define WRITEBACK_EXPIRE   (5 * ONE_SECOND)
+#define WRITEBACK_BACKGROUND_RATIO 5
+#define WRITEBACK_HARD_RATIO 10
+#define WRITEBACK_MAX_RUN 64
+
+static struct linkedlist writeback_devices;
 
 void block_buffer_init(void)
 {
-	mutex_create(&dlock, 0);
-	linkedlist_create(&dirty_list, LINKEDLIST_LOCKLESS);
-	//kthread_create(&syncer, "[ksync]", 0, block_buffer_syncer, 0);
+	linkedlist_create(&writeback_devices, LINKEDLIST_MUTEX);
+}
+
+static inline size_t __dirty_bytes(struct blockctl *ctl)
+{
+	return ctl->dirty_count * ctl->blocksize;
+}
+
+static inline size_t __dirty_limit(int ratio)
+{
+	return ((size_t)pm_num_pages * PAGE_SIZE / 100) * ratio;
+}
+
+/* shell sort, since the dirty list can be long, and we don't have a generic sort */
+static void __sort_buffers(struct buffer **bufs, size_t count)
+{
+	for(size_t gap = count / 2;gap > 0;gap /= 2) {
+		for(size_t i=gap;i<count;i++) {
+			struct buffer *tmp = bufs[i];
+			size_t j;
+			for(j = i;j >= gap && bufs[j - gap]->trueblock > tmp->trueblock;j -= gap)
+				bufs[j] = bufs[j - gap];
+			bufs[j] = tmp;
+		}
+	}
+}
+
+static bool __ioreq_pending(void *data)
+{
+	struct ioreq *req = data;
+	return !(req->flags & IOREQ_COMPLETE);
 }
 
-void buffer_sync(struct buffer *buf)
+/* write back dirty buffers whose device blocks are in [start, end). If all is
+ * false, only buffers that have been dirty for long enough are written. Returns
+ * the number of buffers written. */
+static size_t __writeback_pass(struct blockctl *ctl, bool all, uint64_t start, uint64_t end)
 {
-	if(!(atomic_fetch_or(&buf->flags, BUFFER_WRITEPENDING) & BUFFER_WRITEPENDING)) {
-		assert(buf->flags & BUFFER_DLIST);
-		struct ioreq *req = ioreq_create(buf->bd, WRITE, buf->__block, 1);
+	mutex_acquire(&ctl->writeback_lock);
+	mutex_acquire(&ctl->dirtylock);
+	size_t max = ctl->dirty_list.count, count = 0;
+	if(!max) {
+		mutex_release(&ctl->dirtylock);
+		mutex_release(&ctl->writeback_lock);
+		return 0;
+	}
+	struct buffer **bufs = kmalloc(max * sizeof(struct buffer *));
+	time_t now = tm_timing_get_microseconds();
+	struct linkedentry *ent;
+	for(ent = linkedlist_iter_start(&ctl->dirty_list);ent != linkedlist_iter_end(&ctl->dirty_list);
+			ent = linkedlist_iter_next(ent)) {
+		struct buffer *buf = ent->obj;
+		if(!(buf->flags & BUFFER_DIRTY) || (buf->flags & BUFFER_WRITEPENDING))
+			continue;
+		if(!all && now - buf->dirty_time < WRITEBACK_EXPIRE)
+			continue;
+		if(buf->trueblock < start || buf->trueblock >= end)
+			continue;
+		buffer_inc_refcount(buf);
+		bufs[count++] = buf;
+	}
+	mutex_release(&ctl->dirtylock);
+	if(!count) {
+		kfree(bufs);
+		mutex_release(&ctl->writeback_lock);
+		return 0;
+	}
+
+	__sort_buffers(bufs, count);
+	size_t nreqs = 0;
+	struct ioreq **reqs = kmalloc(count * sizeof(struct ioreq *));
+	for(size_t i=0;i<count;) {
+		size_t run = 1;
+		while(i + run < count && run < WRITEBACK_MAX_RUN
+				&& bufs[i + run]->bd == bufs[i]->bd
+				&& bufs[i + run]->trueblock == bufs[i]->trueblock + run)
+			run++;
+		for(size_t j=0;j<run;j++)
+			atomic_fetch_or(&bufs[i + j]->flags, BUFFER_WRITEPENDING);
+		struct ioreq *req = ioreq_create(bufs[i]->bd, WRITE, bufs[i]->__block, run);
 		atomic_fetch_add(&req->refs, 1);
 		block_elevator_add_request(req);
-		ioreq_put(req);
+		reqs[nreqs++] = req;
+		i += run;
 	}
+	ctl->wb_requests += nreqs;
+	ctl->wb_blocks += count;
+
+	/* wait for all of them, so that the buffers drop off the dirty list when we
+	 * put them, and throttled writers see the effect */
+	for(size_t i=0;i<nreqs;i++) {
+		tm_thread_block_confirm(&reqs[i]->blocklist, THREADSTATE_UNINTERRUPTIBLE,
+				__ioreq_pending, reqs[i]);
+		ioreq_put(reqs[i]);
+	}
+	for(size_t i=0;i<count;i++)
+		buffer_put(bufs[i]);
+	kfree(reqs);
+	kfree(bufs);
+	mutex_release(&ctl->writeback_lock);
+	tm_blocklist_wakeall(&ctl->throttle_wait);
+	return count;
 }
 
-int buffer_sync_all_dirty(void)
+static int __KT_writeback(struct kthread *kt, void *arg)
 {
-	printk(0, "[block]: syncing block buffers (%d buffers)\n", dirty_list.count);
-	mutex_acquire(&dlock);
-	while(dirty_list.count > 0) {
-		struct buffer *buf = linkedlist_head(&dirty_list);
-		buffer_inc_refcount(buf);
-		if(buf->flags & BUFFER_DIRTY)
-			buffer_sync(buf);
-		mutex_release(&dlock);
-		buffer_put(buf);
-		tm_schedule();
-		switch(tm_thread_got_signal(current_thread)) {
-			case SA_RESTART:
-				return -ERESTART;
-			case 0:
-				break;
-			default:
-				return -EINTR;
-		}
-		mutex_acquire(&dlock);
+	struct blockctl *ctl = arg;
+	while(!kthread_is_joining(kt)) {
+		bool all = __dirty_bytes(ctl) > __dirty_limit(WRITEBACK_BACKGROUND_RATIO);
+		size_t written = __writeback_pass(ctl, all, 0, ~0ULL);
+		/* keep going without sleeping only while we're over the background
+		 * limit and still making progress */
+		if(!written || __dirty_bytes(ctl) <= __dirty_limit(WRITEBACK_BACKGROUND_RATIO))
+			tm_thread_block_timeout(&ctl->writeback_wait, WRITEBACK_INTERVAL);
 	}
-	mutex_release(&dlock);
 	return 0;
 }
 
+void block_writeback_init(struct blockctl *ctl)
+{
+	mutex_create(&ctl->dirtylock, 0);
+	mutex_create(&ctl->writeback_lock, 0);
+	linkedlist_create(&ctl->dirty_list, LINKEDLIST_LOCKLESS);
+	blocklist_create(&ctl->writeback_wait, 0, "writeback");
+	blocklist_create(&ctl->throttle_wait, 0, "writeback-throttle");
+	linkedlist_insert(&writeback_devices, &ctl->wb_node, ctl);
+	kthread_create(&ctl->writeback, "[kwriteback]", 0, __KT_writeback, ctl);
+}
+
+static bool __over_hard_limit(void *data)
+{
+	struct blockctl *ctl = data;
+	return __dirty_bytes(ctl) > __dirty_limit(WRITEBACK_HARD_RATIO);
+}
+
+/* called before dirtying buffers. If the device has too much dirty data,
+ * wait for writeback to bring it back down. */
+void block_writeback_throttle(struct blockctl *ctl)
+{
+	while(__over_hard_limit(ctl)) {
+		ctl->wb_throttled++;
+		tm_blocklist_wakeall(&ctl->writeback_wait);
+		tm_thread_block_confirm(&ctl->throttle_wait, THREADSTATE_UNINTERRUPTIBLE,
+				__over_hard_limit, ctl);
+	}
+}
+
+/* write back the dirty buffers in count device blocks starting at start, and
+ * wait for them. Since passes are serialized, this also waits out any pass that
+ * was already writing them. */
+void block_writeback_range(struct blockctl *ctl, uint64_t start, size_t count)
+{
+	if(ctl->dirty_count)
+		__writeback_pass(ctl, true, start, start + count);
+}
+
+static void __sync_device(struct linkedentry *ent)
+{
+	__writeback_pass(ent->obj, true, 0, ~0ULL);
+}
+
+int buffer_sync_all_dirty(void)
+{
+	printk(0, "[block]: syncing block buffers\n");
+	linkedlist_apply(&writeback_devices, __sync_device);
+	return 0;
+}
+
+/* take a reference to room for one block in the device's current page, moving
+ * on to a new page once it's full. The device keeps its own reference to the
+ * current page, so a page isn't freed until it's used up and all of its
+ * buffers are gone. */
+static addr_t __carve(struct blockctl *ctl, size_t *offset)
+{
+	mutex_acquire(&ctl->carve_lock);
+	/* if every buffer carved from the current page has been dropped, only our
+	 * reference is left, so start over at the front instead of leaving the
+	 * dead space to be pinned by the next few buffers */
+	if(ctl->carve_page && mm_physical_get_count(ctl->carve_page) == 1)
+		ctl->carve_offset = 0;
+	if(!ctl->carve_page || ctl->carve_offset + ctl->blocksize > PAGE_SIZE) {
+		if(ctl->carve_page)
+			mm_physical_decrement_count(ctl->carve_page);
+		ctl->carve_page = mm_physical_allocate(PAGE_SIZE, false);
+		mm_physical_increment_count(ctl->carve_page);
+		ctl->carve_offset = 0;
+	}
+	addr_t page = ctl->carve_page;
+	*offset = ctl->carve_offset;
+	ctl->carve_offset += ctl->blocksize;
+	mm_physical_increment_count(page);
+	mutex_release(&ctl->carve_lock);
+	return page;
+}
+
+/* make a buffer for data at offset into page, which the I/O was done into
+ * directly. The buffer takes its own reference to the page. */
+struct buffer *buffer_create_page(struct blockdev *bd, uint64_t block, int flags, addr_t page, size_t offset)
+{
+	struct buffer *b = kmalloc(sizeof(struct buffer));
+	b->bd = bd;
+	b->__block = block;
+	b->flags = flags;
+	b->refs = 1;
+	b->page = page;
+	b->data = (unsigned char *)(page + PHYS_PAGE_MAP + offset);
+	mm_physical_increment_count(page);
+	return b;
+}
+
+/* make a buffer holding a copy of data */
 struct buffer *buffer_create(struct blockdev *bd, uint64_t block, int flags, unsigned char *data)
 {
-	struct buffer *b = kmalloc(sizeof(struct buffer) + bd->ctl->blocksize);
+	struct buffer *b = kmalloc(sizeof(struct buffer));
+	size_t offset;
 	b->bd = bd;
 	b->__block = block;
 	b->flags = flags;
 	b->refs = 1;
+	b->page = __carve(bd->ctl, &offset);
+	b->data = (unsigned char *)(b->page + PHYS_PAGE_MAP + offset);
 	memcpy(b->data, data, bd->ctl->blocksize);
 	return b;
 }
 
+/* allocate physically contiguous pages to read up to *length bytes of blocks
+ * into. If memory is too fragmented for a block that big, smaller ones are
+ * tried, down to a single page, and *length is cut down to what was allocated.
+ * The pages are split up so that each one is freed on its own once the
+ * buffers made from it are gone. The caller holds a reference to each page,
+ * and drops them with buffer_release_pages. */
+addr_t buffer_allocate_pages(size_t *length)
+{
+	size_t size = PAGE_SIZE;
+	while(size < *length)
+		size *= 2;
+	addr_t pages = 0;
+	while(size > PAGE_SIZE && !(pages = mm_physical_allocate_region(size, false, 0, 0)))
+		size /= 2;
+	if(!pages)
+		pages = mm_physical_allocate(size, false);
+	if(size < *length)
+		*length = size;
+	if(size > PAGE_SIZE)
+		mm_physical_split(pages, size);
+	for(addr_t p = pages;p < pages + size;p += PAGE_SIZE) {
+		mm_physical_increment_count(p);
+		if(p >= pages + *length)
+			mm_physical_decrement_count(p);
+	}
+	return pages;
+}
+
+void buffer_release_pages(addr_t pages, size_t length)
+{
+	for(addr_t p = pages;p < pages + length;p += PAGE_SIZE)
+		mm_physical_decrement_count(p);
+}
+
 void buffer_put(struct buffer *buf)
 {
 	assert(buf->refs > 0);
 	if(atomic_fetch_sub(&buf->refs, 1) == 1) {
 		assert(!(buf->flags & BUFFER_DIRTY) && !(buf->flags & BUFFER_DLIST));
+		mm_physical_decrement_count(buf->page);
 		kfree(buf);
 	} else {
-		mutex_acquire(&dlock);
+		struct blockctl *ctl = buf->bd->ctl;
+		bool wake = false;
+		mutex_acquire(&ctl->dirtylock);
 		if(buf->flags & BUFFER_DIRTY) {
 			if(!(buf->flags & BUFFER_DLIST)) {
 				/* changed to dirty, so add to list */
-				linkedlist_insert(&dirty_list, &buf->dlistnode, buf);
+				buf->dirty_time = tm_timing_get_microseconds();
+				linkedlist_insert(&ctl->dirty_list, &buf->dlistnode, buf);
 				atomic_fetch_or(&buf->flags, BUFFER_DLIST);
+				ctl->dirty_count++;
+				wake = __dirty_bytes(ctl) > __dirty_limit(WRITEBACK_BACKGROUND_RATIO);
 			}
 		} else {
 			if(buf->flags & BUFFER_DLIST) {
-				linkedlist_remove(&dirty_list, &buf->dlistnode);
+				linkedlist_remove(&ctl->dirty_list, &buf->dlistnode);
 				atomic_fetch_and(&buf->flags, ~BUFFER_DLIST);
+				ctl->dirty_count--;
 			}
 		}
-		mutex_release(&dlock);
+		mutex_release(&ctl->dirtylock);
+		if(wake)
+			tm_blocklist_wakeall(&ctl->writeback_wait);
 	}
 }
 
@@ -2,19 +2,55 @@
 #include <sea/dm/blockdev.h>
 #include <sea/lib/hash.h>
 #include <sea/errno.h>
-#include <sea/lib/queue.h>
+#include <sea/lib/linkedlist.h>
 #include <sea/mm/reclaim.h>
 #include <sea/vsprintf.h>
 #include <sea/fs/kerfs.h>
-static struct queue lru;
+/* every device's cache, for the global reclaimer */
+static struct linkedlist bcache_devices;
+static _Atomic size_t bcache_buffers = 0;
+
+static size_t block_cache_count(void)
+{
+	return bcache_buffers;
+}
+
+static size_t block_cache_scan(size_t nr)
+{
+	return dm_block_cache_reclaim(nr);
+}
+
+/* buffers cost a disk read to get back, so they're scanned less eagerly
+ * than the in-memory caches */
+static struct reclaimer block_cache_reclaimer = {
+	.name = "blockcache",
+	.count = block_cache_count,
+	.scan = block_cache_scan,
+	.object_size = sizeof(struct buffer) + 512,
+	.seeks = 4,
+};
 
-size_t dm_block_cache_reclaim(void);
-struct mutex reclaim_lock;
 void block_cache_init(void)
 {
-	queue_create(&lru, 0);
-	mm_reclaim_register(dm_block_cache_reclaim, sizeof(struct buffer) + 512);
-	mutex_create(&reclaim_lock, 0);
+	linkedlist_create(&bcache_devices, LINKEDLIST_MUTEX);
+	mm_reclaim_register(&block_cache_reclaimer);
+}
+
+void block_cache_register(struct blockctl *ctl)
+{
+	for(int i=0;i<BCACHE_SHARDS;i++) {
+		struct bcache_shard *shard = &ctl->shards[i];
+		mutex_create(&shard->lock, 0);
+		hash_create(&shard->cache, HASH_LOCKLESS, BCACHE_SHARD_LENGTH);
+		linkedlist_create(&shard->clock, LINKEDLIST_LOCKLESS);
+		shard->hand = NULL;
+	}
+	linkedlist_insert(&bcache_devices, &ctl->cache_node, ctl);
+}
+
+static inline struct bcache_shard *__shard(struct blockctl *ctl, uint64_t trueblock)
+{
+	return &ctl->shards[trueblock % BCACHE_SHARDS];
 }
 
 int kerfs_block_cache_report(int direction, void *param, size_t size,
@@ -25,88 +61,224 @@ int kerfs_block_cache_report(int direction, void *param, size_t size,
 	KERFS_PRINTF(offset, length, buf, current,
 			"BUFFERS LOAD REQS\n"
 			"%7d %3d%% %d\n",
-			ctl->cache.count, (ctl->cache.count * 100) / ctl->cache.length,
+			ctl->cache_count, (ctl->cache_count * 100) / (BCACHE_SHARDS * BCACHE_SHARD_LENGTH),
 			mpscq_count(&ctl->queue));
+	KERFS_PRINTF(offset, length, buf, current,
+			"DIRTY %d, WRITEBACK REQS %d BLOCKS %d, THROTTLED %d\n",
+			ctl->dirty_count, ctl->wb_requests, ctl->wb_blocks, ctl->wb_throttled);
+	KERFS_PRINTF(offset, length, buf, current,
+			"ELEVATOR %s: QUEUED %d, MERGED %d, DISPATCHED %d\n",
+			ctl->sched ? ctl->sched->name : "none",
+			ctl->el_queued, ctl->el_merged, ctl->el_dispatched);
+	KERFS_PRINTF(offset, length, buf, current,
+			"DIRECT BLOCKS %d\n", ctl->direct_blocks);
 	return current;
 }
 
-size_t dm_block_cache_reclaim(void)
+/* take a buffer out of its shard. The cache's reference is handed back to
+ * the caller, to drop once the shard is unlocked. Called with the shard lock held. */
+static void __remove(struct blockctl *ctl, struct bcache_shard *shard, struct buffer *buf)
 {
-	/* TODO */
-	//return 0;
-	mutex_acquire(&reclaim_lock);
-	struct queue_item *item = queue_dequeue_item(&lru);
-	struct buffer *br = item->ent;
-	size_t amount = sizeof(struct buffer) + br->bd->ctl->blocksize;
-	mutex_acquire(&br->bd->ctl->cachelock);
-	if((br->flags & BUFFER_DIRTY) || (br->flags & BUFFER_LOCKED)) {
-		mutex_release(&br->bd->ctl->cachelock);
-		queue_enqueue_item(&lru, &br->qi, br);
-		mutex_release(&reclaim_lock);
-		return 0;
+	if(shard->hand == &buf->clock_entry)
+		shard->hand = buf->clock_entry.next;
+	hash_delete(&shard->cache, &buf->trueblock, sizeof(buf->trueblock));
+	linkedlist_do_remove(&shard->clock, &buf->clock_entry);
+	ctl->cache_count--;
+	bcache_buffers--;
+}
+
+/* run the shard's clock hand until up to max buffers have been evicted into
+ * victims, or it's been around twice. A buffer that has been used since the
+ * hand last passed gets its reference bit cleared and is kept for another
+ * round. The ring is kept newest first, and the hand moves toward the older
+ * end before wrapping back around to the newest. */
+static size_t __shard_reclaim(struct blockctl *ctl, struct bcache_shard *shard,
+		struct buffer **victims, size_t max)
+{
+	size_t found = 0;
+	mutex_acquire(&shard->lock);
+	size_t steps = hash_count(&shard->cache) * 2;
+	while(found < max && steps--) {
+		struct linkedentry *ent = shard->hand;
+		if(!ent)
+			ent = shard->clock.sentry.prev;
+		else if(ent == &shard->clock.sentry)
+			ent = shard->clock.sentry.next;
+		if(ent == &shard->clock.sentry)
+			break;
+		struct buffer *buf = ent->obj;
+		shard->hand = ent->next;
+		if(buf->flags & (BUFFER_DIRTY | BUFFER_LOCKED))
+			continue;
+		if(buf->flags & BUFFER_REFERENCED) {
+			atomic_fetch_and(&buf->flags, ~BUFFER_REFERENCED);
+			continue;
+		}
+		__remove(ctl, shard, buf);
+		victims[found++] = buf;
 	}
+	mutex_release(&shard->lock);
+	return found;
+}
 
-	uint64_t block = buffer_block(br);
-	//printk(0, "reclaim block %d!\n", block);
-	hash_delete(&br->bd->ctl->cache, &block, sizeof(block));
-	mutex_release(&br->bd->ctl->cachelock);
-	buffer_put(br);
-	mutex_release(&reclaim_lock);
+/* drop the cache's reference to an evicted buffer, and return the memory
+ * that actually gave back. Buffers smaller than a page share it, so the page
+ * only counts when the last buffer on it goes. */
+static size_t __put_evicted(struct blockctl *ctl, struct buffer *buf)
+{
+	size_t amount = sizeof(struct buffer);
+	if(ctl->blocksize >= PAGE_SIZE)
+		amount += ctl->blocksize;
+	else if(buf->refs == 1 && mm_physical_get_count(buf->page) == 1)
+		amount += PAGE_SIZE;
+	buffer_put(buf);
 	return amount;
 }
 
-int dm_block_cache_insert(struct blockdev *bd, uint64_t block, struct buffer *buf, int flags)
+/* a page read in by the elevator holds a run of neighbouring blocks, and it
+ * stays allocated while any one of them is cached. Once the clock picks a
+ * victim, take the clean buffers sharing its page along with it, so that
+ * reclaim frees whole pages instead of leaving each one pinned by a survivor.
+ * The page is the unit here, so their reference bits aren't honoured.
+ * Returns the number of bytes freed. */
+static size_t __evict_page(struct blockctl *ctl, struct buffer *victim)
+{
+	size_t per = PAGE_SIZE / ctl->blocksize;
+	size_t amount = 0;
+	if(per > 1) {
+		uint64_t start = victim->trueblock >= per - 1 ? victim->trueblock - (per - 1) : 0;
+		for(uint64_t b = start; b < victim->trueblock + per; b++) {
+			if(b == victim->trueblock)
+				continue;
+			struct bcache_shard *shard = __shard(ctl, b);
+			mutex_acquire(&shard->lock);
+			struct buffer *buf = hash_lookup(&shard->cache, &b, sizeof(b));
+			if(buf && (buf->page != victim->page || (buf->flags & (BUFFER_DIRTY | BUFFER_LOCKED))))
+				buf = NULL;
+			if(buf)
+				__remove(ctl, shard, buf);
+			mutex_release(&shard->lock);
+			if(buf)
+				amount += __put_evicted(ctl, buf);
+		}
+	}
+	return amount + __put_evicted(ctl, victim);
+}
+
+/* evict up to nr buffers from one device, a batch per shard, starting
+ * wherever the last call left off. Returns the number of bytes freed. */
+size_t dm_block_cache_reclaim_device(struct blockctl *ctl, size_t nr)
+{
+	struct buffer *victims[BCACHE_RECLAIM_BATCH];
+	size_t amount = 0;
+	for(int i=0;i<BCACHE_SHARDS && nr;i++) {
+		struct bcache_shard *shard = &ctl->shards[atomic_fetch_add(&ctl->reclaim_shard, 1) % BCACHE_SHARDS];
+		size_t max = nr > BCACHE_RECLAIM_BATCH ? BCACHE_RECLAIM_BATCH : nr;
+		size_t found = __shard_reclaim(ctl, shard, victims, max);
+		for(size_t j=0;j<found;j++)
+			amount += __evict_page(ctl, victims[j]);
+		nr -= found;
+	}
+	return amount;
+}
+
+struct reclaim_state {
+	size_t nr, total, amount;
+};
+
+static void __reclaim_device(struct linkedentry *ent, void *data)
+{
+	struct blockctl *ctl = ent->obj;
+	struct reclaim_state *state = data;
+	if(!ctl->cache_count)
+		return;
+	/* spread the work over the devices by how much each one has cached */
+	size_t nr = (state->nr * ctl->cache_count) / state->total;
+	state->amount += dm_block_cache_reclaim_device(ctl, nr ? nr : 1);
+}
+
+/* evict up to nr buffers, across all devices. Returns the number of bytes freed. */
+size_t dm_block_cache_reclaim(size_t nr)
 {
-	mutex_acquire(&reclaim_lock);
-	mutex_acquire(&bd->ctl->cachelock);
+	struct reclaim_state state = { .nr = nr, .total = bcache_buffers, .amount = 0 };
+	if(!nr || !state.total)
+		return 0;
+	linkedlist_apply_data(&bcache_devices, __reclaim_device, &state);
+	return state.amount;
+}
 
-	struct buffer *prev = 0;
+int dm_block_cache_insert(struct blockdev *bd, uint64_t block, struct buffer *buf, int flags)
+{
+	struct blockctl *ctl = bd->ctl;
 	buf->__block = block;
 	block += buf->bd->partbegin;
-	bool exist = (prev=hash_lookup(&bd->ctl->cache, &block, sizeof(block))) != NULL;
+	struct bcache_shard *shard = __shard(ctl, block);
+	mutex_acquire(&shard->lock);
 
-	if(exist && !(flags & BLOCK_CACHE_OVERWRITE)) {
-		mutex_release(&bd->ctl->cachelock);
-		mutex_release(&reclaim_lock);
+	struct buffer *prev = hash_lookup(&shard->cache, &block, sizeof(block));
+	if(prev && !(flags & BLOCK_CACHE_OVERWRITE)) {
+		mutex_release(&shard->lock);
 		return -EEXIST;
 	}
 
 	buffer_inc_refcount(buf);
-	if(exist) {
-		hash_delete(&bd->ctl->cache, &block, sizeof(block));
-		queue_remove(&lru, &prev->qi);
-		buffer_put(prev);
-	}
+	if(prev)
+		__remove(ctl, shard, prev);
 	buf->trueblock = block;
-	hash_insert(&bd->ctl->cache, &buf->trueblock, sizeof(buf->trueblock), &buf->hash_elem, buf);
-
-	queue_enqueue_item(&lru, &buf->qi, buf);
-	mutex_release(&bd->ctl->cachelock);
-	mutex_release(&reclaim_lock);
+	hash_insert(&shard->cache, &buf->trueblock, sizeof(buf->trueblock), &buf->hash_elem, buf);
+	linkedlist_insert(&shard->clock, &buf->clock_entry, buf);
+	ctl->cache_count++;
+	bcache_buffers++;
+	mutex_release(&shard->lock);
+	if(prev)
+		buffer_put(prev);
 	return 0;
 }
 
 struct buffer *dm_block_cache_get(struct blockdev *bd, uint64_t block)
 {
-	mutex_acquire(&reclaim_lock);
-	mutex_acquire(&bd->ctl->cachelock);
 	block += bd->partbegin;
+	struct bcache_shard *shard = __shard(bd->ctl, block);
+	mutex_acquire(&shard->lock);
 
 	struct buffer *e;
-	if((e = hash_lookup(&bd->ctl->cache, &block, sizeof(block))) == NULL) {
-		mutex_release(&bd->ctl->cachelock);
-	mutex_release(&reclaim_lock);
+	if((e = hash_lookup(&shard->cache, &block, sizeof(block))) == NULL) {
+		mutex_release(&shard->lock);
 		return 0;
 	}
 
 	buffer_inc_refcount(e);
-	mutex_release(&bd->ctl->cachelock);
-	queue_remove(&lru, &e->qi);
-	queue_enqueue_item(&lru, &e->qi, e);
-	mutex_release(&reclaim_lock);
+	/* lazy promotion: rather than moving the buffer, just mark it, and let
+	 * the clock hand give it a second chance. Only write the flag if it's not
+	 * already set, so hot buffers don't keep bouncing their cache line. */
+	if(!(e->flags & BUFFER_REFERENCED))
+		atomic_fetch_or(&e->flags, BUFFER_REFERENCED);
+	mutex_release(&shard->lock);
 	return e;
 }
 
+/* drop count blocks starting at block from the cache. Buffers that are dirty
+ * or still being read in are left alone. */
+void dm_block_cache_invalidate(struct blockdev *bd, uint64_t block, size_t count)
+{
+	struct blockctl *ctl = bd->ctl;
+	if(!ctl->cache_count)
+		return;
+	block += bd->partbegin;
+	for(uint64_t b = block;b < block + count;b++) {
+		struct bcache_shard *shard = __shard(ctl, b);
+		mutex_acquire(&shard->lock);
+		struct buffer *buf = hash_lookup(&shard->cache, &b, sizeof(b));
+		if(buf && !(buf->flags & (BUFFER_DIRTY | BUFFER_LOCKED | BUFFER_WRITEPENDING)))
+			__remove(ctl, shard, buf);
+		else
+			buf = NULL;
+		mutex_release(&shard->lock);
+		if(buf)
+			buffer_put(buf);
+	}
+}
+
 int block_cache_request(struct ioreq *req, off_t initial_offset, size_t total_bytecount, uint8_t *buffer)
 {
 	size_t block = req->block;
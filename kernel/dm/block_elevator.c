@@ -1,80 +1,369 @@
 #include <sea/tm/kthread.h>
 #include <sea/tm/blocking.h>
 #include <sea/tm/thread.h>
+#include <sea/tm/timing.h>
 #include <sea/dm/block.h>
 #include <sea/dm/blockdev.h>
+#include <sea/fs/kerfs.h>
+#include <sea/mm/vmm.h>
+#include <sea/mm/kmalloc.h>
+#include <sea/errno.h>
 #include <stdatomic.h>
-void dm_block_cache_reclaim(void);
+
+static struct elevator_ops *elevators[] = {
+	&elevator_deadline,
+	&elevator_noop,
+};
+
+#define NUM_ELEVATORS (sizeof(elevators) / sizeof(elevators[0]))
+
+#define ELEVATOR_IO_TIMEOUT ONE_SECOND
+
+/* try to merge req into a queued group. Only requests that are exactly
+ * adjacent to the group (in front of it, or behind it) are merged. */
+bool elevator_try_merge(struct ioreq *group, struct ioreq *req)
+{
+	if(group->direction != req->direction || group->bd != req->bd
+			|| group->buffer || req->buffer
+			|| group->length + req->length > ELEVATOR_MAX_BLOCKS)
+		return false;
+	if(group->start + group->length == req->start) {
+		/* back merge; nothing to do but grow */
+	} else if(req->start + req->length == group->start) {
+		group->start = req->start;
+	} else {
+		return false;
+	}
+	group->length += req->length;
+	req->merged = group->merged;
+	group->merged = req;
+	return true;
+}
+
+/* make buffers for count blocks that have just been read into pages */
+static void __insert_read(struct blockdev *bd, struct blockctl *ctl, uint64_t block,
+		addr_t pages, size_t count)
+{
+	for(size_t i=0;i<count;i++) {
+		size_t off = i * ctl->blocksize;
+		struct buffer *buffer = buffer_create_page(bd, block + i, 0,
+				pages + (off & ~(PAGE_SIZE - 1)), off % PAGE_SIZE);
+		atomic_fetch_or(&buffer->flags, BUFFER_LOCKED);
+		dm_block_cache_insert(bd, block + i, buffer, 0);
+		buffer_put(buffer);
+	}
+}
+
+/* copy count dirty buffers into buf to be written out. Returns false if one
+ * of them isn't in the cache any more, in which case the write fails. */
+static bool __gather_write(struct blockdev *bd, struct blockctl *ctl, uint64_t block,
+		unsigned char *buf, size_t count)
+{
+	for(size_t i=0;i<count;i++) {
+		struct buffer *buffer = dm_block_cache_get(bd, block + i);
+		if(!buffer)
+			return false;
+		memcpy(buf + i * ctl->blocksize, buffer->data, ctl->blocksize);
+		atomic_fetch_and(&buffer->flags, ~(BUFFER_DIRTY | BUFFER_WRITEPENDING)); //Should we wait to do this?
+		buffer_put(buffer);
+	}
+	return true;
+}
+
+static void __complete_group(struct ioreq *group, bool failed)
+{
+	struct ioreq *req = group;
+	while(req) {
+		struct ioreq *next = req->merged;
+		req->merged = NULL;
+		if(failed)
+			req->flags |= IOREQ_FAILED;
+		req->flags |= IOREQ_COMPLETE;
+		tm_blocklist_wakeall(&req->blocklist);
+		ioreq_put(req);
+		req = next;
+	}
+}
+
+/* do the I/O for a group, in chunks of up to max blocks, and then complete
+ * every request in it. */
+static void __elevator_issue(struct inode *node, struct blockctl *ctl, struct ioreq *group,
+		unsigned char *buf, int max)
+{
+	struct blockdev *bd = group->bd;
+	size_t count = group->length;
+	uint64_t block = group->start - bd->partbegin;
+	bool failed = false;
+
+	if(group->buffer) {
+		/* direct I/O goes straight between the device and the caller's memory */
+		uint8_t *data = group->buffer;
+		while(count) {
+			int this = max;
+			if(this > (int)count)
+				this = count;
+			size_t ret = ctl->rw(group->direction, node, block + bd->partbegin, data, this);
+			if(ret != ctl->blocksize * this) {
+				failed = true;
+				break;
+			}
+			data += ctl->blocksize * this;
+			block += this;
+			count -= this;
+		}
+	} else if(group->direction == READ) {
+		while(count) {
+			int this = max;
+			if(this > (int)count)
+				this = count;
+			/* read straight into the pages that the buffers will use */
+			size_t bytes = ctl->blocksize * this;
+			addr_t pages = buffer_allocate_pages(&bytes);
+			this = bytes / ctl->blocksize;
+			size_t ret = ctl->rw(READ, node, block + bd->partbegin,
+					(uint8_t *)(pages + PHYS_PAGE_MAP), this);
+			if(ret == bytes)
+				__insert_read(bd, ctl, block, pages, this);
+			else
+				failed = true;
+			buffer_release_pages(pages, bytes);
+			block+=this;
+			count-=this;
+		}
+	} else {
+		while(count) {
+			int this = max;
+			if(this > (int)count)
+				this = count;
+
+			if(!__gather_write(bd, ctl, block, buf, this)) {
+				failed = true;
+				break;
+			}
+			size_t ret = ctl->rw(WRITE, node, block + bd->partbegin, buf, this);
+			if(ret != ctl->blocksize * this) {
+				failed = true;
+				break;
+			}
+			block += this;
+			count -= this;
+		}
+	}
+	__complete_group(group, failed);
+}
+
+/* called by the driver when a submitted transfer is done. The elevator finishes
+ * it up the next time it reaps. */
+void block_io_complete(struct blockio *io, bool ok)
+{
+	io->failed = !ok;
+	atomic_store(&io->complete, true);
+}
+
+/* called by the driver when a submitted transfer may have finished, to get
+ * the elevator to poll again. This takes a blocklist's lock, so an interrupt
+ * handler has to defer it to stage2. */
+void block_io_notify(struct blockctl *ctl)
+{
+	atomic_store(&ctl->io_event, true);
+	tm_blocklist_wakeall(&ctl->io_wait);
+}
+
+static bool __io_should_sleep(void *data)
+{
+	struct blockctl *ctl = data;
+	return !atomic_load(&ctl->io_event) && !kthread_is_joining((&ctl->elevator));
+}
+
+/* for devices that queue: start a chunk of a group, without waiting for it.
+ * Returns the number of blocks started, which is less than count if there
+ * wasn't a contiguous run of memory big enough for all of them. */
+static size_t __elevator_start(struct inode *node, struct blockctl *ctl, struct ioreq *group,
+		uint64_t block, size_t count)
+{
+	struct blockio *io = kmalloc(sizeof(struct blockio));
+	size_t bytes = ctl->blocksize * count;
+	if(group->buffer) {
+		io->pages = 0;
+		io->buffer = group->buffer + (block + group->bd->partbegin - group->start) * ctl->blocksize;
+	} else {
+		io->pages = buffer_allocate_pages(&bytes);
+		io->buffer = (uint8_t *)(io->pages + PHYS_PAGE_MAP);
+		count = bytes / ctl->blocksize;
+	}
+	io->direction = group->direction;
+	io->bd = group->bd;
+	io->group = group;
+	io->block = block;
+	io->start = block + group->bd->partbegin;
+	io->count = count;
+	linkedlist_insert(&ctl->inflight, &io->entry, io);
+	if(io->direction == WRITE && !group->buffer && !__gather_write(group->bd, ctl, block, io->buffer, count))
+		block_io_complete(io, false);
+	else if(ctl->submit(node, io) < 0)
+		block_io_complete(io, false);
+	return count;
+}
+
+/* finish the transfers that the device has completed. A group is completed
+ * once all of its chunks are. Returns the number finished. */
+static size_t __elevator_reap(struct blockctl *ctl)
+{
+	size_t count = 0;
+	struct linkedentry *ent, *next;
+	for(ent = linkedlist_iter_start(&ctl->inflight);ent != linkedlist_iter_end(&ctl->inflight);ent = next) {
+		next = linkedlist_iter_next(ent);
+		struct blockio *io = ent->obj;
+		if(!atomic_load(&io->complete))
+			continue;
+		struct ioreq *group = io->group;
+		if(io->failed)
+			group->flags |= IOREQ_FAILED;
+		else if(io->direction == READ && io->pages)
+			__insert_read(io->bd, ctl, io->block, io->pages, io->count);
+		if(io->pages)
+			buffer_release_pages(io->pages, ctl->blocksize * io->count);
+		linkedlist_do_remove(&ctl->inflight, ent);
+		kfree(io);
+		if(--group->outstanding == 0)
+			__complete_group(group, group->flags & IOREQ_FAILED);
+		count++;
+	}
+	return count;
+}
+
+/* if a different scheduler has been selected, move everything queued
+ * over to it */
+static void __elevator_switch(struct blockctl *ctl)
+{
+	struct elevator_ops *next = ctl->sched_next;
+	void *data = next->init();
+	if(ctl->sched) {
+		struct ioreq *group;
+		while((group = ctl->sched->dispatch(ctl->sched_data))) {
+			/* break the group back up, so the new scheduler can merge as it likes */
+			while(group) {
+				struct ioreq *req = group->merged;
+				group->merged = NULL;
+				group->start = group->block + group->bd->partbegin;
+				group->length = group->count;
+				next->add(data, group);
+				group = req;
+			}
+		}
+		ctl->sched->destroy(ctl->sched_data);
+	}
+	ctl->sched = next;
+	ctl->sched_data = data;
+}
+
 int block_elevator_main(struct kthread *kt, void *arg)
 {
 	struct inode *node = arg;
 	struct blockdev *__bd = node->devdata;
 	struct blockctl *ctl = __bd->ctl;
-	const int max = 8;
+	const int max = ELEVATOR_MAX_BLOCKS;
 	unsigned char *buf = kmalloc(ctl->blocksize * max);
+	/* for queued devices, the group whose chunks are still being started */
+	struct ioreq *starting = NULL;
+	uint64_t next_block = 0;
+	size_t left = 0;
+	if(!ctl->sched_next)
+		ctl->sched_next = elevators[0];
+	linkedlist_create(&ctl->inflight, LINKEDLIST_LOCKLESS);
 	while(!kthread_is_joining(kt)) {
+		if(ctl->sched != ctl->sched_next)
+			__elevator_switch(ctl);
+		/* pull in everything that's been submitted before picking what to
+		 * do next, so the scheduler has the most to sort and merge */
 		struct ioreq *req;
-		if((req = mpscq_dequeue(&ctl->queue))) {
-			size_t count = req->count;
-			size_t block = req->block;
-
-			if(req->direction == READ) {
-				while(count) {
-					int this = 8;
-					if(this > (int)count)
-						this = count;
-					size_t ret = ctl->rw(req->direction, node, block + req->bd->partbegin, buf,
-							this);
-					if(ret == ctl->blocksize * this) {
-						for(int i=0;i<this;i++) {
-							struct buffer *buffer = buffer_create(req->bd,
-									block + i, 0, buf + i * ctl->blocksize);
-							atomic_fetch_or(&buffer->flags, BUFFER_LOCKED);
-							dm_block_cache_insert(req->bd, block + i, buffer, 0);
-							buffer_put(buffer);
-						}
-					} else {
-						req->flags |= IOREQ_FAILED;
-					}
-					block+=this;
-					count-=this;
-				}
-			} else {
-				while(count) {
-					int this = 8;
-					if(this > (int)count)
-						this = count;
-
-					for(int i=0;i<this;i++) {
-						struct buffer *buffer = dm_block_cache_get(req->bd, block + i);
-						assert(buffer);
-						memcpy(buf + i * ctl->blocksize, buffer->data, ctl->blocksize);
-						atomic_fetch_and(&buffer->flags, ~(BUFFER_DIRTY | BUFFER_WRITEPENDING)); //Should we wait to do this?
-						buffer_put(buffer);
-					}
-
-					size_t ret = ctl->rw(WRITE, node, block + req->bd->partbegin, buf, this);
-					if(ret != ctl->blocksize * this) {
-						req->flags |= IOREQ_FAILED;
+		while((req = mpscq_dequeue(&ctl->queue))) {
+			req->start = req->block + req->bd->partbegin;
+			req->length = req->count;
+			req->merged = NULL;
+			ctl->el_queued++;
+			ctl->sched->add(ctl->sched_data, req);
+		}
+		if(ctl->submit) {
+			/* keep the device's queue as full as we can */
+			while(ctl->inflight.count < (size_t)ctl->queue_depth) {
+				if(!left) {
+					if(!(starting = ctl->sched->dispatch(ctl->sched_data)))
 						break;
-					}
-					block += this;
-					count -= this;
+					ctl->el_dispatched++;
+					next_block = starting->start - starting->bd->partbegin;
+					left = starting->length;
+					starting->outstanding = (left + max - 1) / max;
 				}
+				size_t this = left > (size_t)max ? (size_t)max : left;
+				size_t chunks = (left + max - 1) / max;
+				size_t got = __elevator_start(node, ctl, starting, next_block, this);
+				left -= got;
+				next_block += got;
+				/* a short chunk leaves more of the group to start than planned */
+				starting->outstanding += (left + max - 1) / max - (chunks - 1);
 			}
-			req->flags |= IOREQ_COMPLETE;
-			tm_blocklist_wakeall(&req->blocklist);
-			ioreq_put(req);
-		} else {
-			if(hash_length(&ctl->cache) && (hash_count(&ctl->cache) * 100) / hash_length(&ctl->cache) > 300) {
-				dm_block_cache_reclaim();
-				tm_schedule();
-			} else {
-				tm_thread_set_state(current_thread, THREADSTATE_INTERRUPTIBLE);
+			if(ctl->inflight.count) {
+				atomic_store(&ctl->io_event, false);
+				ctl->poll(node);
+				/* nothing finished, so wait for the driver to tell us something
+				 * has. New requests wake us too. The timeout is only there so
+				 * that poll gets a chance to notice a hung device. */
+				if(!__elevator_reap(ctl))
+					tm_thread_block_confirm_timeout(&ctl->io_wait, THREADSTATE_UNINTERRUPTIBLE,
+							ELEVATOR_IO_TIMEOUT, __io_should_sleep, ctl);
+				continue;
 			}
+		} else if((req = ctl->sched->dispatch(ctl->sched_data))) {
+			ctl->el_dispatched++;
+			__elevator_issue(node, ctl, req, buf, max);
+			continue;
+		}
+		if((ctl->cache_count * 100) / (BCACHE_SHARDS * BCACHE_SHARD_LENGTH) > 300) {
+			dm_block_cache_reclaim_device(ctl, BCACHE_RECLAIM_BATCH);
+			tm_schedule();
+		} else {
+			tm_thread_set_state(current_thread, THREADSTATE_INTERRUPTIBLE);
 		}
 	}
 	kfree(buf);
 	return 0;
 }
 
+/* /dev/elevator-N: reading lists the schedulers, with the current one in
+ * brackets. Writing a scheduler's name switches to it. */
+int kerfs_elevator_param(int direction, void *param, size_t size, size_t offset, size_t length, unsigned char *buf)
+{
+	struct blockctl *ctl = param;
+	size_t current = 0;
+	if(direction == READ) {
+		for(size_t i=0;i<NUM_ELEVATORS;i++) {
+			if(elevators[i] == ctl->sched_next) {
+				KERFS_PRINTF(offset, length, buf, current, "[%s] ", elevators[i]->name);
+			} else {
+				KERFS_PRINTF(offset, length, buf, current, "%s ", elevators[i]->name);
+			}
+		}
+		KERFS_PRINTF(offset, length, buf, current, "\n");
+		return current;
+	}
+	if(offset > 0)
+		return 0;
+	if(length > 32)
+		length = 32;
+	char tmp[length + 1];
+	memset(tmp, 0, length + 1);
+	strncpy(tmp, (char *)buf, length);
+	char *n;
+	if((n = strrchr(tmp, '\n')))
+		*n = 0;
+	for(size_t i=0;i<NUM_ELEVATORS;i++) {
+		if(!strcmp(tmp, elevators[i]->name)) {
+			ctl->sched_next = elevators[i];
+			tm_thread_poke(ctl->elevator.thread);
+			return length;
+		}
+	}
+	return -EINVAL;
+}
+
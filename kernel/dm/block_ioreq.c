@@ -12,6 +12,7 @@ struct ioreq *ioreq_create(struct blockdev *bd, int direction, uint64_t start, s
 	req->bd = bd;
 	req->flags = 0;
 	req->refs = 1;
+	req->buffer = NULL;
 	blocklist_create(&req->blocklist, 0, "ioreq");
 	return req;
 }
@@ -7,13 +7,18 @@
 #include <sea/errno.h>
 #include <sea/loader/symbol.h>
 #include <sea/fs/kerfs.h>
+#include <sea/sys/fcntl.h>
+#include <sea/mm/dma.h>
+#include <sea/tm/blocking.h>
 static int block_major;
 static int next_minor = 1;
 int blockdev_register(struct inode *node, struct blockctl *ctl)
 {
 	struct blockdev *bd = kmalloc(sizeof(struct blockdev));
-	mutex_create(&ctl->cachelock, 0);
-	hash_create(&ctl->cache, 0, 0x4000);
+	assert(ctl->blocksize <= PAGE_SIZE && !(PAGE_SIZE % ctl->blocksize));
+	block_cache_register(ctl);
+	mutex_create(&ctl->carve_lock, 0);
+	blocklist_create(&ctl->io_wait, 0, "block-io");
 	mpscq_create(&ctl->queue, 1000);
 	bd->ctl = ctl;
 
@@ -23,9 +28,12 @@ int blockdev_register(struct inode *node, struct blockctl *ctl)
 	node->kdev = dm_device_get(block_major);
 	
 	kthread_create(&ctl->elevator, "[kelevator]", 0, block_elevator_main, node);
+	block_writeback_init(ctl);
 	char name[64];
 	snprintf(name, 64, "/dev/bcache-%d", num);
 	kerfs_register_parameter(name, ctl, 0, 0, kerfs_block_cache_report);
+	snprintf(name, 64, "/dev/elevator-%d", num);
+	kerfs_register_parameter(name, ctl, 0, KERFS_PARAM_WRITE, kerfs_elevator_param);
 	return num;
 }
 
@@ -61,6 +69,8 @@ static ssize_t __block_write(struct file *file, off_t posit, uint8_t *buf, size_
 	int blk_size = bd->ctl->blocksize;
 	unsigned pos = posit;
 
+	block_writeback_throttle(bd->ctl);
+
 	/* If we are offset in a block, we dont wanna overwrite stuff */
 	if(pos % blk_size)
 	{
@@ -114,6 +124,79 @@ static ssize_t __block_write(struct file *file, off_t posit, uint8_t *buf, size_
 	return pos-posit;
 }
 
+/* send one direct request through the elevator and wait for it */
+static bool __direct_request(struct blockdev *bd, int rw, uint64_t block, size_t num_blocks, uint8_t *data)
+{
+	struct ioreq *req = ioreq_create(bd, rw, block, num_blocks);
+	req->buffer = data;
+	atomic_fetch_add(&req->refs, 1);
+	tm_thread_block_confirm(&req->blocklist, THREADSTATE_UNINTERRUPTIBLE,
+			block_elevator_add_request, req);
+	assert(req->flags & IOREQ_COMPLETE);
+	bool ok = !(req->flags & IOREQ_FAILED);
+	ioreq_put(req);
+	return ok;
+}
+
+/* O_DIRECT: move whole blocks straight between buf and the device, without
+ * making buffers for them. The transfer goes through the elevator like any
+ * other request, so it stays ordered with the rest of the device's I/O. Dirty
+ * buffers in the range are written back first and cached ones are dropped, so
+ * that buffered and direct I/O see the same data.
+ *
+ * The elevator thread can't see the caller's address space, so user memory is
+ * faulted in, pinned and mapped into the kernel for the transfer. Memory that
+ * isn't block aligned, or can't be pinned, goes through a kernel copy instead,
+ * one elevator chunk at a time. */
+ssize_t block_direct_io(int rw, struct inode *node, off_t pos, uint8_t *buf, size_t count)
+{
+	struct blockdev *bd = node->devdata;
+	struct blockctl *ctl = bd->ctl;
+	if(pos % ctl->blocksize || count % ctl->blocksize)
+		return -EINVAL;
+	uint64_t block = pos / ctl->blocksize;
+	size_t num_blocks = count / ctl->blocksize;
+	if(!num_blocks)
+		return 0;
+	struct dma_user_region user;
+	bool aligned = !((addr_t)buf % ctl->blocksize), mapped = false;
+	if(aligned && !IS_KERN_MEM((addr_t)buf))
+		mapped = !mm_map_user_buffer(&user, (addr_t)buf, count, rw == READ);
+
+	block_writeback_range(ctl, block + bd->partbegin, num_blocks);
+	dm_block_cache_invalidate(bd, block, num_blocks);
+	bool ok;
+	if(mapped) {
+		ok = __direct_request(bd, rw, block, num_blocks, (uint8_t *)user.v);
+		mm_unmap_user_buffer(&user);
+	} else if(aligned && IS_KERN_MEM((addr_t)buf)) {
+		ok = __direct_request(bd, rw, block, num_blocks, buf);
+	} else {
+		size_t chunk = num_blocks < ELEVATOR_MAX_BLOCKS ? num_blocks : ELEVATOR_MAX_BLOCKS;
+		uint8_t *copy = kmalloc((chunk + 1) * ctl->blocksize);
+		uint8_t *data = (uint8_t *)(((addr_t)copy + ctl->blocksize - 1) & ~(ctl->blocksize - 1));
+		ok = true;
+		for(size_t done = 0;ok && done < num_blocks;done += chunk) {
+			if(chunk > num_blocks - done)
+				chunk = num_blocks - done;
+			uint8_t *user_data = buf + done * ctl->blocksize;
+			if(rw == WRITE)
+				memcpy(data, user_data, chunk * ctl->blocksize);
+			ok = __direct_request(bd, rw, block + done, chunk, data);
+			if(ok && rw == READ)
+				memcpy(user_data, data, chunk * ctl->blocksize);
+		}
+		kfree(copy);
+	}
+	/* a buffered read could have cached the old contents while we were writing */
+	if(rw == WRITE)
+		dm_block_cache_invalidate(bd, block, num_blocks);
+	if(!ok)
+		return -EIO;
+	ctl->direct_blocks += num_blocks;
+	return count;
+}
+
 int block_select(struct file *file, int rw)
 {
 	struct blockdev *bd = file->inode->devdata;
@@ -125,6 +208,8 @@ int block_select(struct file *file, int rw)
 
 ssize_t block_rw(int rw, struct file *file, off_t off, uint8_t *buffer, size_t len)
 {
+	if(file->flags & _FDIRECT)
+		return block_direct_io(rw, file->inode, off, buffer, len);
 	if(rw == READ)
 		return __block_read(file, off, buffer, len);
 	else if(rw == WRITE)
@@ -157,5 +242,8 @@ void blockdev_init(void)
 	
 	loader_add_kernel_symbol(blockdev_register);
 	loader_add_kernel_symbol(blockdev_register_partition);
+	loader_add_kernel_symbol(block_direct_io);
+	loader_add_kernel_symbol(block_io_complete);
+	loader_add_kernel_symbol(block_io_notify);
 }
 
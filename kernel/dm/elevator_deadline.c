@@ -0,0 +1,134 @@
+/* elevator_deadline.c: the deadline scheduler. Reads and writes are each kept
+ * in a list sorted by block, and issued in ascending order from wherever the
+ * last request ended, wrapping around at the end (a one-way elevator). Each
+ * request also gets a deadline, and once the oldest request in a direction has
+ * passed its deadline, it goes next regardless of position. Reads are preferred
+ * over writes, since something is usually waiting on them, but writes are never
+ * passed over more than DEADLINE_WRITES_STARVED times in a row. */
+#include <sea/dm/block.h>
+#include <sea/dm/blockdev.h>
+#include <sea/mm/kmalloc.h>
+#include <sea/tm/timing.h>
+
+#define DEADLINE_READ_EXPIRE  (ONE_MILLISECOND * 500)
+#define DEADLINE_WRITE_EXPIRE (ONE_SECOND * 5)
+#define DEADLINE_WRITES_STARVED 2
+
+#define DIR_READ 0
+#define DIR_WRITE 1
+
+struct deadline_data {
+	struct linkedlist sorted[2], fifo[2];
+	uint64_t next_block;
+	int starved;
+};
+
+static inline int __dir(struct ioreq *req)
+{
+	return req->direction == READ ? DIR_READ : DIR_WRITE;
+}
+
+static void *deadline_init(void)
+{
+	struct deadline_data *dd = kmalloc(sizeof(struct deadline_data));
+	for(int i=0;i<2;i++) {
+		linkedlist_create(&dd->sorted[i], LINKEDLIST_LOCKLESS);
+		linkedlist_create(&dd->fifo[i], LINKEDLIST_LOCKLESS);
+	}
+	return dd;
+}
+
+static void deadline_destroy(void *data)
+{
+	struct deadline_data *dd = data;
+	for(int i=0;i<2;i++) {
+		linkedlist_destroy(&dd->sorted[i]);
+		linkedlist_destroy(&dd->fifo[i]);
+	}
+	kfree(dd);
+}
+
+/* linkedlist only inserts at the front, so do this by hand */
+static void __insert_before(struct linkedlist *list, struct linkedentry *pos,
+		struct linkedentry *entry, void *obj)
+{
+	entry->obj = obj;
+	entry->next = pos;
+	entry->prev = pos->prev;
+	pos->prev->next = entry;
+	pos->prev = entry;
+	list->count++;
+}
+
+static void deadline_add(void *data, struct ioreq *req)
+{
+	struct deadline_data *dd = data;
+	struct linkedlist *sorted = &dd->sorted[__dir(req)];
+	struct linkedentry *ent;
+	for(ent = linkedlist_iter_start(sorted);ent != linkedlist_iter_end(sorted);
+			ent = linkedlist_iter_next(ent)) {
+		struct ioreq *group = ent->obj;
+		/* a front merge moves the group's start back, but since it was
+		 * adjacent, the group stays in the right place in the list */
+		if(elevator_try_merge(group, req)) {
+			req->bd->ctl->el_merged++;
+			return;
+		}
+		if(group->start > req->start)
+			break;
+	}
+	__insert_before(sorted, ent, &req->sort_entry, req);
+	req->deadline = tm_timing_get_microseconds()
+		+ (__dir(req) == DIR_READ ? DEADLINE_READ_EXPIRE : DEADLINE_WRITE_EXPIRE);
+	linkedlist_insert(&dd->fifo[__dir(req)], &req->fifo_entry, req);
+}
+
+static struct ioreq *deadline_dispatch(void *data)
+{
+	struct deadline_data *dd = data;
+	bool reads = dd->sorted[DIR_READ].count > 0;
+	bool writes = dd->sorted[DIR_WRITE].count > 0;
+	int dir;
+	if(reads && (!writes || dd->starved < DEADLINE_WRITES_STARVED)) {
+		dir = DIR_READ;
+		if(writes)
+			dd->starved++;
+	} else if(writes) {
+		dir = DIR_WRITE;
+		dd->starved = 0;
+	} else {
+		return NULL;
+	}
+
+	struct ioreq *req = NULL;
+	/* the oldest request is at the back of the fifo */
+	struct ioreq *oldest = dd->fifo[dir].sentry.prev->obj;
+	if(tm_timing_get_microseconds() >= oldest->deadline) {
+		req = oldest;
+	} else {
+		struct linkedlist *sorted = &dd->sorted[dir];
+		struct linkedentry *ent;
+		for(ent = linkedlist_iter_start(sorted);ent != linkedlist_iter_end(sorted);
+				ent = linkedlist_iter_next(ent)) {
+			struct ioreq *group = ent->obj;
+			if(group->start >= dd->next_block) {
+				req = group;
+				break;
+			}
+		}
+		if(!req)
+			req = linkedlist_iter_start(sorted)->obj;
+	}
+	linkedlist_do_remove(&dd->sorted[dir], &req->sort_entry);
+	linkedlist_do_remove(&dd->fifo[dir], &req->fifo_entry);
+	dd->next_block = req->start + req->length;
+	return req;
+}
+
+struct elevator_ops elevator_deadline = {
+	.name = "deadline",
+	.init = deadline_init,
+	.destroy = deadline_destroy,
+	.add = deadline_add,
+	.dispatch = deadline_dispatch,
+};
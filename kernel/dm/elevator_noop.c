@@ -0,0 +1,58 @@
+/* elevator_noop.c: the noop scheduler. Requests are issued in the order they
+ * arrive, but a request that's adjacent to one that's still queued is merged
+ * into it. Useful for devices where seek order doesn't matter. */
+#include <sea/dm/block.h>
+#include <sea/dm/blockdev.h>
+#include <sea/mm/kmalloc.h>
+
+struct noop_data {
+	struct linkedlist fifo;
+};
+
+static void *noop_init(void)
+{
+	struct noop_data *nd = kmalloc(sizeof(struct noop_data));
+	linkedlist_create(&nd->fifo, LINKEDLIST_LOCKLESS);
+	return nd;
+}
+
+static void noop_destroy(void *data)
+{
+	struct noop_data *nd = data;
+	linkedlist_destroy(&nd->fifo);
+	kfree(nd);
+}
+
+static void noop_add(void *data, struct ioreq *req)
+{
+	struct noop_data *nd = data;
+	struct linkedentry *ent;
+	for(ent = linkedlist_iter_start(&nd->fifo);ent != linkedlist_iter_end(&nd->fifo);
+			ent = linkedlist_iter_next(ent)) {
+		struct ioreq *group = ent->obj;
+		if(elevator_try_merge(group, req)) {
+			req->bd->ctl->el_merged++;
+			return;
+		}
+	}
+	linkedlist_insert(&nd->fifo, &req->fifo_entry, req);
+}
+
+static struct ioreq *noop_dispatch(void *data)
+{
+	struct noop_data *nd = data;
+	if(!nd->fifo.count)
+		return NULL;
+	/* insert puts new requests at the front, so the oldest is at the back */
+	struct ioreq *req = nd->fifo.sentry.prev->obj;
+	linkedlist_do_remove(&nd->fifo, &req->fifo_entry);
+	return req;
+}
+
+struct elevator_ops elevator_noop = {
+	.name = "noop",
+	.init = noop_init,
+	.destroy = noop_destroy,
+	.add = noop_add,
+	.dispatch = noop_dispatch,
+};
@@ -18,6 +18,20 @@ ssize_t fs_callback_inode_write(struct inode *node, size_t off, size_t len, cons
 	return -ENOTSUP;
 }
 
+ssize_t fs_callback_inode_direct_io(struct inode *node, int rw, size_t off, size_t len, unsigned char *buf)
+{
+	assert(node && node->filesystem && node->filesystem->fs_inode_ops);
+	if(node->filesystem->fs_inode_ops->direct_io)
+		return node->filesystem->fs_inode_ops->direct_io(node->filesystem, node, rw, off, len, buf);
+	return -ENOTSUP;
+}
+
+bool fs_callback_inode_has_direct_io(struct inode *node)
+{
+	return node->filesystem && node->filesystem->fs_inode_ops
+		&& node->filesystem->fs_inode_ops->direct_io;
+}
+
 int fs_callback_inode_pull(struct inode *node)
 {
 	assert(node && node->filesystem && node->filesystem->fs_inode_ops);
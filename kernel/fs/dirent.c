@@ -22,11 +22,32 @@ struct mutex *dirent_cache_lock;
  * read from a directory entry is when the dirent has a non-zero count.
  */
 
+static size_t dirent_cache_count(void)
+{
+	return queue_count(dirent_lru);
+}
+
+static size_t dirent_cache_scan(size_t nr)
+{
+	size_t amount = 0;
+	while(nr--)
+		amount += fs_dirent_reclaim_lru();
+	return amount;
+}
+
+static struct reclaimer dirent_reclaimer = {
+	.name = "dirents",
+	.count = dirent_cache_count,
+	.scan = dirent_cache_scan,
+	.object_size = sizeof(struct dirent),
+	.seeks = RECLAIM_DEFAULT_SEEKS,
+};
+
 void vfs_dirent_init(void)
 {
 	dirent_lru = queue_create(0, 0);
 	dirent_cache_lock = mutex_create(0, 0);
-	mm_reclaim_register(fs_dirent_reclaim_lru, sizeof(struct dirent));
+	mm_reclaim_register(&dirent_reclaimer);
 }
 
 void vfs_dirent_acquire(struct dirent *dir)
@@ -97,15 +118,17 @@ size_t fs_dirent_reclaim_lru(void)
 	struct inode *parent = dir->parent;
 	rwlock_acquire(&parent->lock, RWL_WRITER);
 	atomic_fetch_add(&parent->count, 1);
+	size_t amount = 0;
 	if(dir && dir->count == 0) {
 		/* reclaim this node */
 		vfs_inode_del_dirent(parent, dir);
 		vfs_dirent_destroy(dir);
+		amount = sizeof(struct dirent);
 	}
 	atomic_fetch_sub(&parent->count, 1);
 	rwlock_release(&parent->lock, RWL_WRITER);
 	mutex_release(dirent_cache_lock);
-	return sizeof(struct dirent);
+	return amount;
 }
 
 /* This function returns the directory entry associated with the name 'name' under
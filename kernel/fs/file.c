@@ -54,6 +54,7 @@ void file_put(struct file *file)
 {
 	if(atomic_fetch_sub(&file->count, 1) == 1) {
 		/* destroy */
+		fs_file_readahead_cancel(file);
 		if(file->inode->kdev && file->inode->kdev->close)
 			file->inode->kdev->close(file);
 		if(file->dirent)
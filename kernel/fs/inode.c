@@ -9,12 +9,34 @@
 #include <sea/fs/dir.h>
 #include <sea/fs/pipe.h>
 #include <sea/fs/kerfs.h>
+#include <sea/dm/dev.h>
 
 struct hash *icache;
 struct linkedlist *ic_dirty, *ic_inuse;
 struct queue *ic_lru;
 struct mutex *ic_lock;
 
+static size_t icache_count(void)
+{
+	return queue_count(ic_lru);
+}
+
+static size_t icache_scan(size_t nr)
+{
+	size_t amount = 0;
+	while(nr--)
+		amount += fs_inode_reclaim_lru();
+	return amount;
+}
+
+static struct reclaimer icache_reclaimer = {
+	.name = "icache",
+	.count = icache_count,
+	.scan = icache_scan,
+	.object_size = sizeof(struct inode),
+	.seeks = RECLAIM_DEFAULT_SEEKS,
+};
+
 void vfs_icache_init(void)
 {
 	icache = hash_create(0, 0, 0x4000);
@@ -24,7 +46,8 @@ void vfs_icache_init(void)
 	ic_lru = queue_create(0, 0);
 	ic_lock = mutex_create(0, 0);
 
-	mm_reclaim_register(fs_inode_reclaim_lru, sizeof(struct inode));
+	mm_reclaim_register(&icache_reclaimer);
+	fs_inode_pcache_init();
 }
 
 /* these three just handle the dirent cache. They don't actually look anything up */
@@ -259,10 +282,11 @@ int fs_inode_pull(struct inode *node)
 	return r;
 }
 
-/* write an inode to a filesystem */
+/* write an inode (and any dirty cached data) to a filesystem */
 int fs_inode_push(struct inode *node)
 {
 	int r = 0;
+	fs_inode_pcache_writeback(node);
 	if(node->flags & INODE_DIRTY) {
 		r = fs_callback_inode_push(node);
 		if(!r)
@@ -293,7 +317,7 @@ ssize_t fs_inode_write(struct inode *node, size_t off, size_t count, const unsig
 		return -EISDIR;
 	if(!vfs_inode_check_permissions(node, MAY_WRITE, 0))
 		return -EACCES;
-	ssize_t ret = fs_callback_inode_write(node, off, count, buf);
+	ssize_t ret = fs_inode_pcache_write(node, off, count, buf);
 	if(ret > 0) {
 		node->mtime = time_get_epoch();
 		vfs_inode_set_dirty(node);
@@ -307,7 +331,28 @@ ssize_t fs_inode_read(struct inode *node, size_t off, size_t count, unsigned cha
 		return -EACCES;
 	ssize_t ret;
 
-	ret = fs_callback_inode_read(node, off, count, buf);
+	ret = fs_inode_pcache_read(node, off, count, buf);
+	return ret;
+}
+
+/* O_DIRECT on a regular file. The filesystem moves the data between buf and the
+ * disk itself, so cached pages of the range are written back and dropped first.
+ * Pages that are mapped can't be dropped, so they get a copy of whatever was
+ * written. Files that the filesystem can't do direct I/O on just go through
+ * the cache as usual. */
+ssize_t fs_inode_direct_io(int rw, struct inode *node, size_t off, size_t count, unsigned char *buf)
+{
+	if(!fs_inode_pcache_enabled(node) || !fs_callback_inode_has_direct_io(node))
+		return rw == READ ? fs_inode_read(node, off, count, buf) : fs_inode_write(node, off, count, buf);
+	if(!vfs_inode_check_permissions(node, rw == READ ? MAY_READ : MAY_WRITE, 0))
+		return -EACCES;
+	fs_inode_pcache_invalidate(node, off, count);
+	ssize_t ret = fs_callback_inode_direct_io(node, rw, off, count, buf);
+	if(ret > 0 && rw == WRITE) {
+		fs_inode_pcache_update(node, off, ret, buf);
+		node->mtime = time_get_epoch();
+		vfs_inode_set_dirty(node);
+	}
 	return ret;
 }
 
@@ -338,6 +383,7 @@ int vfs_inode_chroot(struct inode *node)
 static void __icache_sync_action(struct linkedentry *entry)
 {
 	struct inode *node = entry->obj;
+	fs_inode_pcache_writeback(node);
 	if(node->flags & INODE_DIRTY)
 		fs_callback_inode_push(node);
 	linkedlist_do_remove(ic_dirty, &node->dirty_item);
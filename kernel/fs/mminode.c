@@ -1,37 +1,450 @@
-/* mminode.c: handle shared memory mapping of files at the inode level. The inode
- * keeps track of physical pages that get shared among mappings from different
- * processes. It handles loading data from pagefaulting, etc.
+/* mminode.c: the per-inode page cache. The inode keeps a radix tree of physical
+ * pages, indexed by page number, that holds file data. read and write go through
+ * these pages for regular files on block-backed filesystems, and shared mappings
+ * map them directly, so all three see the same data. Private mappings get a copy
+ * of the cached page on fault.
  */
 
 #include <sea/kernel.h>
 #include <sea/types.h>
 #include <sea/fs/inode.h>
+#include <sea/fs/kerfs.h>
 #include <sea/mm/vmm.h>
+#include <sea/mm/reclaim.h>
+#include <sea/cpu/time.h>
 #include <stdatomic.h>
 #include <sea/errno.h>
 #include <sea/vsprintf.h>
 #include <sea/mm/kmalloc.h>
-/* Each page of the inode has a count associated with it. When the count reaches
- * zero, the page is written to disk, and the page is freed. When region is mapped,
- * the pages aren't necessarily allocated right away. A call to map_region
- * is made, each page in the region has its count increased. The page is only allocated
- * after a pagefault. A call to unmap_region decreases the counts of all pages in the
- * region.
+#include <sea/tm/process.h>
+#include <limits.h>
+/* Each page of the inode has a count associated with it, which is the number of
+ * shared mappings that cover it. When region is mapped, the pages aren't necessarily
+ * allocated right away. A call to map_region is made, each page in the region has
+ * its count increased. The page is only allocated after a pagefault (or a read or
+ * write). A call to unmap_region decreases the counts of all pages in the region.
+ * Pages with a zero count are only held by the cache, and can be reclaimed.
+ *
+ * Locking: the tree is protected by the inode's mappings_lock. An entry's lock
+ * is acquired either while holding mappings_lock, or while holding a pin on the
+ * entry. Pins are only taken under mappings_lock. Whoever holds mappings_lock and
+ * sees that an entry has no pins knows that nobody is holding or waiting on its
+ * lock, and may free it. Anything that can block on disk I/O under an entry's
+ * lock (reads, writes, writeback) goes through a pin, so that a slow page doesn't
+ * hold up the rest of the inode.
  */
 
 struct physical_page {
 	addr_t page;
 	int pn;
 	int count;
+	int flags;
+	_Atomic int pins;
 	struct mutex lock;
-	struct hashelem hash_elem;
 };
 
-/* if physicals hasn't been initialized, initialize it. */
+#define PHYS_PAGE_DIRTY 1
+
+static struct linkedlist pcache_inodes;
+static struct mutex pcache_lock;
+static _Atomic size_t pcache_pages = 0, pcache_dirty = 0;
+static _Atomic size_t pcache_hits = 0, pcache_misses = 0, pcache_writebacks = 0;
+static _Atomic size_t pcache_readahead = 0;
+
+/* regular files on filesystems with a backing device have their data go through
+ * the cache. Memory-backed filesystems (ramfs) already hold their data in memory,
+ * so caching it would only double the footprint. */
+bool fs_inode_pcache_enabled(struct inode *node)
+{
+	return S_ISREG(node->mode) && node->filesystem && node->filesystem->dev && !node->kdev;
+}
+
+/* if physicals hasn't been initialized, initialize it. Must be called without
+ * mappings_lock held. The tree is valid as soon as the inode is allocated (zeroed),
+ * so all this does is make the inode visible to the reclaimer. */
 static void __init_physicals(struct inode *node)
 {
 	if(!(atomic_fetch_or(&node->flags, INODE_PCACHE) & INODE_PCACHE)) {
-		hash_create(&node->physicals, 0, 1000);
+		mutex_acquire(&pcache_lock);
+		linkedlist_insert(&pcache_inodes, &node->pcache_item, node);
+		mutex_release(&pcache_lock);
+	}
+}
+
+static struct physical_page *__create_entry (void)
+{
+	struct physical_page *p = kmalloc(sizeof(struct physical_page));
+	mutex_create(&p->lock, 0);
+	return p;
+}
+
+/* look up the entry for page pn, creating it if it doesn't exist. Must be called
+ * with mappings_lock held. */
+static struct physical_page *__lookup_entry(struct inode *node, int pn)
+{
+	struct physical_page *entry;
+	if((entry = radix_tree_lookup(&node->physicals, pn)) == NULL) {
+		entry = __create_entry();
+		entry->pn = pn;
+		radix_tree_insert(&node->physicals, pn, entry);
+		atomic_fetch_add_explicit(&node->mapped_entries_count, 1, memory_order_relaxed);
+	}
+	return entry;
+}
+
+/* as above, but returns with the entry's lock held */
+static struct physical_page *__get_entry(struct inode *node, int pn)
+{
+	struct physical_page *entry = __lookup_entry(node, pn);
+	mutex_acquire(&entry->lock);
+	return entry;
+}
+
+/* get the entry for page pn pinned and locked, without holding mappings_lock
+ * while waiting for the entry. Undone by __put_entry. */
+static struct physical_page *__get_entry_pinned(struct inode *node, int pn)
+{
+	mutex_acquire(&node->mappings_lock);
+	struct physical_page *entry = __lookup_entry(node, pn);
+	atomic_fetch_add(&entry->pins, 1);
+	mutex_release(&node->mappings_lock);
+	mutex_acquire(&entry->lock);
+	return entry;
+}
+
+static void __put_entry(struct physical_page *entry)
+{
+	mutex_release(&entry->lock);
+	atomic_fetch_sub(&entry->pins, 1);
+}
+
+/* make sure the entry has a page. If read is set, fill it with data from the
+ * filesystem, otherwise leave it zeroed (the caller is about to overwrite it).
+ * Called with the entry's lock held. */
+static ssize_t __fill_entry(struct inode *node, struct physical_page *entry, bool read)
+{
+	if(entry->page) {
+		atomic_fetch_add_explicit(&pcache_hits, 1, memory_order_relaxed);
+		return 0;
+	}
+	atomic_fetch_add_explicit(&pcache_misses, 1, memory_order_relaxed);
+	entry->page = mm_physical_allocate(PAGE_SIZE, true);
+	mm_physical_increment_count(entry->page);
+	atomic_fetch_add(&node->mapped_pages_count, 1);
+	atomic_fetch_add(&pcache_pages, 1);
+
+	size_t offset = (size_t)entry->pn * PAGE_SIZE;
+	ssize_t err = 0;
+	if(read && offset < (size_t)node->length && node->filesystem) {
+		size_t len = PAGE_SIZE;
+		if(len + offset > (size_t)node->length)
+			len = node->length - offset;
+		err = fs_callback_inode_read(node, offset, len, (void *)(entry->page + PHYS_PAGE_MAP));
+		if(err < 0)
+			printk(0, "[mminode]: read inode failed with %d\n", err);
+	}
+	return err;
+}
+
+/* drop the entry's page. Called with the entry's lock held. */
+static void __release_page(struct inode *node, struct physical_page *entry)
+{
+	if(!entry->page)
+		return;
+	if(entry->flags & PHYS_PAGE_DIRTY)
+		atomic_fetch_sub(&pcache_dirty, 1);
+	entry->flags &= ~PHYS_PAGE_DIRTY;
+	mm_physical_decrement_count(entry->page);
+	entry->page = 0;
+	atomic_fetch_sub(&node->mapped_pages_count, 1);
+	atomic_fetch_sub(&pcache_pages, 1);
+}
+
+/* remove an unmapped entry from the tree and free it. Called with mappings_lock
+ * and the entry's lock held. */
+static void __destroy_entry(struct inode *node, struct physical_page *entry)
+{
+	assert(!entry->count && !atomic_load(&entry->pins));
+	__release_page(node, entry);
+	radix_tree_delete(&node->physicals, entry->pn);
+	mutex_destroy(&entry->lock);
+	kfree(entry);
+	atomic_fetch_sub(&node->mapped_entries_count, 1);
+}
+
+static inline void __set_dirty(struct physical_page *entry)
+{
+	if(!(entry->flags & PHYS_PAGE_DIRTY)) {
+		entry->flags |= PHYS_PAGE_DIRTY;
+		atomic_fetch_add(&pcache_dirty, 1);
+	}
+}
+
+/* write a dirty page back to the filesystem. Called with the entry's lock held. */
+static void __writeback_entry(struct inode *node, struct physical_page *entry)
+{
+	if(!entry->page || !(entry->flags & PHYS_PAGE_DIRTY))
+		return;
+	entry->flags &= ~PHYS_PAGE_DIRTY;
+	atomic_fetch_sub(&pcache_dirty, 1);
+	/* the file may have been deleted since, in which case there's nothing to write to */
+	if(!node->nlink || !node->filesystem)
+		return;
+	size_t offset = (size_t)entry->pn * PAGE_SIZE;
+	if(offset >= (size_t)node->length)
+		return;
+	size_t len = PAGE_SIZE;
+	if(len + offset > (size_t)node->length)
+		len = node->length - offset;
+	atomic_fetch_add_explicit(&pcache_writebacks, 1, memory_order_relaxed);
+	if(fs_callback_inode_write(node, offset, len, (void *)(entry->page + PHYS_PAGE_MAP)) < 0)
+		printk(0, "[mminode]: warning: failed to write back data\n");
+}
+
+ssize_t fs_inode_pcache_read(struct inode *node, size_t off, size_t count, unsigned char *buf)
+{
+	if(!fs_inode_pcache_enabled(node))
+		return fs_callback_inode_read(node, off, count, buf);
+	if(off >= (size_t)node->length)
+		return 0;
+	if(off + count > (size_t)node->length)
+		count = node->length - off;
+	__init_physicals(node);
+	size_t done = 0;
+	while(done < count) {
+		size_t pos = off + done;
+		size_t pgoff = pos % PAGE_SIZE;
+		size_t amount = PAGE_SIZE - pgoff;
+		if(amount > count - done)
+			amount = count - done;
+		struct physical_page *entry = __get_entry_pinned(node, pos / PAGE_SIZE);
+		ssize_t err = __fill_entry(node, entry, true);
+		if(err < 0) {
+			/* don't keep a page we couldn't read. The (now empty) entry
+			 * will get cleaned up by the reclaimer. */
+			if(!entry->count)
+				__release_page(node, entry);
+			__put_entry(entry);
+			return done ? (ssize_t)done : err;
+		}
+		memcpy(buf + done, (void *)(entry->page + PHYS_PAGE_MAP + pgoff), amount);
+		__put_entry(entry);
+		done += amount;
+	}
+	return done;
+}
+
+/* bring npages pages starting at page start into the cache, skipping any that are
+ * already resident. Stops early at the end of the file, or if cancel gets set.
+ * Returns the number of pages read in. */
+size_t fs_inode_pcache_readahead(struct inode *node, size_t start, size_t npages, _Atomic bool *cancel)
+{
+	if(!fs_inode_pcache_enabled(node))
+		return 0;
+	__init_physicals(node);
+	size_t count = 0;
+	for(size_t pn = start;pn < start + npages && !*cancel;pn++) {
+		if(pn * PAGE_SIZE >= (size_t)node->length)
+			break;
+		struct physical_page *entry = __get_entry_pinned(node, pn);
+		if(!entry->page) {
+			if(__fill_entry(node, entry, true) < 0) {
+				if(!entry->count)
+					__release_page(node, entry);
+				__put_entry(entry);
+				break;
+			}
+			count++;
+		}
+		__put_entry(entry);
+	}
+	atomic_fetch_add_explicit(&pcache_readahead, count, memory_order_relaxed);
+	return count;
+}
+
+/* copy newly written data into whichever pages of the region are resident, so that
+ * the cache stays coherent with a write that went straight to the filesystem */
+void fs_inode_pcache_update(struct inode *node, size_t off, size_t count, const unsigned char *buf)
+{
+	if(!(node->flags & INODE_PCACHE))
+		return;
+	size_t done = 0;
+	mutex_acquire(&node->mappings_lock);
+	while(done < count) {
+		size_t pos = off + done;
+		size_t pgoff = pos % PAGE_SIZE;
+		size_t amount = PAGE_SIZE - pgoff;
+		if(amount > count - done)
+			amount = count - done;
+		struct physical_page *entry = radix_tree_lookup(&node->physicals, pos / PAGE_SIZE);
+		if(entry) {
+			mutex_acquire(&entry->lock);
+			if(entry->page)
+				memcpy((void *)(entry->page + PHYS_PAGE_MAP + pgoff), buf + done, amount);
+			mutex_release(&entry->lock);
+		}
+		done += amount;
+	}
+	mutex_release(&node->mappings_lock);
+}
+
+/* writes that land inside the file are done in place in the cache, and the pages
+ * are marked dirty to be written back later (on sync, reclaim, or when the inode
+ * is evicted). Writes that extend the file go to the filesystem right away, since
+ * it's the filesystem that decides how the file grows. */
+ssize_t fs_inode_pcache_write(struct inode *node, size_t off, size_t count, const unsigned char *buf)
+{
+	if(!fs_inode_pcache_enabled(node) || off + count > (size_t)node->length) {
+		ssize_t ret = fs_callback_inode_write(node, off, count, buf);
+		if(ret > 0)
+			fs_inode_pcache_update(node, off, ret, buf);
+		return ret;
+	}
+	__init_physicals(node);
+	size_t done = 0;
+	while(done < count) {
+		size_t pos = off + done;
+		size_t pgoff = pos % PAGE_SIZE;
+		size_t amount = PAGE_SIZE - pgoff;
+		if(amount > count - done)
+			amount = count - done;
+		/* if we're overwriting everything in the page that's part of the file,
+		 * there's no need to read it in first */
+		bool whole = !pgoff && (amount == PAGE_SIZE || pos + amount >= (size_t)node->length);
+		struct physical_page *entry = __get_entry_pinned(node, pos / PAGE_SIZE);
+		ssize_t err = __fill_entry(node, entry, !whole);
+		if(err < 0) {
+			if(!entry->count)
+				__release_page(node, entry);
+			__put_entry(entry);
+			return done ? (ssize_t)done : err;
+		}
+		memcpy((void *)(entry->page + PHYS_PAGE_MAP + pgoff), buf + done, amount);
+		__set_dirty(entry);
+		__put_entry(entry);
+		done += amount;
+	}
+	return done;
+}
+
+/* pin a batch of up to 32 entries from page next up to page last. If
+ * unmapped is set, only entries that aren't mapped anywhere are taken.
+ * Returns the number pinned, and moves next past the batch. */
+static size_t __pin_batch(struct inode *node, struct physical_page **batch,
+		unsigned long *next, unsigned long last, bool unmapped)
+{
+	size_t n, pinned = 0;
+	mutex_acquire(&node->mappings_lock);
+	while(!pinned && *next <= last
+			&& (n = radix_tree_gang_lookup(&node->physicals, *next, (void **)batch, 32)) > 0) {
+		*next = batch[n-1]->pn + 1;
+		for(size_t i=0;i<n && (unsigned long)batch[i]->pn <= last;i++) {
+			if(unmapped && batch[i]->count)
+				continue;
+			atomic_fetch_add(&batch[i]->pins, 1);
+			batch[pinned++] = batch[i];
+		}
+	}
+	mutex_release(&node->mappings_lock);
+	return pinned;
+}
+
+static void __writeback_batch(struct inode *node, struct physical_page **batch, size_t n)
+{
+	for(size_t i=0;i<n;i++) {
+		mutex_acquire(&batch[i]->lock);
+		__writeback_entry(node, batch[i]);
+		mutex_release(&batch[i]->lock);
+	}
+}
+
+/* drop the pins on a batch, freeing the entries that are clean, unmapped, and
+ * not pinned by anyone else. Returns the number of pages freed. */
+static size_t __release_batch(struct inode *node, struct physical_page **batch, size_t n, size_t max)
+{
+	size_t freed = 0;
+	mutex_acquire(&node->mappings_lock);
+	for(size_t i=0;i<n;i++) {
+		struct physical_page *entry = batch[i];
+		if(atomic_fetch_sub(&entry->pins, 1) != 1 || entry->count || freed >= max)
+			continue;
+		/* nobody else has a pin, so this doesn't wait */
+		mutex_acquire(&entry->lock);
+		/* it may have been written to since we wrote it back */
+		if(entry->flags & PHYS_PAGE_DIRTY) {
+			mutex_release(&entry->lock);
+			continue;
+		}
+		if(entry->page)
+			freed++;
+		__destroy_entry(node, entry);
+	}
+	mutex_release(&node->mappings_lock);
+	return freed;
+}
+
+/* write all of the inode's dirty pages back to the filesystem. The writes are
+ * done with only the entries pinned, not with mappings_lock held. */
+void fs_inode_pcache_writeback(struct inode *node)
+{
+	if(!(node->flags & INODE_PCACHE))
+		return;
+	struct physical_page *batch[32];
+	size_t n;
+	unsigned long next = 0;
+	while((n = __pin_batch(node, batch, &next, ULONG_MAX, false)) > 0) {
+		__writeback_batch(node, batch, n);
+		for(size_t i=0;i<n;i++)
+			atomic_fetch_sub(&batch[i]->pins, 1);
+	}
+}
+
+/* the file has been cut down to length. Drop cached pages past the end, and zero
+ * the tail of the last page, so that if the file grows again, the new part reads
+ * as zeros. */
+void fs_inode_pcache_truncate(struct inode *node, size_t length)
+{
+	if(!(node->flags & INODE_PCACHE))
+		return;
+	struct physical_page *batch[32];
+	size_t n;
+	unsigned long next = length / PAGE_SIZE;
+	mutex_acquire(&node->mappings_lock);
+	while((n = radix_tree_gang_lookup(&node->physicals, next, (void **)batch, 32)) > 0) {
+		next = batch[n-1]->pn + 1;
+		for(size_t i=0;i<n;i++) {
+			struct physical_page *entry = batch[i];
+			size_t start = (size_t)entry->pn * PAGE_SIZE;
+			size_t keep = length > start ? length - start : 0;
+			mutex_acquire(&entry->lock);
+			if(!keep && !entry->count && !atomic_load(&entry->pins)) {
+				__destroy_entry(node, entry);
+				continue;
+			}
+			if(!keep && (entry->flags & PHYS_PAGE_DIRTY)) {
+				entry->flags &= ~PHYS_PAGE_DIRTY;
+				atomic_fetch_sub(&pcache_dirty, 1);
+			}
+			if(entry->page)
+				memset((void *)(entry->page + PHYS_PAGE_MAP + keep), 0, PAGE_SIZE - keep);
+			mutex_release(&entry->lock);
+		}
+	}
+	mutex_release(&node->mappings_lock);
+}
+
+/* direct I/O is about to go around the cache for a range of the file. Write back
+ * the dirty pages in it, and drop the ones that aren't mapped anywhere. */
+void fs_inode_pcache_invalidate(struct inode *node, size_t off, size_t count)
+{
+	if(!(node->flags & INODE_PCACHE) || !count)
+		return;
+	struct physical_page *batch[32];
+	size_t n;
+	unsigned long next = off / PAGE_SIZE, last = (off + count - 1) / PAGE_SIZE;
+	while((n = __pin_batch(node, batch, &next, last, false)) > 0) {
+		__writeback_batch(node, batch, n);
+		__release_batch(node, batch, n, n);
 	}
 }
 
@@ -49,9 +462,9 @@ addr_t fs_inode_map_private_physical_page(struct inode *node, addr_t virt,
 	if(!result)
 		panic(0, "trying to remap mminode private section %x", virt);
 	int err=-1;
-	/* try to read the data. If this fails, we don't really have a good way 
-	 * of telling userspace this...eh.
-	 */
+	/* try to read the data. If this fails, we don't really have a good way
+	 * of telling userspace this...eh. For cached files, this is a copy out
+	 * of the page cache. */
 	size_t len = req_len;
 	if(len + offset > (size_t)node->length)
 		len = node->length - offset;
@@ -68,10 +481,10 @@ addr_t fs_inode_map_private_physical_page(struct inode *node, addr_t virt,
 
 /* try to map a physical page of an inode to a virtual address. If FS_INODE_POPULATE
  * is passed in flags, then if the page doesn't exist, then it allocates a physical
- * page, maps it, and loaded the data. If that flag is not passed, then it simply
+ * page, and loads the data. If that flag is not passed, then it simply
  * tries to return the physical page.
  */
-addr_t fs_inode_map_shared_physical_page(struct inode *node, addr_t virt, 
+addr_t fs_inode_map_shared_physical_page(struct inode *node, addr_t virt,
 		size_t offset, int flags, int attrib)
 {
 	assert(!(virt & ~PAGE_MASK));
@@ -83,40 +496,22 @@ addr_t fs_inode_map_shared_physical_page(struct inode *node, addr_t virt,
 	mutex_acquire(&node->mappings_lock);
 	int page_number = offset / PAGE_SIZE;
 	struct physical_page *entry;
-	if((entry = hash_lookup(&node->physicals, &page_number, sizeof(page_number))) == NULL) {
+	if((entry = radix_tree_lookup(&node->physicals, page_number)) == NULL) {
 		mutex_release(&node->mappings_lock);
 		return 0;
 	}
 	assert(entry->count);
-	/* so, we don't have to worry about someone decreasing to count to zero while we're working, 
+	/* so, we don't have to worry about someone decreasing to count to zero while we're working,
 	   since a process never calls this function without being responsible for one of the counts. */
 	mutex_acquire(&entry->lock);
-	if(!entry->page && (flags & FS_INODE_POPULATE))
-	{
-		/* map a new page into virt, and load data into it */
-		entry->page = mm_physical_allocate(0x1000, false);
-		if(!mm_virtual_map(virt, entry->page, MAP_ZERO | attrib | PAGE_WRITE, 0x1000))
-			panic(0, "trying to remap mminode shared section");
-		/* YES. DO THIS TWICE. THIS IS NOT A TYPO. */
-		mm_physical_increment_count(entry->page); /* once for the map */
-		mm_physical_increment_count(entry->page); /* once for entry->page */
-
-		int err=-1;
-		/* try to read the data. If this fails, we don't really have a good way 
-		 * of telling userspace this...eh.
-		 */
-		size_t len = PAGE_SIZE;
-		if(len + offset > (size_t)node->length)
-			len = node->length - offset;
-		if(offset < (size_t)node->length) {
-			if(node->filesystem && (err=fs_inode_read(node, offset, len, (void *)virt) < 0))
-				printk(0, "[mminode]: read inode failed with %d\n", err);
-		}
-		mm_virtual_changeattr(virt, attrib, 0x1000);
-		atomic_fetch_add(&node->mapped_pages_count, 1);
-	} else if(entry->page) {
+	if(!entry->page && (flags & FS_INODE_POPULATE)) {
+		/* if the read fails, we still map the (zeroed) page; there's no good
+		 * way to tell userspace about it */
+		__fill_entry(node, entry, true);
+	}
+	if(entry->page) {
 		mm_physical_increment_count(entry->page);
-		if(!mm_virtual_map(virt, entry->page, attrib, 0x1000))
+		if(!mm_virtual_map(virt, entry->page, attrib, PAGE_SIZE))
 			panic(0, "trying to remap mminode shared section");
 	}
 	addr_t ret = entry->page;
@@ -125,33 +520,51 @@ addr_t fs_inode_map_shared_physical_page(struct inode *node, addr_t virt,
 	return ret;
 }
 
-static struct physical_page *__create_entry (void)
+/* map whichever of npages pages starting at offset are already resident in
+ * the inode, without loading anything. Pages that are already mapped at the
+ * corresponding virtual address are skipped. Returns the number of pages
+ * mapped. The caller must hold a count on the region (ie, have it mapped). */
+size_t fs_inode_map_resident_pages(struct inode *node, addr_t virt,
+		size_t offset, size_t npages, int attrib)
 {
-	struct physical_page *p = kmalloc(sizeof(struct physical_page));
-	mutex_create(&p->lock, 0);
-	return p;
+	assert(!(virt & ~PAGE_MASK));
+	assert(!(offset & ~PAGE_MASK));
+	if(!(node->flags & INODE_PCACHE))
+		return 0;
+	size_t mapped = 0;
+	mutex_acquire(&node->mappings_lock);
+	int page_number = offset / PAGE_SIZE;
+	for(size_t i=0;i<npages;i++, virt += PAGE_SIZE) {
+		struct physical_page *entry = radix_tree_lookup(&node->physicals, page_number + i);
+		if(!entry || !entry->page)
+			continue;
+		if(mm_virtual_getmap(virt, NULL, NULL))
+			continue;
+		mutex_acquire(&entry->lock);
+		if(entry->page) {
+			mm_physical_increment_count(entry->page);
+			if(mm_virtual_map(virt, entry->page, attrib, PAGE_SIZE))
+				mapped++;
+			else
+				mm_physical_decrement_count(entry->page);
+		}
+		mutex_release(&entry->lock);
+	}
+	mutex_release(&node->mappings_lock);
+	return mapped;
 }
 
 /* increase the counts of all requested pages by 1 */
 void fs_inode_map_region(struct inode *node, size_t offset, size_t length)
 {
-	mutex_acquire(&node->mappings_lock);
 	__init_physicals(node);
+	mutex_acquire(&node->mappings_lock);
 	assert(!(offset & ~PAGE_MASK));
 	int page_number = offset / PAGE_SIZE;
 	int npages = ((length-1) / PAGE_SIZE) + 1;
 	for(int i=page_number;i<(page_number+npages);i++)
 	{
-		struct physical_page *entry;
-		if((entry = hash_lookup(&node->physicals, &i, sizeof(i))) == NULL) {
-			/* create the entry, and add it */
-			entry = __create_entry();
-			entry->pn = i;
-			hash_insert(&node->physicals, &entry->pn, sizeof(entry->pn), &entry->hash_elem, entry);
-			atomic_fetch_add_explicit(&node->mapped_entries_count, 1, memory_order_relaxed);
-		}
-		mutex_acquire(&entry->lock);
-
+		struct physical_page *entry = __get_entry(node, i);
 		/* bump the count... */
 		atomic_fetch_add_explicit(&entry->count, 1, memory_order_relaxed);
 		mutex_release(&entry->lock);
@@ -162,70 +575,55 @@ void fs_inode_map_region(struct inode *node, size_t offset, size_t length)
 	mutex_release(&node->mappings_lock);
 }
 
-void fs_inode_sync_physical_page(struct inode *node, addr_t virt, size_t offset, size_t req_len)
+/* a shared mapping's pages are the cache pages, so syncing one is just writing
+ * back the cache page. Called with mappings_lock held. */
+static void __sync_page(struct inode *node, addr_t virt, size_t offset)
 {
-	assert(!(offset & ~PAGE_MASK));
-	assert(!(virt & ~PAGE_MASK));
 	if(!mm_virtual_getmap(virt, NULL, NULL))
 		return;
-	/* again, no real good way to notify userspace of a failure */
-	size_t len = req_len;
-	if(len + offset > (size_t)node->length)
-		len = node->length - offset;
-	if(offset >= (size_t)node->length)
+	struct physical_page *entry = radix_tree_lookup(&node->physicals, offset / PAGE_SIZE);
+	if(!entry)
 		return;
-	if(node->filesystem && fs_inode_write(node, offset, len, (void *)virt) < 0)
-		printk(0, "[mminode]: warning: failed to write back data\n");
+	mutex_acquire(&entry->lock);
+	__set_dirty(entry);
+	__writeback_entry(node, entry);
+	mutex_release(&entry->lock);
 }
 
-void fs_inode_sync_region(struct inode *node, addr_t virt, size_t offset, size_t length)
+void fs_inode_sync_physical_page(struct inode *node, addr_t virt, size_t offset, size_t req_len)
 {
-	mutex_acquire(&node->mappings_lock);
-	assert(node->flags & INODE_PCACHE);
+	(void)req_len;
 	assert(!(offset & ~PAGE_MASK));
 	assert(!(virt & ~PAGE_MASK));
-	int page_number = offset / PAGE_SIZE;
-	int npages = ((length-1) / PAGE_SIZE) + 1;
-	for(int i=page_number;i<(page_number+npages);i++)
-	{
-		fs_inode_sync_physical_page(node, virt + i * PAGE_SIZE, offset + i * PAGE_SIZE,
-				PAGE_SIZE);
-	}
+	if(!(node->flags & INODE_PCACHE) || offset >= (size_t)node->length)
+		return;
+	mutex_acquire(&node->mappings_lock);
+	__sync_page(node, virt, offset);
 	mutex_release(&node->mappings_lock);
+	node->mtime = time_get_epoch();
+	vfs_inode_set_dirty(node);
 }
 
-void fs_inode_pcache_invalidate(struct inode *node, size_t offset, size_t length)
+void fs_inode_sync_region(struct inode *node, addr_t virt, size_t offset, size_t length)
 {
-	if(!(node->flags & INODE_PCACHE))
-		return;
 	mutex_acquire(&node->mappings_lock);
-	offset = offset & PAGE_MASK;
-	int page_number = offset / PAGE_SIZE;
+	assert(node->flags & INODE_PCACHE);
+	assert(!(offset & ~PAGE_MASK));
+	assert(!(virt & ~PAGE_MASK));
 	int npages = ((length-1) / PAGE_SIZE) + 1;
-	for(int i=page_number;i<(page_number+npages);i++)
+	for(int i=0;i<npages;i++)
 	{
-		struct physical_page *entry;
-		if((entry = hash_lookup(&node->physicals, &i, sizeof(i))) != NULL) {
-			mutex_acquire(&entry->lock);
-			if(entry->count == 0) {
-				if(entry->page) {
-					mm_physical_decrement_count(entry->page);
-				}
-				entry->page = 0;
-				hash_delete(&node->physicals, &i, sizeof(i));
-				mutex_destroy(&entry->lock);
-				kfree(entry);
-				atomic_fetch_sub(&node->mapped_entries_count, 1);
-			} else {
-				mutex_release(&entry->lock);
-			}
-		}
+		if(offset + i * PAGE_SIZE >= (size_t)node->length)
+			break;
+		__sync_page(node, virt + i * PAGE_SIZE, offset + i * PAGE_SIZE);
 	}
 	mutex_release(&node->mappings_lock);
+	node->mtime = time_get_epoch();
+	vfs_inode_set_dirty(node);
 }
 
 /* decrease the count of each requested page by 1, and unmap it from the virtual address.
- * if the count reaches zero, sync the page, free it, and delete the entry to the hash table */
+ * the page stays in the cache until it is reclaimed. */
 void fs_inode_unmap_region(struct inode *node, addr_t virt, size_t offset, size_t length)
 {
 	mutex_acquire(&node->mappings_lock);
@@ -237,39 +635,117 @@ void fs_inode_unmap_region(struct inode *node, addr_t virt, size_t offset, size_
 	for(int i=page_number;i<(page_number+npages);i++)
 	{
 		struct physical_page *entry;
-		if((entry = hash_lookup(&node->physicals, &i, sizeof(i))) != NULL) {
+		if((entry = radix_tree_lookup(&node->physicals, i)) != NULL) {
 			mutex_acquire(&entry->lock);
 			atomic_fetch_sub(&entry->count, 1);
 			mutex_release(&entry->lock);
 		}
 		/* we'll actually do the unmapping too */
-		int attr;
 		addr_t page;
-		if(mm_virtual_getmap(virt + (i - page_number)*PAGE_SIZE, &page, &attr)) {
+		if(mm_virtual_getmap(virt + (i - page_number)*PAGE_SIZE, &page, NULL)) {
 			mm_virtual_unmap(virt + (i - page_number)*PAGE_SIZE);
-			mm_physical_decrement_count(entry->page);
+			mm_physical_decrement_count(page);
 		}
 	}
 	mutex_release(&node->mappings_lock);
 }
 
-static void __destroy_entry(struct hashelem *elem)
-{
-	struct physical_page *entry = elem->ptr;
-	if(entry->page) {
-		mm_physical_decrement_count(entry->page);
-	}
-	mutex_destroy(&entry->lock);
-	kfree(entry);
-}
-
 void fs_inode_destroy_physicals(struct inode *node)
 {
-	/* this can only be called from free_inode, so we don't need to worry about locks */
+	/* this can only be called from free_inode, so we don't need to worry about the
+	 * inode's locks. The reclaimer might be looking at it though. */
 	if(!(node->flags & INODE_PCACHE))
 		return;
-	hash_map(&node->physicals, __destroy_entry);
-	hash_destroy(&node->physicals);
+	mutex_acquire(&pcache_lock);
+	linkedlist_remove(&pcache_inodes, &node->pcache_item);
+	mutex_release(&pcache_lock);
+	/* it's off the list, so the reclaimer won't pick it up again, but it
+	 * may still be working on it */
+	while(atomic_load(&node->pcache_reclaiming))
+		tm_schedule();
+
+	struct physical_page *batch[32];
+	size_t n;
+	while((n = radix_tree_gang_lookup(&node->physicals, 0, (void **)batch, 32)) > 0) {
+		for(size_t i=0;i<n;i++) {
+			struct physical_page *entry = batch[i];
+			mutex_acquire(&entry->lock);
+			/* anything still dirty was written back when the inode was pushed */
+			entry->count = 0;
+			__destroy_entry(node, entry);
+		}
+	}
+	radix_tree_destroy(&node->physicals);
 	mutex_destroy(&node->mappings_lock);
 }
 
+/* free up to nr unmapped pages from the inode, writing them back first if they're
+ * dirty. Returns the number of pages freed. Called with no locks held, and the
+ * inode marked as being reclaimed. */
+static size_t __reclaim_inode(struct inode *node, size_t nr)
+{
+	struct physical_page *batch[32];
+	size_t n, freed = 0;
+	unsigned long next = 0;
+	while(freed < nr && (n = __pin_batch(node, batch, &next, ULONG_MAX, true)) > 0) {
+		__writeback_batch(node, batch, n);
+		freed += __release_batch(node, batch, n, nr - freed);
+	}
+	return freed;
+}
+
+static size_t pcache_count(void)
+{
+	return pcache_pages;
+}
+
+/* walk the inodes from least recently added to the cache, freeing pages, and
+ * rotate each one we look at to the front, so the next pass starts elsewhere.
+ * pcache_lock is dropped while an inode's pages are written back; marking the
+ * inode keeps it from being freed in the meantime. */
+static size_t pcache_scan(size_t nr)
+{
+	size_t freed = 0;
+	mutex_acquire(&pcache_lock);
+	size_t inodes = pcache_inodes.count;
+	while(freed < nr && inodes-- && pcache_inodes.count) {
+		struct linkedentry *ent = pcache_inodes.sentry.prev;
+		struct inode *node = ent->obj;
+		linkedlist_do_remove(&pcache_inodes, ent);
+		linkedlist_insert(&pcache_inodes, ent, node);
+		atomic_fetch_add(&node->pcache_reclaiming, 1);
+		mutex_release(&pcache_lock);
+		freed += __reclaim_inode(node, nr - freed);
+		atomic_fetch_sub(&node->pcache_reclaiming, 1);
+		mutex_acquire(&pcache_lock);
+	}
+	mutex_release(&pcache_lock);
+	return freed * PAGE_SIZE;
+}
+
+static struct reclaimer pcache_reclaimer = {
+	.name = "pcache",
+	.count = pcache_count,
+	.scan = pcache_scan,
+	.object_size = PAGE_SIZE,
+	.seeks = RECLAIM_DEFAULT_SEEKS,
+};
+
+void fs_inode_pcache_init(void)
+{
+	linkedlist_create(&pcache_inodes, LINKEDLIST_LOCKLESS);
+	mutex_create(&pcache_lock, 0);
+	mm_reclaim_register(&pcache_reclaimer);
+}
+
+int kerfs_pcache_report(int direction, void *param, size_t size, size_t offset, size_t length, unsigned char *buf)
+{
+	size_t current = 0;
+	KERFS_PRINTF(offset, length, buf, current,
+			"INODES %d, PAGES %d, DIRTY %d\n",
+			pcache_inodes.count, pcache_pages, pcache_dirty);
+	KERFS_PRINTF(offset, length, buf, current,
+			"HITS %d, MISSES %d, WRITEBACKS %d, READAHEAD %d\n",
+			pcache_hits, pcache_misses, pcache_writebacks, pcache_readahead);
+	return current;
+}
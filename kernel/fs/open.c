@@ -78,6 +78,7 @@ struct file *fs_file_open(const char *name, int flags, mode_t mode, int *error)
 	if(flags & _FTRUNC && S_ISREG(inode->mode))
 	{
 		inode->length=0;
+		fs_inode_pcache_truncate(inode, 0);
 		inode->ctime = inode->mtime = time_get_epoch();
 		vfs_inode_set_dirty(inode);
 	}
@@ -23,7 +23,7 @@ struct rfsdirent {
 struct rfsnode {
 	void *data;
 	dev_t dev;
-	size_t length;
+	size_t length, capacity;
 	uint32_t num;
 	mode_t mode;
 	uid_t uid;
@@ -305,6 +305,7 @@ void ramfs_point_to_data(struct inode *node, void *data, size_t len)
 		kfree(rfsnode->data);
 	rfsnode->data = data;
 	rfsnode->length = node->length = len;
+	rfsnode->capacity = len;
 }
 
 ssize_t ramfs_inode_write(struct filesystem *fs, struct inode *node,
@@ -316,19 +317,31 @@ ssize_t ramfs_inode_write(struct filesystem *fs, struct inode *node,
 	if((rfsnode = hash_lookup(info->nodes, &node->id, sizeof(node->id))) == NULL)
 		return -EIO;
 	size_t end = length + offset;
-	if(end > node->length && end > 0x1000)
-		return -EIO;
 	rwlock_acquire(&node->metalock, RWL_WRITER);
-	if(end > node->length) {
-		void *newdata = kmalloc(end);
+	/* truncating only lowers the length, so the buffer past it may still
+	 * hold old data */
+	size_t valid = rfsnode->length < rfsnode->capacity ? rfsnode->length : rfsnode->capacity;
+	if(end > rfsnode->capacity) {
+		/* grow geometrically, so that files written in small
+		 * appends don't get copied on every write */
+		size_t capacity = rfsnode->capacity * 2;
+		if(capacity < end)
+			capacity = end;
+		void *newdata = kmalloc(capacity);
 		if(rfsnode->data) {
-			memcpy(newdata, rfsnode->data, rfsnode->length);
+			memcpy(newdata, rfsnode->data, valid);
 			if((addr_t)rfsnode->data >= MEMMAP_KMALLOC_START && (addr_t)rfsnode->data < MEMMAP_KMALLOC_END)
 			{
 				kfree(rfsnode->data);
 			}
 		}
 		rfsnode->data = newdata;
+		rfsnode->capacity = capacity;
+	}
+	/* a write past the end leaves a hole, which reads back as zeros */
+	if(offset > valid)
+		memset((unsigned char *)rfsnode->data + valid, 0, offset - valid);
+	if(end > node->length) {
 		rfsnode->length = end;
 		node->length = end;
 	}
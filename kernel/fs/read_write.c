@@ -21,8 +21,12 @@ ssize_t fs_file_pread(struct file *file, off_t offset, uint8_t *buffer, size_t l
 	if(file->inode->kdev) {
 		if(file->inode->kdev->rw)
 			ret = file->inode->kdev->rw(READ, file, offset, buffer, length);
+	} else if(file->flags & _FDIRECT) {
+		ret = fs_inode_direct_io(READ, file->inode, offset, length, buffer);
 	} else {
 		ret = fs_inode_read(file->inode, offset, length, buffer);
+		if(ret > 0)
+			fs_file_readahead(file, offset, ret);
 	}
 	return ret;
 }
@@ -41,9 +45,10 @@ ssize_t fs_file_pwrite(struct file *file, off_t offset, uint8_t *buffer, size_t
 	if(file->inode->kdev) {
 		if(file->inode->kdev->rw)
 			ret = file->inode->kdev->rw(WRITE, file, offset, buffer, length);
+	} else if(file->flags & _FDIRECT) {
+		ret = fs_inode_direct_io(WRITE, file->inode, offset, length, buffer);
 	} else {
 		ret = fs_inode_write(file->inode, offset, length, buffer);
-		fs_inode_pcache_invalidate(file->inode, offset, length);
 	}
 	return ret;
 }
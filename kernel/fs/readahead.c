@@ -0,0 +1,157 @@
+/* readahead.c: sequential readahead for regular files. Each open file tracks
+ * where the next sequential read would start. While reads stay sequential, a
+ * window of pages past the read is prefetched into the page cache by a kernel
+ * thread, doubling in size each time the reader catches up to it. A read
+ * anywhere else drops the window and cancels anything still queued. */
+#include <sea/kernel.h>
+#include <sea/fs/inode.h>
+#include <sea/fs/file.h>
+#include <sea/mm/kmalloc.h>
+#include <sea/mm/reclaim.h>
+#include <sea/tm/kthread.h>
+#include <sea/tm/blocking.h>
+#include <sea/tm/process.h>
+#include <stdatomic.h>
+
+#define RA_MIN_PAGES 4   /* 16KB */
+#define RA_MAX_PAGES 128 /* 512KB */
+#define RA_MAX_QUEUED 64
+
+struct readahead_request {
+	struct file *file;
+	struct inode *node;
+	size_t start, npages;
+	_Atomic bool cancelled;
+	bool running;
+	struct linkedentry entry;
+};
+
+static struct linkedlist ra_queue;
+static struct mutex ra_lock;
+static struct blocklist ra_wait;
+static _Atomic bool ra_ready = false;
+static _Atomic size_t ra_queued = 0;
+
+/* mark all of the file's requests as cancelled. Queued ones are dropped
+ * right away, and a running one stops at the next page. Called with ra_lock held. */
+static void __cancel(struct file *file)
+{
+	struct linkedentry *ent, *next;
+	for(ent = linkedlist_iter_start(&ra_queue);ent != linkedlist_iter_end(&ra_queue);ent = next) {
+		next = linkedlist_iter_next(ent);
+		struct readahead_request *req = ent->obj;
+		if(req->file != file)
+			continue;
+		req->cancelled = true;
+		req->file = NULL;
+		if(!req->running) {
+			linkedlist_do_remove(&ra_queue, ent);
+			ra_queued--;
+			vfs_icache_put(req->node);
+			kfree(req);
+		}
+	}
+}
+
+static void __submit(struct file *file, size_t start, size_t npages)
+{
+	if(ra_queued >= RA_MAX_QUEUED)
+		return;
+	struct readahead_request *req = kmalloc(sizeof(struct readahead_request));
+	req->file = file;
+	req->node = file->inode;
+	vfs_inode_get(req->node);
+	req->start = start;
+	req->npages = npages;
+	linkedlist_insert(&ra_queue, &req->entry, req);
+	ra_queued++;
+}
+
+/* called after a successful read of length bytes at offset */
+void fs_file_readahead(struct file *file, off_t offset, size_t length)
+{
+	struct inode *node = file->inode;
+	struct file_readahead *ra = &file->ra;
+	if(!ra_ready || !length || !fs_inode_pcache_enabled(node))
+		return;
+	size_t last = (offset + length - 1) / PAGE_SIZE;
+	bool submit = false;
+	mutex_acquire(&ra_lock);
+	if(offset != ra->next) {
+		/* not sequential, so the window is useless */
+		if(ra->size)
+			__cancel(file);
+		ra->size = 0;
+	} else if(!ra->size) {
+		ra->start = last + 1;
+		ra->size = RA_MIN_PAGES;
+		ra->async_start = ra->start;
+		submit = true;
+	} else if(last >= ra->async_start) {
+		/* the reader has reached the window that was read ahead last time, so
+		 * start on the next one while it works through this one */
+		ra->start += ra->size;
+		if(ra->start <= last)
+			ra->start = last + 1;
+		ra->size *= 2;
+		if(ra->size > RA_MAX_PAGES)
+			ra->size = RA_MAX_PAGES;
+		ra->async_start = ra->start;
+		submit = true;
+	}
+	ra->next = offset + length;
+	if(submit && ra->start * PAGE_SIZE < (size_t)node->length && !mm_reclaim_under_pressure()) {
+		__submit(file, ra->start, ra->size);
+		mutex_release(&ra_lock);
+		tm_blocklist_wakeall(&ra_wait);
+		return;
+	}
+	mutex_release(&ra_lock);
+}
+
+/* the file is going away; make sure nothing refers to it */
+void fs_file_readahead_cancel(struct file *file)
+{
+	if(!ra_ready || !file->ra.size)
+		return;
+	mutex_acquire(&ra_lock);
+	__cancel(file);
+	mutex_release(&ra_lock);
+}
+
+static bool __ra_should_sleep(void *data)
+{
+	struct kthread *kt = data;
+	return !ra_queued && !kthread_is_joining(kt);
+}
+
+int __KT_readahead(struct kthread *kt, void *arg)
+{
+	linkedlist_create(&ra_queue, LINKEDLIST_LOCKLESS);
+	mutex_create(&ra_lock, 0);
+	blocklist_create(&ra_wait, 0, "readahead");
+	ra_ready = true;
+	while(!kthread_is_joining(kt)) {
+		mutex_acquire(&ra_lock);
+		struct readahead_request *req = NULL;
+		if(ra_queued) {
+			/* insert puts new requests at the front, so the oldest is at the back */
+			req = ra_queue.sentry.prev->obj;
+			req->running = true;
+			ra_queued--;
+		}
+		mutex_release(&ra_lock);
+		if(!req) {
+			tm_thread_block_confirm(&ra_wait, THREADSTATE_UNINTERRUPTIBLE,
+					__ra_should_sleep, kt);
+			continue;
+		}
+		fs_inode_pcache_readahead(req->node, req->start, req->npages, &req->cancelled);
+		mutex_acquire(&ra_lock);
+		linkedlist_do_remove(&ra_queue, &req->entry);
+		mutex_release(&ra_lock);
+		vfs_icache_put(req->node);
+		kfree(req);
+	}
+	return 0;
+}
@@ -48,6 +48,7 @@ struct socket *socket_create(int *errcode, int *fd)
 		*errcode = -ENFILE;
 	struct socket *sock = kmalloc(sizeof(struct socket));
 	queue_create(&sock->rec_data_queue, 0);
+	net_route_cache_create(&sock->route_cache);
 	inode->devdata = sock;
 	inode->kdev = &__socket_kdev;
 	file_put(f);
@@ -79,6 +80,7 @@ static void socket_destroy(struct inode *node)
 	if(sock->calls->destroy)
 		sock->calls->destroy(sock);
 	queue_destroy(&sock->rec_data_queue);
+	net_route_cache_destroy(&sock->route_cache);
 	kfree(sock);
 }
 
@@ -98,8 +100,9 @@ int socket_select(struct file *f, int rw)
 	if(r == 0)
 		return 0;
 	/* if the protocol says that we're allowed to read or write, that might
-	 * not be true for the socket layer...check the data queue */
-	if(rw == READ)
+	 * not be true for the socket layer...check the data queue. Protocols that
+	 * can select keep their own receive buffers. */
+	if(rw == READ && !socket->calls->select)
 		return socket->rec_data_queue.count > 0;
 	return 1;
 }
@@ -334,7 +337,8 @@ ssize_t sys_recv(int socket, void *buffer, size_t length, int flags)
 	int ret = 0;
 	if(sock->calls->recvfrom)
 		ret = sock->calls->recvfrom(sock, buffer, length, flags, 0, 0);
-	if(ret)
+	/* stream protocols do their own waiting, and return 0 at end-of-stream */
+	if(ret || sock->type == SOCK_STREAM)
 		return ret;
 	TRACE_MSG("socket", "trace: recv, waiting\n");
 	size_t nbytes = 0;
@@ -391,7 +395,7 @@ int sys_recvfrom(int socketfd, struct socket_fromto_info *m)
 	int ret = 0;
 	if(sock->calls->recvfrom)
 		ret = sock->calls->recvfrom(sock, m->buffer, m->len, m->flags, m->addr, m->addr_len);
-	if(ret)
+	if(ret || sock->type == SOCK_STREAM)
 		return ret;
 	size_t nbytes = 0;
 	while(nbytes == 0) {
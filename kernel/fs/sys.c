@@ -130,10 +130,13 @@ int sys_setup(int a)
 	kerfs_register_report("/dev/kmm", kerfs_kmalloc_report);
 	kerfs_register_report("/dev/route", kerfs_route_report);
 	kerfs_register_report("/dev/fs_icache", kerfs_icache_report);
+	kerfs_register_report("/dev/pcache", kerfs_pcache_report);
 	kerfs_register_report("/dev/modules", kerfs_module_report);
 	kerfs_register_report("/dev/pfault", kerfs_pfault_report);
 	kerfs_register_report("/dev/syslog", kerfs_syslog);
 	kerfs_register_report("/dev/frames", kerfs_frames_report);
+	kerfs_register_report("/dev/valloc", kerfs_valloc_report);
+	kerfs_register_report("/dev/reclaim", kerfs_reclaim_report);
 	kerfs_register_parameter("/dev/trace_on", NULL, 0, KERFS_PARAM_WRITE, kerfs_trace_on);
 	kerfs_register_parameter("/dev/trace_off", NULL, 0, KERFS_PARAM_WRITE, kerfs_trace_off);
 	tm_process_create_kerfs_entries(current_process);
@@ -166,6 +169,8 @@ void fs_init(void)
 	loader_add_kernel_symbol(fs_path_resolve_inode);
 	loader_add_kernel_symbol(sys_mknod);
 	loader_add_kernel_symbol(sys_unlink);
+	loader_add_kernel_symbol(kerfs_register_parameter);
+	loader_add_kernel_symbol(kerfs_unregister_entry);
 	loader_add_kernel_symbol(vfs_inode_set_needread);
 	loader_add_kernel_symbol(fs_filesystem_register);
 	loader_add_kernel_symbol(fs_filesystem_unregister);
@@ -506,6 +511,7 @@ int sys_ftruncate(int f, off_t length)
 		return -EACCES;
 	}
 	file->inode->length = length;
+	fs_inode_pcache_truncate(file->inode, length);
 	file->inode->mtime = time_get_epoch();
 	vfs_inode_set_dirty(file->inode);
 	file_put(file);
@@ -21,12 +21,14 @@
 #include <sea/vsprintf.h>
 #include <sea/cpu/processor.h>
 
-struct kthread kthread_pager;
+struct kthread kthread_pager, kthread_readahead;
 int __KT_pager(struct kthread *, void *);
+int __KT_readahead(struct kthread *, void *);
 int kt_kernel_idle_task(void)
 {
 	tm_thread_raise_flag(current_thread, THREAD_KERNEL);
 	kthread_create(&kthread_pager, "[kpager]", 0, __KT_pager, 0);
+	kthread_create(&kthread_readahead, "[kreadahead]", 0, __KT_readahead, 0);
 	strncpy((char *)current_process->command, "[kernel]", 128);
 	/* wait until init has successfully executed, and then remap. */
 	while(!(kernel_state_flags & KSF_HAVEEXECED)) {
@@ -17,6 +17,7 @@
 #include <sea/lib/linkedlist.h>
 #include <sea/trace.h>
 #include <sea/fs/socket.h>
+#include <sea/lib/mpscq.h>
 
 struct linkedlist module_list;
 static struct mutex sym_mutex;
@@ -70,6 +71,7 @@ void loader_init_kernel_symbols(void)
 	loader_add_kernel_symbol(queue_enqueue);
 	loader_add_kernel_symbol(queue_destroy);
 	loader_add_kernel_symbol(socket_bind);
+	loader_add_kernel_symbol(socket_create);
 	loader_add_kernel_symbol(inb);
 	loader_add_kernel_symbol(outb);
 	loader_add_kernel_symbol(inw);
@@ -91,6 +93,11 @@ void loader_init_kernel_symbols(void)
 	loader_add_kernel_symbol(hash_delete);
 	loader_add_kernel_symbol(hash_create);
 	loader_add_kernel_symbol(hash_destroy);
+	loader_add_kernel_symbol(mpscq_create);
+	loader_add_kernel_symbol(mpscq_enqueue);
+	loader_add_kernel_symbol(mpscq_dequeue);
+	loader_add_kernel_symbol(mpscq_count);
+	loader_add_kernel_symbol(mpscq_destroy);
 
 	/* these systems export these, but have no initialization function */
 	loader_add_kernel_symbol(time_get_epoch);
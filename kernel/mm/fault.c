@@ -15,11 +15,17 @@ static bool timer_init = false;
 int kerfs_pfault_report(int direction, void *param, size_t size, size_t offset, size_t length, unsigned char *buf)
 {
 	size_t current = 0;
+	struct mm_fault_stats st;
+	mm_mapping_get_fault_stats(&st);
 	KERFS_PRINTF(offset, length, buf, current,
 			"    MIN      MAX    MEAN   RMEAN COUNT\n"
-			"%7d %8d %7d %7d %5d\n",
+			"%7d %8d %7d %7d %5d\n"
+			"huge pages: %d mapped, %d fallback, %d split\n"
+			"fault-around: %d pages, populate: %d pages\n",
 			timer.min, timer.max, (uint64_t)timer.mean,
-			(uint64_t)timer.recent_mean, timer.runs);
+			(uint64_t)timer.recent_mean, timer.runs,
+			st.thp_mapped, st.thp_fallback, st.thp_split,
+			st.around_pages, st.populated_pages);
 	return current;
 }
 
@@ -30,12 +36,12 @@ static void print_mappings(void)
 	printk(0, "           START              END   LENGTH FLAGS    INODE   OFFSET\n");
 	mutex_acquire(&proc->map_lock);
 	
-	struct linkedentry *node;
+	struct interval_node *node;
 	struct memmap *map;
-	for(node = linkedlist_iter_start(&proc->mappings);
-			node != linkedlist_iter_end(&proc->mappings);
-			node = linkedlist_iter_next(node)) {
-		map = linkedentry_obj(node);
+	for(node = interval_tree_first(&proc->mappings);
+			node;
+			node = interval_tree_next(node)) {
+		map = interval_node_obj(node);
 		char flags[6];
 		memset(flags, ' ', sizeof(flags));
 		if(map->flags & MAP_SHARED)
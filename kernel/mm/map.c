@@ -5,7 +5,6 @@
 #include <sea/lib/linkedlist.h>
 #include <sea/mm/map.h>
 
-#include <sea/mm/valloc.h>
 #include <sea/errno.h>
 #include <sea/mm/kmalloc.h>
 
@@ -19,7 +18,6 @@ static struct memmap *initialize_map(struct inode *node,
 	map->offset = offset;
 	map->length = length;
 	map->virtual = virt_start;
-	map->vr.start = 0;
 	return map;
 }
 
@@ -30,41 +28,151 @@ static int is_valid_location(addr_t addr)
 	return 1;
 }
 
-static int acquire_virtual_location(struct valloc_region *vr, addr_t *virt, int fixed, size_t length)
+/* pick where a new mapping goes. A valid address that was asked for is used
+ * as is. Otherwise, the new mapping goes in the lowest gap in the mmap region
+ * that it fits in. Returns false if there's nowhere to put it. Called with
+ * map_lock held. */
+static bool acquire_virtual_location(addr_t *virt, int fixed, size_t length)
 {
 	assert(virt);
-	vr->start=0;
-	/* if the given address is valid, use that. */
-	if(is_valid_location(*virt) && is_valid_location(*virt + length)) {
-		return 0;
-	} else if(fixed) {
-		/* if it wasn't valid, and MAP_FIXED was specified, fail. */
-		*virt = 0;
-		return 0;
-	}
-	/* otherwise, allocate from given range... */
-	int npages = ((length-1)/PAGE_SIZE) + 1;
-	*virt = 0;
-	vr->start = 0;
-	valloc_allocate(&(current_process->mmf_valloc), vr, npages);
-	return 1;
+	if(is_valid_location(*virt) && is_valid_location(*virt + length))
+		return true;
+	/* if it wasn't valid, and MAP_FIXED was specified, fail. */
+	if(fixed)
+		return false;
+	size_t rounded = ((length - 1) & PAGE_MASK) + PAGE_SIZE;
+	return interval_tree_find_gap(&current_process->mappings,
+			MEMMAP_MMAP_BEGIN, MEMMAP_MMAP_END, rounded, virt);
 }
 
-static void release_virtual_location(struct valloc_region *vr)
+/* 'length' may not be page aligned, but the mapping acts as if it were rounded
+ * up. 'length' refers to file length, but in a partial page, memory mapping
+ * is still valid for the rest of the page, just filled with zeros. */
+static inline addr_t mapping_end(struct memmap *map)
 {
-	if(!vr || !vr->start)
-		return;
-	valloc_deallocate(&(current_process->mmf_valloc), vr);
+	return map->virtual + ((map->length + ~PAGE_MASK) & PAGE_MASK);
 }
 
 static void record_mapping(struct memmap *map)
 {
-	linkedlist_insert(&current_process->mappings, &map->entry, map);
+	interval_tree_insert(&current_process->mappings, &map->node_entry,
+			map->virtual, mapping_end(map), map);
+	current_process->map_generation++;
 }
 
 static void remove_mapping(struct memmap *map)
 {
-	linkedlist_remove(&current_process->mappings, &map->entry);
+	interval_tree_remove(&current_process->mappings, &map->node_entry);
+	current_process->map_generation++;
+}
+
+/* re-key a mapping after its start or length has changed */
+static void update_mapping(struct memmap *map)
+{
+	remove_mapping(map);
+	if(map->length)
+		record_mapping(map);
+}
+
+/* transparent huge pages: faults in large, private anonymous mappings are
+ * satisfied with a whole 2MB page when the surrounding aligned region is
+ * entirely inside the mapping and nothing has been mapped there yet. The
+ * huge page's reference count lives in its first frame. Anything that needs
+ * to deal with part of one (partial unmap, fork's COW) splits it back into
+ * small pages first. */
+#define HUGE_PAGE_SIZE 0x200000
+static _Atomic size_t thp_mapped = 0, thp_fallback = 0, thp_split = 0;
+static _Atomic size_t around_pages = 0, populated_pages = 0;
+
+void mm_mapping_get_fault_stats(struct mm_fault_stats *stats)
+{
+	stats->thp_mapped = thp_mapped;
+	stats->thp_fallback = thp_fallback;
+	stats->thp_split = thp_split;
+	stats->around_pages = around_pages;
+	stats->populated_pages = populated_pages;
+}
+
+static bool is_huge_page(addr_t virt)
+{
+	int attr;
+	return mm_virtual_getmap(virt, NULL, &attr) && (attr & PAGE_LARGE);
+}
+
+static void split_huge_page(addr_t virt)
+{
+	addr_t base = virt & ~(addr_t)(HUGE_PAGE_SIZE - 1);
+	addr_t page;
+	int attr;
+	if(!mm_virtual_getmap(base, &page, &attr) || !(attr & PAGE_LARGE))
+		return;
+	/* every frame gets the count that the huge page had */
+	int count = mm_physical_get_count(page);
+	for(addr_t p = page + PAGE_SIZE; p < page + HUGE_PAGE_SIZE; p += PAGE_SIZE) {
+		for(int i=0;i<count;i++)
+			mm_physical_increment_count(p);
+	}
+	mm_physical_split(page, HUGE_PAGE_SIZE);
+	mm_virtual_split(base);
+	thp_split++;
+}
+
+static bool map_huge_page(struct memmap *map, addr_t address)
+{
+	if((map->flags & (MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS)) != (MAP_PRIVATE | MAP_ANONYMOUS))
+		return false;
+	addr_t base = address & ~(addr_t)(HUGE_PAGE_SIZE - 1);
+	if(base < map->virtual || base + HUGE_PAGE_SIZE > map->virtual + map->length)
+		return false;
+	if(!mm_virtual_large_slot_free(base))
+		return false;
+	addr_t phys = mm_physical_allocate_region(HUGE_PAGE_SIZE, true, 0, 0);
+	if(!phys) {
+		thp_fallback++;
+		return false;
+	}
+	int attr = PAGE_PRESENT | PAGE_USER | ((map->prot & PROT_WRITE) ? PAGE_WRITE : 0);
+	if(!mm_virtual_map(base, phys, attr, HUGE_PAGE_SIZE)) {
+		mm_physical_deallocate(phys);
+		thp_fallback++;
+		return false;
+	}
+	mm_physical_increment_count(phys);
+	thp_mapped++;
+	return true;
+}
+
+/* unmap privately held pages in batches, so other CPUs only get one TLB
+ * shootdown per batch. The pages can't be released until the shootdown is
+ * done, since another CPU might still be writing to them. */
+#define UNMAP_BATCH 64
+static void unmap_private_range(addr_t start, addr_t end)
+{
+	addr_t pages[UNMAP_BATCH];
+	addr_t v = start;
+	while(v < end) {
+		int count = 0;
+		mm_tlb_gather_begin();
+		while(v < end && count < UNMAP_BATCH) {
+			/* a huge page can only start at the beginning of the range or
+			 * on a 2MB boundary. Drop it whole if we're unmapping all of it */
+			if((v == start || !(v & (HUGE_PAGE_SIZE - 1))) && is_huge_page(v)) {
+				if(!(v & (HUGE_PAGE_SIZE - 1)) && v + HUGE_PAGE_SIZE <= end) {
+					pages[count++] = mm_virtual_unmap(v);
+					v += HUGE_PAGE_SIZE;
+					continue;
+				}
+				split_huge_page(v);
+			}
+			addr_t phys = mm_virtual_unmap(v);
+			if(phys)
+				pages[count++] = phys;
+			v += PAGE_SIZE;
+		}
+		mm_tlb_gather_end();
+		for(int i=0;i<count;i++)
+			mm_physical_decrement_count(pages[i]);
+	}
 }
 
 static void disengage_mapping_region(struct memmap *map, addr_t start, size_t offset, size_t length)
@@ -77,11 +185,7 @@ static void disengage_mapping_region(struct memmap *map, addr_t start, size_t of
 	} else {
 		/* we don't need to tell mminode about it, since it maps the page and the forgets
 		 * about it */
-		for(addr_t v = start;v < (start + length);v += PAGE_SIZE) {
-			addr_t phys = mm_virtual_unmap(v);
-			if(phys)
-				mm_physical_decrement_count(phys);
-		}
+		unmap_private_range(start, start + length);
 	}
 }
 
@@ -100,29 +204,17 @@ addr_t mm_establish_mapping(struct inode *node, addr_t virt,
 	vfs_inode_get(node);
 	mutex_acquire(&current_process->map_lock);
 	/* get a virtual region to use */
-	struct valloc_region vr;
-	int ret = acquire_virtual_location(&vr, &virt, flags & MAP_FIXED, length);
-	if(!ret && !virt) {
+	if(!acquire_virtual_location(&virt, flags & MAP_FIXED, length)) {
 		mutex_release(&current_process->map_lock);
 		vfs_icache_put(node);
 		return -ENOMEM;
 	}
-	if(vr.start)
-		virt = vr.start;
 	//printk(0, "[mmap]: mapping %x for %x, f=%x, p=%x: %d:%x\n", 
 	//		virt, length, flags, prot, node->id, offset);
 	struct memmap *map = initialize_map(node, virt, prot, flags, offset, length);
-	if(vr.start)
-		memcpy(&(map->vr), &vr, sizeof(struct valloc_region));
-	
 	record_mapping(map);
 	/* unmap the region of previous pages */
-	for(addr_t s=virt;s < (virt + length);s+=PAGE_SIZE)
-	{
-		addr_t phys = mm_virtual_unmap(s);
-		if(phys)
-			mm_physical_decrement_count(phys);
-	}
+	unmap_private_range(virt, virt + length);
 	/* if it's MAP_SHARED, then notify the mminode framework. Otherwise, we just
 	 * wait for a pagefault to bring in the pages */
 	if((flags & MAP_SHARED))
@@ -133,7 +225,6 @@ addr_t mm_establish_mapping(struct inode *node, addr_t virt,
 
 static int __do_mm_disestablish_mapping(struct memmap *map)
 {
-	release_virtual_location(&map->vr);
 	vfs_icache_put(map->node);
 	map->node = 0;
 	remove_mapping(map);
@@ -168,18 +259,19 @@ int mm_sync_mapping(struct memmap *map, addr_t start, size_t length, int flags)
 
 void mm_mappings_clone(struct process *child)
 {
-	struct linkedentry *node;
+	struct interval_node *node;
 	if(current_process->pid == 0)
 		return;
-	for(node = linkedlist_iter_start(&current_process->mappings);
-			node != linkedlist_iter_end(&current_process->mappings);
-			node = linkedlist_iter_next(node)) {
-		struct memmap *map = linkedentry_obj(node);
+	for(node = interval_tree_first(&current_process->mappings);
+			node;
+			node = interval_tree_next(node)) {
+		struct memmap *map = interval_node_obj(node);
 		/* first create the new mapping structure */
 		struct memmap *new = kmalloc(sizeof(*map));
 		memcpy(new, map, sizeof(*new));
 		vfs_inode_get(new->node);
-		linkedlist_insert(&child->mappings, &new->entry, new);
+		interval_tree_insert(&child->mappings, &new->node_entry,
+				new->virtual, mapping_end(new), new);
 		/* okay, now do the mapping */
 		int attr = PAGE_PRESENT | PAGE_USER;
 		if(new->flags & MAP_SHARED) {
@@ -192,6 +284,9 @@ void mm_mappings_clone(struct process *child)
 		}
 		addr_t end = ((new->virtual + new->length - 1) & PAGE_MASK) + PAGE_SIZE;
 		for(addr_t virt = new->virtual; virt < end; virt += PAGE_SIZE) {
+			/* pages are shared copy-on-write one small page at a time */
+			if(virt == new->virtual || !(virt & (HUGE_PAGE_SIZE - 1)))
+				split_huge_page(virt);
 			addr_t page;
 			bool r = mm_virtual_getmap(virt, &page, NULL);
 			if(r) {
@@ -204,32 +299,25 @@ void mm_mappings_clone(struct process *child)
 		}
 		
 	}
-	memcpy(&child->mmf_valloc, &current_process->mmf_valloc, sizeof(child->mmf_valloc));
-	mutex_create(&child->mmf_valloc.lock, 0);
 }
 
-/* linear scan over all mappings for an address...yeah, it's a but slow, but
- * most programs aren't going to have a large number of mapped regions...probably */
+/* look up the mapping containing an address. Each thread remembers the last
+ * mapping it found, since faults tend to come in runs over the same region;
+ * the cached entry is only trusted if no mapping has been added or removed
+ * since. Must be called with map_lock held. */
 static struct memmap *find_mapping(addr_t address)
 {
-	struct linkedentry *n;
-	struct memmap *map;
-	/* don't worry about the list's lock, we already have a lock */
-	for(n = linkedlist_iter_start(&current_process->mappings);
-			n != linkedlist_iter_end(&current_process->mappings);
-			n = linkedlist_iter_next(n)) {
-		map = linkedentry_obj(n);
-		/* check if address is in range. A special case to note: 'length' may not
-		 * be page aligned, but here we act as if it were rounded up. 'length' refers
-		 * to file length, but in a partial page, memory mapping is still valid for
-		 * the rest of the page, just filled with zeros. */
-		size_t rounded_length = map->length;
-		if(rounded_length & (~PAGE_MASK))
-			rounded_length = (rounded_length & PAGE_MASK) + PAGE_SIZE;
-		if(address >= map->virtual && address < (map->virtual + rounded_length))
-			return map;
+	struct thread *thr = current_thread;
+	struct memmap *map = thr->map_cache;
+	if(map && thr->map_cache_generation == current_process->map_generation
+			&& address >= map->virtual && address < mapping_end(map))
+		return map;
+	map = interval_node_obj(interval_tree_find(&current_process->mappings, address));
+	if(map) {
+		thr->map_cache = map;
+		thr->map_cache_generation = current_process->map_generation;
 	}
-	return 0;
+	return map;
 }
 
 static int load_file_data(struct memmap *map, addr_t fault_address)
@@ -252,6 +340,26 @@ static int load_file_data(struct memmap *map, addr_t fault_address)
 	}
 	return 0;
 }
+/* fault-around: when a shared file mapping faults, also map any pages in an
+ * aligned window around the fault that are already resident in the inode
+ * (because another process, or an earlier mapping, loaded them). This costs
+ * no I/O and saves a fault for each such page. */
+#define FAULT_AROUND_PAGES 16
+static void fault_around(struct memmap *map, addr_t address)
+{
+	if(!(map->flags & MAP_SHARED) || (map->flags & MAP_ANONYMOUS))
+		return;
+	addr_t start = address & ~(addr_t)(FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+	addr_t end = start + FAULT_AROUND_PAGES * PAGE_SIZE;
+	if(start < map->virtual)
+		start = map->virtual;
+	if(end > mapping_end(map))
+		end = mapping_end(map);
+	int attr = PAGE_PRESENT | PAGE_USER | ((map->prot & PROT_WRITE) ? PAGE_WRITE : 0);
+	around_pages += fs_inode_map_resident_pages(map->node, start,
+			map->offset + (start - map->virtual), (end - start) / PAGE_SIZE, attr);
+}
+
 #include <sea/vsprintf.h>
 /* handles a pagefault. If we can find the mapping, we need to check
  * the cause of the fault against what we're allowed to do, and then
@@ -295,7 +403,24 @@ int mm_page_fault_test_mappings(addr_t address, int pf_cause)
 		goto out;
 	if((pf_cause & PF_CAUSE_WRITE) && !(map->prot & PROT_WRITE))
 		goto out;
-	
+	if(map_huge_page(map, address)) {
+		mutex_release(&current_process->map_lock);
+		return 0;
+	}
+	/* anonymous memory has nothing to read in, so fill it while still
+	 * holding the lock. This keeps a concurrent huge page fault from
+	 * racing with us over the same page directory entry. */
+	if(map->flags & MAP_ANONYMOUS) {
+		int ret = load_file_data(map, address);
+		mutex_release(&current_process->map_lock);
+		return ret == -1 ? -1 : 0;
+	}
+	fault_around(map, address);
+	if(mm_virtual_getmap(address, NULL, NULL)) {
+		/* fault-around got the page we wanted too */
+		mutex_release(&current_process->map_lock);
+		return 0;
+	}
 	mutex_release(&current_process->map_lock);
 	if(load_file_data(map, address) != -1)
 	{
@@ -307,6 +432,19 @@ out:
 	return -1;
 }
 
+/* fault in every page of a range up front, as if it had been touched. Used for
+ * MAP_POPULATE, so that a region that's going to be used anyway (eg, program
+ * text) doesn't take a fault per page. */
+void mm_mapping_populate(addr_t start, size_t length)
+{
+	for(addr_t addr = start & PAGE_MASK; addr < start + length; addr += PAGE_SIZE) {
+		if(mm_virtual_getmap(addr, NULL, NULL))
+			continue;
+		if(mm_page_fault_test_mappings(addr, PF_CAUSE_USER | PF_CAUSE_READ) == 0)
+			populated_pages++;
+	}
+}
+
 int mm_mapping_msync(addr_t start, size_t length, int flags)
 {
 	mutex_acquire(&current_process->map_lock);
@@ -351,9 +489,11 @@ int mm_mapping_munmap(addr_t start, size_t length)
 				map->length = 0;
 			else
 				map->length -= PAGE_SIZE;
+			update_mapping(map);
 		} else if((map->virtual + (rounded_length - PAGE_SIZE)) == addr) {
 			/* page is at the end of the map */
 			map->length -= page_len;
+			update_mapping(map);
 		} else {
 			/* the page splits the map. create a second mapping */
 			struct memmap *n = initialize_map(map->node, map->virtual, map->prot, map->flags, map->offset, map->length);
@@ -361,19 +501,18 @@ int mm_mapping_munmap(addr_t start, size_t length)
 			n->offset += (addr - n->virtual) + PAGE_SIZE;
 			n->virtual = addr + PAGE_SIZE;
 			map->length = (addr - map->virtual);
+			update_mapping(map);
 			/* we don't need to notify the mminode framework that a new mapping has been created, since
 			 * the counts on the pages haven't actually changed */
-			if(map->vr.start) {
-				/* split virtual node */
-				valloc_split_region(&(current_process->mmf_valloc), 
-						&map->vr, &n->vr, map->length / PAGE_SIZE);
-			}
 			/* remember to increase the count of the inode... */
 			vfs_inode_get(n->node);
 			record_mapping(n);
 		}
-		if(map->length == 0)
-			__do_mm_disestablish_mapping(map);
+		if(map->length == 0) {
+			/* update_mapping already took it out of the tree */
+			vfs_icache_put(map->node);
+			kfree(map);
+		}
 	}
 	mutex_release(&current_process->map_lock);
 	return 0;
@@ -383,13 +522,9 @@ int mm_mapping_munmap(addr_t start, size_t length)
 void mm_destroy_all_mappings(struct process *t)
 {
 	/* we don't need to lock, because we assume only one thread */
-	struct linkedentry *cur, *next;
-	struct memmap *map;
-	for(cur = linkedlist_iter_start(&t->mappings);
-			cur != linkedlist_iter_end(&t->mappings);
-			cur = next) {
-		map = linkedentry_obj(cur);
-		next = linkedlist_iter_next(cur);
+	struct interval_node *cur;
+	while((cur = t->mappings.root)) {
+		struct memmap *map = interval_node_obj(cur);
 		disengage_mapping(map);
 		__do_mm_disestablish_mapping(map);
 	}
@@ -9,7 +9,9 @@
 #include <sea/mm/dma.h>
 #include <sea/mm/kmalloc.h>
 #include <sea/mm/reclaim.h>
+#include <sea/mm/map.h>
 #include <sea/vsprintf.h>
+#include <sea/errno.h>
 #include <sea/cpu/interrupt.h>
 #include <stdbool.h>
 #include <sea/fs/inode.h>
@@ -154,6 +156,7 @@ static void process_memorymap(struct multiboot *mboot)
 }
 
 void pmm_buddy_init();
+void pmm_buddy_reclaim_init(void);
 void arch_mm_virtual_init(struct vmm_context *context);
 void mm_init(struct multiboot *m)
 {
@@ -166,6 +169,8 @@ void mm_init(struct multiboot *m)
 	set_ksf(KSF_MMU);
 	/* hey, look at that, we have happy memory times! */
 	mm_reclaim_init();
+	slab_reclaim_init();
+	pmm_buddy_reclaim_init();
 	for(size_t i=0;i<=(sizeof(struct pagedata) * maximum_page_number) / mm_page_size(1);i++) {
 		mm_virtual_map(MEMMAP_FRAMECOUNT_START + i * mm_page_size(1),
 				mm_physical_allocate(mm_page_size(1), true),
@@ -180,20 +185,33 @@ void mm_init(struct multiboot *m)
 	loader_add_kernel_symbol(mm_virtual_getmap);
 	loader_add_kernel_symbol(mm_allocate_dma_buffer);
 	loader_add_kernel_symbol(mm_free_dma_buffer);
+	loader_add_kernel_symbol(mm_map_user_buffer);
+	loader_add_kernel_symbol(mm_unmap_user_buffer);
 	loader_add_kernel_symbol(mm_physical_allocate);
+	loader_add_kernel_symbol(mm_physical_allocate_region);
 	loader_add_kernel_symbol(mm_physical_deallocate);
+	loader_add_kernel_symbol(mm_physical_increment_count);
+	loader_add_kernel_symbol(mm_physical_decrement_count);
 #endif
 }
 
 /* TODO: specify maximum */
 static struct valloc dma_virtual;
 static bool dma_virtual_init = false;
-int mm_allocate_dma_buffer(struct dma_region *d)
+static void __dma_virtual_init(void)
 {
 	if(!atomic_exchange(&dma_virtual_init, true)) {
 		valloc_create(&dma_virtual, MEMMAP_VIRTDMA_START, MEMMAP_VIRTDMA_END, mm_page_size(0), 0);
+		valloc_report_register(&dma_virtual, "dma");
 	}
-	d->p.address = mm_physical_allocate(d->p.size, false);
+}
+
+int mm_allocate_dma_buffer(struct dma_region *d)
+{
+	__dma_virtual_init();
+	/* most of our DMA-capable devices (ata, rtl8139) can only
+	 * address the low 4GB */
+	d->p.address = mm_physical_allocate_region(d->p.size, false, 0, PMM_DMA32_LIMIT);
 	if(d->p.address == 0)
 		return -1;
 
@@ -210,8 +228,10 @@ int mm_allocate_dma_buffer(struct dma_region *d)
 int mm_free_dma_buffer(struct dma_region *d)
 {
 	int npages = ((d->p.size-1) / mm_page_size(0)) + 1;
+	mm_tlb_gather_begin();
 	for(int i=0;i<npages;i++)
 		mm_virtual_unmap(d->v + i * mm_page_size(0));
+	mm_tlb_gather_end();
 	mm_physical_deallocate(d->p.address);
 	struct valloc_region reg;
 	reg.flags = 0;
@@ -222,6 +242,84 @@ int mm_free_dma_buffer(struct dma_region *d)
 	return 0;
 }
 
+/* undo the first d->npages pages of a user buffer mapping, and give back its
+ * window of npages */
+static void __user_buffer_release(struct dma_user_region *d, size_t npages)
+{
+	mm_tlb_gather_begin();
+	for(size_t i=0;i<d->npages;i++)
+		mm_virtual_unmap(d->start + i * PAGE_SIZE);
+	mm_tlb_gather_end();
+	for(size_t i=0;i<d->npages;i++)
+		mm_physical_decrement_count(d->pins[i]);
+	struct valloc_region reg;
+	reg.flags = 0;
+	reg.start = d->start;
+	reg.npages = npages;
+	valloc_deallocate(&dma_virtual, &reg);
+	kfree(d->pins);
+	d->v = d->start = 0;
+	d->npages = 0;
+}
+
+/* pin the pages behind length bytes at buffer in the current process, and map
+ * them in order into kernel memory. Each page is looked up and pinned under
+ * map_lock, so it can't be freed in between. Pages that aren't there yet (or
+ * aren't writable, if write is set) are faulted in first, as if the caller had
+ * touched them. Fails with -EFAULT if that doesn't work. Undone by
+ * mm_unmap_user_buffer. */
+int mm_map_user_buffer(struct dma_user_region *d, addr_t buffer, size_t length, bool write)
+{
+	__dma_virtual_init();
+	addr_t first = buffer & ~(PAGE_SIZE - 1);
+	size_t npages = (buffer + length - first - 1) / PAGE_SIZE + 1;
+	struct valloc_region reg;
+	valloc_allocate(&dma_virtual, &reg, npages);
+	d->start = reg.start;
+	d->v = reg.start + (buffer - first);
+	d->pins = kmalloc(npages * sizeof(addr_t));
+	bool faulted = false;
+	mutex_acquire(&current_process->map_lock);
+	d->npages = 0;
+	while(d->npages < npages) {
+		addr_t virt = first + d->npages * PAGE_SIZE, phys;
+		int flags;
+		if(!mm_virtual_getmap(virt, &phys, &flags) || (write && !(flags & PAGE_WRITE))) {
+			if(faulted)
+				break;
+			/* the fault handler takes map_lock itself */
+			mutex_release(&current_process->map_lock);
+			int ret = mm_page_fault_test_mappings(virt, PF_CAUSE_USER
+					| (write ? PF_CAUSE_WRITE : PF_CAUSE_READ));
+			mutex_acquire(&current_process->map_lock);
+			if(ret)
+				break;
+			faulted = true;
+			continue;
+		}
+		faulted = false;
+		/* only the head frame of a huge page is counted */
+		size_t size = mm_page_size((flags & PAGE_LARGE) ? 1 : 0);
+		d->pins[d->npages] = phys & ~(size - 1);
+		mm_physical_increment_count(d->pins[d->npages]);
+		mm_virtual_map(reg.start + d->npages * PAGE_SIZE,
+				(phys & ~(size - 1)) + (virt & (size - 1) & ~(PAGE_SIZE - 1)),
+				PAGE_PRESENT | PAGE_WRITE, PAGE_SIZE);
+		d->npages++;
+	}
+	mutex_release(&current_process->map_lock);
+	if(d->npages < npages) {
+		__user_buffer_release(d, npages);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+void mm_unmap_user_buffer(struct dma_user_region *d)
+{
+	__user_buffer_release(d, d->npages);
+}
+
 void arch_mm_physical_memcpy(void *dest, void *src, size_t length, int mode);
 void mm_physical_memcpy(void *dest, void *src, size_t length, int mode)
 {
@@ -82,6 +82,8 @@ addr_t mm_mmap(addr_t address, size_t length, int prot, int flags, struct file *
 	mm_mapping_munmap(address, length);
 	addr_t mapped_address = mm_establish_mapping(node, address, prot, flags, offset, length);
 	vfs_icache_put(node);
+	if((flags & MAP_POPULATE) && (intptr_t)mapped_address > 0)
+		mm_mapping_populate(mapped_address, length);
 	return mapped_address;
 }
 
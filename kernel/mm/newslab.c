@@ -9,6 +9,10 @@
 #include <sea/mm/kmalloc.h>
 #include <stdatomic.h>
 #include <sea/fs/kerfs.h>
+#include <sea/mm/reclaim.h>
+#include <sea/cpu/processor.h>
+#include <sea/tm/thread.h>
+#include <sea/spinlock.h>
 struct slab {
 	struct cache *cache;
 	struct linkedentry node;
@@ -19,12 +23,40 @@ struct slab {
 	struct mutex lock;
 };
 
+/* Per-CPU magazine layer (Bonwick & Adams, "Magazines and Vmem").
+ * Each CPU holds a loaded and a previous magazine for each cache, each
+ * of which is always either full or empty when not loaded. Allocation
+ * and free only touch the current CPU's magazines; when both are
+ * exhausted they are exchanged with the cache's depot, and only when
+ * the depot can't help do we fall through to the slab layer. */
+#define MAGAZINE_SIZE 14
+
+struct magazine {
+	struct magazine *next;
+	int rounds;
+	void *objs[MAGAZINE_SIZE];
+};
+
+struct cpu_cache {
+	struct magazine *loaded, *previous;
+	size_t hits, misses;
+};
+
+struct depot {
+	struct spinlock lock;
+	struct magazine *full, *empty;
+	size_t nfull, nempty;
+};
+
 struct cache {
 	struct linkedlist empty, partial, full;
 	size_t slabcount;
 	size_t object_size;
 	struct mutex lock;
 	struct hashelem hash_elem;
+	struct linkedentry node;
+	struct depot depot;
+	struct cpu_cache cpu_caches[CONFIG_MAX_CPUS];
 };
 
 #define SLAB_SIZE mm_page_size(1)
@@ -33,6 +65,27 @@ struct cache cache_cache;
 struct mutex cache_lock;
 struct hash cache_hash;
 struct valloc slabs_reg;
+static struct linkedlist cache_list;
+
+/* allocations too big for a slab get their own run of pages, mapped into
+ * a separate part of the kmalloc region. A header at the start of the
+ * run records its length so that kfree can unmap it. */
+struct large_object {
+	uint32_t magic;
+	size_t npages;
+	size_t size;
+};
+
+#define LARGE_MAGIC 0x1A26E0B1
+#define LARGE_HEADER_SIZE 64
+_Static_assert(sizeof(struct large_object) <= LARGE_HEADER_SIZE, "large object header too big");
+static struct valloc large_reg;
+static _Atomic size_t large_count = 0, large_bytes = 0;
+
+/* small sizes index straight into this table, so that the common
+ * case doesn't need cache_lock or a hash lookup */
+#define NUM_SMALL_CLASSES (0x1000 / 64 + 1)
+static struct cache * _Atomic small_classes[NUM_SMALL_CLASSES];
 
 int full_slabs_count=0, partial_slabs_count=0, empty_slabs_count=0;
 size_t total_allocated=0;
@@ -50,6 +103,25 @@ int kerfs_kmalloc_report(int direction, void *param, size_t size, size_t offset,
 			valloc_count_used(&slabs_reg), slabs_reg.npages,
 			full_slabs_count, partial_slabs_count, empty_slabs_count,
 			(hash_count(&cache_hash) * 100) / hash_length(&cache_hash), total_allocated);
+	size_t hits = 0, misses = 0, nfull = 0, nempty = 0;
+	mutex_acquire(&cache_lock);
+	for(struct linkedentry *entry = linkedlist_iter_start(&cache_list);
+			entry != linkedlist_iter_end(&cache_list);
+			entry = linkedlist_iter_next(entry)) {
+		struct cache *cache = entry->obj;
+		nfull += cache->depot.nfull;
+		nempty += cache->depot.nempty;
+		for(int i=0;i<CONFIG_MAX_CPUS;i++) {
+			hits += cache->cpu_caches[i].hits;
+			misses += cache->cpu_caches[i].misses;
+		}
+	}
+	mutex_release(&cache_lock);
+	KERFS_PRINTF(offset, length, buf, current,
+			"Magazines: hits %d, misses %d, depot full %d, depot empty %d\n",
+			hits, misses, nfull, nempty);
+	KERFS_PRINTF(offset, length, buf, current,
+			"Large objects: %d (%d KB)\n", large_count, large_bytes / 1024);
 	return current;
 }
 
@@ -69,6 +141,8 @@ static struct slab *allocate_new_slab(struct cache *cache)
 	slab->magic = SLAB_MAGIC;
 	slab->max = (slab->allocator.npages - slab->allocator.nindex);
 	slab->cache = cache;
+	if(slab_get_usage() > 50)
+		mm_pager_wakeup();
 	mutex_create(&slab->lock, 0);
 	cache->slabcount++;
 	assert(slab->max > 2);
@@ -150,20 +224,198 @@ static void *allocate_object_from_cache(struct cache *cache)
 	return ret;
 }
 
+static struct cpu *magazine_cpu_get(void)
+{
+	if(!current_thread || !current_thread->cpu || current_thread->interrupt_level)
+		return NULL;
+	return cpu_get_current();
+}
+
+static void *cache_allocate(struct cache *cache)
+{
+	struct cpu *cpu = magazine_cpu_get();
+	if(cpu) {
+		struct cpu_cache *cc = &cache->cpu_caches[cpu->knum];
+		void *obj = NULL;
+		if(cc->loaded && cc->loaded->rounds > 0) {
+			obj = cc->loaded->objs[--cc->loaded->rounds];
+		} else if(cc->previous && cc->previous->rounds > 0) {
+			struct magazine *tmp = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = tmp;
+			obj = cc->loaded->objs[--cc->loaded->rounds];
+		} else {
+			spinlock_acquire(&cache->depot.lock);
+			struct magazine *full = cache->depot.full;
+			if(full) {
+				cache->depot.full = full->next;
+				cache->depot.nfull--;
+				if(cc->previous) {
+					cc->previous->next = cache->depot.empty;
+					cache->depot.empty = cc->previous;
+					cache->depot.nempty++;
+				}
+				cc->previous = cc->loaded;
+				cc->loaded = full;
+				obj = full->objs[--full->rounds];
+			}
+			spinlock_release(&cache->depot.lock);
+		}
+		if(obj)
+			cc->hits++;
+		else
+			cc->misses++;
+		cpu_put_current(cpu);
+		if(obj)
+			return obj;
+	}
+	return allocate_object_from_cache(cache);
+}
+
+static void cache_free(void *object)
+{
+	struct slab *slab = get_slab_from_object(object);
+	assert(slab->magic == SLAB_MAGIC);
+	struct cache *cache = slab->cache;
+	struct cpu *cpu = magazine_cpu_get();
+	if(cpu) {
+		struct cpu_cache *cc = &cache->cpu_caches[cpu->knum];
+		bool done = true;
+		if(cc->loaded && cc->loaded->rounds < MAGAZINE_SIZE) {
+			cc->loaded->objs[cc->loaded->rounds++] = object;
+		} else if(cc->previous && cc->previous->rounds == 0) {
+			struct magazine *tmp = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = tmp;
+			cc->loaded->objs[cc->loaded->rounds++] = object;
+		} else {
+			spinlock_acquire(&cache->depot.lock);
+			struct magazine *empty = cache->depot.empty;
+			if(empty) {
+				cache->depot.empty = empty->next;
+				cache->depot.nempty--;
+				if(cc->previous) {
+					cc->previous->next = cache->depot.full;
+					cache->depot.full = cc->previous;
+					cache->depot.nfull++;
+				}
+				cc->previous = cc->loaded;
+				cc->loaded = empty;
+				empty->objs[empty->rounds++] = object;
+			} else {
+				done = false;
+			}
+			spinlock_release(&cache->depot.lock);
+		}
+		cpu_put_current(cpu);
+		if(done)
+			return;
+		/* the depot is out of empty magazines. Make one for next time
+		 * (which we can't do with preemption off), and free this object
+		 * back to its slab directly. */
+		struct magazine *mag = kmalloc(sizeof(struct magazine));
+		spinlock_acquire(&cache->depot.lock);
+		mag->next = cache->depot.empty;
+		cache->depot.empty = mag;
+		cache->depot.nempty++;
+		spinlock_release(&cache->depot.lock);
+	}
+	free_object(object);
+}
+
+/* depot trim hooks, called by the reclaimer under memory pressure. The
+ * magazines loaded on each CPU are left alone; they're bounded in size,
+ * and can only be touched safely by their owner. */
+static size_t slab_count_magazines(void)
+{
+	size_t count = 0;
+	mutex_acquire(&cache_lock);
+	for(struct linkedentry *entry = linkedlist_iter_start(&cache_list);
+			entry != linkedlist_iter_end(&cache_list);
+			entry = linkedlist_iter_next(entry)) {
+		struct cache *cache = entry->obj;
+		count += cache->depot.nfull + cache->depot.nempty;
+	}
+	mutex_release(&cache_lock);
+	return count;
+}
+
+/* free up to nr magazines from the depots. Empty magazines go first, since
+ * they cost nothing to give up. */
+static size_t slab_reclaim_magazines(size_t nr)
+{
+	struct magazine *list = NULL;
+	size_t amount = 0;
+	mutex_acquire(&cache_lock);
+	for(struct linkedentry *entry = linkedlist_iter_start(&cache_list);
+			entry != linkedlist_iter_end(&cache_list) && nr;
+			entry = linkedlist_iter_next(entry)) {
+		struct cache *cache = entry->obj;
+		spinlock_acquire(&cache->depot.lock);
+		while(nr && cache->depot.empty) {
+			struct magazine *mag = cache->depot.empty;
+			cache->depot.empty = mag->next;
+			cache->depot.nempty--;
+			mag->next = list;
+			list = mag;
+			nr--;
+		}
+		while(nr && cache->depot.full) {
+			struct magazine *mag = cache->depot.full;
+			cache->depot.full = mag->next;
+			cache->depot.nfull--;
+			mag->next = list;
+			list = mag;
+			nr--;
+		}
+		spinlock_release(&cache->depot.lock);
+	}
+	mutex_release(&cache_lock);
+
+	while(list) {
+		struct magazine *mag = list;
+		list = mag->next;
+		for(int i=0;i<mag->rounds;i++) {
+			amount += get_slab_from_object(mag->objs[i])->cache->object_size;
+			free_object(mag->objs[i]);
+		}
+		amount += sizeof(struct magazine);
+		kfree(mag);
+	}
+	return amount;
+}
+
+static struct reclaimer magazine_reclaimer = {
+	.name = "magazines",
+	.count = slab_count_magazines,
+	.scan = slab_reclaim_magazines,
+	.object_size = sizeof(struct magazine),
+	.seeks = 1,
+};
+
+void slab_reclaim_init(void)
+{
+	mm_reclaim_register(&magazine_reclaimer);
+}
+
 static void construct_cache(struct cache *cache, size_t sz)
 {
+	memset(cache, 0, sizeof(*cache));
 	linkedlist_create(&cache->empty, LINKEDLIST_LOCKLESS);
 	linkedlist_create(&cache->partial, LINKEDLIST_LOCKLESS);
 	linkedlist_create(&cache->full, LINKEDLIST_LOCKLESS);
 	mutex_create(&cache->lock, 0);
 	cache->object_size = sz;
 	cache->slabcount=0;
+	spinlock_create(&cache->depot.lock);
 }
 
 static struct cache *select_cache(size_t size)
 {
-	mutex_acquire(&cache_lock);
 	struct cache *cache;
+	if(size < NUM_SMALL_CLASSES * 64 && (cache = atomic_load(&small_classes[size / 64])))
+		return cache;
+	mutex_acquire(&cache_lock);
 	if((cache = hash_lookup(&cache_hash, &size, sizeof(size))) == NULL) {
 		size_t cachesize = ((sizeof(struct cache) - 1) & ~63) + 64;
 		cache = hash_lookup(&cache_hash, &cachesize, sizeof(cachesize));
@@ -171,11 +423,71 @@ static struct cache *select_cache(size_t size)
 		cache = allocate_object_from_cache(cache);
 		construct_cache(cache, size);
 		hash_insert(&cache_hash, &cache->object_size, sizeof(cache->object_size), &cache->hash_elem, cache);
+		linkedlist_insert(&cache_list, &cache->node, cache);
 	}
+	if(size < NUM_SMALL_CLASSES * 64)
+		atomic_store(&small_classes[size / 64], cache);
 	mutex_release(&cache_lock);
 	return cache;
 }
 
+static void *allocate_large(size_t size)
+{
+	size_t npages = (size + LARGE_HEADER_SIZE - 1) / mm_page_size(0) + 1;
+	struct valloc_region reg;
+	if(valloc_allocate(&large_reg, &reg, npages) == 0)
+		panic(PANIC_NOSYNC, "could not allocate region for large object (%d)", size);
+	for(size_t i=0;i<npages;i++) {
+		addr_t phys = mm_physical_allocate(mm_page_size(0), true);
+		if(!mm_virtual_map(reg.start + i * mm_page_size(0), phys,
+					PAGE_PRESENT | PAGE_WRITE, mm_page_size(0)))
+			panic(PANIC_NOSYNC, "large object region already mapped");
+	}
+	struct large_object *lo = (void *)reg.start;
+	lo->magic = LARGE_MAGIC;
+	lo->npages = npages;
+	lo->size = size;
+	atomic_fetch_add_explicit(&large_count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&large_bytes, npages * mm_page_size(0), memory_order_relaxed);
+	return (void *)(reg.start + LARGE_HEADER_SIZE);
+}
+
+#define LARGE_UNMAP_BATCH 64
+static void free_large(void *data)
+{
+	struct large_object *lo = (void *)((addr_t)data - LARGE_HEADER_SIZE);
+	assert(((addr_t)lo & (mm_page_size(0) - 1)) == 0);
+	assert(lo->magic == LARGE_MAGIC);
+	lo->magic = 0;
+	struct valloc_region reg;
+	reg.start = (addr_t)lo;
+	reg.npages = lo->npages;
+	reg.flags = 0;
+	atomic_fetch_sub_explicit(&large_count, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&large_bytes, reg.npages * mm_page_size(0), memory_order_relaxed);
+	/* unmap in batches, and only free the pages once the other CPUs
+	 * have dropped their TLB entries for them */
+	addr_t pages[LARGE_UNMAP_BATCH];
+	for(long i=0;i<reg.npages;) {
+		int count = 0;
+		mm_tlb_gather_begin();
+		for(;i < reg.npages && count < LARGE_UNMAP_BATCH;i++) {
+			addr_t phys = mm_virtual_unmap(reg.start + i * mm_page_size(0));
+			if(phys)
+				pages[count++] = phys;
+		}
+		mm_tlb_gather_end();
+		for(int j=0;j<count;j++)
+			mm_physical_deallocate(pages[j]);
+	}
+	valloc_deallocate(&large_reg, &reg);
+}
+
+static inline bool is_large_object(void *data)
+{
+	return (addr_t)data >= large_reg.start && (addr_t)data < large_reg.end;
+}
+
 #define NUM_ENTRIES 256
 static struct linkedlist *__entries[NUM_ENTRIES];
 static struct linkedlist __entries_list[NUM_ENTRIES];
@@ -195,10 +507,18 @@ void slab_init(addr_t start, addr_t end)
 	construct_cache(&cache_cache, cachesize);
 	hash_insert(&cache_hash, &cache_cache.object_size, sizeof(cache_cache.object_size),
 			&cache_cache.hash_elem, &cache_cache);
+	linkedlist_create(&cache_list, LINKEDLIST_LOCKLESS);
+	linkedlist_insert(&cache_list, &cache_cache.node, &cache_cache);
 	mutex_create(&cache_lock, 0);
 
-	/* init the region */
-	valloc_create(&slabs_reg, start, end, SLAB_SIZE, 0);
+	/* init the regions. The top sixteenth of the kmalloc area is
+	 * used for large objects */
+	addr_t large_start = end - ((end - start) / 16);
+	large_start &= ~(SLAB_SIZE - 1);
+	valloc_create(&slabs_reg, start, large_start, SLAB_SIZE, 0);
+	valloc_create(&large_reg, large_start, end, mm_page_size(0), 0);
+	valloc_report_register(&slabs_reg, "slabs");
+	valloc_report_register(&large_reg, "large");
 }
 
 #define CANARY 1
@@ -206,6 +526,10 @@ void slab_init(addr_t start, addr_t end)
 void *slab_kmalloc(size_t __size)
 {
 	assert(__size);
+	if(__size > SLAB_SIZE / 4) {
+		/* pages come from the allocator already zeroed */
+		return allocate_large(__size);
+	}
 #if CANARY
 	size_t size = (((__size + sizeof(uint32_t)*2 + sizeof(size_t))-1) & ~(63)) + 64;
 #else
@@ -218,10 +542,11 @@ void *slab_kmalloc(size_t __size)
 	void *obj = 0;
 	if(size <= SLAB_SIZE / 4) {
 		struct cache *cache = select_cache(size);
-		obj = allocate_object_from_cache(cache);
+		obj = cache_allocate(cache);
 
 	} else {
-		panic(PANIC_NOSYNC, "cannot allocate things that big (%d)!", size);
+		/* rounding for the canaries pushed us over the limit */
+		return allocate_large(__size);
 	}
 #if CANARY
 	uint32_t *canary = (uint32_t *)(obj);
@@ -241,6 +566,10 @@ void *slab_kmalloc(size_t __size)
 void slab_kfree(void *data)
 {
 	assert((addr_t)data >= MEMMAP_KMALLOC_START && (addr_t)data < MEMMAP_KMALLOC_END);
+	if(is_large_object(data)) {
+		free_large(data);
+		return;
+	}
 #if CANARY
 	data = (void *)((addr_t)data - (sizeof(uint32_t) + sizeof(size_t)) );
 	uint32_t *canary = data;
@@ -253,6 +582,6 @@ void slab_kfree(void *data)
 	*canary = 0;
 	*canary2 = 0;
 #endif
-	free_object(data);
+	cache_free(data);
 }
 
@@ -1,32 +1,61 @@
 #include <sea/mm/vmm.h>
 #include <sea/tm/process.h>
 #include <sea/tm/kthread.h>
+#include <sea/tm/blocking.h>
 #include <sea/mm/reclaim.h>
 #include <sea/vsprintf.h>
 #include <sea/tm/timing.h>
-/* this is an extremely complicated function, so take some care
- * when reading it to increase understanding */
-int slab_get_usage(void);
+
+/* the pager sleeps until an allocator notices that it has crossed its
+ * watermark (see mm_pager_wakeup), and then reclaims until the pressure
+ * is gone or there's nothing left to reclaim. */
+#define PAGER_BATCH (128 * 1024)
+
+static struct blocklist pager_wait;
+static _Atomic bool pager_ready = false;
+static _Atomic bool pager_kicked = false;
+
+void mm_pager_wakeup(void)
+{
+	if(!pager_ready || atomic_exchange(&pager_kicked, true))
+		return;
+	/* the blocklist's spinlock can't be taken in interrupt context,
+	 * since we might have interrupted its holder. */
+	if(!current_thread || current_thread->interrupt_level) {
+		pager_kicked = false;
+		return;
+	}
+	tm_blocklist_wakeall(&pager_wait);
+}
+
+static bool __pager_should_sleep(void *data)
+{
+	struct kthread *kt = data;
+	return !pager_kicked && !kthread_is_joining(kt);
+}
+
 int __KT_pager(struct kthread *kt, void *arg)
 {
 	/* TODO: Need a good, clean API for this */
 	current_thread->priority = 10000;
+	blocklist_create(&pager_wait, 0, "pager");
+	pager_ready = true;
 	int active = 0;
 	while(!kthread_is_joining(kt)) {
-		/* reclaim memory if needed */
-		int km_use = slab_get_usage();
-		int pm_use = mm_physical_get_usage();
-		if(km_use > 50 || pm_use > 50) {
-			if(!mm_reclaim_size(128)) {
+		pager_kicked = false;
+		while(mm_reclaim_under_pressure()) {
+			if(!mm_reclaim_size(PAGER_BATCH)) {
+				/* nothing left that can be reclaimed; don't spin on
+				 * allocations that keep kicking us. */
 				tm_thread_delay(ONE_SECOND / 2);
-			} else {
-				if(!active++)
-					printk(0, "[mm]: activating memory reclaimer\n");
+				break;
 			}
-		} else {
-			tm_thread_delay(ONE_SECOND);
-			if(active > 0) active /= 2;
+			if(!active++)
+				printk(0, "[mm]: activating memory reclaimer\n");
 		}
+		if(active > 0) active /= 2;
+		tm_thread_block_confirm(&pager_wait, THREADSTATE_UNINTERRUPTIBLE,
+				__pager_should_sleep, kt);
 	}
 	return 0;
 }
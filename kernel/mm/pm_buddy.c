@@ -5,23 +5,45 @@
 #include <sea/mutex.h>
 #include <sea/fs/kerfs.h>
 #include <sea/lib/stack.h>
+#include <sea/cpu/processor.h>
+#include <sea/tm/thread.h>
+#include <sea/mm/reclaim.h>
 #define IS_POWER2(x) ((x != 0) && ((x & (~x + 1)) == x))
 
 #define MIN_PHYS_MEM 0
 
-#define MAX_ORDER 21
+#define MAX_ORDER 20
 #define MIN_SIZE PAGE_SIZE
 #define MAX_SIZE ((addr_t)MIN_SIZE << MAX_ORDER)
-#define MEMORY_SIZE (MAX_SIZE - MIN_PHYS_MEM)
 
-#define NOT_FREE (-1)
-struct mutex pm_buddy_mutex;
-uint8_t *bitmaps[MAX_ORDER + 1];
+/* physical memory is split into zones, each of which is a complete buddy
+ * allocator (freelists, bitmaps, lock) covering MAX_SIZE bytes. Blocks never
+ * merge across a zone boundary, so a block from ZONE_DMA32 always lies below
+ * 4GB. */
+#define ZONE_DMA32  0
+#define ZONE_NORMAL 1
+#define NUM_ZONES   2
+#define ZONE_SIZE MAX_SIZE
+#define MEMORY_SIZE (ZONE_SIZE * NUM_ZONES)
 
-struct stack freelists[MAX_ORDER+1];
-static char static_bitmaps[((MEMORY_SIZE / MIN_SIZE) / 8) * 2];
+struct buddy_zone {
+	const char *name;
+	addr_t start, end;
+	struct mutex lock;
+	uint8_t *bitmaps[MAX_ORDER + 1];
+	struct stack freelists[MAX_ORDER + 1];
+	size_t num_allocated[MAX_ORDER + 1];
+	_Atomic size_t free_memory;
+};
+
+static struct buddy_zone zones[NUM_ZONES] = {
+	[ZONE_DMA32]  = { .name = "DMA32"  },
+	[ZONE_NORMAL] = { .name = "NORMAL" },
+};
+
+/* the highest orders of each zone need less than a byte, but get one */
+static char static_bitmaps[((MEMORY_SIZE / MIN_SIZE) / 8) * 2 + NUM_ZONES * (MAX_ORDER + 1)];
 static bool inited = false;
-static size_t num_allocated[MAX_ORDER + 1];
 
 static _Atomic size_t free_memory = 0;
 static _Atomic size_t total_memory = 0;
@@ -39,78 +61,165 @@ static inline int min_possible_order(addr_t address)
 
 static inline size_t buddy_order_max_blocks(int order)
 {
-	return MEMORY_SIZE / ((addr_t)MIN_SIZE << order);
+	return ZONE_SIZE / ((addr_t)MIN_SIZE << order);
+}
+
+static inline struct buddy_zone *zone_of(addr_t address)
+{
+	return &zones[(address - MIN_PHYS_MEM) / ZONE_SIZE];
 }
 
-/* TODO: - OOM
- *       - Limit memory locations
- */
+static inline int zone_bit(struct buddy_zone *zone, addr_t address, int order)
+{
+	return (address - zone->start) / ((addr_t)MIN_SIZE << order);
+}
 
-static addr_t __do_pmm_buddy_allocate(size_t length)
+/* returns 0 if the zone has no free block large enough. Physical page 0 is
+ * never handed to the allocator, so 0 is never a valid block. */
+static addr_t __do_pmm_buddy_allocate(struct buddy_zone *zone, size_t length)
 {
 	assert(inited);
 	if(!IS_POWER2(length))
 		panic(0, "can only allocate in powers of 2");
 	if(length < MIN_SIZE)
 		panic(0, "length less than minimum size");
-	if(length > MAX_SIZE) {
-		panic(PANIC_NOSYNC, "out of physical memory");
-	}
+	if(length > MAX_SIZE)
+		return 0;
 
 	int order = min_possible_order(length);
 
-	if(stack_is_empty(&freelists[order])) {
-		addr_t a = __do_pmm_buddy_allocate(length * 2);
-		int bit = a / length;
+	if(stack_is_empty(&zone->freelists[order])) {
+		addr_t a = __do_pmm_buddy_allocate(zone, length * 2);
+		if(!a)
+			return 0;
 
 		struct stack_elem *elem1 = (void *)(a + PHYS_PAGE_MAP);
 		struct stack_elem *elem2 = (void *)(a + length + PHYS_PAGE_MAP);
 
-		stack_push(&freelists[order], elem1, (void *)a);
-		stack_push(&freelists[order], elem2, (void *)(a + length));
+		stack_push(&zone->freelists[order], elem1, (void *)a);
+		stack_push(&zone->freelists[order], elem2, (void *)(a + length));
 	}
 
-	addr_t address = (addr_t)stack_pop(&freelists[order]);
-	int bit = address / length;
-	assert(!bitmap_test(bitmaps[order], bit));
-	bitmap_set(bitmaps[order], bit);
-	num_allocated[order]++;
+	addr_t address = (addr_t)stack_pop(&zone->freelists[order]);
+	int bit = zone_bit(zone, address, order);
+	assert(!bitmap_test(zone->bitmaps[order], bit));
+	bitmap_set(zone->bitmaps[order], bit);
+	zone->num_allocated[order]++;
 
 	return address;
 }
 
-static int deallocate(addr_t address, int order)
+/* find a free block that contains a length-sized, length-aligned piece lying
+ * entirely within [min, max), and split it down to that piece. Freelists are
+ * searched smallest order first so that large blocks are left intact. */
+static addr_t __do_pmm_buddy_allocate_range(struct buddy_zone *zone, size_t length, addr_t min, addr_t max)
+{
+	assert(inited);
+	int order = min_possible_order(length);
+	addr_t first = (min + length - 1) & ~(length - 1);
+	for(int k = order; k <= MAX_ORDER; k++) {
+		struct stack *list = &zone->freelists[k];
+		size_t size = (addr_t)MIN_SIZE << k;
+		struct stack_elem *elem = list->top;
+		for(size_t n = 0; n < list->count; n++, elem = elem->prev) {
+			addr_t block = (addr_t)elem->obj;
+			addr_t lo = block > first ? block : first;
+			addr_t hi = block + size < max ? block + size : max;
+			if(lo + length > hi)
+				continue;
+
+			stack_delete(list, elem);
+			bitmap_set(zone->bitmaps[k], zone_bit(zone, block, k));
+			zone->num_allocated[k]++;
+			while(k > order) {
+				k--;
+				size /= 2;
+				addr_t other = block + size;
+				if(lo >= block + size) {
+					other = block;
+					block += size;
+				}
+				stack_push(&zone->freelists[k], (void *)(other + PHYS_PAGE_MAP), (void *)other);
+				bitmap_set(zone->bitmaps[k], zone_bit(zone, block, k));
+				zone->num_allocated[k]++;
+			}
+			assert(block == lo);
+			return block;
+		}
+	}
+	return 0;
+}
+
+static int deallocate(struct buddy_zone *zone, addr_t address, int order)
 {
 	assert(inited);
 	if(order > MAX_ORDER)
 		return -1;
-	int bit = address / ((addr_t)MIN_SIZE << order);
-	if(!bitmap_test(bitmaps[order], bit)) {
-		return deallocate(address, order + 1);
+	int bit = zone_bit(zone, address, order);
+	if(!bitmap_test(zone->bitmaps[order], bit)) {
+		return deallocate(zone, address, order + 1);
 	} else {
 		addr_t buddy = address ^ ((addr_t)MIN_SIZE << order);
-		int buddy_bit = buddy / ((addr_t)MIN_SIZE << order);
-		bitmap_reset(bitmaps[order], bit);
+		int buddy_bit = zone_bit(zone, buddy, order);
+		bitmap_reset(zone->bitmaps[order], bit);
 
-		if(!bitmap_test(bitmaps[order], buddy_bit)) {
+		if(order < MAX_ORDER && !bitmap_test(zone->bitmaps[order], buddy_bit)) {
 			struct stack_elem *elem = (void *)(buddy + PHYS_PAGE_MAP);
-			stack_delete(&freelists[order], elem);
-			deallocate(buddy > address ? address : buddy, order + 1);
+			stack_delete(&zone->freelists[order], elem);
+			zone->free_memory -= (addr_t)MIN_SIZE << order;
+			deallocate(zone, buddy > address ? address : buddy, order + 1);
 		} else {
 			struct stack_elem *elem = (void *)(address + PHYS_PAGE_MAP);
-			stack_push(&freelists[order], elem, (void *)address);
+			stack_push(&zone->freelists[order], elem, (void *)address);
+			zone->free_memory += (addr_t)MIN_SIZE << order;
 		}
-		num_allocated[order]--;
+		zone->num_allocated[order]--;
 		return order;
 	}
 }
 
+/* unconstrained allocations prefer high memory, leaving the DMA32 zone for
+ * callers that actually need it. */
+static const int zone_fallback[NUM_ZONES] = { ZONE_NORMAL, ZONE_DMA32 };
+
+static size_t pcp_drain_all(void);
+
+static size_t __do_pmm_buddy_allocate_batch(size_t length, addr_t *blocks, size_t count)
+{
+	size_t got = 0;
+	for(int i=0;i<NUM_ZONES && got < count;i++) {
+		struct buddy_zone *zone = &zones[zone_fallback[i]];
+		if(zone->free_memory < length)
+			continue;
+		mutex_acquire(&zone->lock);
+		while(got < count) {
+			addr_t a = __do_pmm_buddy_allocate(zone, length);
+			if(!a)
+				break;
+			zone->free_memory -= length;
+			blocks[got++] = a;
+		}
+		mutex_release(&zone->lock);
+	}
+	return got;
+}
+
+static size_t pmm_buddy_allocate_batch(size_t length, addr_t *blocks, size_t count)
+{
+	size_t got = __do_pmm_buddy_allocate_batch(length, blocks, count);
+	/* the per-CPU lists may be holding the blocks we need */
+	if(!got && pcp_drain_all())
+		got = __do_pmm_buddy_allocate_batch(length, blocks, count);
+	if(!got)
+		panic(PANIC_NOSYNC, "out of physical memory");
+	return got;
+}
+
 static inline addr_t pmm_buddy_allocate(size_t length)
 {
-	mutex_acquire(&pm_buddy_mutex);
-	addr_t ret = __do_pmm_buddy_allocate(length);
+	addr_t ret;
+	pmm_buddy_allocate_batch(length, &ret, 1);
 	free_memory -= length;
-	mutex_release(&pm_buddy_mutex);
 	return ret;
 }
 
@@ -118,29 +227,265 @@ static inline void pmm_buddy_deallocate(addr_t address)
 {
 	if(address >= MIN_PHYS_MEM + MEMORY_SIZE)
 		return;
-	mutex_acquire(&pm_buddy_mutex);
-	int order = deallocate(address, 0);
+	struct buddy_zone *zone = zone_of(address);
+	mutex_acquire(&zone->lock);
+	int order = deallocate(zone, address, 0);
 	if(order >= 0) {
 		free_memory += MIN_SIZE << order;
 		if(total_memory < free_memory)
 			total_memory = free_memory;
 	}
-	mutex_release(&pm_buddy_mutex);
+	mutex_release(&zone->lock);
+}
+
+/* Per-CPU page caches. The lists are only touched by their owning CPU with
+ * preemption disabled. Since the zone mutexes may not be taken with preemption
+ * off, refills and drains move blocks through a small on-stack array and do
+ * the buddy work after the CPU has been released. */
+
+/* bumped to ask every CPU to drain its lists. Another CPU's lists can't be
+ * touched from here, so each CPU notices the new generation the next time it
+ * frees a block, and drains itself. */
+static _Atomic unsigned long pcp_drain_gen = 0;
+
+static void pcp_cache_init(struct pmm_cpu_cache *cache)
+{
+	for(int i=0;i<=PMM_PCP_MAX_ORDER;i++) {
+		struct pmm_pcp_list *pcp = &cache->lists[i];
+		stack_create(&pcp->list, STACK_LOCKLESS);
+		pcp->batch = PMM_PCP_BATCH_MAX >> i;
+		pcp->high = pcp->batch * 4;
+		pcp->low = pcp->high - pcp->batch;
+	}
+	cache->drain_gen = pcp_drain_gen;
+	cache->inited = true;
+}
+
+static unsigned pcp_num_caches(void)
+{
+#if CONFIG_SMP
+	return cpu_array_num;
+#else
+	return 1;
+#endif
+}
+
+static struct pmm_cpu_cache *pcp_cache(unsigned i)
+{
+#if CONFIG_SMP
+	return &cpu_get(i)->pmm_cache;
+#else
+	return &primary_cpu->pmm_cache;
+#endif
+}
+
+static struct cpu *pcp_cpu_get(void)
+{
+	if(!current_thread || !current_thread->cpu || current_thread->interrupt_level)
+		return NULL;
+	struct cpu *cpu = cpu_get_current();
+	if(unlikely(!cpu->pmm_cache.inited))
+		pcp_cache_init(&cpu->pmm_cache);
+	return cpu;
+}
+
+/* the block's order can be found without the lock by probing the bitmaps of
+ * the small orders: the bits covering a block we own cannot change under us. */
+static int pcp_block_order(addr_t address)
+{
+	struct buddy_zone *zone = zone_of(address);
+	for(int order=0;order<=PMM_PCP_MAX_ORDER;order++) {
+		if(bitmap_test(zone->bitmaps[order], zone_bit(zone, address, order)))
+			return order;
+	}
+	return -1;
+}
+
+/* hand blocks taken off a list back to their zones, taking each zone's
+ * lock once */
+static void pcp_release(addr_t *blocks, size_t num, int order)
+{
+	for(int z=0;z<NUM_ZONES;z++) {
+		struct buddy_zone *zone = &zones[z];
+		bool locked = false;
+		for(size_t i=0;i<num;i++) {
+			if(zone_of(blocks[i]) != zone)
+				continue;
+			if(!locked) {
+				mutex_acquire(&zone->lock);
+				locked = true;
+			}
+			deallocate(zone, blocks[i], order);
+		}
+		if(locked)
+			mutex_release(&zone->lock);
+	}
+}
+
+static size_t pcp_drain_local(void);
+
+static addr_t pcp_allocate(int order)
+{
+	size_t length = (addr_t)MIN_SIZE << order;
+	struct cpu *cpu = pcp_cpu_get();
+	if(!cpu)
+		return pmm_buddy_allocate(length);
+	struct pmm_cpu_cache *cache = &cpu->pmm_cache;
+	struct pmm_pcp_list *pcp = &cache->lists[order];
+	if(!stack_is_empty(&pcp->list)) {
+		addr_t ret = (addr_t)stack_pop(&pcp->list);
+		cache->hits++;
+		cpu_put_current(cpu);
+		free_memory -= length;
+		return ret;
+	}
+	cache->misses++;
+	size_t batch = pcp->batch;
+	cpu_put_current(cpu);
+
+	addr_t blocks[PMM_PCP_BATCH_MAX];
+	batch = pmm_buddy_allocate_batch(length, blocks, batch);
+
+	/* we may have migrated, so refill whichever CPU we're on now */
+	cpu = pcp_cpu_get();
+	cache = &cpu->pmm_cache;
+	pcp = &cache->lists[order];
+	for(size_t i=1;i<batch;i++) {
+		stack_push(&pcp->list, (void *)(blocks[i] + PHYS_PAGE_MAP), (void *)blocks[i]);
+	}
+	cache->refills++;
+	cpu_put_current(cpu);
+	free_memory -= length;
+	return blocks[0];
+}
+
+static bool pcp_deallocate(addr_t address)
+{
+	int order = pcp_block_order(address);
+	if(order < 0)
+		return false;
+	struct cpu *cpu = pcp_cpu_get();
+	if(!cpu)
+		return false;
+	struct pmm_cpu_cache *cache = &cpu->pmm_cache;
+	size_t length = (addr_t)MIN_SIZE << order;
+	address &= ~(length - 1);
+	struct pmm_pcp_list *pcp = &cache->lists[order];
+	stack_push(&pcp->list, (void *)(address + PHYS_PAGE_MAP), (void *)address);
+	free_memory += length;
+	if(total_memory < free_memory)
+		total_memory = free_memory;
+
+	if(unlikely(cache->drain_gen != pcp_drain_gen)) {
+		cpu_put_current(cpu);
+		pcp_drain_local();
+		return true;
+	}
+	if(pcp->list.count <= pcp->high) {
+		cpu_put_current(cpu);
+		return true;
+	}
+
+	addr_t blocks[PMM_PCP_BATCH_MAX];
+	size_t num = 0;
+	while(pcp->list.count > pcp->low && num < pcp->batch)
+		blocks[num++] = (addr_t)stack_pop(&pcp->list);
+	cache->drains++;
+	cpu_put_current(cpu);
+	pcp_release(blocks, num, order);
+	return true;
+}
+
+/* give everything in the current CPU's lists back to the buddy zones, so that
+ * the blocks can merge again. Returns the number of bytes drained. */
+static size_t pcp_drain_local(void)
+{
+	size_t amount = 0;
+	for(int order=0;order<=PMM_PCP_MAX_ORDER;order++) {
+		size_t left = ~(size_t)0;
+		while(left) {
+			struct cpu *cpu = pcp_cpu_get();
+			if(!cpu)
+				return amount;
+			struct pmm_cpu_cache *cache = &cpu->pmm_cache;
+			struct pmm_pcp_list *pcp = &cache->lists[order];
+			cache->drain_gen = pcp_drain_gen;
+			/* don't chase blocks that get freed while we're at it */
+			if(left > pcp->list.count)
+				left = pcp->list.count;
+			addr_t blocks[PMM_PCP_BATCH_MAX];
+			size_t num = 0;
+			while(num < left && num < PMM_PCP_BATCH_MAX)
+				blocks[num++] = (addr_t)stack_pop(&pcp->list);
+			if(num)
+				cache->drains++;
+			cpu_put_current(cpu);
+			pcp_release(blocks, num, order);
+			amount += num * ((addr_t)MIN_SIZE << order);
+			left -= num;
+		}
+	}
+	return amount;
+}
+
+/* drain this CPU's lists now, and have the others drain theirs */
+static size_t pcp_drain_all(void)
+{
+	pcp_drain_gen++;
+	return pcp_drain_local();
+}
+
+/* the reclaimer counts cached pages, and drains whole lists when asked,
+ * since they never hold more than a few batches */
+static size_t pcp_count(void)
+{
+	size_t pages = 0;
+	for(unsigned i=0;i<pcp_num_caches();i++) {
+		struct pmm_cpu_cache *cache = pcp_cache(i);
+		if(!cache->inited)
+			continue;
+		for(int o=0;o<=PMM_PCP_MAX_ORDER;o++)
+			pages += cache->lists[o].list.count << o;
+	}
+	return pages;
+}
+
+static size_t pcp_scan(size_t nr)
+{
+	return pcp_drain_all();
+}
+
+static struct reclaimer pcp_reclaimer = {
+	.name = "pcp",
+	.count = pcp_count,
+	.scan = pcp_scan,
+	.object_size = MIN_SIZE,
+	.seeks = 1,
+};
+
+void pmm_buddy_reclaim_init(void)
+{
+	mm_reclaim_register(&pcp_reclaimer);
 }
 
 void pmm_buddy_init()
 {
-	int total = ((MEMORY_SIZE / MIN_SIZE) / (8 * 1024)) * 2 - 1;
-	mutex_create(&pm_buddy_mutex, 0);
 	addr_t start = (addr_t)static_bitmaps;
-	int length = ((MEMORY_SIZE / MIN_SIZE) / (8));
-	for(int i=0;i<=MAX_ORDER;i++) {
-		bitmaps[i] = (uint8_t *)start;
-		memset(bitmaps[i], ~0, length);
-		stack_create(&freelists[i], STACK_LOCKLESS);
-		start += length;
-		length /= 2;
-		num_allocated[i] = buddy_order_max_blocks(i);
+	for(int z=0;z<NUM_ZONES;z++) {
+		struct buddy_zone *zone = &zones[z];
+		mutex_create(&zone->lock, 0);
+		zone->start = MIN_PHYS_MEM + z * ZONE_SIZE;
+		zone->end = zone->start + ZONE_SIZE;
+		zone->free_memory = 0;
+		int length = ((ZONE_SIZE / MIN_SIZE) / (8));
+		for(int i=0;i<=MAX_ORDER;i++) {
+			zone->bitmaps[i] = (uint8_t *)start;
+			memset(zone->bitmaps[i], ~0, length ? length : 1);
+			stack_create(&zone->freelists[i], STACK_LOCKLESS);
+			start += length ? length : 1;
+			length /= 2;
+			zone->num_allocated[i] = buddy_order_max_blocks(i);
+		}
 	}
 	inited = true;
 }
@@ -151,6 +496,23 @@ int kerfs_pmm_report(int direction, void *param, size_t size, size_t offset, siz
 	KERFS_PRINTF(offset, length, buf, current,
 			"Avail. Memory: %dKB/%dKB (%dMB/%dMB)\n",
 			free_memory / 1024, total_memory / 1024, free_memory / (1024 * 1024), total_memory / (1024 * 1024));
+	for(unsigned i=0;i<pcp_num_caches();i++) {
+		struct pmm_cpu_cache *cache = pcp_cache(i);
+		if(!cache->inited)
+			continue;
+		KERFS_PRINTF(offset, length, buf, current,
+				"CPU %d cache: hits %d, misses %d, refills %d, drains %d, cached",
+				i, cache->hits, cache->misses, cache->refills, cache->drains);
+		for(int o=0;o<=PMM_PCP_MAX_ORDER;o++) {
+			KERFS_PRINTF(offset, length, buf, current,
+					" %d", cache->lists[o].list.count);
+		}
+		KERFS_PRINTF(offset, length, buf, current, "\n");
+	}
+	for(int z=0;z<NUM_ZONES;z++) {
+		KERFS_PRINTF(offset, length, buf, current,
+				"Zone %-6s: %dMB free\n", zones[z].name, zones[z].free_memory / (1024 * 1024));
+	}
 	/*for(int i=0;i<=MAX_ORDER;i++) {
 		KERFS_PRINTF(offset, length, buf, current,
 			"Order %d: %d / %d\n", i,
@@ -160,23 +522,97 @@ int kerfs_pmm_report(int direction, void *param, size_t size, size_t offset, siz
 	return current;
 }
 
+/* wake the pager once more than half of physical memory is in use */
+static inline void pmm_check_watermark(void)
+{
+	if(free_memory * 2 < total_memory)
+		mm_pager_wakeup();
+}
+
 addr_t mm_physical_allocate(size_t length, bool clear)
 {
-	addr_t ret = pmm_buddy_allocate(length);
+	addr_t ret;
+	int order = min_possible_order(length);
+	if(IS_POWER2(length) && length >= MIN_SIZE && order <= PMM_PCP_MAX_ORDER)
+		ret = pcp_allocate(order);
+	else
+		ret = pmm_buddy_allocate(length);
+	pmm_check_watermark();
 	if(clear)
 		arch_mm_physical_memset((void *)ret, 0, length);
 	return ret;
 }
 
+static addr_t __do_pmm_buddy_allocate_region(size_t length, addr_t min, addr_t max)
+{
+	addr_t ret = 0;
+	for(int i=0;i<NUM_ZONES && !ret;i++) {
+		struct buddy_zone *zone = &zones[zone_fallback[i]];
+		if(zone->end <= min || zone->start >= max || zone->free_memory < length)
+			continue;
+		mutex_acquire(&zone->lock);
+		if(min <= zone->start && max >= zone->end)
+			ret = __do_pmm_buddy_allocate(zone, length);
+		else
+			ret = __do_pmm_buddy_allocate_range(zone, length, min, max);
+		if(ret)
+			zone->free_memory -= length;
+		mutex_release(&zone->lock);
+	}
+	return ret;
+}
+
+/* allocate a naturally aligned block of length bytes lying entirely within
+ * [min, max). A max of 0 means no upper limit. Returns 0 if no such block is
+ * free; unlike mm_physical_allocate, this does not panic. */
 addr_t mm_physical_allocate_region(size_t length, bool clear, addr_t min, addr_t max)
 {
-	/* TODO: actually implement this */
-	return mm_physical_allocate(length, clear);
+	if(!max || max > MIN_PHYS_MEM + MEMORY_SIZE)
+		max = MIN_PHYS_MEM + MEMORY_SIZE;
+	if(!IS_POWER2(length) || length < MIN_SIZE)
+		panic(0, "can only allocate in powers of 2");
+
+	addr_t ret = __do_pmm_buddy_allocate_region(length, min, max);
+	/* small blocks parked in the per-CPU lists can keep their buddies from
+	 * merging, so give them back and try again before giving up */
+	if(!ret && pcp_drain_all())
+		ret = __do_pmm_buddy_allocate_region(length, min, max);
+	if(!ret)
+		return 0;
+	free_memory -= length;
+	pmm_check_watermark();
+	if(clear)
+		arch_mm_physical_memset((void *)ret, 0, length);
+	return ret;
 }
 
 void mm_physical_deallocate(addr_t address)
 {
-	pmm_buddy_deallocate(address);
+	if(address >= MIN_PHYS_MEM + MEMORY_SIZE)
+		return;
+	if(!pcp_deallocate(address))
+		pmm_buddy_deallocate(address);
+}
+
+/* turn an allocated block into individually allocated MIN_SIZE pages, each
+ * of which can then be freed on its own. Marking every sub-block at every
+ * lower order is exactly the state the bitmaps would be in had the pages
+ * been allocated by splitting the block one at a time. */
+void mm_physical_split(addr_t address, size_t length)
+{
+	if(address >= MIN_PHYS_MEM + MEMORY_SIZE)
+		return;
+	int order = min_possible_order(length);
+	struct buddy_zone *zone = zone_of(address);
+	mutex_acquire(&zone->lock);
+	assert(bitmap_test(zone->bitmaps[order], zone_bit(zone, address, order)));
+	for(int k = order - 1; k >= 0; k--) {
+		size_t size = (addr_t)MIN_SIZE << k;
+		for(addr_t a = address; a < address + length; a += size)
+			bitmap_set(zone->bitmaps[k], zone_bit(zone, a, k));
+		zone->num_allocated[k] += length / size;
+	}
+	mutex_release(&zone->lock);
 }
 
 int mm_physical_get_usage(void)
@@ -1,7 +1,8 @@
 #include <sea/mm/kmalloc.h>
 #include <sea/mm/reclaim.h>
+#include <sea/mm/pmm.h>
 #include <sea/lib/linkedlist.h>
-#include <sea/lib/linkedlist.h>
+#include <sea/fs/kerfs.h>
 
 struct linkedlist reclaimers;
 
@@ -10,32 +11,90 @@ void mm_reclaim_init(void)
 	linkedlist_create(&reclaimers, LINKEDLIST_MUTEX);
 }
 
-void mm_reclaim_register(size_t (*fn)(void), size_t size)
+void mm_reclaim_register(struct reclaimer *rec)
 {
-	struct reclaimer *rec = kmalloc(sizeof(struct reclaimer));
-	rec->size = size;
-	rec->fn = fn;
+	rec->scanned = rec->freed = 0;
+	if(!rec->seeks)
+		rec->seeks = RECLAIM_DEFAULT_SEEKS;
 	linkedlist_insert(&reclaimers, &rec->node, rec);
 }
 
-static unsigned long __reclaim_reducer(struct linkedentry *entry, unsigned long value)
+/* memory is considered under pressure when either the physical allocator
+ * or the kmalloc region is more than this percent used */
+#define RECLAIM_WATERMARK 50
+int slab_get_usage(void);
+bool mm_reclaim_under_pressure(void)
+{
+	return mm_physical_get_usage() > RECLAIM_WATERMARK
+		|| slab_get_usage() > RECLAIM_WATERMARK;
+}
+
+struct shrink_control {
+	int priority;
+	size_t freed;
+};
+
+/* scan a share of each reclaimer proportional to its size, so that a
+ * large cache gives up more than a small one. */
+static void __shrink_one(struct linkedentry *entry, void *data)
 {
 	struct reclaimer *rec = entry->obj;
-	return rec->fn() + value;
+	struct shrink_control *sc = data;
+	size_t count = rec->count();
+	if(!count)
+		return;
+	size_t nr = ((count >> sc->priority) * RECLAIM_DEFAULT_SEEKS) / rec->seeks;
+	if(sc->priority == 0 && nr == 0)
+		nr = count;
+	if(nr > count)
+		nr = count;
+	if(!nr)
+		return;
+	size_t freed = rec->scan(nr);
+	rec->scanned += nr;
+	rec->freed += freed;
+	sc->freed += freed;
 }
 
+static size_t __shrink_all(int priority)
+{
+	struct shrink_control sc = { .priority = priority, .freed = 0 };
+	linkedlist_apply_data(&reclaimers, __shrink_one, &sc);
+	return sc.freed;
+}
+
+/* reclaim at least size bytes if possible, raising the scan pressure each
+ * round that falls short. Returns the number of bytes freed. */
 size_t mm_reclaim_size(size_t size)
 {
-	size_t amount = 0, thisround = 1;
-	while(amount < size && thisround != 0) {
-		thisround = linkedlist_reduce(&reclaimers, __reclaim_reducer, 0);
-		amount += thisround;
-	}
+	size_t amount = 0;
+	for(int prio = RECLAIM_PRIORITY_MAX; prio >= 0 && amount < size; prio--)
+		amount += __shrink_all(prio);
 	return amount;
 }
 
 void mm_reclaim(void)
 {
-	linkedlist_reduce(&reclaimers, __reclaim_reducer, 0);
+	__shrink_all(RECLAIM_PRIORITY_MAX / 2);
+}
+
+int kerfs_reclaim_report(int direction, void *param, size_t size,
+		size_t offset, size_t length, unsigned char *buf)
+{
+	size_t current = 0;
+	KERFS_PRINTF(offset, length, buf, current,
+			" OBJECTS  OBJSIZE SEEKS    SCANNED  FREED(KB) NAME\n");
+	__linkedlist_lock(&reclaimers);
+	for(struct linkedentry *entry = linkedlist_iter_start(&reclaimers);
+			entry != linkedlist_iter_end(&reclaimers);
+			entry = linkedlist_iter_next(entry)) {
+		struct reclaimer *rec = entry->obj;
+		KERFS_PRINTF(offset, length, buf, current,
+				"%8d %8d %5d %10d %10d %s\n",
+				rec->count(), rec->object_size, rec->seeks,
+				rec->scanned, rec->freed / 1024, rec->name);
+	}
+	__linkedlist_unlock(&reclaimers);
+	return current;
 }
 
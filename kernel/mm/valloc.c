@@ -2,105 +2,175 @@
  * Allocates regions of virtual memory, of nearly arbitrary granularity
  * (must be multiples of PAGE_SIZE)
  *
- * current implementation is done as a bitmap with next-fit. This
- * isn't particularly good, or anything, but it's reasonably fast
- * and simple.
+ * current implementation is done as a bitmap with next-fit. The bitmap
+ * is scanned a 64-bit word at a time, and is backed by two summary
+ * bitmaps (one bit per bitmap word) recording which words are completely
+ * full and which are completely empty. Searches use the summaries to skip
+ * over runs of full words when looking for a free bit, and over runs of
+ * empty words when measuring a free range, so the cost of a search
+ * depends on the fragmentation of the region rather than on its size.
  *
- * WARNING: This is REALLY SLOW for large areas (>32 bits) of virtual
- * memory */
+ * The bitmap and the summaries live at the start of the region itself,
+ * in the first nindex pages. */
 
 #include <sea/kernel.h>
 #include <sea/mm/valloc.h>
 #include <sea/mm/vmm.h>
 #include <sea/mm/kmalloc.h>
 #include <sea/kobj.h>
-#define SET_BIT(start,index) \
-	(*((uint8_t *)start + (index / 8)) |= (1 << (index % 8)))
+#include <sea/fs/kerfs.h>
 
-#define CLEAR_BIT(start,index) \
-	(*((uint8_t *)start + (index / 8)) &= ~(1 << (index % 8)))
+#define WORD_BITS 64
 
-#define TEST_BIT(start,index) \
-	(*((uint8_t *)start + (index / 8)) & (1 << (index % 8)))
+static inline uint64_t *__valloc_leaf(struct valloc *va)
+{
+	return (uint64_t *)va->start;
+}
+
+static inline uint64_t *__valloc_full(struct valloc *va)
+{
+	return __valloc_leaf(va) + va->nwords;
+}
+
+static inline uint64_t *__valloc_empty(struct valloc *va)
+{
+	return __valloc_full(va) + va->nsum;
+}
+
+static inline uint64_t __valloc_mask(int bit, int count)
+{
+	return (count == WORD_BITS ? ~0ull : ((1ull << count) - 1)) << bit;
+}
+
+static void __valloc_update_summary(struct valloc *va, long w)
+{
+	uint64_t word = __valloc_leaf(va)[w];
+	uint64_t bit = 1ull << (w % WORD_BITS);
+	if(word == ~0ull)
+		__valloc_full(va)[w / WORD_BITS] |= bit;
+	else
+		__valloc_full(va)[w / WORD_BITS] &= ~bit;
+	if(word == 0)
+		__valloc_empty(va)[w / WORD_BITS] |= bit;
+	else
+		__valloc_empty(va)[w / WORD_BITS] &= ~bit;
+}
 
 static void __valloc_set_bits(struct valloc *va, long start, long count)
 {
-	for(long idx = start;idx < (start + count); idx++) {
+	uint64_t *leaf = __valloc_leaf(va);
+	for(long idx = start;idx < (start + count);) {
+		long w = idx / WORD_BITS;
+		int bit = idx % WORD_BITS;
+		int n = WORD_BITS - bit;
+		if(n > (start + count) - idx)
+			n = (start + count) - idx;
+		uint64_t mask = __valloc_mask(bit, n);
 		if(start >= va->nindex)
-			assert(!TEST_BIT(va->start, idx));
-		SET_BIT(va->start, idx);
+			assert(!(leaf[w] & mask));
+		leaf[w] |= mask;
+		__valloc_update_summary(va, w);
+		idx += n;
 	}
 }
 
-static int __valloc_count_bits(struct valloc *va)
+static void __valloc_clear_bits(struct valloc *va, long start, long count)
 {
-	int count = 0;
-	for(long idx = 0;idx < va->npages; idx++) {
-		if(TEST_BIT(va->start, idx))
-			++count;
+	uint64_t *leaf = __valloc_leaf(va);
+	for(long idx = start;idx < (start + count);) {
+		long w = idx / WORD_BITS;
+		int bit = idx % WORD_BITS;
+		int n = WORD_BITS - bit;
+		if(n > (start + count) - idx)
+			n = (start + count) - idx;
+		uint64_t mask = __valloc_mask(bit, n);
+		if(start >= va->nindex)
+			assert((leaf[w] & mask) == mask);
+		leaf[w] &= ~mask;
+		__valloc_update_summary(va, w);
+		idx += n;
 	}
-	return count;
 }
 
-static void __valloc_clear_bits(struct valloc *va, long start, long count)
+static long __valloc_count_bits(struct valloc *va)
 {
-	for(long idx = start;idx < (start + count); idx++) {
-		if(start >= va->nindex)
-			assert(TEST_BIT(va->start, idx));
-		CLEAR_BIT(va->start, idx);
-		assert(!TEST_BIT(va->start, idx));
+	long count = 0;
+	uint64_t *leaf = __valloc_leaf(va);
+	for(long w = 0;w < va->nwords; w++)
+		count += __builtin_popcountll(leaf[w]);
+	/* don't count the padding bits past the end of the region */
+	return count - (va->nwords * WORD_BITS - va->npages);
+}
+
+/* returns the index of the first bit in [idx, limit) that is clear (if
+ * want_set is false) or set (if want_set is true), or limit if there is
+ * none. Whole words that can't contain a match are skipped using the
+ * matching summary bitmap. */
+static long __valloc_scan(struct valloc *va, long idx, long limit, bool want_set)
+{
+	uint64_t *leaf = __valloc_leaf(va);
+	uint64_t *skip = want_set ? __valloc_empty(va) : __valloc_full(va);
+	while(idx < limit) {
+		long w = idx / WORD_BITS;
+		uint64_t word = want_set ? leaf[w] : ~leaf[w];
+		word &= ~0ull << (idx % WORD_BITS);
+		va->search_words++;
+		if(word) {
+			idx = w * WORD_BITS + __builtin_ctzll(word);
+			return idx < limit ? idx : limit;
+		}
+		/* find the next word that isn't all-full (or all-empty) */
+		w++;
+		long s = w / WORD_BITS;
+		if(s >= va->nsum)
+			return limit;
+		uint64_t candidates = ~skip[s] & (~0ull << (w % WORD_BITS));
+		while(!candidates) {
+			if(++s >= va->nsum || s * WORD_BITS * WORD_BITS >= limit)
+				return limit;
+			candidates = ~skip[s];
+			va->search_words++;
+		}
+		idx = (s * WORD_BITS + __builtin_ctzll(candidates)) * WORD_BITS;
+	}
+	return limit;
+}
+
+/* find np clear bits, starting in [from, limit) and ending before limit */
+static long __valloc_find_run(struct valloc *va, long np, long from, long limit)
+{
+	long idx = from;
+	while(idx < limit) {
+		long start = __valloc_scan(va, idx, limit, false);
+		if(start + np > limit)
+			return -1;
+		long end = __valloc_scan(va, start, start + np, true);
+		if(end - start >= np)
+			return start;
+		idx = end;
 	}
+	return -1;
 }
 
-/* performs a linear next-fit search */
+/* performs a next-fit search */
 static long __valloc_get_start_index(struct valloc *va, long np)
 {
-	long start = -1;
-	long count = 0;
 	long idx = va->last;
 	if(idx >= va->npages)
 		idx=0;
-	long prev = idx;
-	do {
-		int res = TEST_BIT(va->start, idx);
-		if(start == -1 && res == 0) {
-			/* we aren't checking a region for length, 
-			 * and we found an empty bit. Start checking
-			 * this region for length */
-			start = idx;
-			count=1;
-			if(count == np)
-				break;
-		} else {
-			/* we're checking a region for length. If this
-			 * bit is 0, then we add to the count. Otherwise,
-			 * we reset start to start looking for a new region */
-			if(res == 0)
-				count++;
-			else {
-				start = -1;
-				count = 0;
-			}
-			/* if this region is long enough, break out */
-			if(count == np)
-				break;
-		}
-		idx++;
-		/* need to wrap around due to next-fit */
-		if(idx >= va->npages) {
-			/* the region can't wrap around... */
-			start = -1;
-			count=0;
-			idx=0;
-		}
-	} while(idx != prev);
-	/* if it's a reasonable and legal region, return it */
-	if(start != -1 && start < va->npages && count >= np) {
-		/* and update 'last' for next-fit */
+	va->searches++;
+	long start = __valloc_find_run(va, np, idx, va->npages);
+	if(start == -1 && idx > 0) {
+		/* need to wrap around due to next-fit. The region can't wrap
+		 * around, but it can run past where we started. */
+		long limit = idx + np - 1;
+		start = __valloc_find_run(va, np, 0, limit < va->npages ? limit : va->npages);
+	}
+	if(start != -1) {
+		/* update 'last' for next-fit */
 		va->last = start + np;
-		return start;
 	}
-	return -1;
+	return start;
 }
 
 static void __valloc_populate_index(struct valloc *va, int flags)
@@ -124,6 +194,18 @@ static void __valloc_populate_index(struct valloc *va, int flags)
 		}
 
 	}
+	/* the padding past the end of the region is never free */
+	long used = va->npages % WORD_BITS;
+	if(used)
+		__valloc_leaf(va)[va->nwords - 1] |= ~__valloc_mask(0, used);
+	for(long w = 0;w < va->nsum * WORD_BITS;w++) {
+		if(w < va->nwords) {
+			__valloc_update_summary(va, w);
+		} else {
+			__valloc_full(va)[w / WORD_BITS] |= 1ull << (w % WORD_BITS);
+			__valloc_empty(va)[w / WORD_BITS] &= ~(1ull << (w % WORD_BITS));
+		}
+	}
 	__valloc_set_bits(va, 0, va->nindex);
 }
 
@@ -152,7 +234,10 @@ struct valloc *valloc_create(struct valloc *va, addr_t start, addr_t end, size_t
 	mutex_create(&va->lock, 0);
 
 	va->npages = (end - start) / page_size;
-	va->nindex = ((va->npages-1) / (8 * page_size)) + 1;
+	va->nwords = (va->npages - 1) / WORD_BITS + 1;
+	va->nsum = (va->nwords - 1) / WORD_BITS + 1;
+	size_t index_bytes = (va->nwords + va->nsum * 2) * sizeof(uint64_t);
+	va->nindex = ((index_bytes - 1) / page_size) + 1;
 	__valloc_populate_index(va, flags);
 	return va;
 }
@@ -172,7 +257,8 @@ struct valloc_region *valloc_allocate(struct valloc *va, struct valloc_region *r
 	mutex_acquire(&va->lock);
 	/* find and set the region */
 	long index = __valloc_get_start_index(va, np);
-	__valloc_set_bits(va, index, np);
+	if(index != -1)
+		__valloc_set_bits(va, index, np);
 	assert(index < va->npages);
 	mutex_release(&va->lock);
 	if(index == -1)
@@ -197,7 +283,7 @@ int valloc_count_used(struct valloc *va)
 {
 	assert(va->magic == VALLOC_MAGIC);
 	mutex_acquire(&va->lock);
-	int ret = __valloc_count_bits(va);
+	long ret = __valloc_count_bits(va);
 	mutex_release(&va->lock);
 	return ret;
 }
@@ -233,3 +319,61 @@ struct valloc_region *valloc_split_region(struct valloc *va, struct valloc_regio
 	return nr;
 }
 
+
+/* walks the free ranges of a region, for reporting. Takes the lock. */
+void valloc_get_stats(struct valloc *va, struct valloc_stats *st)
+{
+	assert(va->magic == VALLOC_MAGIC);
+	memset(st, 0, sizeof(*st));
+	mutex_acquire(&va->lock);
+	size_t saved = va->search_words;
+	long idx = 0;
+	while(idx < va->npages) {
+		long start = __valloc_scan(va, idx, va->npages, false);
+		if(start >= va->npages)
+			break;
+		long end = __valloc_scan(va, start, va->npages, true);
+		st->free_extents++;
+		st->free_pages += end - start;
+		if(end - start > st->largest_extent)
+			st->largest_extent = end - start;
+		idx = end;
+	}
+	va->search_words = saved;
+	st->searches = va->searches;
+	st->search_words = va->search_words;
+	mutex_release(&va->lock);
+}
+
+#define MAX_REPORTED 8
+static struct {
+	const char *name;
+	struct valloc *va;
+} reported[MAX_REPORTED];
+static int num_reported = 0;
+
+void valloc_report_register(struct valloc *va, const char *name)
+{
+	assert(num_reported < MAX_REPORTED);
+	reported[num_reported].name = name;
+	reported[num_reported].va = va;
+	num_reported++;
+}
+
+int kerfs_valloc_report(int direction, void *param, size_t size, size_t offset, size_t length, unsigned char *buf)
+{
+	size_t current = 0;
+	KERFS_PRINTF(offset, length, buf, current,
+			"%-10s %10s %10s %8s %10s %10s %s\n",
+			"REGION", "PAGES", "FREE", "EXTENTS", "LARGEST", "SEARCHES", "WORDS/SEARCH");
+	for(int i=0;i<num_reported;i++) {
+		struct valloc_stats st;
+		valloc_get_stats(reported[i].va, &st);
+		KERFS_PRINTF(offset, length, buf, current,
+				"%-10s %10d %10d %8d %10d %10d %d\n",
+				reported[i].name, reported[i].va->npages, st.free_pages,
+				st.free_extents, st.largest_extent, st.searches,
+				st.searches ? st.search_words / st.searches : 0);
+	}
+	return current;
+}
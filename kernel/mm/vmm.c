@@ -1,6 +1,8 @@
 #include <sea/types.h>
 #include <sea/mm/vmm.h>
 #include <stdbool.h>
+#include <sea/tm/thread.h>
+#include <sea/kernel.h>
 void arch_mm_context_clone(struct vmm_context *old, struct vmm_context *new);
 void arch_mm_context_destroy(struct vmm_context *dir);
 void arch_mm_free_userspace();
@@ -22,6 +24,29 @@ void mm_flush_page_tables(void)
 	arch_mm_flush_page_tables();
 }
 
+void arch_mm_tlb_gather_flush(struct tlb_gather *);
+void mm_tlb_gather_begin(void)
+{
+	if(current_thread)
+		current_thread->tlb_gather.depth++;
+}
+
+void mm_tlb_gather_end(void)
+{
+	if(!current_thread)
+		return;
+	struct tlb_gather *gather = &current_thread->tlb_gather;
+	assert(gather->depth > 0);
+	if(--gather->depth == 0)
+		arch_mm_tlb_gather_flush(gather);
+}
+
+void arch_mm_handle_tlb_ipi(void);
+void mm_handle_tlb_ipi(void)
+{
+	arch_mm_handle_tlb_ipi();
+}
+
 bool arch_mm_context_virtual_map(struct vmm_context *ctx,
 		addr_t virtual, addr_t physical, int flags, size_t length);
 
@@ -91,6 +116,25 @@ bool mm_context_virtual_changeattr(struct vmm_context *ctx, addr_t virtual, int
 	return arch_mm_context_virtual_changeattr(ctx, virtual, flags, length);
 }
 
+bool arch_mm_virtual_split(addr_t virtual);
+bool arch_mm_context_virtual_split(struct vmm_context *ctx, addr_t virtual);
+bool arch_mm_virtual_large_slot_free(addr_t virtual);
+
+bool mm_virtual_split(addr_t virtual)
+{
+	return arch_mm_virtual_split(virtual);
+}
+
+bool mm_context_virtual_split(struct vmm_context *ctx, addr_t virtual)
+{
+	return arch_mm_context_virtual_split(ctx, virtual);
+}
+
+bool mm_virtual_large_slot_free(addr_t virtual)
+{
+	return arch_mm_virtual_large_slot_free(virtual);
+}
+
 bool mm_virtual_trymap(addr_t virtual, int flags, size_t length)
 {
 	bool result = false;
@@ -3,11 +3,17 @@
 #include <sea/net/interface.h>
 #include <sea/errno.h>
 
-int net_callback_poll(struct net_dev *nd, struct net_packet *packets, int max)
+int net_callback_poll(struct net_dev *nd, int queue, struct net_packet **packets, int budget)
 {
 	if(!nd || !nd->callbacks || !nd->callbacks->poll || !packets)
 		return -EINVAL;
-	return nd->callbacks->poll(nd, packets, max);
+	return nd->callbacks->poll(nd, queue, packets, budget);
+}
+
+void net_callback_rx_interrupts(struct net_dev *nd, int queue, bool enable)
+{
+	if(nd && nd->callbacks && nd->callbacks->rx_interrupts)
+		nd->callbacks->rx_interrupts(nd, queue, enable);
 }
 
 int net_callback_change_link(struct net_dev *nd, uint32_t link)
@@ -39,6 +39,35 @@ void net_data_receive(struct net_dev *nd, struct net_packet *packet)
 		dlp->receive(nd, packet);
 }
 
+void net_data_receive_batch(struct net_dev *nd, struct net_packet **packets, int count)
+{
+	struct data_layer_protocol *dlp = net_data_get_protocol(nd->hw_type);
+	if(!dlp)
+		return;
+	if(!dlp->decode) {
+		for(int i=0;i<count && dlp->receive;i++)
+			dlp->receive(nd, packets[i]);
+		return;
+	}
+	/* hand up each run of packets for the same protocol together */
+	struct net_packet *run[count];
+	sa_family_t run_af = 0;
+	int length = 0;
+	for(int i=0;i<count;i++) {
+		sa_family_t af = dlp->decode(nd, packets[i]);
+		if(af == (sa_family_t)-1)
+			continue;
+		if(length && af != run_af) {
+			net_nlayer_receive_batch(nd, run, length, run_af);
+			length = 0;
+		}
+		run_af = af;
+		run[length++] = packets[i];
+	}
+	if(length)
+		net_nlayer_receive_batch(nd, run, length, run_af);
+}
+
 void net_data_init(void)
 {
 	memset(protocols, 0, sizeof(protocols));
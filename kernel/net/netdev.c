@@ -3,6 +3,7 @@
 #include <stdatomic.h>
 #include <sea/errno.h>
 #include <sea/fs/devfs.h>
+#include <sea/fs/kerfs.h>
 #include <sea/kernel.h>
 #include <sea/loader/symbol.h>
 #include <sea/mm/kmalloc.h>
@@ -44,7 +45,9 @@ void net_init(void)
 	net_major = dm_device_register(&__kd);
 #if CONFIG_MODULES
 	loader_add_kernel_symbol(net_add_device);
+	loader_add_kernel_symbol(net_add_device_mq);
 	loader_add_kernel_symbol(net_notify_packet_ready);
+	loader_add_kernel_symbol(net_notify_rx_queue);
 	loader_add_kernel_symbol(net_receive_packet);
 	loader_add_kernel_symbol(net_data_queue_enqueue);
 	loader_add_kernel_symbol(socket_set_calls);
@@ -55,11 +58,20 @@ void net_init(void)
 	loader_add_kernel_symbol(net_tlayer_deregister_protocol);
 	loader_add_kernel_symbol(sys_bind);
 	loader_add_kernel_symbol(net_route_select_entry);
+	loader_add_kernel_symbol(net_route_lookup);
+	loader_add_kernel_symbol(net_route_generation);
+	loader_add_kernel_symbol(net_route_get);
+	loader_add_kernel_symbol(net_route_put);
+	loader_add_kernel_symbol(net_route_cache_create);
+	loader_add_kernel_symbol(net_route_cache_destroy);
+	loader_add_kernel_symbol(net_route_cache_lookup);
 	loader_add_kernel_symbol(net_packet_create);
 	loader_add_kernel_symbol(net_nlayer_register_protocol);
 	loader_add_kernel_symbol(net_nlayer_unregister_protocol);
 	loader_add_kernel_symbol(net_packet_get);
 	loader_add_kernel_symbol(net_packet_put);
+	loader_add_kernel_symbol(net_packet_add_frag);
+	loader_add_kernel_symbol(net_packet_copy_out);
 	loader_add_kernel_symbol(net_iface_get_netaddr);
 	loader_add_kernel_symbol(net_iface_get_netmask);
 	loader_add_kernel_symbol(net_tlayer_recvfrom_network);
@@ -70,47 +82,107 @@ void net_init(void)
 	loader_add_kernel_symbol(net_transmit_packet);
 	loader_add_kernel_symbol(net_nlayer_receive_from_dlayer);
 	loader_add_kernel_symbol(net_data_unregister_protocol);
+	loader_add_kernel_symbol(net_nlayer_send_packet);
 #endif
+	net_route_init();
 	arp_init();
 	net_tlayer_init();
 	net_nlayer_init();
 	net_data_init();
 }
 
+/* Receive queues work like NAPI. A queue starts out interrupt driven; its
+ * rx interrupt calls net_notify_rx_queue, which masks further interrupts
+ * for the queue and wakes its thread. The thread then polls the queue for
+ * up to NET_RX_BUDGET packets at a time, handing each batch up the stack as
+ * a unit, until a poll comes back short. Then it unmasks interrupts and
+ * goes back to sleep. */
+static void __rx_record_batch(struct net_rx_queue *rxq, int count)
+{
+	int bucket = 0;
+	while(count) {
+		bucket++;
+		count >>= 1;
+	}
+	if(bucket >= NET_RX_HIST_BUCKETS)
+		bucket = NET_RX_HIST_BUCKETS - 1;
+	rxq->polls++;
+	rxq->batch_hist[bucket]++;
+}
+
 static int kt_packet_rec_thread(struct kthread *kt, void *arg)
 {
-	struct net_packet *pack;
-	struct net_dev *nd = arg;
-	int packets=0;
-	int ret = 0;
+	struct net_rx_queue *rxq = arg;
+	struct net_dev *nd = rxq->nd;
+	struct net_packet *packets[NET_RX_BUDGET];
+	for(int i=0;i<NET_RX_BUDGET;i++)
+		packets[i] = net_packet_create(0, 0);
 	while(!kthread_is_joining(kt)) {
-		if(nd->rx_pending || ret) {
-			packets++;
-			pack = net_packet_create(0, 0);
-			ret = net_callback_poll(nd, pack, 1);
-			TRACE(0, "[kpacket]: got packet (%d %d : %d)\n", nd->rx_pending, packets, ret);
-			if(ret > 0) {
-				if(nd->rx_pending > 0)
-					atomic_fetch_sub(&nd->rx_pending, 1);
-				net_receive_packet(nd, pack, 1);
-			} else {
-				tm_schedule();
+		if(!atomic_load(&rxq->polling)) {
+			tm_thread_pause(current_thread);
+			continue;
+		}
+		atomic_store(&rxq->pending, 0);
+		int ret = net_callback_poll(nd, rxq->idx, packets, NET_RX_BUDGET);
+		if(ret < 0)
+			ret = 0;
+		TRACE(0, "[kpacket]: polled %d packets from queue %d\n", ret, rxq->idx);
+		__rx_record_batch(rxq, ret);
+		if(ret > 0) {
+			net_receive_packet(nd, packets, ret);
+			/* anything the stack wants to keep, it took a reference to */
+			for(int i=0;i<ret;i++) {
+				net_packet_put(packets[i], 0);
+				packets[i] = net_packet_create(0, 0);
 			}
-			net_packet_put(pack, 0);
-			pack = 0;
-			nd->rx_thread_lastwork = tm_timing_get_microseconds();
-		} else {
-			if(tm_timing_get_microseconds() > nd->rx_thread_lastwork + ONE_SECOND * 5)
-				tm_thread_pause(current_thread);
-			else
-				tm_schedule();
 		}
+		if(ret == NET_RX_BUDGET) {
+			/* there's probably more, but let everything else run first */
+			tm_schedule();
+			continue;
+		}
+		atomic_store(&rxq->polling, 0);
+		net_callback_rx_interrupts(nd, rxq->idx, true);
+		/* a device that can't mask its interrupts may have notified us
+		 * while we were polling, and that packet could have come in after
+		 * the poll. Check again rather than wait for the next one. */
+		int expect = 0;
+		if(atomic_load(&rxq->pending) && atomic_compare_exchange_strong(&rxq->polling, &expect, 1))
+			net_callback_rx_interrupts(nd, rxq->idx, false);
 	}
+	for(int i=0;i<NET_RX_BUDGET;i++)
+		net_packet_put(packets[i], 0);
 	return 0;
 }
 
-struct net_dev *net_add_device(struct net_dev_calls *fn, void *data)
+int kerfs_netdev_rx_report(int direction, void *param, size_t size,
+		size_t offset, size_t length, unsigned char *buf)
+{
+	size_t current = 0;
+	struct net_dev *nd = param;
+	for(int q=0;q<nd->rx_queue_count;q++) {
+		struct net_rx_queue *rxq = &nd->rx_queues[q];
+		KERFS_PRINTF(offset, length, buf, current,
+				"%s queue %d (cpu %d): %d polls, %s\n", nd->name, q,
+				rxq->thread.thread->cpuid, rxq->polls,
+				atomic_load(&rxq->polling) ? "polling" : "interrupts");
+		KERFS_PRINTF(offset, length, buf, current, "BATCH 0: %d\n", rxq->batch_hist[0]);
+		for(int i=1;i<NET_RX_HIST_BUCKETS - 1;i++) {
+			KERFS_PRINTF(offset, length, buf, current, "BATCH %d-%d: %d\n",
+					1 << (i - 1), (1 << i) - 1, rxq->batch_hist[i]);
+		}
+		KERFS_PRINTF(offset, length, buf, current, "BATCH %d: %d\n",
+				NET_RX_BUDGET, rxq->batch_hist[NET_RX_HIST_BUCKETS - 1]);
+	}
+	return current;
+}
+
+/* add a device with more than one receive queue. Each queue's thread is
+ * started on a CPU of its own, as far as they go; the driver can find it
+ * in rx_queues[i].thread, and aim the queue's interrupt there. */
+struct net_dev *net_add_device_mq(struct net_dev_calls *fn, void *data, int rx_queues)
 {
+	assert(rx_queues > 0 && rx_queues <= NET_MAX_RX_QUEUES);
 	struct net_dev *nd = kmalloc(sizeof(struct net_dev));
 	linkedlist_insert(net_list, &nd->node, nd);
 	nd->callbacks = fn;
@@ -119,8 +191,14 @@ struct net_dev *net_add_device(struct net_dev_calls *fn, void *data)
 	net_callback_get_mac(nd, mac);
 	memcpy(nd->hw_address, mac, sizeof(uint8_t) * 6);
 	if(fn->poll) {
-		kthread_create(&nd->rec_thread, "[kpacket]", 0, kt_packet_rec_thread, nd);
-		nd->rec_thread.thread->priority = 100;
+		nd->rx_queue_count = rx_queues;
+		for(int i=0;i<rx_queues;i++) {
+			struct net_rx_queue *rxq = &nd->rx_queues[i];
+			rxq->nd = nd;
+			rxq->idx = i;
+			kthread_create(&rxq->thread, "[kpacket]", 0, kt_packet_rec_thread, rxq);
+			rxq->thread.thread->priority = 100;
+		}
 	}
 	net_iface_set_flags(nd, IFACE_FLAGS_DEFAULT);
 	int num = atomic_fetch_add_explicit(&nd_num, 1, memory_order_relaxed) + 1;
@@ -133,16 +211,31 @@ struct net_dev *net_add_device(struct net_dev_calls *fn, void *data)
 	char path[8 + strlen(nd->name)];
 	snprintf(path, 8+strlen(nd->name), "/dev/%s", nd->name);
 	sys_mknod(path, S_IFCHR | 0600, GETDEV(net_major, num));
+	if(fn->poll) {
+		char name[32];
+		snprintf(name, 32, "/dev/rxbatch-%d", num);
+		kerfs_register_parameter(name, nd, 0, 0, kerfs_netdev_rx_report);
+	}
 
 	return nd;
 }
 
+struct net_dev *net_add_device(struct net_dev_calls *fn, void *data)
+{
+	return net_add_device_mq(fn, data, 1);
+}
+
 void net_remove_device(struct net_dev *nd)
 {
 	devices[nd->num] = 0;
 	linkedlist_remove(net_list, &nd->node);
-	if(nd->callbacks->poll)
-		kthread_join(&nd->rec_thread, 0);
+	if(nd->callbacks->poll) {
+		char name[32];
+		snprintf(name, 32, "/dev/rxbatch-%d", nd->num);
+		kerfs_unregister_entry(name);
+		for(int i=0;i<nd->rx_queue_count;i++)
+			kthread_join(&nd->rx_queues[i].thread, 0);
+	}
 	kfree(nd);
 }
 
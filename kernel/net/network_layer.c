@@ -37,12 +37,27 @@ void net_nlayer_receive_from_dlayer(struct net_dev *nd, struct net_packet *packe
 		p->receive(nd, packet, payload);
 }
 
-int net_nlayer_send_packet(void *payload, size_t len, struct sockaddr *dest, struct sockaddr *src, sa_family_t sa_family, int prot)
+void net_nlayer_receive_batch(struct net_dev *nd, struct net_packet **packets, int count, sa_family_t sa_family)
+{
+	struct nlayer_protocol *p = protocols[sa_family];
+	if(!p)
+		return;
+	for(int i=0;i<count;i++)
+		packets[i]->data_header = packets[i]->data;
+	if(p->receive_batch) {
+		p->receive_batch(nd, packets, count);
+	} else if(p->receive) {
+		for(int i=0;i<count;i++)
+			p->receive(nd, packets[i], packets[i]->network_header);
+	}
+}
+
+int net_nlayer_send_packet(void *payload, size_t len, struct sockaddr *dest, struct sockaddr *src, sa_family_t sa_family, int prot, struct route_cache *rc)
 {
 
 	struct nlayer_protocol *p = protocols[sa_family];
 	if(p && p->send)
-		return p->send(payload, len, dest, src, prot);
+		return p->send(payload, len, dest, src, prot, rc);
 	return -ENOTSUP;
 }
 
@@ -12,14 +12,105 @@
 #include <sea/vsprintf.h>
 #include <stdatomic.h>
 #include <sea/trace.h>
-#include <sea/kobj.h>
+#include <sea/mm/pmm.h>
+#include <sea/cpu/processor.h>
+#include <sea/tm/thread.h>
+#include <sea/errno.h>
+
+/* Each CPU keeps a pool of packets, with their pages, so that receiving a
+ * frame doesn't go to kmalloc and the page allocator every time. A pool is
+ * only touched by its own CPU with preemption disabled. Packets are made in
+ * batches when a pool runs dry, and go back to their pool when they're
+ * freed, unless it's full or a fragment of another packet still holds the
+ * page. Like the page caches, the pools are bypassed in interrupt context. */
+#define NP_POOL_HIGH  64
+#define NP_POOL_BATCH 8
+
+struct net_packet_pool {
+	bool inited;
+	struct stack list;
+};
+
+static struct net_packet_pool pools[CONFIG_MAX_CPUS];
+
+static struct cpu *pool_cpu_get(void)
+{
+	if(!current_thread || !current_thread->cpu || current_thread->interrupt_level)
+		return NULL;
+	struct cpu *cpu = cpu_get_current();
+	struct net_packet_pool *pool = &pools[cpu->knum];
+	if(unlikely(!pool->inited)) {
+		stack_create(&pool->list, STACK_LOCKLESS);
+		pool->inited = true;
+	}
+	return cpu;
+}
+
+static struct net_packet *__packet_alloc(void)
+{
+	struct net_packet *packet = kmalloc(sizeof(struct net_packet));
+	packet->page = mm_physical_allocate(NP_BUFFER_SIZE, false);
+	mm_physical_increment_count(packet->page);
+	packet->head = (unsigned char *)(packet->page + PHYS_PAGE_MAP);
+	return packet;
+}
+
+static struct net_packet *pool_take(void)
+{
+	struct cpu *cpu = pool_cpu_get();
+	if(!cpu)
+		return __packet_alloc();
+	struct net_packet_pool *pool = &pools[cpu->knum];
+	struct net_packet *packet = stack_pop(&pool->list);
+	cpu_put_current(cpu);
+	if(packet)
+		return packet;
+
+	/* allocating can sleep, so do it with the CPU released */
+	struct net_packet *batch[NP_POOL_BATCH];
+	for(int i=0;i<NP_POOL_BATCH;i++)
+		batch[i] = __packet_alloc();
+	cpu = pool_cpu_get();
+	pool = &pools[cpu->knum];
+	for(int i=1;i<NP_POOL_BATCH;i++)
+		stack_push(&pool->list, &batch[i]->pool_elem, batch[i]);
+	cpu_put_current(cpu);
+	return batch[0];
+}
+
+static bool pool_give(struct net_packet *packet)
+{
+	struct cpu *cpu = pool_cpu_get();
+	if(!cpu)
+		return false;
+	struct net_packet_pool *pool = &pools[cpu->knum];
+	bool ret = pool->list.count < NP_POOL_HIGH;
+	if(ret)
+		stack_push(&pool->list, &packet->pool_elem, packet);
+	cpu_put_current(cpu);
+	return ret;
+}
 
 struct net_packet *net_packet_create(struct net_packet *packet, int flags)
 {
-	KOBJ_CREATE(packet, flags, NP_FLAG_ALLOC);
+	if(!packet) {
+		packet = pool_take();
+		packet->flags = flags | NP_FLAG_ALLOC;
+	} else {
+		memset(packet, 0, sizeof(*packet));
+		packet->flags = flags;
+		packet->page = mm_physical_allocate(NP_BUFFER_SIZE, false);
+		mm_physical_increment_count(packet->page);
+		packet->head = (unsigned char *)(packet->page + PHYS_PAGE_MAP);
+	}
 	TRACE_MSG("net.packet", "creating new packet %x\n", packet);
 	packet->count = 1;
+	packet->data = packet->head + NP_HEADROOM;
+	packet->length = 0;
+	packet->frag_length = 0;
+	packet->nr_frags = 0;
 	packet->data_header = packet->data;
+	packet->network_header = 0;
 	return packet;
 }
 
@@ -27,7 +118,77 @@ void net_packet_destroy(struct net_packet *packet)
 {
 	assert(packet->count == 0);
 	TRACE_MSG("net.packet", "destroying packet %x\n", packet);
-	KOBJ_DESTROY(packet, NP_FLAG_ALLOC);
+	for(int i=0;i<packet->nr_frags;i++)
+		mm_physical_decrement_count(packet->frags[i].page);
+	if((packet->flags & NP_FLAG_ALLOC) && mm_physical_get_count(packet->page) == 1
+			&& pool_give(packet))
+		return;
+	mm_physical_decrement_count(packet->page);
+	if(packet->flags & NP_FLAG_ALLOC)
+		kfree(packet);
+}
+
+/* hang length bytes at offset into page off the end of the packet. The packet
+ * holds a reference to the page until it's destroyed. */
+int net_packet_add_frag(struct net_packet *packet, addr_t page, size_t offset, size_t length)
+{
+	if(packet->nr_frags == NP_MAX_FRAGS)
+		return -ENOSPC;
+	assert(offset + length <= PAGE_SIZE);
+	mm_physical_increment_count(page);
+	struct net_packet_frag *frag = &packet->frags[packet->nr_frags++];
+	frag->page = page;
+	frag->offset = offset;
+	frag->length = length;
+	packet->frag_length += length;
+	packet->length += length;
+	return 0;
+}
+
+/* pull the fragments into the linear part, and drop them */
+int net_packet_linearize(struct net_packet *packet)
+{
+	if(!packet->nr_frags)
+		return 0;
+	if(packet->frag_length > net_packet_tailroom(packet))
+		return -ENOSPC;
+	size_t headlen = net_packet_headlen(packet);
+	net_packet_copy_out(packet, headlen, packet->data + headlen, packet->frag_length);
+	for(int i=0;i<packet->nr_frags;i++)
+		mm_physical_decrement_count(packet->frags[i].page);
+	packet->nr_frags = 0;
+	packet->frag_length = 0;
+	return 0;
+}
+
+/* copy out length bytes of the frame starting at offset, gathering the
+ * fragments. Returns the number of bytes copied. */
+size_t net_packet_copy_out(struct net_packet *packet, size_t offset, void *buf, size_t length)
+{
+	size_t copied = 0;
+	size_t headlen = net_packet_headlen(packet);
+	if(offset < headlen) {
+		size_t n = headlen - offset < length ? headlen - offset : length;
+		memcpy(buf, packet->data + offset, n);
+		copied += n;
+		offset = 0;
+	} else {
+		offset -= headlen;
+	}
+	for(int i=0;i<packet->nr_frags && copied < length;i++) {
+		struct net_packet_frag *frag = &packet->frags[i];
+		if(offset >= frag->length) {
+			offset -= frag->length;
+			continue;
+		}
+		size_t n = frag->length - offset;
+		if(n > length - copied)
+			n = length - copied;
+		memcpy((uint8_t *)buf + copied, (void *)(frag->page + PHYS_PAGE_MAP + frag->offset + offset), n);
+		copied += n;
+		offset = 0;
+	}
+	return copied;
 }
 
 void net_packet_get(struct net_packet *packet)
@@ -49,22 +210,40 @@ void net_packet_put(struct net_packet *packet, int flag)
 		net_packet_destroy(packet);
 }
 
+/* called by a driver, usually from its interrupt handler, when a receive
+ * queue has packets. Hands the queue over to its thread, if it doesn't have
+ * it already. No locks are taken, since this may have interrupted the
+ * thread itself; it's resumed directly, and THREAD_WAKEUP covers the case
+ * where it's between checking polling and pausing. */
+void net_notify_rx_queue(struct net_dev *nd, int queue)
+{
+	if(!nd->callbacks->poll)
+		return;
+	struct net_rx_queue *rxq = &nd->rx_queues[queue];
+	atomic_store(&rxq->pending, 1);
+	int expect = 0;
+	if(atomic_compare_exchange_strong(&rxq->polling, &expect, 1)) {
+		net_callback_rx_interrupts(nd, queue, false);
+		struct thread *thread = rxq->thread.thread;
+		tm_thread_raise_flag(thread, THREAD_WAKEUP);
+		tm_thread_resume(thread);
+	}
+}
+
 void net_notify_packet_ready(struct net_dev *nd)
 {
-	atomic_fetch_add(&nd->rx_pending, 1);
-	if(nd->callbacks->poll)
-		tm_thread_resume(nd->rec_thread.thread);
-	/* TODO: notify CPU to schedule this process NOW */
+	net_notify_rx_queue(nd, 0);
 }
 
-void net_receive_packet(struct net_dev *nd, struct net_packet *packets, int count)
+void net_receive_packet(struct net_dev *nd, struct net_packet **packets, int count)
 {
 	TRACE_MSG("net.packet", "receive %d packets\n", count);
+	size_t bytes = 0;
+	for(int i=0;i<count;i++)
+		bytes += packets[i]->length;
 	atomic_fetch_add_explicit(&nd->rx_count, count, memory_order_relaxed);
-	for(int i=0;i<count;i++) {
-		atomic_fetch_add_explicit(&nd->rx_bytes, packets[i].length, memory_order_relaxed);
-		net_data_receive(nd, &packets[i]);
-	}
+	atomic_fetch_add_explicit(&nd->rx_bytes, bytes, memory_order_relaxed);
+	net_data_receive_batch(nd, packets, count);
 }
 
 int net_transmit_packet(struct net_dev *nd, struct net_packet *packets, int count)
@@ -207,9 +207,7 @@ void arp_send_request(struct net_dev *nd, uint16_t prot_type, uint8_t prot_addr[
 
 	struct net_packet netpacket;
 	net_packet_create(&netpacket, 0);
-	netpacket.data_header = (void *)netpacket.data;
-	
-	memcpy((void *)((addr_t)netpacket.data + nd->data_header_len), &packet, sizeof(packet));
+	memcpy(netpacket.data, &packet, sizeof(packet));
 	
 	arp_send_packet(nd, &netpacket, &packet, 1);
 	net_packet_put(&netpacket, NP_FLAG_DESTROY);
@@ -289,6 +287,8 @@ int arp_receive_packet(struct net_dev *nd, struct net_packet *netpacket, struct
 			
 			arp_write_short(s.sa_data + 2, &packet->src_p_addr_1, &packet->src_p_addr_2);
 			
+			/* send the reply back in the same packet */
+			netpacket->data = (unsigned char *)packet;
 			arp_send_packet(nd, netpacket, packet, 0);
 		}
 	}
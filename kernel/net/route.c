@@ -1,7 +1,6 @@
 #include <sea/net/route.h>
 #include <sea/net/interface.h>
 #include <sea/lib/linkedlist.h>
-#include <sea/rwlock.h>
 #include <sea/fs/proc.h>
 #include <sea/vsprintf.h>
 #include <sea/errno.h>
@@ -10,8 +9,47 @@
 #include <sea/kernel.h>
 #include <sea/trace.h>
 #include <sea/fs/kerfs.h>
-/* TODO: make thread-safe */
-static struct linkedlist *table = 0;
+#include <sea/cpu/processor.h>
+#include <sea/tm/process.h>
+#include <sea/asm/system.h>
+#include <stdatomic.h>
+
+/* The routes live in a list, which only writers look at, and in a path
+ * compressed binary trie keyed on the destination prefix, which is what
+ * lookups walk. A lookup touches at most one node per prefix length that
+ * could match.
+ *
+ * The trie is never changed in place. A writer builds a new one from the
+ * list, swaps it in, and bumps the generation. It then waits until every
+ * CPU has been seen outside a lookup before freeing the old trie and
+ * dropping the table's reference to any routes that went away. Lookups run
+ * with preemption off, so that wait is short, and they take no locks; all
+ * they write is their own CPU's counter.
+ *
+ * Anything that holds on to a route can keep the generation it was looked
+ * up in, and only look again once the table has changed. */
+
+struct route_leaf {
+	struct route *route;
+	struct route_leaf *next;
+};
+
+struct route_node {
+	uint32_t prefix; /* host order, and zero past len */
+	int len;
+	struct route_node *child[2];
+	struct route_leaf *routes;
+};
+
+struct route_readers {
+	_Atomic int active;
+} __attribute__((aligned(64)));
+
+static struct mutex table_lock;
+static struct linkedlist table;
+static _Atomic(struct route_node *) trie = NULL;
+static _Atomic unsigned long generation = 1;
+static struct route_readers readers[CONFIG_MAX_CPUS];
 
 /* TODO: generics */
 #define NETWORK_PREFIX(addr,mask) (addr & mask)
@@ -26,89 +64,253 @@ unsigned int bit_count(uint32_t v)
 	return ((v + ((v >> 4) & 0xF0F0F0F)) * 0x1010101) >> 24; // count
 }
 
-/* confidence of -1 means DO NOT send the packet that way. Confidence of
- * any positive number or zero means valid route, with the highest confidence
- * value being the best choice (and the default route being zero confidence)
- */
-int __net_route_calc_confidence(struct route *r, uint32_t addr)
+static inline uint32_t __prefix_mask(int len)
+{
+	return len ? ~0u << (32 - len) : 0;
+}
+
+static inline int __key_bit(uint32_t key, int i)
+{
+	return (key >> (31 - i)) & 1;
+}
+
+/* whether a packet to addr may be sent this way. Default routes are also
+ * hung off the root, so they match anything. */
+static bool __route_usable(struct route *r, uint32_t addr)
 {
 	if(!(r->flags & ROUTE_FLAG_UP))
-			return -1;
+		return false;
 	if(!(r->interface->flags & IFACE_FLAG_UP))
-		return -1;
-	uint32_t prefix = NETWORK_PREFIX(addr, r->netmask);
-	if(prefix == r->destination) {
-		return bit_count(r->netmask);
+		return false;
+	return NETWORK_PREFIX(addr, r->netmask) == r->destination
+		|| (r->flags & ROUTE_FLAG_DEFAULT);
+}
+
+static struct route_node *__node_create(uint32_t prefix, int len)
+{
+	struct route_node *n = kmalloc(sizeof(struct route_node));
+	n->prefix = prefix;
+	n->len = len;
+	return n;
+}
+
+static void __trie_insert(struct route_node **slot, uint32_t prefix, int len, struct route *r)
+{
+	struct route_node *n;
+	while((n = *slot)) {
+		int common = n->len < len ? n->len : len;
+		uint32_t diff = (n->prefix ^ prefix) & __prefix_mask(common);
+		if(diff)
+			common = __builtin_clz(diff);
+		if(common < n->len) {
+			/* the new prefix branches off above n */
+			struct route_node *split = __node_create(prefix & __prefix_mask(common), common);
+			split->child[__key_bit(n->prefix, common)] = n;
+			*slot = n = split;
+		}
+		if(n->len == len)
+			break;
+		slot = &n->child[__key_bit(prefix, n->len)];
 	}
-	/* default route has a confidence of 0, but is still a possible route */
-	if(r->flags & ROUTE_FLAG_DEFAULT)
-		return 0;
-	return -1;
+	if(!n)
+		*slot = n = __node_create(prefix, len);
+	/* keep the order routes were added in, so the first one wins a tie */
+	struct route_leaf **leaf = &n->routes;
+	while(*leaf)
+		leaf = &(*leaf)->next;
+	*leaf = kmalloc(sizeof(struct route_leaf));
+	(*leaf)->route = r;
 }
 
-/* this function does the actual routing algorithm. addr is the
- * destination address, and the function returns the route entry
- * for how to route it. */
-struct route *net_route_select_entry(uint32_t addr)
+static void __trie_destroy(struct route_node *n)
+{
+	if(!n)
+		return;
+	__trie_destroy(n->child[0]);
+	__trie_destroy(n->child[1]);
+	struct route_leaf *leaf, *next;
+	for(leaf = n->routes;leaf;leaf = next) {
+		next = leaf->next;
+		kfree(leaf);
+	}
+	kfree(n);
+}
+
+/* Masks are assumed to be contiguous. One that isn't is filed under its
+ * number of set bits, and lookups still check it exactly. */
+static struct route_node *__trie_build(void)
 {
-	if(!table)
-		return 0;
-	struct route *r, *best = 0;
+	struct route_node *root = NULL;
 	struct linkedentry *node;
-	int i = 0, max_score = -1;
-	
-	__linkedlist_lock(table);
-	for(node = linkedlist_iter_start(table);
-			node != linkedlist_iter_end(table);
+	for(node = linkedlist_iter_start(&table);
+			node != linkedlist_iter_end(&table);
 			node = linkedlist_iter_next(node)) {
-		r = linkedentry_obj(node);
-		int confidence = __net_route_calc_confidence(r, addr);
-		if(confidence >= 0) {
-			/* possible route! */
-			if(!best || max_score < confidence) {
-				max_score = confidence;
-				best = r;
+		struct route *r = linkedentry_obj(node);
+		int len = bit_count(r->netmask);
+		uint32_t prefix = BIG_TO_HOST32(r->destination) & __prefix_mask(len);
+		__trie_insert(&root, prefix, len, r);
+		if((r->flags & ROUTE_FLAG_DEFAULT) && len)
+			__trie_insert(&root, 0, 0, r);
+	}
+	return root;
+}
+
+/* wait until no lookup can still be looking at something that was
+ * unpublished before this was called */
+static void __route_synchronize(void)
+{
+	for(unsigned i=0;i<CONFIG_MAX_CPUS;i++) {
+		while(atomic_load(&readers[i].active))
+			tm_schedule();
+	}
+}
+
+/* called with table_lock held, after the list has changed */
+static void __table_publish(void)
+{
+	struct route_node *old = atomic_exchange(&trie, __trie_build());
+	atomic_fetch_add(&generation, 1);
+	__route_synchronize();
+	__trie_destroy(old);
+}
+
+void net_route_get(struct route *r)
+{
+	assert(atomic_load(&r->refs) > 0);
+	atomic_fetch_add(&r->refs, 1);
+}
+
+void net_route_put(struct route *r)
+{
+	if(atomic_fetch_sub(&r->refs, 1) == 1)
+		kfree(r);
+}
+
+unsigned long net_route_generation(void)
+{
+	return atomic_load(&generation);
+}
+
+/* this function does the actual routing algorithm. addr is the
+ * destination address, and the function returns a reference to the
+ * route entry for how to route it, and the generation of the table it
+ * was found in. */
+struct route *net_route_lookup(uint32_t addr, unsigned long *gen)
+{
+	uint32_t key = BIG_TO_HOST32(addr);
+	struct route *best = NULL;
+	struct cpu *cpu = cpu_get_current();
+	atomic_fetch_add(&readers[cpu->knum].active, 1);
+	/* the generation has to be read before the trie, so that a route
+	 * from a newer trie can be stamped older, but never the reverse */
+	if(gen)
+		*gen = atomic_load(&generation);
+	struct route_node *n = atomic_load(&trie);
+	while(n && !((key ^ n->prefix) & __prefix_mask(n->len))) {
+		for(struct route_leaf *leaf = n->routes;leaf;leaf = leaf->next) {
+			if(__route_usable(leaf->route, addr)) {
+				best = leaf->route;
+				break;
 			}
 		}
+		if(n->len == 32)
+			break;
+		n = n->child[__key_bit(key, n->len)];
 	}
-	__linkedlist_unlock(table);
+	if(best)
+		net_route_get(best);
+	atomic_fetch_sub(&readers[cpu->knum].active, 1);
+	cpu_put_current(cpu);
 	return best;
 }
 
+struct route *net_route_select_entry(uint32_t addr)
+{
+	return net_route_lookup(addr, NULL);
+}
+
+void net_route_cache_create(struct route_cache *rc)
+{
+	mutex_create(&rc->lock, 0);
+	rc->route = NULL;
+	rc->gen = 0;
+}
+
+void net_route_cache_destroy(struct route_cache *rc)
+{
+	if(rc->route)
+		net_route_put(rc->route);
+	mutex_destroy(&rc->lock);
+}
+
+/* like net_route_lookup, but only looks in the table if it has changed, or
+ * addr isn't the address the cached route is for */
+struct route *net_route_cache_lookup(struct route_cache *rc, uint32_t addr, unsigned long *gen)
+{
+	mutex_acquire(&rc->lock);
+	if(!rc->route || rc->addr != addr || rc->gen != atomic_load(&generation)) {
+		if(rc->route)
+			net_route_put(rc->route);
+		rc->route = net_route_lookup(addr, &rc->gen);
+		rc->addr = addr;
+	}
+	struct route *r = rc->route;
+	if(r)
+		net_route_get(r);
+	if(gen)
+		*gen = rc->gen;
+	mutex_release(&rc->lock);
+	return r;
+}
+
+/* the table takes over the reference that the route was created with */
 void net_route_add_entry(struct route *r)
 {
-	if(!table)
-		table = linkedlist_create(0, LINKEDLIST_MUTEX);
-	linkedlist_insert(table, &r->node, r);
+	r->refs = 1;
+	mutex_acquire(&table_lock);
+	linkedlist_insert(&table, &r->node, r);
+	__table_publish();
+	mutex_release(&table_lock);
 }
 
 void net_route_del_entry(struct route *r)
 {
-	assert(table);
-	linkedlist_remove(table, &r->node);
+	mutex_acquire(&table_lock);
+	linkedlist_remove(&table, &r->node);
+	__table_publish();
+	mutex_release(&table_lock);
+	net_route_put(r);
 }
 
 int net_route_find_del_entry(uint32_t dest, struct net_dev *nd)
 {
 	struct route *r, *del=0;
 	struct linkedentry *node;
-	__linkedlist_lock(table);
-	for(node = linkedlist_iter_start(table);
-			node != linkedlist_iter_end(table);
+	mutex_acquire(&table_lock);
+	for(node = linkedlist_iter_start(&table);
+			node != linkedlist_iter_end(&table);
 			node = linkedlist_iter_next(node)) {
 		r = linkedentry_obj(node);
 		if(r->destination == dest && r->interface == nd) {
 			del = r;
 		}
 	}
-	__linkedlist_unlock(table);
 	if(del) {
-		linkedlist_remove(table, &del->node);
-		kfree(del);
+		linkedlist_remove(&table, &del->node);
+		__table_publish();
 	}
+	mutex_release(&table_lock);
+	if(del)
+		net_route_put(del);
 	return del ? 0 : -ENOENT;
 }
 
+void net_route_init(void)
+{
+	mutex_create(&table_lock, 0);
+	linkedlist_create(&table, LINKEDLIST_LOCKLESS);
+}
+
 static void write_addr(char *str, uint32_t addr)
 {
 	snprintf(str, 32, "%d.%d.%d.%d", (addr) & 0xFF, (addr >> 8) & 0xFF, (addr >> 16) & 0xFF, (addr >> 24) & 0xFF);
@@ -119,13 +321,11 @@ int kerfs_route_report(int direction, void *param, size_t size, size_t offset, s
 	size_t current = 0;
 	KERFS_PRINTF(offset, length, buf, current,
 			"DEST            GATEWAY         MASK            FLAGS IFACE\n");
-	if(!table)
-		return current;
-	struct route *r, *del=0;
+	struct route *r;
 	struct linkedentry *node;
-	__linkedlist_lock(table);
-	for(node = linkedlist_iter_start(table);
-			node != linkedlist_iter_end(table);
+	mutex_acquire(&table_lock);
+	for(node = linkedlist_iter_start(&table);
+			node != linkedlist_iter_end(&table);
 			node = linkedlist_iter_next(node)) {
 		r = linkedentry_obj(node);
 		char dest[32];
@@ -146,8 +346,7 @@ int kerfs_route_report(int direction, void *param, size_t size, size_t offset, s
 				r->interface->name);
 
 	}
-	__linkedlist_unlock(table);
+	mutex_release(&table_lock);
 
 	return current;
 }
-
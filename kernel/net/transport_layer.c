@@ -131,6 +131,8 @@ int net_tlayer_recvfrom_network(struct sockaddr *src, struct sockaddr *dest, str
 	/* ask the protocol to fill in address data */
 	if(tpi->inject_port)
 		tpi->inject_port(np, payload, len, src, dest);
+	if(tpi->flags & TLPROT_FLAG_DEMUX)
+		return tpi->recv_packet ? tpi->recv_packet(NULL, src, np, payload, len) : 0;
 	/* get the socket from the port pool */
 	struct socket *sock;
 	if(!(sock = net_tlayer_get_socket(prot, dest)))
@@ -142,7 +144,7 @@ int net_tlayer_recvfrom_network(struct sockaddr *src, struct sockaddr *dest, str
 
 int net_tlayer_sendto_network(struct socket *socket, struct sockaddr *src, struct sockaddr *dest, void *payload, size_t len)
 {
-	return net_nlayer_send_packet(payload, len, dest, src, socket->domain, socket->prot);
+	return net_nlayer_send_packet(payload, len, dest, src, socket->domain, socket->prot, &socket->route_cache);
 }
 
 void net_tlayer_init(void)
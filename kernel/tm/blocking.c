@@ -279,3 +279,54 @@ int tm_thread_block_timeout(struct blocklist *blocklist, time_t microseconds)
 	return 0;
 }
 
+/* block_confirm, but give up after the timeout. Returns -ETIME if the
+ * timeout expired before anything woke us up. */
+int tm_thread_block_confirm_timeout(struct blocklist *blocklist, int state, time_t microseconds,
+		bool (*cfn)(void *), void *data)
+{
+	struct async_call *call = &current_thread->block_timeout;
+	call->func = __timeout_expired;
+	call->priority = ASYNC_CALL_PRIORITY_MEDIUM;
+	call->data = (unsigned long)current_thread;
+	cpu_disable_preemption();
+	assert(__current_cpu->preempt_disable == 1);
+	spinlock_acquire(&blocklist->lock);
+	assert(!current_thread->blocklist);
+	assert(state != THREADSTATE_RUNNING);
+	int ret;
+	if(state == THREADSTATE_INTERRUPTIBLE && (ret=tm_thread_got_signal(current_thread))) {
+		cfn(data);
+		spinlock_release(&blocklist->lock);
+		cpu_enable_preemption();
+		return ret == SA_RESTART ? -ERESTART : -EINTR;
+	}
+	tm_thread_set_state(current_thread, state);
+	tm_thread_add_to_blocklist(blocklist);
+	if(!cfn(data)) {
+		tm_thread_remove_from_blocklist(current_thread, false);
+		tm_thread_set_state(current_thread, THREADSTATE_RUNNING);
+		spinlock_release(&blocklist->lock);
+		cpu_enable_preemption();
+		return 0;
+	}
+	struct ticker *ticker = &__current_cpu->ticker;
+	ticker_insert(ticker, microseconds, call);
+	spinlock_release(&blocklist->lock);
+	cpu_enable_preemption();
+	tm_schedule();
+	int old = cpu_interrupt_set(0);
+	cpu_disable_preemption();
+	ticker_delete(&current_thread->cpu->ticker, call);
+	cpu_interrupt_set(old);
+	if(current_thread->flags & THREAD_TIMEOUT_EXPIRED) {
+		tm_thread_lower_flag(current_thread, THREAD_TIMEOUT_EXPIRED);
+		cpu_enable_preemption();
+		return -ETIME;
+	}
+	cpu_enable_preemption();
+	if((ret=tm_thread_got_signal(current_thread)) && state != THREADSTATE_UNINTERRUPTIBLE) {
+		return ret == SA_RESTART ? -ERESTART : -EINTR;
+	}
+	return 0;
+}
+
@@ -123,8 +123,6 @@ __attribute__((noinline)) static void tm_process_exit(int code)
 		vfs_icache_put(current_process->cwd);
 	mutex_destroy(&current_process->fdlock);
 	mm_destroy_all_mappings(current_process);
-	linkedlist_destroy(&(current_process->mappings));
-	valloc_destroy(&current_process->mmf_valloc);
 
 	/* this is done before SIGCHILD is sent out */
 	atomic_fetch_or(&current_process->flags, PROCESS_EXITED);
@@ -52,12 +52,12 @@ int kerfs_mappings_report(int direction, void *param, size_t size, size_t offset
 				"           START              END   LENGTH FLAGS    INODE   OFFSET\n");
 	mutex_acquire(&proc->map_lock);
 	
-	struct linkedentry *node;
+	struct interval_node *node;
 	struct memmap *map;
-	for(node = linkedlist_iter_start(&proc->mappings);
-			node != linkedlist_iter_end(&proc->mappings);
-			node = linkedlist_iter_next(node)) {
-		map = linkedentry_obj(node);
+	for(node = interval_tree_first(&proc->mappings);
+			node;
+			node = interval_tree_next(node)) {
+		map = interval_node_obj(node);
 		char flags[6];
 		memset(flags, ' ', sizeof(flags));
 		if(map->flags & MAP_SHARED)
@@ -178,12 +178,11 @@ static struct process *tm_process_copy(int flags, struct thread *newthread)
 	newp->parent = current_process;
 	linkedlist_create(&newp->threadlist, 0);
 	blocklist_create(&newp->waitlist, 0, "process-waitlist");
-	linkedlist_create(&newp->mappings, LINKEDLIST_LOCKLESS);
+	interval_tree_create(&newp->mappings);
 	mutex_create(&newp->map_lock, 0); /* we need to lock this during page faults */
 	mutex_create(&newp->stacks_lock, 0);
 	mutex_create(&newp->fdlock, 0);
 	hash_create(&newp->files, HASH_LOCKLESS, 64);
-	valloc_create(&newp->mmf_valloc, MEMMAP_MMAP_BEGIN, MEMMAP_MMAP_END, PAGE_SIZE, 0);
 	mm_mappings_clone(newp);
 	if(current_process->root) {
 		newp->root = current_process->root;
@@ -46,7 +46,6 @@ void tm_init_multitasking(void)
 	hash_insert(thread_table, &thread->tid, sizeof(thread->tid), &thread->hash_elem, thread);
 	linkedlist_insert(process_list, &proc->listnode, proc);
 
-	valloc_create(&proc->mmf_valloc, MEMMAP_MMAP_BEGIN, MEMMAP_MMAP_END, PAGE_SIZE, 0);
 	linkedlist_create(&proc->threadlist, 0);
 	mutex_create(&proc->map_lock, 0);
 	mutex_create(&proc->stacks_lock, 0);
@@ -84,6 +83,12 @@ void tm_init_multitasking(void)
 	loader_add_kernel_symbol(tm_thread_exit);
 	loader_add_kernel_symbol(tm_thread_poke);
 	loader_add_kernel_symbol(tm_thread_block);
+	loader_add_kernel_symbol(tm_thread_block_confirm);
+	loader_add_kernel_symbol(tm_thread_block_confirm_timeout);
+	loader_add_kernel_symbol(ticker_insert);
+	loader_add_kernel_symbol(ticker_delete);
+	loader_add_kernel_symbol(blocklist_create);
+	loader_add_kernel_symbol(blocklist_destroy);
 	loader_add_kernel_symbol(tm_thread_got_signal);
 	loader_add_kernel_symbol(tm_thread_unblock);
 	loader_add_kernel_symbol(tm_blocklist_wakeall);
@@ -0,0 +1,300 @@
+#include <sea/lib/intervaltree.h>
+#include <sea/kernel.h>
+
+void interval_tree_create(struct interval_tree *tree)
+{
+	tree->root = NULL;
+	tree->count = 0;
+}
+
+static inline addr_t __max_end(struct interval_node *node)
+{
+	return node ? node->max_end : 0;
+}
+
+static inline void __update(struct interval_node *node)
+{
+	addr_t m = node->end;
+	if(__max_end(node->left) > m)
+		m = __max_end(node->left);
+	if(__max_end(node->right) > m)
+		m = __max_end(node->right);
+	node->max_end = m;
+}
+
+static void __propagate(struct interval_node *node)
+{
+	for(;node;node = node->parent)
+		__update(node);
+}
+
+static void __replace_child(struct interval_tree *tree, struct interval_node *parent,
+		struct interval_node *old, struct interval_node *new)
+{
+	if(!parent)
+		tree->root = new;
+	else if(parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+	if(new)
+		new->parent = parent;
+}
+
+static void __rotate_left(struct interval_tree *tree, struct interval_node *x)
+{
+	struct interval_node *y = x->right;
+	x->right = y->left;
+	if(y->left)
+		y->left->parent = x;
+	__replace_child(tree, x->parent, x, y);
+	y->left = x;
+	x->parent = y;
+	__update(x);
+	__update(y);
+}
+
+static void __rotate_right(struct interval_tree *tree, struct interval_node *x)
+{
+	struct interval_node *y = x->left;
+	x->left = y->right;
+	if(y->right)
+		y->right->parent = x;
+	__replace_child(tree, x->parent, x, y);
+	y->right = x;
+	x->parent = y;
+	__update(x);
+	__update(y);
+}
+
+static inline bool __is_red(struct interval_node *node)
+{
+	return node && node->red;
+}
+
+void interval_tree_insert(struct interval_tree *tree, struct interval_node *node,
+		addr_t start, addr_t end, void *obj)
+{
+	node->start = start;
+	node->end = end;
+	node->max_end = end;
+	node->obj = obj;
+	node->left = node->right = NULL;
+	node->red = true;
+
+	struct interval_node *parent = NULL, **link = &tree->root;
+	while(*link) {
+		parent = *link;
+		if(parent->max_end < end)
+			parent->max_end = end;
+		link = start < parent->start ? &parent->left : &parent->right;
+	}
+	node->parent = parent;
+	*link = node;
+	tree->count++;
+
+	while(__is_red(node->parent)) {
+		parent = node->parent;
+		struct interval_node *gp = parent->parent;
+		if(parent == gp->left) {
+			struct interval_node *uncle = gp->right;
+			if(__is_red(uncle)) {
+				parent->red = uncle->red = false;
+				gp->red = true;
+				node = gp;
+				continue;
+			}
+			if(node == parent->right) {
+				__rotate_left(tree, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			gp->red = true;
+			__rotate_right(tree, gp);
+		} else {
+			struct interval_node *uncle = gp->left;
+			if(__is_red(uncle)) {
+				parent->red = uncle->red = false;
+				gp->red = true;
+				node = gp;
+				continue;
+			}
+			if(node == parent->left) {
+				__rotate_right(tree, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			gp->red = true;
+			__rotate_left(tree, gp);
+		}
+	}
+	tree->root->red = false;
+}
+
+static void __remove_fixup(struct interval_tree *tree, struct interval_node *x,
+		struct interval_node *parent)
+{
+	while(x != tree->root && !__is_red(x)) {
+		if(x == parent->left) {
+			struct interval_node *w = parent->right;
+			if(__is_red(w)) {
+				w->red = false;
+				parent->red = true;
+				__rotate_left(tree, parent);
+				w = parent->right;
+			}
+			if(!__is_red(w->left) && !__is_red(w->right)) {
+				w->red = true;
+				x = parent;
+				parent = x->parent;
+			} else {
+				if(!__is_red(w->right)) {
+					w->left->red = false;
+					w->red = true;
+					__rotate_right(tree, w);
+					w = parent->right;
+				}
+				w->red = parent->red;
+				parent->red = false;
+				w->right->red = false;
+				__rotate_left(tree, parent);
+				x = tree->root;
+			}
+		} else {
+			struct interval_node *w = parent->left;
+			if(__is_red(w)) {
+				w->red = false;
+				parent->red = true;
+				__rotate_right(tree, parent);
+				w = parent->left;
+			}
+			if(!__is_red(w->left) && !__is_red(w->right)) {
+				w->red = true;
+				x = parent;
+				parent = x->parent;
+			} else {
+				if(!__is_red(w->left)) {
+					w->right->red = false;
+					w->red = true;
+					__rotate_left(tree, w);
+					w = parent->left;
+				}
+				w->red = parent->red;
+				parent->red = false;
+				w->left->red = false;
+				__rotate_right(tree, parent);
+				x = tree->root;
+			}
+		}
+	}
+	if(x)
+		x->red = false;
+}
+
+void interval_tree_remove(struct interval_tree *tree, struct interval_node *node)
+{
+	struct interval_node *x, *parent;
+	bool removed_red = node->red;
+	if(!node->left || !node->right) {
+		x = node->left ? node->left : node->right;
+		parent = node->parent;
+		__replace_child(tree, parent, node, x);
+		__propagate(parent);
+	} else {
+		/* splice out the successor, and put it where node was */
+		struct interval_node *succ = node->right;
+		while(succ->left)
+			succ = succ->left;
+		removed_red = succ->red;
+		x = succ->right;
+		if(succ->parent == node) {
+			parent = succ;
+		} else {
+			parent = succ->parent;
+			__replace_child(tree, parent, succ, x);
+			succ->right = node->right;
+			succ->right->parent = succ;
+		}
+		__replace_child(tree, node->parent, node, succ);
+		succ->left = node->left;
+		succ->left->parent = succ;
+		succ->red = node->red;
+		__propagate(parent);
+	}
+	tree->count--;
+	if(!removed_red)
+		__remove_fixup(tree, x, parent);
+	node->parent = node->left = node->right = NULL;
+}
+
+/* returns the lowest-starting interval that overlaps [start, end) */
+struct interval_node *interval_tree_first_overlap(struct interval_tree *tree,
+		addr_t start, addr_t end)
+{
+	struct interval_node *node = tree->root, *best = NULL;
+	while(node) {
+		if(node->left && node->left->max_end > start) {
+			/* if anything overlaps on the left, it starts before node does */
+			node = node->left;
+			continue;
+		}
+		if(node->start < end && node->end > start) {
+			best = node;
+			break;
+		}
+		if(node->start >= end)
+			break;
+		node = node->right;
+		if(node && node->max_end <= start)
+			break;
+	}
+	return best;
+}
+
+struct interval_node *interval_tree_find(struct interval_tree *tree, addr_t point)
+{
+	return interval_tree_first_overlap(tree, point, point + 1);
+}
+
+struct interval_node *interval_tree_first(struct interval_tree *tree)
+{
+	struct interval_node *node = tree->root;
+	while(node && node->left)
+		node = node->left;
+	return node;
+}
+
+struct interval_node *interval_tree_next(struct interval_node *node)
+{
+	if(node->right) {
+		node = node->right;
+		while(node->left)
+			node = node->left;
+		return node;
+	}
+	while(node->parent && node == node->parent->right)
+		node = node->parent;
+	return node->parent;
+}
+
+/* find the lowest address in [lo, hi) where length bytes fit without
+ * overlapping any interval. Only the intervals that overlap [lo, hi) are
+ * visited. */
+bool interval_tree_find_gap(struct interval_tree *tree, addr_t lo, addr_t hi,
+		size_t length, addr_t *result)
+{
+	addr_t cand = lo;
+	struct interval_node *node = interval_tree_first_overlap(tree, lo, hi);
+	for(;node && node->start < hi;node = interval_tree_next(node)) {
+		if(node->start >= cand + length)
+			break;
+		if(node->end > cand)
+			cand = node->end;
+	}
+	if(cand + length > hi || cand + length < cand)
+		return false;
+	*result = cand;
+	return true;
+}
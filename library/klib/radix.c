@@ -0,0 +1,160 @@
+#include <sea/lib/radix.h>
+#include <sea/kernel.h>
+#include <sea/mm/kmalloc.h>
+#include <sea/errno.h>
+
+#define INDEX_BITS (sizeof(unsigned long) * 8)
+#define MAX_HEIGHT ((INDEX_BITS + RADIX_TREE_SHIFT - 1) / RADIX_TREE_SHIFT)
+
+void radix_tree_create(struct radix_tree *tree)
+{
+	tree->root = NULL;
+	tree->height = 0;
+	tree->count = 0;
+}
+
+static void __destroy_node(struct radix_node *node, unsigned int height)
+{
+	if(height > 1) {
+		for(int i=0;i<RADIX_TREE_SLOTS;i++) {
+			if(node->slots[i])
+				__destroy_node(node->slots[i], height - 1);
+		}
+	}
+	kfree(node);
+}
+
+/* frees the interior of the tree. The items themselves belong to the caller. */
+void radix_tree_destroy(struct radix_tree *tree)
+{
+	if(tree->root)
+		__destroy_node(tree->root, tree->height);
+	radix_tree_create(tree);
+}
+
+/* the largest index that a tree of the given height can hold */
+static inline unsigned long __max_index(unsigned int height)
+{
+	if(height * RADIX_TREE_SHIFT >= INDEX_BITS)
+		return ~0UL;
+	return (1UL << (height * RADIX_TREE_SHIFT)) - 1;
+}
+
+static inline int __slot(unsigned long index, unsigned int height)
+{
+	return (index >> ((height - 1) * RADIX_TREE_SHIFT)) & (RADIX_TREE_SLOTS - 1);
+}
+
+static struct radix_node *__create_node(void)
+{
+	/* kmalloc returns zeroed memory, so all the slots start empty */
+	return kmalloc(sizeof(struct radix_node));
+}
+
+int radix_tree_insert(struct radix_tree *tree, unsigned long index, void *item)
+{
+	assert(item);
+	if(!tree->root) {
+		tree->root = __create_node();
+		tree->height = 1;
+	}
+	while(index > __max_index(tree->height)) {
+		/* grow the tree upward. The old root becomes slot 0 of the new root */
+		struct radix_node *node = __create_node();
+		node->slots[0] = tree->root;
+		node->count = 1;
+		tree->root = node;
+		tree->height++;
+	}
+
+	struct radix_node *node = tree->root;
+	for(unsigned int height = tree->height;height > 1;height--) {
+		int slot = __slot(index, height);
+		if(!node->slots[slot]) {
+			node->slots[slot] = __create_node();
+			node->count++;
+		}
+		node = node->slots[slot];
+	}
+	int slot = __slot(index, 1);
+	if(node->slots[slot])
+		return -EEXIST;
+	node->slots[slot] = item;
+	node->count++;
+	tree->count++;
+	return 0;
+}
+
+void *radix_tree_lookup(struct radix_tree *tree, unsigned long index)
+{
+	if(!tree->root || index > __max_index(tree->height))
+		return NULL;
+	struct radix_node *node = tree->root;
+	for(unsigned int height = tree->height;height > 1;height--) {
+		node = node->slots[__slot(index, height)];
+		if(!node)
+			return NULL;
+	}
+	return node->slots[__slot(index, 1)];
+}
+
+void *radix_tree_delete(struct radix_tree *tree, unsigned long index)
+{
+	if(!tree->root || index > __max_index(tree->height))
+		return NULL;
+	struct radix_node *path[MAX_HEIGHT + 1];
+	struct radix_node *node = tree->root;
+	unsigned int height;
+	for(height = tree->height;height > 1;height--) {
+		path[height] = node;
+		node = node->slots[__slot(index, height)];
+		if(!node)
+			return NULL;
+	}
+	path[1] = node;
+	void *item = node->slots[__slot(index, 1)];
+	if(!item)
+		return NULL;
+
+	/* clear the slot, and free any nodes that become empty on the way up */
+	for(height = 1;height <= tree->height;height++) {
+		node = path[height];
+		node->slots[__slot(index, height)] = NULL;
+		if(--node->count)
+			break;
+		kfree(node);
+		if(height == tree->height) {
+			tree->root = NULL;
+			tree->height = 0;
+		}
+	}
+	tree->count--;
+	return item;
+}
+
+static size_t __gang_lookup(struct radix_node *node, unsigned int height, unsigned long base,
+		unsigned long first, void **results, size_t max, size_t found)
+{
+	int shift = (height - 1) * RADIX_TREE_SHIFT;
+	int start = first > base ? (int)((first - base) >> shift) : 0;
+	for(int i=start;i<RADIX_TREE_SLOTS && found < max;i++) {
+		if(!node->slots[i])
+			continue;
+		if(height == 1)
+			results[found++] = node->slots[i];
+		else
+			found = __gang_lookup(node->slots[i], height - 1,
+					base + ((unsigned long)i << shift), first, results, max, found);
+	}
+	return found;
+}
+
+/* fill results with up to max items, in index order, whose
+ * indexes are at least first. Returns the number found. */
+size_t radix_tree_gang_lookup(struct radix_tree *tree, unsigned long first,
+		void **results, size_t max)
+{
+	if(!tree->root || !max || first > __max_index(tree->height))
+		return 0;
+	return __gang_lookup(tree->root, tree->height, 0, first, results, max, 0);
+}